@@ -0,0 +1,445 @@
+//
+//  AAArchiveIndex.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "AAEncodedHeader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INDEX_HEADER_SIZE 20
+#define INDEX_RECORD_SIZE 48
+
+typedef struct {
+    const char *path; /* in the string table */
+    uint64_t pathOffset;
+    uint32_t pathLength;
+    uint32_t headerSize;
+    uint64_t headerOffset;
+    uint64_t payloadSize;
+    uint64_t datOffset;
+    uint64_t datSize;
+} IndexRecord;
+
+struct AAArchiveIndex_impl {
+    AAByteStream archive;
+    IndexRecord *records; /* sorted by path, then header offset */
+    size_t count;
+    char *strings;
+    size_t stringsSize;
+};
+
+static inline void storeLE(uint8_t *p, uint64_t x, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        p[i] = (uint8_t)(x >> (8 * i));
+    }
+}
+
+static inline uint64_t loadLE(const uint8_t *p, size_t n) {
+    uint64_t x = 0;
+    for (size_t i = 0; i < n; i++) {
+        x |= (uint64_t)p[i] << (8 * i);
+    }
+    return x;
+}
+
+static ssize_t readFully(AAByteStream s, void *buf, size_t nbyte) {
+    size_t total = 0;
+    while (total < nbyte) {
+        ssize_t n = AAByteStreamRead(s, (uint8_t *)buf + total, nbyte - total);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break; /* end of stream */
+        }
+        total += n;
+    }
+    return total;
+}
+
+static ssize_t preadFully(AAByteStream s, void *buf, size_t nbyte, off_t offset) {
+    size_t total = 0;
+    while (total < nbyte) {
+        ssize_t n = AAByteStreamPRead(s, (uint8_t *)buf + total, nbyte - total, offset + (off_t)total);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break; /* end of stream */
+        }
+        total += n;
+    }
+    return total;
+}
+
+static ssize_t writeFully(AAByteStream s, const void *buf, size_t nbyte) {
+    size_t total = 0;
+    while (total < nbyte) {
+        ssize_t n = AAByteStreamWrite(s, (const uint8_t *)buf + total, nbyte - total);
+        if (n <= 0) {
+            return -1;
+        }
+        total += n;
+    }
+    return total;
+}
+
+static int comparePaths(const char *a, size_t aLength, const char *b, size_t bLength) {
+    int c = memcmp(a, b, (aLength < bLength) ? aLength : bLength);
+    if (c != 0) {
+        return c;
+    }
+    return (aLength < bLength) ? -1 : (aLength > bLength);
+}
+
+static int compareRecords(const void *a, const void *b) {
+    const IndexRecord *ra = a;
+    const IndexRecord *rb = b;
+    int c = comparePaths(ra->path, ra->pathLength, rb->path, rb->pathLength);
+    if (c != 0) {
+        return c;
+    }
+    return (ra->headerOffset < rb->headerOffset) ? -1 : (ra->headerOffset > rb->headerOffset);
+}
+
+/* Number of records with path < \p path, or <= \p path when \p upper */
+static size_t lowerBound(AAArchiveIndex index, const char *path, size_t length, int upper) {
+    size_t lo = 0;
+    size_t hi = index->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = comparePaths(index->records[mid].path, index->records[mid].pathLength, path, length);
+        if (c < 0 || (upper && c == 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Set the path pointers once the string table is complete */
+static void setPaths(AAArchiveIndex index) {
+    for (size_t i = 0; i < index->count; i++) {
+        index->records[i].path = index->strings + index->records[i].pathOffset;
+    }
+}
+
+#pragma mark - Build
+
+AAArchiveIndex AAArchiveIndexCreateWithArchive(AAByteStream archive) {
+    AAArchiveIndex index = calloc(1, sizeof(struct AAArchiveIndex_impl));
+    AAEntryReader reader = AAEntryReaderOpen(archive, 0, 0);
+    size_t recordsCapacity = 0;
+    size_t stringsCapacity = 0;
+    if (!index || !reader) {
+        ParallelCompressionLogError("malloc");
+        goto FAIL;
+    }
+    index->archive = archive;
+
+    for (;;) {
+        const uint8_t *header;
+        size_t size;
+        int status = AAEntryReaderNext(reader, &header, &size);
+        if (status == 0) {
+            break;
+        }
+        if (status < 0) {
+            goto FAIL;
+        }
+        int64_t payloadSize = aaEncodedHeaderPayloadSize(header, size);
+        if (payloadSize < 0) {
+            goto FAIL;
+        }
+        uint64_t offset = (uint64_t)AAEntryReaderGetEntryOffset(reader);
+
+        AAEncodedField pat;
+        if (aaEncodedHeaderFindField(header, size, "PAT", &pat) > 0 && pat.type == AA_FIELD_TYPE_STRING) {
+            if (index->count == recordsCapacity) {
+                size_t newCapacity = (recordsCapacity < 1024) ? 1024 : 2 * recordsCapacity;
+                IndexRecord *records = realloc(index->records, newCapacity * sizeof(IndexRecord));
+                if (!records) {
+                    ParallelCompressionLogError("malloc");
+                    goto FAIL;
+                }
+                index->records = records;
+                recordsCapacity = newCapacity;
+            }
+            if (!index->strings || index->stringsSize + pat.valueSize > stringsCapacity) {
+                size_t newCapacity = (stringsCapacity < 65536) ? 65536 : 2 * stringsCapacity;
+                while (newCapacity < index->stringsSize + pat.valueSize) {
+                    newCapacity *= 2;
+                }
+                char *strings = realloc(index->strings, newCapacity);
+                if (!strings) {
+                    ParallelCompressionLogError("malloc");
+                    goto FAIL;
+                }
+                index->strings = strings;
+                stringsCapacity = newCapacity;
+            }
+            IndexRecord *r = &index->records[index->count++];
+            memcpy(index->strings + index->stringsSize, pat.value, pat.valueSize);
+            r->pathOffset = index->stringsSize;
+            r->pathLength = (uint32_t)pat.valueSize;
+            index->stringsSize += pat.valueSize;
+            r->headerSize = (uint32_t)size;
+            r->headerOffset = offset;
+            r->payloadSize = (uint64_t)payloadSize;
+            AAEncodedField dat;
+            if (aaEncodedHeaderFindField(header, size, "DAT", &dat) > 0 && dat.type == AA_FIELD_TYPE_BLOB) {
+                r->datOffset = offset + size + dat.blobOffset;
+                r->datSize = dat.uintValue;
+            } else {
+                r->datOffset = 0;
+                r->datSize = 0;
+            }
+        }
+    }
+    setPaths(index);
+    qsort(index->records, index->count, sizeof(IndexRecord), compareRecords);
+    AAEntryReaderDestroy(reader);
+    return index;
+
+FAIL:
+    AAEntryReaderDestroy(reader);
+    AAArchiveIndexDestroy(index);
+    return 0;
+}
+
+#pragma mark - Load / save
+
+AAArchiveIndex AAArchiveIndexOpen(AAByteStream index_stream, AAByteStream archive) {
+    AAArchiveIndex index = calloc(1, sizeof(struct AAArchiveIndex_impl));
+    uint8_t *buf = 0;
+    if (!index) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    index->archive = archive;
+
+    uint8_t h[INDEX_HEADER_SIZE];
+    if (readFully(index_stream, h, INDEX_HEADER_SIZE) != INDEX_HEADER_SIZE || memcmp(h, "AAI1", 4) != 0) {
+        ParallelCompressionLogError("invalid index");
+        goto FAIL;
+    }
+    uint64_t count = loadLE(h + 4, 8);
+    uint64_t stringsSize = loadLE(h + 12, 8);
+    if (count > SIZE_MAX / INDEX_RECORD_SIZE || count > SIZE_MAX / sizeof(IndexRecord) || stringsSize > SIZE_MAX - 1) {
+        ParallelCompressionLogError("invalid index");
+        goto FAIL;
+    }
+
+    /* records are read in chunks, so a corrupted count fails at the end of the stream, not in malloc */
+    size_t chunkCount = 4096;
+    buf = malloc(chunkCount * INDEX_RECORD_SIZE);
+    if (!buf) {
+        ParallelCompressionLogError("malloc");
+        goto FAIL;
+    }
+    size_t capacity = 0;
+    while (index->count < count) {
+        size_t n = (count - index->count < chunkCount) ? (size_t)(count - index->count) : chunkCount;
+        if (readFully(index_stream, buf, n * INDEX_RECORD_SIZE) != (ssize_t)(n * INDEX_RECORD_SIZE)) {
+            ParallelCompressionLogError("truncated index");
+            goto FAIL;
+        }
+        if (index->count + n > capacity) {
+            size_t newCapacity = (capacity < chunkCount) ? chunkCount : 2 * capacity;
+            IndexRecord *records = realloc(index->records, newCapacity * sizeof(IndexRecord));
+            if (!records) {
+                ParallelCompressionLogError("malloc");
+                goto FAIL;
+            }
+            index->records = records;
+            capacity = newCapacity;
+        }
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t *p = buf + i * INDEX_RECORD_SIZE;
+            IndexRecord *r = &index->records[index->count++];
+            r->pathOffset = loadLE(p, 8);
+            r->pathLength = (uint32_t)loadLE(p + 8, 4);
+            r->headerSize = (uint32_t)loadLE(p + 12, 4);
+            r->headerOffset = loadLE(p + 16, 8);
+            r->payloadSize = loadLE(p + 24, 8);
+            r->datOffset = loadLE(p + 32, 8);
+            r->datSize = loadLE(p + 40, 8);
+            if (r->pathOffset > stringsSize || r->pathLength > stringsSize - r->pathOffset
+                || r->headerSize < AA_ENCODED_HEADER_MIN_SIZE || r->headerSize > AA_ENCODED_HEADER_MAX_SIZE) {
+                ParallelCompressionLogError("invalid index");
+                goto FAIL;
+            }
+        }
+    }
+
+    index->strings = malloc(stringsSize + 1);
+    if (!index->strings) {
+        ParallelCompressionLogError("malloc");
+        goto FAIL;
+    }
+    if (readFully(index_stream, index->strings, stringsSize) != (ssize_t)stringsSize) {
+        ParallelCompressionLogError("truncated index");
+        goto FAIL;
+    }
+    index->stringsSize = stringsSize;
+    setPaths(index);
+
+    /* lookups rely on the order */
+    for (size_t i = 1; i < index->count; i++) {
+        if (compareRecords(&index->records[i - 1], &index->records[i]) > 0) {
+            ParallelCompressionLogError("invalid index order");
+            goto FAIL;
+        }
+    }
+    free(buf);
+    return index;
+
+FAIL:
+    free(buf);
+    AAArchiveIndexDestroy(index);
+    return 0;
+}
+
+int AAArchiveIndexWrite(AAArchiveIndex index, AAByteStream out) {
+    uint8_t h[INDEX_HEADER_SIZE];
+    memcpy(h, "AAI1", 4);
+    storeLE(h + 4, index->count, 8);
+    storeLE(h + 12, index->stringsSize, 8);
+    if (writeFully(out, h, INDEX_HEADER_SIZE) < 0) {
+        ParallelCompressionLogError("AAByteStreamWrite");
+        return -1;
+    }
+    for (size_t i = 0; i < index->count; i++) {
+        const IndexRecord *r = &index->records[i];
+        uint8_t p[INDEX_RECORD_SIZE];
+        storeLE(p, r->pathOffset, 8);
+        storeLE(p + 8, r->pathLength, 4);
+        storeLE(p + 12, r->headerSize, 4);
+        storeLE(p + 16, r->headerOffset, 8);
+        storeLE(p + 24, r->payloadSize, 8);
+        storeLE(p + 32, r->datOffset, 8);
+        storeLE(p + 40, r->datSize, 8);
+        if (writeFully(out, p, INDEX_RECORD_SIZE) < 0) {
+            ParallelCompressionLogError("AAByteStreamWrite");
+            return -1;
+        }
+    }
+    if (index->stringsSize > 0 && writeFully(out, index->strings, index->stringsSize) < 0) {
+        ParallelCompressionLogError("AAByteStreamWrite");
+        return -1;
+    }
+    return 0;
+}
+
+#pragma mark - Lookup
+
+size_t AAArchiveIndexGetEntryCount(AAArchiveIndex index) {
+    return index->count;
+}
+
+int AAArchiveIndexGetEntry(AAArchiveIndex index, size_t i, AAArchiveIndexEntry *entry) {
+    if (i >= index->count) {
+        return -1;
+    }
+    const IndexRecord *r = &index->records[i];
+    entry->path = r->path;
+    entry->path_length = r->pathLength;
+    entry->header_offset = (off_t)r->headerOffset;
+    entry->header_size = r->headerSize;
+    entry->payload_offset = (off_t)(r->headerOffset + r->headerSize);
+    entry->payload_size = r->payloadSize;
+    entry->dat_offset = (off_t)r->datOffset;
+    entry->dat_size = r->datSize;
+    return 0;
+}
+
+int AAArchiveIndexLookup(AAArchiveIndex index, const char *path, AAArchiveIndexEntry *entry) {
+    size_t length = strlen(path);
+    size_t i = lowerBound(index, path, length, 1);
+    if (i == 0 || comparePaths(index->records[i - 1].path, index->records[i - 1].pathLength, path, length) != 0) {
+        return 0;
+    }
+    AAArchiveIndexGetEntry(index, i - 1, entry);
+    return 1;
+}
+
+int AAArchiveIndexLookupPrefix(AAArchiveIndex index, const char *prefix, size_t *first, size_t *count) {
+    size_t length = strlen(prefix);
+    size_t lo = lowerBound(index, prefix, length, 0);
+    size_t hi = lo;
+    while (hi < index->count && index->records[hi].pathLength >= length && memcmp(index->records[hi].path, prefix, length) == 0) {
+        hi++;
+    }
+    *first = lo;
+    *count = hi - lo;
+    return 0;
+}
+
+#pragma mark - Read
+
+ssize_t AAArchiveIndexReadHeader(AAArchiveIndex index, const AAArchiveIndexEntry *entry, void *buf, size_t nbyte) {
+    if (nbyte < entry->header_size) {
+        ParallelCompressionLogError("buffer too small");
+        return -1;
+    }
+    if (preadFully(index->archive, buf, entry->header_size, entry->header_offset) != (ssize_t)entry->header_size
+        || aaEncodedHeaderSize(buf) != (int)entry->header_size) {
+        ParallelCompressionLogError("invalid header");
+        return -1;
+    }
+    return entry->header_size;
+}
+
+ssize_t AAArchiveIndexReadBlob(AAArchiveIndex index, const AAArchiveIndexEntry *entry, AAFieldKey key, void *buf, size_t nbyte, off_t offset) {
+    off_t blobOffset;
+    uint64_t blobSize;
+    if (key.ikey == AA_FIELD_C("DAT").ikey && entry->dat_offset > 0) {
+        blobOffset = entry->dat_offset;
+        blobSize = entry->dat_size;
+    } else {
+        uint8_t *header = malloc(entry->header_size);
+        if (!header) {
+            ParallelCompressionLogError("malloc");
+            return -1;
+        }
+        AAEncodedField field;
+        int r = -1;
+        if (AAArchiveIndexReadHeader(index, entry, header, entry->header_size) >= 0) {
+            r = aaEncodedHeaderFindField(header, entry->header_size, key.skey, &field);
+        }
+        free(header);
+        if (r <= 0 || field.type != AA_FIELD_TYPE_BLOB) {
+            return -1;
+        }
+        blobOffset = entry->payload_offset + (off_t)field.blobOffset;
+        blobSize = field.uintValue;
+    }
+    if (offset < 0) {
+        return -1;
+    }
+    if ((uint64_t)offset >= blobSize) {
+        return 0;
+    }
+    if ((uint64_t)nbyte > blobSize - (uint64_t)offset) {
+        nbyte = (size_t)(blobSize - (uint64_t)offset);
+    }
+    ssize_t n = preadFully(index->archive, buf, nbyte, blobOffset + offset);
+    if (n != (ssize_t)nbyte) {
+        ParallelCompressionLogError("truncated archive");
+        return -1;
+    }
+    return n;
+}
+
+void AAArchiveIndexDestroy(AAArchiveIndex index) {
+    if (!index) {
+        return;
+    }
+    free(index->records);
+    free(index->strings);
+    free(index);
+}
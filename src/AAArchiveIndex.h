@@ -0,0 +1,206 @@
+// AppleArchive archive index
+
+#pragma once
+
+#ifndef __APPLE_ARCHIVE_H
+#error Include AppleArchive.h instead of this file
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull begin")
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma mark - Archive index
+
+/*!
+  @abstract Table of contents of an uncompressed archive
+
+  @discussion
+  The index maps the PAT of each entry to the location of its header and payload in the archive, sorted by PAT,
+  so a single entry, or all entries under a path prefix, can be located with a binary search, then read with
+  AAByteStreamPRead without decoding the entries before it.
+  The index is built in one pass over the archive headers, and can be saved to a sidecar file, in the
+  following format, all integers little endian:
+  - "AAI1", entry count (u64), string table size (u64)
+  - one 48 byte record per entry, sorted by PAT, then by header offset:
+    PAT offset in the string table (u64), PAT length (u32), header size (u32), header offset (u64),
+    payload size (u64), DAT offset (u64), DAT size (u64)
+  - the string table, holding the PAT of all entries
+*/
+typedef struct AAArchiveIndex_impl * AAArchiveIndex APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Location of an entry in the archive
+*/
+typedef struct {
+  const char * path;             ///< PAT, valid until the index is destroyed, not 0-terminated
+  size_t path_length;            ///< PAT length
+  off_t header_offset;           ///< offset of the entry header in the archive
+  size_t header_size;            ///< encoded header size
+  off_t payload_offset;          ///< offset of the payload (blobs) in the archive, i.e. header_offset + header_size
+  uint64_t payload_size;         ///< total size of the blobs
+  off_t dat_offset;              ///< offset of the DAT blob in the archive, or 0 if the entry has no DAT
+  uint64_t dat_size;             ///< DAT blob size
+} AAArchiveIndexEntry APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Build the index of an archive
+
+  @discussion
+  The archive is read with an AAEntryReader from the current position of \p archive, which must be offset 0.
+  Payloads are skipped without being read when the stream implements pread or seek. Entries without a PAT
+  field are not indexed. \p archive must remain valid until the index is destroyed, and implement pread to
+  read entries with the index. It is not closed by AAArchiveIndexDestroy.
+
+  @param archive uncompressed archive stream
+
+  @return a new index on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAArchiveIndex _Nullable AAArchiveIndexCreateWithArchive(
+  AAByteStream archive);
+
+/*!
+  @abstract Load an index saved with AAArchiveIndexWrite
+
+  @discussion \p archive must remain valid until the index is destroyed. It is not closed by AAArchiveIndexDestroy.
+
+  @param index_stream stream to read the index from, read until the end of the index
+  @param archive archive stream, must implement pread
+
+  @return a new index on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAArchiveIndex _Nullable AAArchiveIndexOpen(
+  AAByteStream index_stream,
+  AAByteStream archive);
+
+/*!
+  @abstract Save an index
+
+  @param index index
+  @param out receives the index
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AAArchiveIndexWrite(
+  AAArchiveIndex index,
+  AAByteStream out);
+
+/*!
+  @abstract Get the number of entries in an index
+
+  @param index index
+
+  @return the number of entries
+*/
+APPLE_ARCHIVE_API size_t AAArchiveIndexGetEntryCount(
+  AAArchiveIndex index);
+
+/*!
+  @abstract Get an entry, in PAT order
+
+  @param index index
+  @param i entry index, in 0..count-1
+  @param entry receives the entry
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AAArchiveIndexGetEntry(
+  AAArchiveIndex index,
+  size_t i,
+  AAArchiveIndexEntry * entry);
+
+/*!
+  @abstract Find an entry by path
+
+  @discussion If the archive contains several entries with the same PAT, the last one is returned.
+
+  @param index index
+  @param path PAT of the entry
+  @param entry receives the entry if found
+
+  @return 1 if found, 0 if not found
+*/
+APPLE_ARCHIVE_API int AAArchiveIndexLookup(
+  AAArchiveIndex index,
+  const char * path,
+  AAArchiveIndexEntry * entry);
+
+/*!
+  @abstract Find the entries with a path prefix
+
+  @discussion
+  The entries are in PAT order, so the entries whose PAT starts with \p prefix are a contiguous range, returned
+  as indices for AAArchiveIndexGetEntry. The prefix is a string prefix: to get the entries inside directory
+  "a", without "ab", use prefix "a/".
+
+  @param index index
+  @param prefix PAT prefix
+  @param first receives the index of the first entry in the range
+  @param count receives the number of entries in the range
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AAArchiveIndexLookupPrefix(
+  AAArchiveIndex index,
+  const char * prefix,
+  size_t * first,
+  size_t * count);
+
+/*!
+  @abstract Read the encoded header of an entry
+
+  @param index index
+  @param entry entry
+  @param buf receives the header
+  @param nbyte capacity of \p buf, at least entry->header_size
+
+  @return the header size on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API ssize_t AAArchiveIndexReadHeader(
+  AAArchiveIndex index,
+  const AAArchiveIndexEntry * entry,
+  void * buf,
+  size_t nbyte);
+
+/*!
+  @abstract Read a blob of an entry
+
+  @discussion The header is read to locate the blob, except for DAT.
+
+  @param index index
+  @param entry entry
+  @param key blob field key, e.g. DAT, XAT
+  @param buf receives the bytes
+  @param nbyte number of bytes to read
+  @param offset read location in the blob
+
+  @return the number of bytes read, less than \p nbyte at the end of the blob, and a negative error code on failure, or
+  if the entry has no such blob
+*/
+APPLE_ARCHIVE_API ssize_t AAArchiveIndexReadBlob(
+  AAArchiveIndex index,
+  const AAArchiveIndexEntry * entry,
+  AAFieldKey key,
+  void * buf,
+  size_t nbyte,
+  off_t offset);
+
+/*!
+  @abstract Destroy an index
+
+  @param index index, can be NULL
+*/
+APPLE_ARCHIVE_API void AAArchiveIndexDestroy(
+  AAArchiveIndex _Nullable index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull end")
+#endif
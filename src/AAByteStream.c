@@ -52,14 +52,14 @@ ssize_t aaFileStreamRead(AAByteStreamFileDesc fileDesc, void * buf, size_t nbyte
 }
 
 ssize_t aaFileStreamWrite(AAByteStreamFileDesc fileDesc, void * buf, size_t nbyte) {
-    if (fileDesc->reserved == 0) {
+    if (fileDesc->reserved) {
         return -1;
     }
     return write(fileDesc->fd, buf, nbyte);
 }
 
 ssize_t aaFileStreamPRead(AAByteStreamFileDesc fileDesc, void * buf, size_t nbyte, off_t offset) {
-    if (fileDesc->reserved == 0) {
+    if (fileDesc->reserved) {
         return -1;
     }
     return pread(fileDesc->fd, buf, nbyte, offset);
@@ -147,7 +147,7 @@ int AAByteStreamClose(AAByteStream s) {
         return 0;
     }
     AAByteStreamCloseProc closeProc = s->closeProc;
-    int result = closeProc(s);
+    int result = closeProc(fileDesc);
     free(s);
     return result;
 }
@@ -165,7 +165,7 @@ ssize_t AAByteStreamPRead(AAByteStream s, void *buf, size_t nbyte, off_t offset)
     if (!preadProc) {
         return -1;
     }
-    return preadProc(s, buf, nbyte, offset);
+    return preadProc(s->fileDesc, buf, nbyte, offset);
 }
 
 ssize_t AAByteStreamWrite(AAByteStream s, const void *buf, size_t nbyte) {
@@ -173,7 +173,7 @@ ssize_t AAByteStreamWrite(AAByteStream s, const void *buf, size_t nbyte) {
     if (!writeProc) {
         return -1;
     }
-    return writeProc(s, buf, nbyte);
+    return writeProc(s->fileDesc, buf, nbyte);
 }
 
 ssize_t AAByteStreamPWrite(AAByteStream s, const void *buf, size_t nbyte, off_t offset) {
@@ -181,7 +181,7 @@ ssize_t AAByteStreamPWrite(AAByteStream s, const void *buf, size_t nbyte, off_t
     if (!pwriteProc) {
         return -1;
     }
-    return pwriteProc(s, buf, nbyte, offset);
+    return pwriteProc(s->fileDesc, buf, nbyte, offset);
 }
 
 off_t AAByteStreamSeek(AAByteStream s, off_t offset, int whence) {
@@ -189,7 +189,7 @@ off_t AAByteStreamSeek(AAByteStream s, off_t offset, int whence) {
     if (!seekProc) {
         return -1;
     }
-    return seekProc(s, offset, whence);
+    return seekProc(s->fileDesc, offset, whence);
 }
 
 int aaTempFileStreamClose(AAByteStreamTempFileDesc fileDesc) {
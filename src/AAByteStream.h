@@ -159,6 +159,215 @@ APPLE_ARCHIVE_API AAByteStream _Nullable AAFileStreamOpenWithPath(
   mode_t open_mode)
 APPLE_ARCHIVE_AVAILABLE(macos(11.0), ios(14.0), watchos(7.0), tvos(14.0));
 
+/*!
+  @abstract Sparse file stream statistics
+*/
+typedef struct {
+  uint64_t data_bytes;    ///< bytes read from, or written to, the file
+  uint64_t hole_bytes;    ///< bytes of 0 in holes, returned without reading the file, or skipped when writing it
+} AASparseFileStats APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Create a file input stream skipping the holes of sparse files
+
+  @discussion
+  Same as AAFileStreamOpenWithFD for reading. If the file has fewer blocks allocated than its size, its data extents
+  are located with lseek SEEK_DATA and SEEK_HOLE, and the holes are returned as 0 without reading the file.
+  Where SEEK_DATA is not supported, the file is read normally. PRead can be called from several threads.
+  If \p fd is not seekable, e.g. a pipe, the stream only supports sequential reads, and PRead fails.
+  If \p stats is not NULL, it is updated after each read.
+
+  @param fd is the opened file descriptor
+  @param automatic_close if not 0, we'll close(fd) when the stream is closed
+  @param stats receives the stream statistics, can be NULL
+
+  @return a new stream instance on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAByteStream _Nullable AASparseFileInputStreamOpenWithFD(
+  int fd,
+  int automatic_close,
+  AASparseFileStats * _Nullable stats);
+
+/*!
+  @abstract Create a file output stream writing aligned blocks of 0 as holes
+
+  @discussion
+  Sequential writes only, starting at the current offset of \p fd, which must be at the end of the file, e.g. a new file.
+  Blocks of 0 aligned on the filesystem block size are skipped instead of written, leaving holes, unless \p flags
+  contains AA_FLAG_EXTRACT_NO_AUTO_SPARSE. The file size is set when the stream is closed.
+  If \p stats is not NULL, it is updated after each write.
+
+  @param fd is the opened file descriptor
+  @param automatic_close if not 0, we'll close(fd) when the stream is closed
+  @param flags stream flags
+  @param stats receives the stream statistics, can be NULL
+
+  @return a new stream instance on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAByteStream _Nullable AASparseFileOutputStreamOpenWithFD(
+  int fd,
+  int automatic_close,
+  AAFlagSet flags,
+  AASparseFileStats * _Nullable stats);
+
+/*!
+  @abstract Compression stream statistics, for one tier of blocks
+
+  @discussion Bytes saved by a tier are \p raw_bytes - \p compressed_bytes
+*/
+typedef struct {
+  uint64_t block_count;         ///< number of blocks
+  uint64_t raw_bytes;           ///< uncompressed size of these blocks
+  uint64_t compressed_bytes;    ///< size of these blocks in the compressed stream, excluding block headers
+} AACompressionTierStats APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Compression stream statistics
+*/
+typedef struct {
+  AACompressionTierStats compressed;   ///< blocks compressed with the stream algorithm
+  AACompressionTierStats fast;         ///< blocks compressed with faster settings of the stream algorithm
+  AACompressionTierStats stored;       ///< blocks stored raw (AA_COMPRESSION_ALGORITHM_NONE)
+  uint64_t sampled_out_bytes;          ///< raw bytes stored without running the codec, after sampling
+} AACompressionStats APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Create a compression stream
+
+  @discussion
+  Data written to the returned stream is split in blocks of \p block_size bytes, compressed by \p n_threads worker threads,
+  and written in order to \p compressed_stream.
+  Each block is first sampled: blocks that would not compress are stored raw without running the codec,
+  and blocks that would barely compress use faster settings of \p compression_algorithm.
+  The returned stream MUST be closed before \p compressed_stream.
+
+  @param compressed_stream is the output stream receiving the compressed data
+  @param compression_algorithm one of AA_COMPRESSION_ALGORITHM_*
+  @param block_size is the size of uncompressed blocks, or 0 for default (4 MiB)
+  @param flags stream flags
+  @param n_threads is the number of worker threads, or 0 for default
+
+  @return a new stream instance on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAByteStream _Nullable AACompressionOutputStreamOpen(
+  AAByteStream compressed_stream,
+  AACompressionAlgorithm compression_algorithm,
+  size_t block_size,
+  AAFlagSet flags,
+  int n_threads)
+APPLE_ARCHIVE_AVAILABLE(macos(11.0), ios(14.0), watchos(7.0), tvos(14.0));
+
+/*!
+  @abstract Create a compression stream with explicit sampling thresholds
+
+  @discussion
+  Same as AACompressionOutputStreamOpen. Blocks with a projected raw/compressed ratio below \p store_ratio are stored raw,
+  and blocks with a projected ratio below \p fast_ratio are compressed with faster settings.
+  Set both to 0 to compress every block with \p compression_algorithm.
+  If \p stats is not NULL, it is updated each time a block is written, and holds the final values after close.
+  If \p budget is not NULL, the block buffers (2 × \p block_size per block in flight) are reserved from it until the
+  stream is closed: with a short budget, fewer blocks are in flight, and open fails if not even one block fits.
+
+  @param compressed_stream is the output stream receiving the compressed data
+  @param compression_algorithm one of AA_COMPRESSION_ALGORITHM_*
+  @param block_size is the size of uncompressed blocks, or 0 for default (4 MiB)
+  @param store_ratio projected ratio below which blocks are stored raw (default 1.05)
+  @param fast_ratio projected ratio below which blocks use faster settings (default 1.3)
+  @param stats receives the stream statistics, can be NULL
+  @param budget memory budget for the block buffers, can be NULL
+  @param flags stream flags
+  @param n_threads is the number of worker threads, or 0 for default
+
+  @return a new stream instance on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAByteStream _Nullable AACompressionOutputStreamOpenExt(
+  AAByteStream compressed_stream,
+  AACompressionAlgorithm compression_algorithm,
+  size_t block_size,
+  double store_ratio,
+  double fast_ratio,
+  AACompressionStats * _Nullable stats,
+  AAMemoryBudget _Nullable budget,
+  AAFlagSet flags,
+  int n_threads);
+
+/*!
+  @abstract Create a compression stream using a dictionary
+
+  @discussion
+  Same as AACompressionOutputStreamOpen, with every block compressed using \p dict, e.g. trained with
+  AACompressionDictionaryTrain. This pays off for small blocks, where each block would otherwise start
+  with an empty history. The dictionary is stored once, raw in the first block, as an AA_ENTRY_TYPE_METADATA
+  archive entry with a DIC blob field: archive decoders skip it, and AADecompressionInputStreamOpen loads it
+  before decoding other blocks.
+
+  @param compressed_stream is the output stream receiving the compressed data
+  @param compression_algorithm is the compression algorithm, must support dictionaries (zlib, LZ4)
+  @param block_size is the block size, or 0 for default, must be larger than the dictionary entry
+  @param dict dictionary, copied by the stream
+  @param dict_size number of bytes in \p dict
+  @param budget memory budget for the block buffers, can be NULL, see AACompressionOutputStreamOpenExt
+  @param flags stream flags
+  @param n_threads is the number of worker threads, or 0 for default
+
+  @return a new stream instance on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAByteStream _Nullable AACompressionOutputStreamOpenWithDictionary(
+  AAByteStream compressed_stream,
+  AACompressionAlgorithm compression_algorithm,
+  size_t block_size,
+  const uint8_t * dict,
+  size_t dict_size,
+  AAMemoryBudget _Nullable budget,
+  AAFlagSet flags,
+  int n_threads);
+
+/*!
+  @abstract Create a sequential decompression stream
+
+  @discussion
+  Compressed blocks are read from \p compressed_stream and decoded by \p n_threads worker threads ahead of the reader.
+  If \p compressed_stream implements pread, a block index is built on demand by scanning the block headers,
+  and the returned stream implements pread and seek: only the blocks covering the requested range are decoded.
+  Otherwise, the returned stream only supports sequential reads and forward seeks.
+  The returned stream MUST be closed before \p compressed_stream.
+
+  @param compressed_stream is the input stream providing the compressed data
+  @param flags stream flags
+  @param n_threads is the number of worker threads, or 0 for default
+
+  @return a new stream instance on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAByteStream _Nullable AADecompressionInputStreamOpen(
+  AAByteStream compressed_stream,
+  AAFlagSet flags,
+  int n_threads)
+APPLE_ARCHIVE_AVAILABLE(macos(11.0), ios(14.0), watchos(7.0), tvos(14.0));
+
+/*!
+  @abstract Create a sequential decompression stream with explicit read-ahead depth
+
+  @discussion Same as AADecompressionInputStreamOpen, at most \p read_ahead blocks are decoded ahead of the reader.
+  If \p budget is not NULL, the read-ahead buffers (2 × block size per block) and the decoded block cache used by pread
+  are reserved from it: with a short budget, fewer blocks are read ahead, fewer blocks are cached, and concurrent pread
+  calls wait for memory. The read-ahead buffers are reserved without waiting on the first read, which fails if not even
+  one block fits. The budget should allow at least 4 blocks per stream.
+
+  @param compressed_stream is the input stream providing the compressed data
+  @param flags stream flags
+  @param n_threads is the number of worker threads, or 0 for default
+  @param read_ahead is the maximum number of blocks in flight, or 0 for default (2 per thread)
+  @param budget memory budget for the block buffers, can be NULL
+
+  @return a new stream instance on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAByteStream _Nullable AADecompressionInputStreamOpenWithReadAhead(
+  AAByteStream compressed_stream,
+  AAFlagSet flags,
+  int n_threads,
+  int read_ahead,
+  AAMemoryBudget _Nullable budget);
+
 #endif /* AAByteStream_h */
 
 #if __has_feature(assume_nonnull)
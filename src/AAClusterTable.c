@@ -0,0 +1,218 @@
+//
+//  AAClusterTable.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+#define AA_CLUSTER_FIEMAP_EXTENTS 64 /* extents per FIEMAP call */
+
+enum {
+    AA_CLUSTER_SLOT_EMPTY = 0,
+    AA_CLUSTER_SLOT_BUSY = 1, /* claimed, key being written */
+    AA_CLUSTER_SLOT_READY = 2,
+};
+
+typedef struct {
+    uint32_t state;
+    AAClusterKey key;
+    uint64_t cluster;
+} AAClusterSlot;
+
+struct AAClusterTable_impl {
+    size_t mask; /* number of slots - 1 */
+    size_t capacity;
+    size_t count;
+    AAClusterSlot *slots;
+};
+
+#pragma mark - Keys
+
+int AAClusterKeyInitWithHardLink(AAClusterKey *key, const char *path) {
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        ParallelCompressionLogError("lstat: %s");
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_nlink < 2) {
+        return 0;
+    }
+    key->dev = st.st_dev;
+    key->id = st.st_ino;
+    key->layout = 0;
+    return 1;
+}
+
+#if defined(__linux__)
+
+int AAClusterKeyInitWithClone(AAClusterKey *key, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        ParallelCompressionLogError("fstat");
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        return 0;
+    }
+    size_t fmSize = sizeof(struct fiemap) + AA_CLUSTER_FIEMAP_EXTENTS * sizeof(struct fiemap_extent);
+    struct fiemap *fm = malloc(fmSize);
+    AAHashContext ctx = AAHashContextCreate(AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_SHA256));
+    int result = 0;
+    if (!fm || !ctx) {
+        ParallelCompressionLogError("malloc");
+        result = -1;
+        goto END;
+    }
+    uint64_t size = st.st_size;
+    AAHashContextUpdate(ctx, &size, sizeof(size));
+    uint64_t start = 0;
+    int first = 1;
+    int last = 0;
+    while (!last) {
+        memset(fm, 0, sizeof(struct fiemap));
+        fm->fm_start = start;
+        fm->fm_length = FIEMAP_MAX_OFFSET - start;
+        fm->fm_extent_count = AA_CLUSTER_FIEMAP_EXTENTS;
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0) {
+            goto END; /* not supported by the filesystem */
+        }
+        if (fm->fm_mapped_extents == 0) {
+            goto END; /* hole at the end, or no extent */
+        }
+        for (uint32_t i = 0; i < fm->fm_mapped_extents; i++) {
+            const struct fiemap_extent *e = &fm->fm_extents[i];
+            /* all extents must be on disk, at a known address, and shared */
+            if (!(e->fe_flags & FIEMAP_EXTENT_SHARED) ||
+                (e->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED |
+                                FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_UNWRITTEN))) {
+                goto END;
+            }
+            if (first) {
+                key->id = e->fe_physical;
+                first = 0;
+            }
+            uint64_t extent[3] = { e->fe_logical, e->fe_physical, e->fe_length };
+            AAHashContextUpdate(ctx, extent, sizeof(extent));
+            start = e->fe_logical + e->fe_length;
+            if (e->fe_flags & FIEMAP_EXTENT_LAST) {
+                last = 1;
+            }
+        }
+    }
+    AADigests digests;
+    AAHashContextFinal(ctx, &digests);
+    key->dev = st.st_dev;
+    memcpy(&key->layout, digests.sha256, sizeof(key->layout));
+    result = 1;
+
+END:
+    AAHashContextDestroy(ctx);
+    free(fm);
+    return result;
+}
+
+#else
+
+int AAClusterKeyInitWithClone(AAClusterKey *key, int fd) {
+    (void)key;
+    (void)fd;
+    return 0;
+}
+
+#endif
+
+#pragma mark - Table
+
+static uint64_t keyHash(const AAClusterKey *key) {
+    uint64_t h = key->dev * 0x9e3779b97f4a7c15ULL;
+    h ^= key->id + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h ^= key->layout + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    /* splitmix64 finalizer */
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+AAClusterTable AAClusterTableCreate(size_t capacity) {
+    AAClusterTable table = calloc(1, sizeof(struct AAClusterTable_impl));
+    if (!table) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    /* at most half full */
+    size_t nSlots = 16;
+    while (nSlots < 2 * capacity) {
+        nSlots *= 2;
+    }
+    table->slots = calloc(nSlots, sizeof(AAClusterSlot));
+    if (!table->slots) {
+        ParallelCompressionLogError("malloc");
+        free(table);
+        return 0;
+    }
+    table->mask = nSlots - 1;
+    table->capacity = capacity;
+    return table;
+}
+
+void AAClusterTableDestroy(AAClusterTable table) {
+    if (!table) {
+        return;
+    }
+    free(table->slots);
+    free(table);
+}
+
+int AAClusterTableInsert(AAClusterTable table, const AAClusterKey *key, uint64_t *cluster_id) {
+    size_t i = keyHash(key) & table->mask;
+    for (size_t probes = 0; probes <= table->mask; probes++, i = (i + 1) & table->mask) {
+        AAClusterSlot *slot = &table->slots[i];
+        uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (state == AA_CLUSTER_SLOT_EMPTY) {
+            /* the slot count is bounded by the capacity, so probe sequences stay short */
+            if (__atomic_load_n(&table->count, __ATOMIC_RELAXED) >= table->capacity) {
+                ParallelCompressionLogError("cluster table full");
+                return -1;
+            }
+            uint32_t expected = AA_CLUSTER_SLOT_EMPTY;
+            if (__atomic_compare_exchange_n(&slot->state, &expected, AA_CLUSTER_SLOT_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                slot->key = *key;
+                slot->cluster = *cluster_id;
+                __atomic_store_n(&slot->state, AA_CLUSTER_SLOT_READY, __ATOMIC_RELEASE);
+                __atomic_fetch_add(&table->count, 1, __ATOMIC_RELAXED);
+                return 1;
+            }
+            state = expected; /* claimed by another thread */
+        }
+        while (state == AA_CLUSTER_SLOT_BUSY) {
+            /* key being written, usually a few stores away */
+            sched_yield();
+            state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        }
+        if (slot->key.dev == key->dev && slot->key.id == key->id && slot->key.layout == key->layout) {
+            *cluster_id = slot->cluster;
+            return 0;
+        }
+    }
+    ParallelCompressionLogError("cluster table full");
+    return -1;
+}
+
+size_t AAClusterTableGetCount(AAClusterTable table) {
+    return __atomic_load_n(&table->count, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,111 @@
+// AppleArchive hard link and clone clusters
+
+#pragma once
+
+#ifndef __APPLE_ARCHIVE_H
+#error Include AppleArchive.h instead of this file
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull begin")
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma mark - Cluster table
+
+/*!
+  @abstract Concurrent table assigning HLC and CLC cluster ids
+
+  @discussion
+  Maps file identities to cluster ids: the first file inserted with a given key defines the cluster id,
+  and later files with the same key get it back. The table uses open addressing, and insertions are
+  lock-free, so scanner threads can insert files concurrently.
+  The capacity is fixed when the table is created, e.g. to the number of paths in the path list.
+*/
+typedef struct AAClusterTable_impl * AAClusterTable APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Cluster key, identifying a hard link cluster or a clone cluster
+*/
+typedef struct {
+  uint64_t dev;      ///< st_dev
+  uint64_t id;       ///< st_ino for a hard link, physical address of the first extent for a clone
+  uint64_t layout;   ///< 0 for a hard link, 64 bits of the SHA-256 of the file size and extent map for a clone
+} AAClusterKey APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Get the hard link cluster key of a file, without following a final symbolic link
+
+  @param key receives the key
+  @param path file path
+
+  @return 1 if \p path is a regular file with more than one link, 0 if not, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AAClusterKeyInitWithHardLink(AAClusterKey * key, const char * path);
+
+/*!
+  @abstract Get the clone cluster key of an open file
+
+  @discussion
+  On Linux, the extent map is obtained with FIEMAP, and the file is a clone if all its extents are shared
+  with another file. Files with the same key have the same extents, and are clones of each other.
+  Other platforms always return 0.
+
+  @param key receives the key
+  @param fd open file descriptor
+
+  @return 1 if the file data is entirely shared, 0 if not, or if the filesystem can't tell, and a negative
+  error code on failure
+*/
+APPLE_ARCHIVE_API int AAClusterKeyInitWithClone(AAClusterKey * key, int fd);
+
+/*!
+  @abstract Create a cluster table
+
+  @param capacity max number of keys
+
+  @return a new table on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAClusterTable _Nullable AAClusterTableCreate(size_t capacity);
+
+/*!
+  @abstract Destroy a cluster table
+
+  @param table target table, do nothing if NULL
+*/
+APPLE_ARCHIVE_API void AAClusterTableDestroy(AAClusterTable _Nullable table);
+
+/*!
+  @abstract Insert a key, or get the cluster id of the key if already inserted
+
+  @discussion Thread safe and lock-free, except that a thread inserting a key may wait for another thread
+  inserting the same key.
+
+  @param table target table
+  @param key cluster key
+  @param cluster_id cluster id to store if \p key is new, e.g. the entry id of the file, and receives the
+  cluster id stored with \p key
+
+  @return 1 if \p key was inserted, 0 if it was found, and a negative error code if the table is full
+*/
+APPLE_ARCHIVE_API int AAClusterTableInsert(AAClusterTable table, const AAClusterKey * key, uint64_t * cluster_id);
+
+/*!
+  @abstract Get the number of keys in a table
+
+  @param table target table
+
+  @return number of keys inserted
+*/
+APPLE_ARCHIVE_API size_t AAClusterTableGetCount(AAClusterTable table);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull end")
+#endif
@@ -0,0 +1,187 @@
+//
+//  AACodec.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "AACodecBackends.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define AA_CODEC_MAX_BACKENDS 32
+
+struct AACodecContext_impl {
+    const AACodecBackend *backend;
+    void *state;
+};
+
+static pthread_once_t codecRegistryOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t codecRegistryLock = PTHREAD_MUTEX_INITIALIZER;
+static const AACodecBackend *codecRegistry[AA_CODEC_MAX_BACKENDS];
+static int codecRegistryCount;
+
+static const AACodecBackend * const aaCodecBuiltinBackends[] = {
+#if AA_CODEC_HAS_ZLIB
+    &aaCodecBackendZlib,
+#endif
+#if AA_CODEC_HAS_ZLIB_NG
+    &aaCodecBackendZlibNG,
+#endif
+#if AA_CODEC_HAS_LZMA
+    &aaCodecBackendLZMA,
+#endif
+#if AA_CODEC_HAS_LZ4
+    &aaCodecBackendLZ4,
+#endif
+#if AA_CODEC_HAS_LZFSE
+    &aaCodecBackendLZFSE,
+#endif
+    0
+};
+
+#pragma mark - NONE
+
+static ssize_t aaCodecNoneEncode(void *ctx, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    (void)ctx;
+    (void)dst;
+    (void)dst_capacity;
+    (void)src;
+    (void)src_size;
+    /* always stored raw */
+    return 0;
+}
+
+static ssize_t aaCodecNoneDecode(void *ctx, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    (void)ctx;
+    if (src_size > dst_capacity) {
+        return -1;
+    }
+    memcpy(dst, src, src_size);
+    return src_size;
+}
+
+static const AACodecBackend aaCodecBackendNone = {
+    .name = "none",
+    .algorithm = AA_COMPRESSION_ALGORITHM_NONE,
+    .priority = 0,
+    .encode = aaCodecNoneEncode,
+    .decode = aaCodecNoneDecode,
+};
+
+#pragma mark - Registry
+
+static int registerLocked(const AACodecBackend *backend) {
+    if (!backend || !backend->encode || !backend->decode) {
+        ParallelCompressionLogError("invalid codec backend");
+        return -1;
+    }
+    if (codecRegistryCount == AA_CODEC_MAX_BACKENDS) {
+        ParallelCompressionLogError("too many codec backends");
+        return -1;
+    }
+    codecRegistry[codecRegistryCount++] = backend;
+    return 0;
+}
+
+static void registerBuiltinBackends(void) {
+    pthread_mutex_lock(&codecRegistryLock);
+    registerLocked(&aaCodecBackendNone);
+    for (const AACodecBackend * const *backend = aaCodecBuiltinBackends; *backend; backend++) {
+        registerLocked(*backend);
+    }
+    pthread_mutex_unlock(&codecRegistryLock);
+}
+
+int AACodecRegister(const AACodecBackend *backend) {
+    pthread_once(&codecRegistryOnce, registerBuiltinBackends);
+    pthread_mutex_lock(&codecRegistryLock);
+    int result = registerLocked(backend);
+    pthread_mutex_unlock(&codecRegistryLock);
+    return result;
+}
+
+const AACodecBackend *AACodecGetBackend(AACompressionAlgorithm algorithm) {
+    pthread_once(&codecRegistryOnce, registerBuiltinBackends);
+    const AACodecBackend *best = 0;
+    pthread_mutex_lock(&codecRegistryLock);
+    for (int i = 0; i < codecRegistryCount; i++) {
+        const AACodecBackend *backend = codecRegistry[i];
+        if (backend->algorithm != algorithm) {
+            continue;
+        }
+        if (best && best->priority >= backend->priority) {
+            continue;
+        }
+        /* runtime probe, e.g. a CPU feature or an optional shared library */
+        if (backend->available && !backend->available()) {
+            continue;
+        }
+        best = backend;
+    }
+    pthread_mutex_unlock(&codecRegistryLock);
+    return best;
+}
+
+#pragma mark - Contexts
+
+AACodecContext AACodecContextCreate(AACompressionAlgorithm algorithm) {
+    const AACodecBackend *backend = AACodecGetBackend(algorithm);
+    if (!backend) {
+        ParallelCompressionLogError("no codec for algorithm: %u");
+        return 0;
+    }
+    AACodecContext ctx = calloc(1, sizeof(struct AACodecContext_impl));
+    if (!ctx) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    ctx->backend = backend;
+    if (backend->context_create) {
+        ctx->state = backend->context_create();
+        if (!ctx->state) {
+            ParallelCompressionLogError("codec context_create");
+            free(ctx);
+            return 0;
+        }
+    }
+    return ctx;
+}
+
+void AACodecContextDestroy(AACodecContext ctx) {
+    if (!ctx) {
+        return;
+    }
+    if (ctx->backend->context_destroy) {
+        ctx->backend->context_destroy(ctx->state);
+    }
+    free(ctx);
+}
+
+const AACodecBackend *AACodecContextGetBackend(AACodecContext ctx) {
+    return ctx->backend;
+}
+
+int AACodecContextSetDictionary(AACodecContext ctx, const uint8_t *dict, size_t dict_size) {
+    if (!ctx->backend->set_dictionary) {
+        ParallelCompressionLogError("codec doesn't support dictionaries");
+        return -1;
+    }
+    return ctx->backend->set_dictionary(ctx->state, dict, dict_size);
+}
+
+ssize_t AACodecEncodeBlock(AACodecContext ctx, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    return ctx->backend->encode(ctx->state, dst, dst_capacity, src, src_size);
+}
+
+ssize_t AACodecEncodeBlockFast(AACodecContext ctx, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    if (!ctx->backend->encode_fast) {
+        return ctx->backend->encode(ctx->state, dst, dst_capacity, src, src_size);
+    }
+    return ctx->backend->encode_fast(ctx->state, dst, dst_capacity, src, src_size);
+}
+
+ssize_t AACodecDecodeBlock(AACodecContext ctx, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    return ctx->backend->decode(ctx->state, dst, dst_capacity, src, src_size);
+}
@@ -0,0 +1,185 @@
+// AppleArchive block codecs
+
+#pragma once
+
+#ifndef __APPLE_ARCHIVE_H
+#error Include AppleArchive.h instead of this file
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull begin")
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma mark - Codec backends
+
+/*!
+  @abstract Codec backend
+
+  @discussion
+  A backend implements one compression algorithm with a stateless block API: all per-call state lives in
+  a context created by \p context_create, reused for every block processed by the same thread.
+  Several backends can be registered for the same algorithm, the available one with the highest
+  \p priority is selected at runtime.
+
+  \p encode returns the compressed size on success, 0 if the output doesn't fit in \p dst_capacity bytes
+  (the block is then stored raw), and a negative value on failure.
+  \p decode returns the decoded size on success, and a negative value on failure.
+  \p encode_fast is optional, it trades ratio for speed and its output must be readable by \p decode.
+  \p set_dictionary is optional, it sets the dictionary used by all subsequent encode and decode calls on the context.
+*/
+typedef struct {
+  const char * name;
+  AACompressionAlgorithm algorithm;
+  int priority;
+  int (* _Nullable available)(void);
+  void * _Nullable (* _Nullable context_create)(void);
+  void (* _Nullable context_destroy)(void * _Nullable ctx);
+  ssize_t (*encode)(void * _Nullable ctx, uint8_t * dst, size_t dst_capacity, const uint8_t * src, size_t src_size);
+  ssize_t (*decode)(void * _Nullable ctx, uint8_t * dst, size_t dst_capacity, const uint8_t * src, size_t src_size);
+  ssize_t (* _Nullable encode_fast)(void * _Nullable ctx, uint8_t * dst, size_t dst_capacity, const uint8_t * src, size_t src_size);
+  int (* _Nullable set_dictionary)(void * _Nullable ctx, const uint8_t * _Nullable dict, size_t dict_size);
+} AACodecBackend APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+typedef struct AACodecContext_impl * AACodecContext APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Register a codec backend
+
+  @discussion \p backend is not copied, and must remain valid until the process exits.
+
+  @param backend backend to register
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AACodecRegister(const AACodecBackend * backend);
+
+/*!
+  @abstract Get the preferred backend for \p algorithm
+
+  @param algorithm one of AA_COMPRESSION_ALGORITHM_*
+
+  @return the available backend with the highest priority, and NULL if none is available
+*/
+APPLE_ARCHIVE_API const AACodecBackend * _Nullable AACodecGetBackend(AACompressionAlgorithm algorithm);
+
+#pragma mark - Codec contexts
+
+/*!
+  @abstract Create a codec context for \p algorithm
+
+  @discussion A context is not thread safe, and should be owned by a single worker thread.
+
+  @param algorithm one of AA_COMPRESSION_ALGORITHM_*
+
+  @return a new context on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AACodecContext _Nullable AACodecContextCreate(AACompressionAlgorithm algorithm);
+
+/*!
+  @abstract Destroy a codec context
+
+  @param ctx target context, do nothing if NULL
+*/
+APPLE_ARCHIVE_API void AACodecContextDestroy(AACodecContext _Nullable ctx);
+
+/*!
+  @abstract Get the backend used by \p ctx
+
+  @param ctx target context
+
+  @return the backend
+*/
+APPLE_ARCHIVE_API const AACodecBackend * AACodecContextGetBackend(AACodecContext ctx);
+
+/*!
+  @abstract Set the dictionary used by \p ctx
+
+  @discussion \p dict is not copied, and must remain valid while \p ctx is used. Blocks compressed with a dictionary
+  can only be decompressed by a context using the same dictionary.
+
+  @param ctx codec context
+  @param dict dictionary, or NULL to remove it
+  @param dict_size number of bytes in \p dict
+
+  @return 0 on success, and a negative error code on failure, or if the backend doesn't support dictionaries
+*/
+APPLE_ARCHIVE_API int AACodecContextSetDictionary(AACodecContext ctx, const uint8_t * _Nullable dict, size_t dict_size);
+
+/*!
+  @abstract Compress one block
+
+  @param ctx codec context
+  @param dst receives the compressed data
+  @param dst_capacity number of bytes available in \p dst
+  @param src data to compress
+  @param src_size number of bytes in \p src
+
+  @return the compressed size on success, 0 if it doesn't fit in \p dst_capacity, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API ssize_t AACodecEncodeBlock(AACodecContext ctx, uint8_t * dst, size_t dst_capacity, const uint8_t * src, size_t src_size);
+
+/*!
+  @abstract Compress one block with faster settings
+
+  @discussion Uses the backend \p encode_fast if available (e.g. a lower level of the same algorithm), and \p encode otherwise.
+  The output is decoded by AACodecDecodeBlock.
+
+  @param ctx codec context
+  @param dst receives the compressed data
+  @param dst_capacity number of bytes available in \p dst
+  @param src data to compress
+  @param src_size number of bytes in \p src
+
+  @return the compressed size on success, 0 if it doesn't fit in \p dst_capacity, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API ssize_t AACodecEncodeBlockFast(AACodecContext ctx, uint8_t * dst, size_t dst_capacity, const uint8_t * src, size_t src_size);
+
+/*!
+  @abstract Decompress one block
+
+  @param ctx codec context
+  @param dst receives the decompressed data
+  @param dst_capacity number of bytes available in \p dst
+  @param src compressed data
+  @param src_size number of bytes in \p src
+
+  @return the decompressed size on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API ssize_t AACodecDecodeBlock(AACodecContext ctx, uint8_t * dst, size_t dst_capacity, const uint8_t * src, size_t src_size);
+
+#pragma mark - Dictionaries
+
+/*!
+  @abstract Train a dictionary from samples
+
+  @discussion
+  Selects the segments of \p samples sharing the most 8-byte sequences with other samples, with the most
+  valuable segments at the end of the dictionary, where LZ codecs reach them with the shortest distances.
+  Samples should be representative of small payloads compressed with the dictionary, e.g. file contents.
+
+  @param dict receives the dictionary
+  @param dict_capacity number of bytes available in \p dict, 32 KiB for zlib, 64 KiB for LZ4 are the useful maximums
+  @param samples concatenated samples
+  @param sample_sizes size of each sample
+  @param sample_count number of samples
+
+  @return the dictionary size on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API ssize_t AACompressionDictionaryTrain(
+  uint8_t * dict,
+  size_t dict_capacity,
+  const uint8_t * samples,
+  const size_t * sample_sizes,
+  size_t sample_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull end")
+#endif
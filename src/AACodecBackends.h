@@ -0,0 +1,50 @@
+//
+//  AACodecBackends.h
+//  libAppleArchive
+//
+
+#ifndef AACodecBackends_h
+#define AACodecBackends_h
+
+/*
+ * Built-in codec backends, each one is compiled in when its library headers are found.
+ * Backends for the same algorithm are ranked by priority, the best available one is
+ * picked at runtime by AACodecGetBackend.
+ */
+
+#if __has_include(<zlib.h>)
+#define AA_CODEC_HAS_ZLIB 1
+#endif
+#if __has_include(<zlib-ng.h>)
+#define AA_CODEC_HAS_ZLIB_NG 1
+#endif
+#if __has_include(<lzma.h>)
+#define AA_CODEC_HAS_LZMA 1
+#endif
+#if __has_include(<lz4.h>)
+#define AA_CODEC_HAS_LZ4 1
+#endif
+#if __has_include(<lzfse.h>)
+#define AA_CODEC_HAS_LZFSE 1
+#endif
+
+#define AA_CODEC_PRIORITY_REFERENCE 10
+#define AA_CODEC_PRIORITY_OPTIMIZED 20
+
+#if AA_CODEC_HAS_ZLIB
+extern const AACodecBackend aaCodecBackendZlib;
+#endif
+#if AA_CODEC_HAS_ZLIB_NG
+extern const AACodecBackend aaCodecBackendZlibNG;
+#endif
+#if AA_CODEC_HAS_LZMA
+extern const AACodecBackend aaCodecBackendLZMA;
+#endif
+#if AA_CODEC_HAS_LZ4
+extern const AACodecBackend aaCodecBackendLZ4;
+#endif
+#if AA_CODEC_HAS_LZFSE
+extern const AACodecBackend aaCodecBackendLZFSE;
+#endif
+
+#endif /* AACodecBackends_h */
@@ -0,0 +1,198 @@
+//
+//  AACodecLZ4.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "AACodecBackends.h"
+
+#if AA_CODEC_HAS_LZ4
+
+#include <lz4.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * LZ4 with the block framing used by the Compression library:
+ *   "bv41" raw_size:u32le compressed_size:u32le data   compressed block
+ *   "bv4-" raw_size:u32le data                         uncompressed block
+ *   "bv4$"                                             end of stream
+ * Compressed blocks may reference the output of previous blocks, and the
+ * first block may reference the context dictionary.
+ */
+#define AA_LZ4_COMPRESSED_HEADER_SIZE 12
+#define AA_LZ4_RAW_HEADER_SIZE 8
+#define AA_LZ4_END_SIZE 4
+
+struct aaLZ4Context {
+    void *state; /* LZ4_sizeofState() bytes, reused for every block */
+    LZ4_stream_t *dictStream; /* allocated when a dictionary is set */
+    const uint8_t *dict;
+    int dictSize;
+};
+
+static uint32_t loadLE32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void storeLE32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static void *aaLZ4ContextCreate(void) {
+    struct aaLZ4Context *ctx = calloc(1, sizeof(struct aaLZ4Context));
+    if (!ctx) {
+        return 0;
+    }
+    ctx->state = malloc(LZ4_sizeofState());
+    if (!ctx->state) {
+        free(ctx);
+        return 0;
+    }
+    return ctx;
+}
+
+static void aaLZ4ContextDestroy(void *arg) {
+    struct aaLZ4Context *ctx = arg;
+    if (!ctx) {
+        return;
+    }
+    free(ctx->state);
+    if (ctx->dictStream) {
+        LZ4_freeStream(ctx->dictStream);
+    }
+    free(ctx);
+}
+
+static ssize_t aaLZ4Encode(void *arg, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    struct aaLZ4Context *ctx = arg;
+    if (src_size > LZ4_MAX_INPUT_SIZE) {
+        return -1;
+    }
+    if (dst_capacity <= AA_LZ4_COMPRESSED_HEADER_SIZE + AA_LZ4_END_SIZE) {
+        return 0;
+    }
+    size_t capacity = dst_capacity - AA_LZ4_COMPRESSED_HEADER_SIZE - AA_LZ4_END_SIZE;
+    if (capacity > INT32_MAX) {
+        capacity = INT32_MAX;
+    }
+    int compressedSize;
+    if (ctx->dict) {
+        LZ4_loadDict(ctx->dictStream, (const char *)ctx->dict, ctx->dictSize);
+        compressedSize = LZ4_compress_fast_continue(ctx->dictStream, (const char *)src, (char *)dst + AA_LZ4_COMPRESSED_HEADER_SIZE, (int)src_size, (int)capacity, 1);
+    } else {
+        compressedSize = LZ4_compress_fast_extState(ctx->state, (const char *)src, (char *)dst + AA_LZ4_COMPRESSED_HEADER_SIZE, (int)src_size, (int)capacity, 1);
+    }
+    if (compressedSize <= 0) {
+        /* output doesn't fit */
+        return 0;
+    }
+    memcpy(dst, "bv41", 4);
+    storeLE32(dst + 4, (uint32_t)src_size);
+    storeLE32(dst + 8, (uint32_t)compressedSize);
+    memcpy(dst + AA_LZ4_COMPRESSED_HEADER_SIZE + compressedSize, "bv4$", 4);
+    return AA_LZ4_COMPRESSED_HEADER_SIZE + compressedSize + AA_LZ4_END_SIZE;
+}
+
+static ssize_t aaLZ4Decode(void *arg, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    struct aaLZ4Context *ctx = arg;
+    size_t pos = 0;
+    size_t out = 0;
+    while (1) {
+        if (pos + 4 > src_size) {
+            ParallelCompressionLogError("truncated lz4 stream");
+            return -1;
+        }
+        const uint8_t *magic = src + pos;
+        if (memcmp(magic, "bv4$", 4) == 0) {
+            return out;
+        }
+        if (memcmp(magic, "bv41", 4) == 0) {
+            if (pos + AA_LZ4_COMPRESSED_HEADER_SIZE > src_size) {
+                ParallelCompressionLogError("truncated lz4 block header");
+                return -1;
+            }
+            uint32_t rawSize = loadLE32(magic + 4);
+            uint32_t compressedSize = loadLE32(magic + 8);
+            pos += AA_LZ4_COMPRESSED_HEADER_SIZE;
+            if (compressedSize > src_size - pos || rawSize > dst_capacity - out || compressedSize > INT32_MAX || rawSize > INT32_MAX) {
+                ParallelCompressionLogError("invalid lz4 block");
+                return -1;
+            }
+            /* the last 64 KB of previous output is the dictionary, or the context dictionary for the first block */
+            const char *dict = (const char *)dst + out;
+            int dictSize = out > 0x10000 ? 0x10000 : (int)out;
+            dict -= dictSize;
+            if (out == 0 && ctx->dict) {
+                dict = (const char *)ctx->dict;
+                dictSize = ctx->dictSize;
+            }
+            int n = LZ4_decompress_safe_usingDict((const char *)src + pos, (char *)dst + out, (int)compressedSize, (int)rawSize, dict, dictSize);
+            if (n < 0 || (uint32_t)n != rawSize) {
+                ParallelCompressionLogError("LZ4_decompress_safe_usingDict");
+                return -1;
+            }
+            pos += compressedSize;
+            out += rawSize;
+            continue;
+        }
+        if (memcmp(magic, "bv4-", 4) == 0) {
+            if (pos + AA_LZ4_RAW_HEADER_SIZE > src_size) {
+                ParallelCompressionLogError("truncated lz4 block header");
+                return -1;
+            }
+            uint32_t rawSize = loadLE32(magic + 4);
+            pos += AA_LZ4_RAW_HEADER_SIZE;
+            if (rawSize > src_size - pos || rawSize > dst_capacity - out) {
+                ParallelCompressionLogError("invalid lz4 block");
+                return -1;
+            }
+            memcpy(dst + out, src + pos, rawSize);
+            pos += rawSize;
+            out += rawSize;
+            continue;
+        }
+        ParallelCompressionLogError("invalid lz4 block magic");
+        return -1;
+    }
+}
+
+static int aaLZ4SetDictionary(void *arg, const uint8_t *dict, size_t dict_size) {
+    struct aaLZ4Context *ctx = arg;
+    if (!dict || !dict_size) {
+        ctx->dict = 0;
+        ctx->dictSize = 0;
+        return 0;
+    }
+    if (!ctx->dictStream) {
+        ctx->dictStream = LZ4_createStream();
+        if (!ctx->dictStream) {
+            ParallelCompressionLogError("LZ4_createStream");
+            return -1;
+        }
+    }
+    /* LZ4 only references the last 64 KB */
+    if (dict_size > 0x10000) {
+        dict += dict_size - 0x10000;
+        dict_size = 0x10000;
+    }
+    ctx->dict = dict;
+    ctx->dictSize = (int)dict_size;
+    return 0;
+}
+
+const AACodecBackend aaCodecBackendLZ4 = {
+    .name = "lz4",
+    .algorithm = AA_COMPRESSION_ALGORITHM_LZ4,
+    .priority = AA_CODEC_PRIORITY_REFERENCE,
+    .context_create = aaLZ4ContextCreate,
+    .context_destroy = aaLZ4ContextDestroy,
+    .encode = aaLZ4Encode,
+    .decode = aaLZ4Decode,
+    .set_dictionary = aaLZ4SetDictionary,
+};
+
+#endif /* AA_CODEC_HAS_LZ4 */
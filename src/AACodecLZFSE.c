@@ -0,0 +1,73 @@
+//
+//  AACodecLZFSE.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "AACodecBackends.h"
+
+#if AA_CODEC_HAS_LZFSE
+
+#include <lzfse.h>
+#include <stdlib.h>
+
+struct aaLZFSEContext {
+    void *encodeScratch; /* lzfse_encode_scratch_size() bytes, allocated on first encode */
+    void *decodeScratch; /* lzfse_decode_scratch_size() bytes, allocated on first decode */
+};
+
+static void *aaLZFSEContextCreate(void) {
+    return calloc(1, sizeof(struct aaLZFSEContext));
+}
+
+static void aaLZFSEContextDestroy(void *arg) {
+    struct aaLZFSEContext *ctx = arg;
+    if (!ctx) {
+        return;
+    }
+    free(ctx->encodeScratch);
+    free(ctx->decodeScratch);
+    free(ctx);
+}
+
+static ssize_t aaLZFSEEncode(void *arg, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    struct aaLZFSEContext *ctx = arg;
+    if (!ctx->encodeScratch) {
+        ctx->encodeScratch = malloc(lzfse_encode_scratch_size());
+        if (!ctx->encodeScratch) {
+            ParallelCompressionLogError("malloc");
+            return -1;
+        }
+    }
+    /* 0 when the output doesn't fit */
+    return lzfse_encode_buffer(dst, dst_capacity, src, src_size, ctx->encodeScratch);
+}
+
+static ssize_t aaLZFSEDecode(void *arg, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    struct aaLZFSEContext *ctx = arg;
+    if (!ctx->decodeScratch) {
+        ctx->decodeScratch = malloc(lzfse_decode_scratch_size());
+        if (!ctx->decodeScratch) {
+            ParallelCompressionLogError("malloc");
+            return -1;
+        }
+    }
+    size_t n = lzfse_decode_buffer(dst, dst_capacity, src, src_size, ctx->decodeScratch);
+    if (n == 0) {
+        ParallelCompressionLogError("lzfse_decode_buffer");
+        return -1;
+    }
+    return n;
+}
+
+const AACodecBackend aaCodecBackendLZFSE = {
+    .name = "lzfse",
+    .algorithm = AA_COMPRESSION_ALGORITHM_LZFSE,
+    .priority = AA_CODEC_PRIORITY_REFERENCE,
+    .context_create = aaLZFSEContextCreate,
+    .context_destroy = aaLZFSEContextDestroy,
+    .encode = aaLZFSEEncode,
+    .decode = aaLZFSEDecode,
+};
+
+#endif /* AA_CODEC_HAS_LZFSE */
@@ -0,0 +1,121 @@
+//
+//  AACodecLZMA.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "AACodecBackends.h"
+
+#if AA_CODEC_HAS_LZMA
+
+#include <lzma.h>
+#include <stdlib.h>
+
+/* AA_COMPRESSION_ALGORITHM_LZMA is preset 6, in the xz container, the fast variant uses preset 1 */
+#define AA_LZMA_PRESET 6
+#define AA_LZMA_FAST_PRESET 1
+
+struct aaLZMAContext {
+    lzma_stream encoder;
+    lzma_stream fastEncoder; /* separate stream, switching presets would reallocate the match finder */
+    lzma_stream decoder;
+    int encoderReady;
+    int fastEncoderReady;
+    int decoderReady;
+};
+
+static void *aaLZMAContextCreate(void) {
+    struct aaLZMAContext *ctx = malloc(sizeof(struct aaLZMAContext));
+    if (!ctx) {
+        return 0;
+    }
+    lzma_stream init = LZMA_STREAM_INIT;
+    ctx->encoder = init;
+    ctx->fastEncoder = init;
+    ctx->decoder = init;
+    ctx->encoderReady = 0;
+    ctx->fastEncoderReady = 0;
+    ctx->decoderReady = 0;
+    return ctx;
+}
+
+static void aaLZMAContextDestroy(void *arg) {
+    struct aaLZMAContext *ctx = arg;
+    if (!ctx) {
+        return;
+    }
+    if (ctx->encoderReady) {
+        lzma_end(&ctx->encoder);
+    }
+    if (ctx->fastEncoderReady) {
+        lzma_end(&ctx->fastEncoder);
+    }
+    if (ctx->decoderReady) {
+        lzma_end(&ctx->decoder);
+    }
+    free(ctx);
+}
+
+static ssize_t aaLZMAEncodeWithPreset(lzma_stream *encoder, int *ready, uint32_t preset, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    /* re-initializing an existing stream reuses its match finder and dictionary allocations */
+    if (lzma_easy_encoder(encoder, preset, LZMA_CHECK_CRC64) != LZMA_OK) {
+        ParallelCompressionLogError("lzma_easy_encoder");
+        return -1;
+    }
+    *ready = 1;
+    encoder->next_in = src;
+    encoder->avail_in = src_size;
+    encoder->next_out = dst;
+    encoder->avail_out = dst_capacity;
+    lzma_ret status = lzma_code(encoder, LZMA_FINISH);
+    if (status == LZMA_STREAM_END) {
+        return encoder->total_out;
+    }
+    if (status == LZMA_OK || status == LZMA_BUF_ERROR) {
+        /* output doesn't fit */
+        return 0;
+    }
+    ParallelCompressionLogError("lzma_code");
+    return -1;
+}
+
+static ssize_t aaLZMAEncode(void *arg, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    struct aaLZMAContext *ctx = arg;
+    return aaLZMAEncodeWithPreset(&ctx->encoder, &ctx->encoderReady, AA_LZMA_PRESET, dst, dst_capacity, src, src_size);
+}
+
+static ssize_t aaLZMAEncodeFast(void *arg, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    struct aaLZMAContext *ctx = arg;
+    return aaLZMAEncodeWithPreset(&ctx->fastEncoder, &ctx->fastEncoderReady, AA_LZMA_FAST_PRESET, dst, dst_capacity, src, src_size);
+}
+
+static ssize_t aaLZMADecode(void *arg, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    struct aaLZMAContext *ctx = arg;
+    if (lzma_stream_decoder(&ctx->decoder, UINT64_MAX, 0) != LZMA_OK) {
+        ParallelCompressionLogError("lzma_stream_decoder");
+        return -1;
+    }
+    ctx->decoderReady = 1;
+    ctx->decoder.next_in = src;
+    ctx->decoder.avail_in = src_size;
+    ctx->decoder.next_out = dst;
+    ctx->decoder.avail_out = dst_capacity;
+    if (lzma_code(&ctx->decoder, LZMA_FINISH) != LZMA_STREAM_END) {
+        ParallelCompressionLogError("lzma_code");
+        return -1;
+    }
+    return ctx->decoder.total_out;
+}
+
+const AACodecBackend aaCodecBackendLZMA = {
+    .name = "lzma",
+    .algorithm = AA_COMPRESSION_ALGORITHM_LZMA,
+    .priority = AA_CODEC_PRIORITY_REFERENCE,
+    .context_create = aaLZMAContextCreate,
+    .context_destroy = aaLZMAContextDestroy,
+    .encode = aaLZMAEncode,
+    .decode = aaLZMADecode,
+    .encode_fast = aaLZMAEncodeFast,
+};
+
+#endif /* AA_CODEC_HAS_LZMA */
@@ -0,0 +1,29 @@
+//
+//  AACodecZlib.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "AACodecBackends.h"
+
+#if AA_CODEC_HAS_ZLIB
+
+#include <zlib.h>
+
+#define AA_ZLIB_STREAM z_stream
+#define AA_ZLIB(name) name
+#include "AACodecZlibImpl.h"
+
+const AACodecBackend aaCodecBackendZlib = {
+    .name = "zlib",
+    .algorithm = AA_COMPRESSION_ALGORITHM_ZLIB,
+    .priority = AA_CODEC_PRIORITY_REFERENCE,
+    .context_create = aaZlibContextCreate,
+    .context_destroy = aaZlibContextDestroy,
+    .encode = aaZlibEncode,
+    .decode = aaZlibDecode,
+    .encode_fast = aaZlibEncodeFast,
+    .set_dictionary = aaZlibSetDictionary,
+};
+
+#endif /* AA_CODEC_HAS_ZLIB */
@@ -0,0 +1,164 @@
+//
+//  AACodecZlibImpl.h
+//  libAppleArchive
+//
+
+/*
+ * Shared zlib backend implementation, included by AACodecZlib.c and AACodecZlibNG.c
+ * after defining:
+ *   AA_ZLIB_STREAM    stream type (z_stream, zng_stream)
+ *   AA_ZLIB(name)     function name in the selected API (name, zng_##name)
+ */
+
+#include <stdlib.h>
+
+/* AA_COMPRESSION_ALGORITHM_ZLIB is level 5, the fast variant uses level 1 */
+#define AA_ZLIB_LEVEL 5
+#define AA_ZLIB_FAST_LEVEL 1
+/* blocks are the 2 bytes zlib header, then raw DEFLATE as COMPRESSION_ZLIB, without the Adler-32 trailer */
+#define AA_ZLIB_WINDOW_BITS (-15)
+#define AA_ZLIB_MEM_LEVEL 8
+#define AA_ZLIB_HEADER_SIZE 2
+
+struct aaZlibContext {
+    AA_ZLIB_STREAM deflater;
+    AA_ZLIB_STREAM inflater;
+    int deflaterReady;
+    int deflaterLevel;
+    int inflaterReady;
+    const uint8_t *dict;
+    size_t dictSize;
+};
+
+static void *aaZlibContextCreate(void) {
+    /* streams are initialized on first use, a decoding thread never allocates deflate state */
+    return calloc(1, sizeof(struct aaZlibContext));
+}
+
+static void aaZlibContextDestroy(void *arg) {
+    struct aaZlibContext *ctx = arg;
+    if (!ctx) {
+        return;
+    }
+    if (ctx->deflaterReady) {
+        AA_ZLIB(deflateEnd)(&ctx->deflater);
+    }
+    if (ctx->inflaterReady) {
+        AA_ZLIB(inflateEnd)(&ctx->inflater);
+    }
+    free(ctx);
+}
+
+/* RFC1950 header: deflate with a 32 KB window, FLEVEL from \p level, no preset dictionary id */
+static void aaZlibWriteHeader(uint8_t *dst, int level) {
+    unsigned cmf = 0x78;
+    unsigned flevel = (level < 2) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3;
+    unsigned flg = flevel << 6;
+    flg += 31 - ((cmf << 8) + flg) % 31;
+    dst[0] = (uint8_t)cmf;
+    dst[1] = (uint8_t)flg;
+}
+
+static ssize_t aaZlibEncodeWithLevel(struct aaZlibContext *ctx, int level, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    if (!ctx->deflaterReady) {
+        if (AA_ZLIB(deflateInit2)(&ctx->deflater, level, Z_DEFLATED, AA_ZLIB_WINDOW_BITS, AA_ZLIB_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+            ParallelCompressionLogError("deflateInit2");
+            return -1;
+        }
+        ctx->deflaterReady = 1;
+        ctx->deflaterLevel = level;
+    } else if (AA_ZLIB(deflateReset)(&ctx->deflater) != Z_OK) {
+        ParallelCompressionLogError("deflateReset");
+        return -1;
+    }
+    if (ctx->deflaterLevel != level) {
+        /* no input pending after reset, only the level settings change */
+        if (AA_ZLIB(deflateParams)(&ctx->deflater, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+            ParallelCompressionLogError("deflateParams");
+            return -1;
+        }
+        ctx->deflaterLevel = level;
+    }
+    if (ctx->dict && AA_ZLIB(deflateSetDictionary)(&ctx->deflater, ctx->dict, (uint32_t)ctx->dictSize) != Z_OK) {
+        ParallelCompressionLogError("deflateSetDictionary");
+        return -1;
+    }
+    if (src_size > UINT32_MAX || dst_capacity > UINT32_MAX) {
+        return -1;
+    }
+    if (dst_capacity <= AA_ZLIB_HEADER_SIZE) {
+        return 0;
+    }
+    aaZlibWriteHeader(dst, level);
+    ctx->deflater.next_in = (void *)src;
+    ctx->deflater.avail_in = (uint32_t)src_size;
+    ctx->deflater.next_out = dst + AA_ZLIB_HEADER_SIZE;
+    ctx->deflater.avail_out = (uint32_t)(dst_capacity - AA_ZLIB_HEADER_SIZE);
+    int status = AA_ZLIB(deflate)(&ctx->deflater, Z_FINISH);
+    if (status == Z_STREAM_END) {
+        return AA_ZLIB_HEADER_SIZE + ctx->deflater.total_out;
+    }
+    if (status == Z_OK || status == Z_BUF_ERROR) {
+        /* output doesn't fit */
+        return 0;
+    }
+    ParallelCompressionLogError("deflate");
+    return -1;
+}
+
+static ssize_t aaZlibEncode(void *arg, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    return aaZlibEncodeWithLevel(arg, AA_ZLIB_LEVEL, dst, dst_capacity, src, src_size);
+}
+
+static ssize_t aaZlibEncodeFast(void *arg, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    return aaZlibEncodeWithLevel(arg, AA_ZLIB_FAST_LEVEL, dst, dst_capacity, src, src_size);
+}
+
+static ssize_t aaZlibDecode(void *arg, uint8_t *dst, size_t dst_capacity, const uint8_t *src, size_t src_size) {
+    struct aaZlibContext *ctx = arg;
+    if (!ctx->inflaterReady) {
+        if (AA_ZLIB(inflateInit2)(&ctx->inflater, AA_ZLIB_WINDOW_BITS) != Z_OK) {
+            ParallelCompressionLogError("inflateInit2");
+            return -1;
+        }
+        ctx->inflaterReady = 1;
+    } else if (AA_ZLIB(inflateReset)(&ctx->inflater) != Z_OK) {
+        ParallelCompressionLogError("inflateReset");
+        return -1;
+    }
+    /* raw streams carry no dictionary id, set it before the first byte */
+    if (ctx->dict && AA_ZLIB(inflateSetDictionary)(&ctx->inflater, ctx->dict, (uint32_t)ctx->dictSize) != Z_OK) {
+        ParallelCompressionLogError("inflateSetDictionary");
+        return -1;
+    }
+    if (src_size > UINT32_MAX || dst_capacity > UINT32_MAX) {
+        return -1;
+    }
+    /* deflate method, valid check bits, no preset dictionary id */
+    if (src_size < AA_ZLIB_HEADER_SIZE || (src[0] & 0x0f) != 8 || ((src[0] << 8) + src[1]) % 31 != 0 || (src[1] & 0x20)) {
+        ParallelCompressionLogError("invalid zlib header");
+        return -1;
+    }
+    src += AA_ZLIB_HEADER_SIZE;
+    src_size -= AA_ZLIB_HEADER_SIZE;
+    ctx->inflater.next_in = (void *)src;
+    ctx->inflater.avail_in = (uint32_t)src_size;
+    ctx->inflater.next_out = dst;
+    ctx->inflater.avail_out = (uint32_t)dst_capacity;
+    int status = AA_ZLIB(inflate)(&ctx->inflater, Z_FINISH);
+    if (status != Z_STREAM_END) {
+        ParallelCompressionLogError("inflate");
+        return -1;
+    }
+    return ctx->inflater.total_out;
+}
+
+static int aaZlibSetDictionary(void *arg, const uint8_t *dict, size_t dict_size) {
+    struct aaZlibContext *ctx = arg;
+    if (dict_size > UINT32_MAX) {
+        return -1;
+    }
+    ctx->dict = dict_size ? dict : 0;
+    ctx->dictSize = dict_size;
+    return 0;
+}
@@ -0,0 +1,35 @@
+//
+//  AACodecZlibNG.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "AACodecBackends.h"
+
+#if AA_CODEC_HAS_ZLIB_NG
+
+#include <zlib-ng.h>
+
+#define AA_ZLIB_STREAM zng_stream
+#define AA_ZLIB(name) zng_##name
+#include "AACodecZlibImpl.h"
+
+static int aaZlibNGAvailable(void) {
+    /* zlib-ng picks its SIMD kernels (AVX2, AVX512, NEON, ...) internally at first use */
+    return zlibng_version() != 0;
+}
+
+const AACodecBackend aaCodecBackendZlibNG = {
+    .name = "zlib-ng",
+    .algorithm = AA_COMPRESSION_ALGORITHM_ZLIB,
+    .priority = AA_CODEC_PRIORITY_OPTIMIZED,
+    .available = aaZlibNGAvailable,
+    .context_create = aaZlibContextCreate,
+    .context_destroy = aaZlibContextDestroy,
+    .encode = aaZlibEncode,
+    .decode = aaZlibDecode,
+    .encode_fast = aaZlibEncodeFast,
+    .set_dictionary = aaZlibSetDictionary,
+};
+
+#endif /* AA_CODEC_HAS_ZLIB_NG */
@@ -0,0 +1,189 @@
+//
+//  AACompressionDictionary.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Segments are scored on the 8-byte sequences they contain */
+#define AA_DICTIONARY_KMER_SIZE 8
+#define AA_DICTIONARY_SEGMENT_SIZE 1024
+#define AA_DICTIONARY_MIN_HASH_BITS 12
+#define AA_DICTIONARY_MAX_HASH_BITS 22
+
+typedef struct {
+    size_t offset;
+    size_t size;
+    uint64_t score;
+} AADictionarySegment;
+
+static inline uint32_t kmerHash(const uint8_t *p, int bits) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return (uint32_t)((v * UINT64_C(0x9E3779B97F4A7C15)) >> (64 - bits));
+}
+
+static int compareSegmentScore(const void *a, const void *b) {
+    const AADictionarySegment *x = a;
+    const AADictionarySegment *y = b;
+    return (x->score < y->score) - (x->score > y->score);
+}
+
+/*
+ * Simplified COVER: each k-mer is weighted by the number of samples
+ * containing it. Samples are split in epochs, one per segment, and the
+ * best scoring segment of each epoch is selected. K-mers of a selected
+ * segment are zeroed, so later segments cover different content.
+ */
+ssize_t AACompressionDictionaryTrain(uint8_t *dict, size_t dict_capacity, const uint8_t *samples, const size_t *sample_sizes, size_t sample_count) {
+    size_t total = 0;
+    for (size_t i = 0; i < sample_count; i++) {
+        total += sample_sizes[i];
+    }
+    if (dict_capacity == 0 || total == 0) {
+        return 0;
+    }
+    if (total <= dict_capacity) {
+        /* everything fits */
+        memcpy(dict, samples, total);
+        return total;
+    }
+    size_t segmentSize = AA_DICTIONARY_SEGMENT_SIZE;
+    if (segmentSize > dict_capacity) {
+        segmentSize = dict_capacity;
+    }
+    if (segmentSize < AA_DICTIONARY_KMER_SIZE) {
+        memcpy(dict, samples + total - dict_capacity, dict_capacity);
+        return dict_capacity;
+    }
+    int bits = AA_DICTIONARY_MIN_HASH_BITS;
+    while (bits < AA_DICTIONARY_MAX_HASH_BITS && ((size_t)1 << bits) < total) {
+        bits++;
+    }
+    size_t tableSize = (size_t)1 << bits;
+    uint32_t *frequency = calloc(tableSize, sizeof(uint32_t));
+    uint32_t *lastSample = calloc(tableSize, sizeof(uint32_t));
+    size_t epochCount = dict_capacity / segmentSize;
+    AADictionarySegment *segments = calloc(epochCount, sizeof(AADictionarySegment));
+    if (!frequency || !lastSample || !segments) {
+        ParallelCompressionLogError("malloc");
+        free(frequency);
+        free(lastSample);
+        free(segments);
+        return -1;
+    }
+
+    /* Document frequency: count each k-mer once per sample */
+    size_t offset = 0;
+    for (size_t i = 0; i < sample_count; i++) {
+        size_t size = sample_sizes[i];
+        for (size_t j = 0; j + AA_DICTIONARY_KMER_SIZE <= size; j++) {
+            uint32_t h = kmerHash(samples + offset + j, bits);
+            if (lastSample[h] != (uint32_t)(i + 1)) {
+                lastSample[h] = (uint32_t)(i + 1);
+                frequency[h]++;
+            }
+        }
+        offset += size;
+    }
+    free(lastSample);
+
+    /* Best segment of each epoch */
+    size_t segmentCount = 0;
+    size_t epochSize = total / epochCount;
+    for (size_t e = 0; e < epochCount; e++) {
+        size_t begin = e * epochSize;
+        size_t end = (e + 1 == epochCount) ? total : begin + epochSize;
+        if (end - begin < segmentSize) {
+            continue;
+        }
+        size_t kmers = segmentSize - AA_DICTIONARY_KMER_SIZE + 1;
+        uint64_t score = 0;
+        for (size_t j = 0; j < kmers; j++) {
+            score += frequency[kmerHash(samples + begin + j, bits)];
+        }
+        uint64_t bestScore = score;
+        size_t bestOffset = begin;
+        for (size_t pos = begin + 1; pos + segmentSize <= end; pos++) {
+            /* slide by one byte */
+            score -= frequency[kmerHash(samples + pos - 1, bits)];
+            score += frequency[kmerHash(samples + pos + kmers - 1, bits)];
+            if (score > bestScore) {
+                bestScore = score;
+                bestOffset = pos;
+            }
+        }
+        if (bestScore == 0) {
+            continue;
+        }
+        for (size_t j = 0; j < kmers; j++) {
+            frequency[kmerHash(samples + bestOffset + j, bits)] = 0;
+        }
+        segments[segmentCount].offset = bestOffset;
+        segments[segmentCount].size = segmentSize;
+        segments[segmentCount].score = bestScore;
+        segmentCount++;
+    }
+    free(frequency);
+
+    /* Highest scores at the end of the dictionary, closest to the data */
+    qsort(segments, segmentCount, sizeof(AADictionarySegment), compareSegmentScore);
+    size_t pos = dict_capacity;
+    for (size_t i = 0; i < segmentCount; i++) {
+        pos -= segments[i].size;
+        memcpy(dict + pos, samples + segments[i].offset, segments[i].size);
+    }
+    free(segments);
+    size_t dictSize = dict_capacity - pos;
+    memmove(dict, dict + pos, dictSize);
+    return dictSize;
+}
+
+#pragma mark - Dictionary entry
+
+/*
+ * The dictionary is stored as an archive metadata entry: TYP=M, an empty
+ * PAT, and a DIC blob holding the dictionary bytes.
+ */
+size_t pcEncodeDictionaryEntry(uint8_t *dst, size_t dictSize) {
+    uint8_t *p = dst;
+    memcpy(p, "AA01", 4);
+    p[4] = (uint8_t)PC_DICTIONARY_ENTRY_HEADER_SIZE;
+    p[5] = (uint8_t)(PC_DICTIONARY_ENTRY_HEADER_SIZE >> 8);
+    p += 6;
+    memcpy(p, "TYP1", 4);
+    p[4] = AA_ENTRY_TYPE_METADATA;
+    p += 5;
+    memcpy(p, "PATP", 4);
+    p[4] = 0;
+    p[5] = 0;
+    p += 6;
+    memcpy(p, "DICB", 4);
+    for (int i = 0; i < 4; i++) {
+        p[4 + i] = (uint8_t)(dictSize >> (8 * i));
+    }
+    return PC_DICTIONARY_ENTRY_HEADER_SIZE;
+}
+
+int pcDecodeDictionaryEntry(const uint8_t *src, size_t size, const uint8_t **dict, size_t *dictSize) {
+    uint8_t expected[PC_DICTIONARY_ENTRY_HEADER_SIZE];
+    if (size < PC_DICTIONARY_ENTRY_HEADER_SIZE) {
+        return 0;
+    }
+    pcEncodeDictionaryEntry(expected, 0);
+    /* everything but the blob size is fixed */
+    if (memcmp(src, expected, PC_DICTIONARY_ENTRY_HEADER_SIZE - 4) != 0) {
+        return 0;
+    }
+    const uint8_t *p = src + PC_DICTIONARY_ENTRY_HEADER_SIZE - 4;
+    size_t n = (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16) | ((size_t)p[3] << 24);
+    if (n > size - PC_DICTIONARY_ENTRY_HEADER_SIZE) {
+        return 0;
+    }
+    *dict = src + PC_DICTIONARY_ENTRY_HEADER_SIZE;
+    *dictSize = n;
+    return 1;
+}
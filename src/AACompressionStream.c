@@ -0,0 +1,485 @@
+//
+//  AACompressionStream.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "ThreadPipeline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define AA_COMPRESSION_DEFAULT_BLOCK_SIZE (4 << 20)
+#define AA_COMPRESSION_ITEMS_PER_THREAD 2
+#define AA_COMPRESSION_DEFAULT_STORE_RATIO 1.05
+#define AA_COMPRESSION_DEFAULT_FAST_RATIO 1.3
+
+/* Sampling: a few windows spread over the block */
+#define AA_SAMPLE_WINDOW_SIZE 4096
+#define AA_SAMPLE_WINDOW_COUNT 4
+#define AA_SAMPLE_HASH_BITS 12
+
+enum {
+    AA_COMPRESSION_TIER_DEFAULT = 0, /* stream algorithm */
+    AA_COMPRESSION_TIER_FAST    = 1, /* faster settings of the stream algorithm */
+    AA_COMPRESSION_TIER_STORED  = 2, /* stored raw */
+};
+
+struct AACompressionBlock_impl {
+    uint8_t *raw;
+    size_t rawSize;
+    uint8_t *compressed;
+    size_t compressedSize;
+    int tier;
+    int sampled; /* tier was decided by sampling, the codec didn't run */
+};
+
+typedef struct AACompressionBlock_impl * AACompressionBlock;
+
+struct AACompressionStream_impl {
+    AAByteStream compressedStream;
+    AAFlagSet flags;
+    AACompressionAlgorithm algorithm;
+    size_t blockSize;
+    int nThreads;
+    int nItems;
+    double storeRatio; /* store blocks with projected ratio below this */
+    double fastRatio; /* use the fast tier below this */
+    AACompressionStats stats;
+    AACompressionStats *userStats;
+    ThreadPipeline pipeline;
+    struct AACompressionBlock_impl *blocks;
+    AACodecContext *workerContexts;
+    struct AACompressionWorker_impl *workers;
+    AACompressionBlock current; /* being filled by the writer */
+    uint8_t *dict; /* shared by all worker contexts, NULL if none */
+    size_t dictSize;
+    AAMemoryBudget budget;
+    size_t reserved; /* bytes reserved from budget for the blocks */
+    int cancelled;
+    int failed;
+};
+
+typedef struct AACompressionStream_impl * AACompressionStream;
+
+#pragma mark - Sampling
+
+/*
+ * Cheap compressibility estimate, on a few windows of the block:
+ * order-0 entropy of the byte histogram for literals, and the fraction
+ * of 4-byte sequences already seen in the window for LZ matches.
+ * Returns the projected raw/compressed ratio.
+ */
+static double estimateRatio(const uint8_t *data, size_t size) {
+    uint32_t histogram[256];
+    uint16_t seen[1 << AA_SAMPLE_HASH_BITS];
+    size_t sampled = 0;
+    size_t matches = 0;
+    memset(histogram, 0, sizeof(histogram));
+    size_t stride = size / AA_SAMPLE_WINDOW_COUNT;
+    for (int w = 0; w < AA_SAMPLE_WINDOW_COUNT; w++) {
+        const uint8_t *window = data + w * stride;
+        size_t windowSize = size - w * stride;
+        if (windowSize > AA_SAMPLE_WINDOW_SIZE) {
+            windowSize = AA_SAMPLE_WINDOW_SIZE;
+        }
+        memset(seen, 0, sizeof(seen));
+        for (size_t i = 0; i < windowSize; i++) {
+            histogram[window[i]]++;
+            if (i + 4 <= windowSize) {
+                uint32_t v;
+                memcpy(&v, window + i, 4);
+                uint32_t h = (v * 2654435761u) >> (32 - AA_SAMPLE_HASH_BITS);
+                /* store position + 1, 0 is empty */
+                if (seen[h]) {
+                    uint32_t u;
+                    memcpy(&u, window + seen[h] - 1, 4);
+                    matches += (u == v);
+                }
+                seen[h] = (uint16_t)(i + 1);
+            }
+        }
+        sampled += windowSize;
+    }
+    if (!sampled) {
+        return INFINITY;
+    }
+    double entropy = 0;
+    for (int i = 0; i < 256; i++) {
+        if (histogram[i]) {
+            double p = (double)histogram[i] / sampled;
+            entropy -= p * log2(p);
+        }
+    }
+    double matchFraction = (double)matches / sampled;
+    /* literal bits for unmatched bytes, and a rough 1/8 cost for matched bytes */
+    double compressedFraction = (1.0 - matchFraction) * entropy / 8.0 + matchFraction * 0.125;
+    if (compressedFraction <= 0) {
+        return INFINITY;
+    }
+    return 1.0 / compressedFraction;
+}
+
+static ssize_t writeFully(AAByteStream s, const void *buf, size_t nbyte) {
+    size_t total = 0;
+    while (total < nbyte) {
+        ssize_t n = AAByteStreamWrite(s, (const uint8_t *)buf + total, nbyte - total);
+        if (n <= 0) {
+            return -1;
+        }
+        total += n;
+    }
+    return total;
+}
+
+#pragma mark - Pipeline
+
+struct AACompressionWorker_impl {
+    AACompressionStream stream;
+    AACodecContext ctx; /* NULL for AA_COMPRESSION_ALGORITHM_NONE */
+};
+
+typedef struct AACompressionWorker_impl * AACompressionWorker;
+
+static int compressionWorkerProc(void *worker_data, void *item) {
+    AACompressionWorker worker = worker_data;
+    AACompressionStream s = worker->stream;
+    AACompressionBlock block = item;
+    block->compressedSize = 0;
+    block->sampled = 0;
+    block->tier = AA_COMPRESSION_TIER_DEFAULT;
+    if (block->rawSize == 0) {
+        /* empty block submitted at close */
+        return 0;
+    }
+    if (!worker->ctx) {
+        block->tier = AA_COMPRESSION_TIER_STORED;
+        return 0;
+    }
+    if (s->storeRatio > 0 || s->fastRatio > 0) {
+        double ratio = estimateRatio(block->raw, block->rawSize);
+        if (ratio < s->storeRatio) {
+            /* not worth running the codec */
+            block->tier = AA_COMPRESSION_TIER_STORED;
+            block->sampled = 1;
+            return 0;
+        }
+        if (ratio < s->fastRatio) {
+            block->tier = AA_COMPRESSION_TIER_FAST;
+        }
+    }
+    /* compressed output must be strictly smaller than the raw block, equal sizes mean stored */
+    ssize_t n;
+    if (block->tier == AA_COMPRESSION_TIER_FAST) {
+        n = AACodecEncodeBlockFast(worker->ctx, block->compressed, block->rawSize - 1, block->raw, block->rawSize);
+    } else {
+        n = AACodecEncodeBlock(worker->ctx, block->compressed, block->rawSize - 1, block->raw, block->rawSize);
+    }
+    if (n < 0) {
+        ParallelCompressionLogError("AACodecEncodeBlock");
+        return -1;
+    }
+    if (n == 0) {
+        block->tier = AA_COMPRESSION_TIER_STORED;
+        return 0;
+    }
+    block->compressedSize = n;
+    return 0;
+}
+
+static void updateStats(AACompressionStream s, AACompressionBlock block) {
+    AACompressionTierStats *tier;
+    size_t size = block->compressedSize;
+    switch (block->tier) {
+        case AA_COMPRESSION_TIER_FAST:
+            tier = &s->stats.fast;
+            break;
+        case AA_COMPRESSION_TIER_STORED:
+            tier = &s->stats.stored;
+            size = block->rawSize;
+            if (block->sampled) {
+                s->stats.sampled_out_bytes += block->rawSize;
+            }
+            break;
+        default:
+            tier = &s->stats.compressed;
+            break;
+    }
+    tier->block_count++;
+    tier->raw_bytes += block->rawSize;
+    tier->compressed_bytes += size;
+    if (s->userStats) {
+        *s->userStats = s->stats;
+    }
+}
+
+/* Write the oldest block in flight to the compressed stream */
+static int retireBlock(AACompressionStream s) {
+    int status = 0;
+    AACompressionBlock block = ThreadPipelineRetireItem(s->pipeline, &status);
+    if (!block) {
+        return -1;
+    }
+    if (status < 0) {
+        ThreadPipelineReleaseItem(s->pipeline, block);
+        s->failed = 1;
+        return -1;
+    }
+    if (block->rawSize) {
+        int stored = (block->tier == AA_COMPRESSION_TIER_STORED);
+        size_t payloadSize = stored ? block->rawSize : block->compressedSize;
+        uint8_t blockHeader[PC_BLOCK_HEADER_SIZE];
+        pcStoreBE64(blockHeader, block->rawSize);
+        pcStoreBE64(blockHeader + 8, payloadSize);
+        if (writeFully(s->compressedStream, blockHeader, PC_BLOCK_HEADER_SIZE) != PC_BLOCK_HEADER_SIZE
+            || writeFully(s->compressedStream, stored ? block->raw : block->compressed, payloadSize) != (ssize_t)payloadSize) {
+            ParallelCompressionLogError("AAByteStreamWrite");
+            ThreadPipelineReleaseItem(s->pipeline, block);
+            s->failed = 1;
+            return -1;
+        }
+        updateStats(s, block);
+    }
+    ThreadPipelineReleaseItem(s->pipeline, block);
+    return 0;
+}
+
+static int submitCurrent(AACompressionStream s) {
+    AACompressionBlock block = s->current;
+    s->current = 0;
+    return ThreadPipelineSubmitItem(s->pipeline, block);
+}
+
+ssize_t aaCompressionStreamWrite(AACompressionStream s, const void *buf, size_t nbyte) {
+    if (s->cancelled || s->failed) {
+        return -1;
+    }
+    size_t total = 0;
+    while (total < nbyte) {
+        if (!s->current) {
+            /* all items in flight, the writer is the only one retiring them */
+            while (ThreadPipelineInFlight(s->pipeline) >= s->nItems) {
+                if (retireBlock(s) < 0) {
+                    return -1;
+                }
+            }
+            s->current = ThreadPipelineAcquireItem(s->pipeline);
+            if (!s->current) {
+                return -1;
+            }
+            s->current->rawSize = 0;
+        }
+        size_t n = s->blockSize - s->current->rawSize;
+        if (n > nbyte - total) {
+            n = nbyte - total;
+        }
+        memcpy(s->current->raw + s->current->rawSize, (const uint8_t *)buf + total, n);
+        s->current->rawSize += n;
+        total += n;
+        if (s->current->rawSize == s->blockSize && submitCurrent(s) < 0) {
+            return -1;
+        }
+    }
+    return total;
+}
+
+void aaCompressionStreamCancel(AACompressionStream s) {
+    s->cancelled = 1;
+    AAByteStreamCancel(s->compressedStream);
+}
+
+int aaCompressionStreamClose(AACompressionStream s) {
+    if (!s) {
+        return 0;
+    }
+    int result = 0;
+    if (s->pipeline) {
+        if (!s->cancelled && !s->failed) {
+            /* flush the last partial block, an empty one is submitted too and skipped when retired */
+            if (s->current && submitCurrent(s) < 0) {
+                result = -1;
+            }
+            while (result == 0 && ThreadPipelineInFlight(s->pipeline) > 0) {
+                if (retireBlock(s) < 0) {
+                    result = -1;
+                }
+            }
+        }
+        ThreadPipelineDestroy(s->pipeline);
+    }
+    if (s->cancelled || s->failed) {
+        result = -1;
+    }
+    if (s->blocks) {
+        for (int i = 0; i < s->nItems; i++) {
+            free(s->blocks[i].raw);
+            free(s->blocks[i].compressed);
+        }
+        free(s->blocks);
+    }
+    if (s->workerContexts) {
+        for (int i = 0; i < s->nThreads; i++) {
+            AACodecContextDestroy(s->workerContexts[i]);
+        }
+        free(s->workerContexts);
+    }
+    free(s->workers);
+    free(s->dict);
+    AAMemoryBudgetRelease(s->budget, s->reserved);
+    free(s);
+    return result;
+}
+
+/* Store the dictionary entry in the first block, raw */
+static int writeDictionaryBlock(AACompressionStream s) {
+    uint8_t blockHeader[PC_BLOCK_HEADER_SIZE];
+    uint8_t entryHeader[PC_DICTIONARY_ENTRY_HEADER_SIZE];
+    size_t rawSize = PC_DICTIONARY_ENTRY_HEADER_SIZE + s->dictSize;
+    pcStoreBE64(blockHeader, rawSize);
+    pcStoreBE64(blockHeader + 8, rawSize);
+    pcEncodeDictionaryEntry(entryHeader, s->dictSize);
+    if (writeFully(s->compressedStream, blockHeader, PC_BLOCK_HEADER_SIZE) != PC_BLOCK_HEADER_SIZE
+        || writeFully(s->compressedStream, entryHeader, PC_DICTIONARY_ENTRY_HEADER_SIZE) != PC_DICTIONARY_ENTRY_HEADER_SIZE
+        || writeFully(s->compressedStream, s->dict, s->dictSize) != (ssize_t)s->dictSize) {
+        ParallelCompressionLogError("AAByteStreamWrite");
+        return -1;
+    }
+    return 0;
+}
+
+#pragma mark - Open
+
+static AAByteStream compressionStreamOpen(AAByteStream compressed_stream, AACompressionAlgorithm compression_algorithm, size_t block_size, double store_ratio, double fast_ratio, AACompressionStats *stats, const uint8_t *dict, size_t dict_size, AAMemoryBudget budget, AAFlagSet flags, int n_threads) {
+    char magic = pcMagicFromAlgorithm(compression_algorithm);
+    if (!magic) {
+        ParallelCompressionLogError("invalid compression algorithm: %u");
+        return 0;
+    }
+    if (block_size == 0) {
+        block_size = AA_COMPRESSION_DEFAULT_BLOCK_SIZE;
+    }
+    if (block_size > PC_MAX_BLOCK_SIZE) {
+        ParallelCompressionLogError("invalid block size: %zu");
+        return 0;
+    }
+    if (dict && (compression_algorithm == AA_COMPRESSION_ALGORITHM_NONE || dict_size > UINT32_MAX
+                 || PC_DICTIONARY_ENTRY_HEADER_SIZE + dict_size > block_size)) {
+        ParallelCompressionLogError("invalid dictionary");
+        return 0;
+    }
+    AACompressionStream s = calloc(1, sizeof(struct AACompressionStream_impl));
+    if (!s) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    s->compressedStream = compressed_stream;
+    s->flags = flags;
+    s->algorithm = compression_algorithm;
+    s->blockSize = block_size;
+    s->nThreads = n_threads > 0 ? n_threads : (int)getDefaultNThreads();
+    s->nItems = s->nThreads * AA_COMPRESSION_ITEMS_PER_THREAD;
+    s->budget = budget;
+    s->storeRatio = store_ratio;
+    s->fastRatio = fast_ratio;
+    s->userStats = stats;
+    if (stats) {
+        memset(stats, 0, sizeof(AACompressionStats));
+    }
+
+    if (dict && dict_size) {
+        s->dict = malloc(dict_size);
+        if (!s->dict) {
+            ParallelCompressionLogError("malloc");
+            free(s);
+            return 0;
+        }
+        memcpy(s->dict, dict, dict_size);
+        s->dictSize = dict_size;
+    }
+
+    /* each block holds a raw and a compressed buffer, fewer blocks in flight if the budget is short */
+    int nItems = AAMemoryBudgetAcquireItems(budget, 2 * block_size, s->nItems);
+    if (nItems < 0) {
+        ParallelCompressionLogError("memory budget exhausted");
+        free(s->dict);
+        free(s);
+        return 0;
+    }
+    s->nItems = nItems;
+    s->reserved = (size_t)nItems * 2 * block_size;
+
+    s->blocks = calloc(s->nItems, sizeof(struct AACompressionBlock_impl));
+    s->workerContexts = calloc(s->nThreads, sizeof(AACodecContext));
+    struct AACompressionWorker_impl *workers = calloc(s->nThreads, sizeof(struct AACompressionWorker_impl));
+    void **workerData = calloc(s->nThreads, sizeof(void *));
+    void **items = calloc(s->nItems, sizeof(void *));
+    int ok = s->blocks && s->workerContexts && workers && workerData && items;
+    for (int i = 0; ok && i < s->nItems; i++) {
+        s->blocks[i].raw = malloc(block_size);
+        s->blocks[i].compressed = malloc(block_size);
+        ok = s->blocks[i].raw && s->blocks[i].compressed;
+        items[i] = &s->blocks[i];
+    }
+    for (int i = 0; ok && i < s->nThreads; i++) {
+        if (compression_algorithm != AA_COMPRESSION_ALGORITHM_NONE) {
+            s->workerContexts[i] = AACodecContextCreate(compression_algorithm);
+            ok = (s->workerContexts[i] != 0);
+        }
+        if (ok && s->dict) {
+            ok = (AACodecContextSetDictionary(s->workerContexts[i], s->dict, s->dictSize) == 0);
+        }
+        workers[i].stream = s;
+        workers[i].ctx = s->workerContexts[i];
+        workerData[i] = &workers[i];
+    }
+    if (ok) {
+        s->pipeline = ThreadPipelineCreate(s->nThreads, s->nItems, compressionWorkerProc, workerData, items);
+        ok = (s->pipeline != 0);
+    }
+    free(workerData);
+    free(items);
+    if (!ok) {
+        ParallelCompressionLogError("compression stream setup failed");
+        free(workers);
+        s->cancelled = 1;
+        aaCompressionStreamClose(s);
+        return 0;
+    }
+    /* workers are referenced by the pipeline threads, owned by the stream from now on */
+    s->workers = workers;
+
+    uint8_t streamHeader[PC_STREAM_HEADER_SIZE] = { 'p', 'b', 'z', (uint8_t)magic };
+    pcStoreBE64(streamHeader + 4, block_size);
+    if (writeFully(compressed_stream, streamHeader, PC_STREAM_HEADER_SIZE) != PC_STREAM_HEADER_SIZE
+        || (s->dict && writeDictionaryBlock(s) < 0)) {
+        ParallelCompressionLogError("AAByteStreamWrite");
+        s->cancelled = 1;
+        aaCompressionStreamClose(s);
+        return 0;
+    }
+
+    AAByteStream stream = AACustomByteStreamOpen();
+    if (!stream) {
+        s->cancelled = 1;
+        aaCompressionStreamClose(s);
+        return 0;
+    }
+    AACustomByteStreamSetData(stream, s);
+    AACustomByteStreamSetCloseProc(stream, (AAByteStreamCloseProc)aaCompressionStreamClose);
+    AACustomByteStreamSetWriteProc(stream, (AAByteStreamWriteProc)aaCompressionStreamWrite);
+    AACustomByteStreamSetCancelProc(stream, (AAByteStreamCancelProc)aaCompressionStreamCancel);
+    return stream;
+}
+
+AAByteStream AACompressionOutputStreamOpenExt(AAByteStream compressed_stream, AACompressionAlgorithm compression_algorithm, size_t block_size, double store_ratio, double fast_ratio, AACompressionStats *stats, AAMemoryBudget budget, AAFlagSet flags, int n_threads) {
+    return compressionStreamOpen(compressed_stream, compression_algorithm, block_size, store_ratio, fast_ratio, stats, 0, 0, budget, flags, n_threads);
+}
+
+AAByteStream AACompressionOutputStreamOpenWithDictionary(AAByteStream compressed_stream, AACompressionAlgorithm compression_algorithm, size_t block_size, const uint8_t *dict, size_t dict_size, AAMemoryBudget budget, AAFlagSet flags, int n_threads) {
+    return compressionStreamOpen(compressed_stream, compression_algorithm, block_size, AA_COMPRESSION_DEFAULT_STORE_RATIO, AA_COMPRESSION_DEFAULT_FAST_RATIO, 0, dict, dict_size, budget, flags, n_threads);
+}
+
+AAByteStream AACompressionOutputStreamOpen(AAByteStream compressed_stream, AACompressionAlgorithm compression_algorithm, size_t block_size, AAFlagSet flags, int n_threads) {
+    return AACompressionOutputStreamOpenExt(compressed_stream, compression_algorithm, block_size, AA_COMPRESSION_DEFAULT_STORE_RATIO, AA_COMPRESSION_DEFAULT_FAST_RATIO, 0, 0, flags, n_threads);
+}
@@ -0,0 +1,860 @@
+//
+//  AADecompressionStream.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "ThreadPipeline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define AA_DECOMPRESSION_READ_AHEAD_PER_THREAD 2
+
+typedef struct {
+    uint64_t rawOffset; /* offset of the block in the decompressed stream */
+    uint64_t compressedOffset; /* offset of the block header in the compressed stream */
+    uint64_t rawSize;
+    uint64_t compressedSize;
+} AADecompressionIndexEntry;
+
+struct AADecompressionBlock_impl {
+    AADecompressionIndexEntry entry;
+    int fetchStatus; /* 1 if the block holds data, 0 at end of stream, negative on failure */
+    uint8_t *compressed;
+    uint8_t *raw;
+};
+
+typedef struct AADecompressionBlock_impl * AADecompressionBlock;
+
+struct AADecompressionCacheEntry_impl {
+    uint64_t blockIndex;
+    uint64_t lastUse;
+    uint8_t *raw;
+    size_t size; /* reserved from the budget for raw */
+    int valid;
+};
+
+struct AADecompressionStream_impl {
+    AAByteStream compressedStream;
+    AAFlagSet flags;
+    uint32_t algorithm;
+    uint64_t blockSize;
+    int randomAccess; /* compressed stream supports pread */
+    int nThreads;
+    int readAhead;
+    int cancelled;
+    uint8_t *dict; /* loaded from the first block, NULL if none */
+    size_t dictSize;
+    AAMemoryBudget budget;
+    size_t reserved; /* bytes reserved from budget for the read-ahead blocks */
+
+    /* sequential reads, blocks are decoded by the pipeline ahead of the reader */
+    ThreadPipeline pipeline;
+    struct AADecompressionBlock_impl *blocks;
+    AACodecContext *workerContexts; /* one per worker thread */
+    AADecompressionBlock current;
+    uint64_t currentPos; /* read position in current->raw */
+    uint64_t skip; /* bytes to discard at the start of the next block, after a seek */
+    uint64_t nextBlock; /* next block to fetch (random access) */
+    uint64_t nextRawOffset; /* raw offset of the next block to fetch (sequential) */
+    int eof; /* no more blocks to fetch */
+    uint64_t position; /* decompressed stream position */
+
+    /* block index and decoded block cache, shared with concurrent pread calls */
+    pthread_mutex_t lock;
+    AADecompressionIndexEntry *index;
+    uint64_t indexCount;
+    uint64_t indexCapacity;
+    int indexComplete;
+    struct AADecompressionCacheEntry_impl *cache;
+    int cacheSize;
+    uint64_t cacheClock;
+    AACodecContext *contextPool; /* idle codec contexts for pread callers */
+    int contextPoolCount;
+};
+
+typedef struct AADecompressionStream_impl * AADecompressionStream;
+
+static ssize_t readFully(AAByteStream s, void *buf, size_t nbyte) {
+    size_t total = 0;
+    while (total < nbyte) {
+        ssize_t n = AAByteStreamRead(s, (uint8_t *)buf + total, nbyte - total);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+static ssize_t preadFully(AAByteStream s, void *buf, size_t nbyte, off_t offset) {
+    size_t total = 0;
+    while (total < nbyte) {
+        ssize_t n = AAByteStreamPRead(s, (uint8_t *)buf + total, nbyte - total, offset + total);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+static int decodeBlock(AACodecContext ctx, uint8_t *dst, uint64_t dstSize, const uint8_t *src, uint64_t srcSize) {
+    if (srcSize == dstSize) {
+        /* stored raw */
+        memcpy(dst, src, dstSize);
+        return 0;
+    }
+    ssize_t n = AACodecDecodeBlock(ctx, dst, dstSize, src, srcSize);
+    if (n < 0 || (uint64_t)n != dstSize) {
+        ParallelCompressionLogError("AACodecDecodeBlock");
+        return -1;
+    }
+    return 0;
+}
+
+/* Create a codec context using the stream dictionary */
+static AACodecContext createContext(AADecompressionStream s) {
+    AACodecContext ctx = AACodecContextCreate(s->algorithm);
+    if (ctx && s->dict && AACodecContextSetDictionary(ctx, s->dict, s->dictSize) < 0) {
+        AACodecContextDestroy(ctx);
+        return 0;
+    }
+    return ctx;
+}
+
+/*
+ * If the raw first block \p data holds a dictionary entry, load it and set it on existing contexts.
+ * Returns 0 on success or if there is no dictionary, and -1 on failure.
+ */
+static int loadDictionary(AADecompressionStream s, const uint8_t *data, size_t size) {
+    const uint8_t *dict;
+    size_t dictSize;
+    if (s->dict || !pcDecodeDictionaryEntry(data, size, &dict, &dictSize)) {
+        return 0;
+    }
+    s->dict = malloc(dictSize ? dictSize : 1);
+    if (!s->dict) {
+        ParallelCompressionLogError("malloc");
+        return -1;
+    }
+    memcpy(s->dict, dict, dictSize);
+    s->dictSize = dictSize;
+    /* no other block was submitted yet, the worker contexts are idle */
+    for (int i = 0; s->workerContexts && i < s->nThreads; i++) {
+        if (s->workerContexts[i] && AACodecContextSetDictionary(s->workerContexts[i], s->dict, s->dictSize) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int validBlockHeader(AADecompressionStream s, uint64_t rawSize, uint64_t compressedSize) {
+    if (rawSize == 0 || rawSize > s->blockSize) {
+        ParallelCompressionLogError("invalid block raw size: %llu");
+        return 0;
+    }
+    if (compressedSize == 0 || compressedSize > rawSize) {
+        ParallelCompressionLogError("invalid block compressed size: %llu");
+        return 0;
+    }
+    return 1;
+}
+
+#pragma mark - Block index
+
+/*
+ * Make sure the index covers raw offset \p offset, scanning block headers
+ * with pread. Only the 16 byte block headers are read, payloads are skipped.
+ * Must be called with s->lock held.
+ * Returns 1 if a block covering \p offset was found (and stored in \p blockIndex),
+ * 0 if \p offset is past the end of the stream, and -1 on failure.
+ */
+static int indexFindBlockLocked(AADecompressionStream s, uint64_t offset, uint64_t *blockIndex) {
+    while (1) {
+        if (s->indexCount) {
+            AADecompressionIndexEntry *last = &s->index[s->indexCount - 1];
+            if (offset < last->rawOffset + last->rawSize) {
+                /* covered, binary search */
+                uint64_t lo = 0;
+                uint64_t hi = s->indexCount - 1;
+                while (lo < hi) {
+                    uint64_t mid = lo + (hi - lo + 1) / 2;
+                    if (s->index[mid].rawOffset <= offset) {
+                        lo = mid;
+                    } else {
+                        hi = mid - 1;
+                    }
+                }
+                *blockIndex = lo;
+                return 1;
+            }
+        }
+        if (s->indexComplete) {
+            return 0;
+        }
+        uint64_t rawOffset = 0;
+        uint64_t compressedOffset = PC_STREAM_HEADER_SIZE;
+        if (s->indexCount) {
+            AADecompressionIndexEntry *last = &s->index[s->indexCount - 1];
+            rawOffset = last->rawOffset + last->rawSize;
+            compressedOffset = last->compressedOffset + PC_BLOCK_HEADER_SIZE + last->compressedSize;
+        }
+        uint8_t blockHeader[PC_BLOCK_HEADER_SIZE];
+        ssize_t n = preadFully(s->compressedStream, blockHeader, PC_BLOCK_HEADER_SIZE, compressedOffset);
+        if (n == 0) {
+            s->indexComplete = 1;
+            continue;
+        }
+        if (n != PC_BLOCK_HEADER_SIZE) {
+            ParallelCompressionLogError("truncated block header");
+            return -1;
+        }
+        uint64_t rawSize = pcLoadBE64(blockHeader);
+        uint64_t compressedSize = pcLoadBE64(blockHeader + 8);
+        if (!validBlockHeader(s, rawSize, compressedSize)) {
+            return -1;
+        }
+        if (s->indexCount == s->indexCapacity) {
+            uint64_t capacity = s->indexCapacity ? s->indexCapacity + (s->indexCapacity >> 1) : 64;
+            AADecompressionIndexEntry *index = realloc(s->index, capacity * sizeof(AADecompressionIndexEntry));
+            if (!index) {
+                ParallelCompressionLogError("malloc");
+                return -1;
+            }
+            s->index = index;
+            s->indexCapacity = capacity;
+        }
+        AADecompressionIndexEntry *entry = &s->index[s->indexCount++];
+        entry->rawOffset = rawOffset;
+        entry->compressedOffset = compressedOffset;
+        entry->rawSize = rawSize;
+        entry->compressedSize = compressedSize;
+    }
+}
+
+static int indexGetBlock(AADecompressionStream s, uint64_t blockIndex, AADecompressionIndexEntry *entry) {
+    pthread_mutex_lock(&s->lock);
+    while (blockIndex >= s->indexCount && !s->indexComplete) {
+        uint64_t unused;
+        uint64_t end = 0;
+        if (s->indexCount) {
+            end = s->index[s->indexCount - 1].rawOffset + s->index[s->indexCount - 1].rawSize;
+        }
+        if (indexFindBlockLocked(s, end, &unused) < 0) {
+            pthread_mutex_unlock(&s->lock);
+            return -1;
+        }
+    }
+    int found = blockIndex < s->indexCount;
+    if (found) {
+        *entry = s->index[blockIndex];
+    }
+    pthread_mutex_unlock(&s->lock);
+    return found;
+}
+
+#pragma mark - Memory budget
+
+/* Drop all cached blocks, and release their memory. Must be called with s->lock held */
+static void cacheClearLocked(AADecompressionStream s) {
+    for (int i = 0; i < s->cacheSize; i++) {
+        struct AADecompressionCacheEntry_impl *c = &s->cache[i];
+        free(c->raw);
+        AAMemoryBudgetRelease(s->budget, c->size);
+        c->raw = 0;
+        c->size = 0;
+        c->valid = 0;
+    }
+}
+
+/*
+ * Reserve \p size bytes for a pread buffer. When the budget is short, the cache
+ * is dropped first: it may hold the memory this call is waiting for.
+ */
+static int budgetAcquire(AADecompressionStream s, size_t size) {
+    if (AAMemoryBudgetTryAcquire(s->budget, size) == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&s->lock);
+    cacheClearLocked(s);
+    pthread_mutex_unlock(&s->lock);
+    return AAMemoryBudgetAcquire(s->budget, size);
+}
+
+/* Same as budgetAcquire, without blocking */
+static int budgetTryAcquire(AADecompressionStream s, size_t size) {
+    if (AAMemoryBudgetTryAcquire(s->budget, size) == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&s->lock);
+    cacheClearLocked(s);
+    pthread_mutex_unlock(&s->lock);
+    return AAMemoryBudgetTryAcquire(s->budget, size);
+}
+
+#pragma mark - Sequential read
+
+static int decompressionWorkerProc(void *worker_data, void *item) {
+    AACodecContext ctx = worker_data;
+    AADecompressionBlock block = item;
+    if (block->fetchStatus <= 0) {
+        /* end of stream marker, or fetch error */
+        return block->fetchStatus;
+    }
+    return decodeBlock(ctx, block->raw, block->entry.rawSize, block->compressed, block->entry.compressedSize);
+}
+
+/* Returns 1 if \p block was filled, 0 at end of stream, and -1 on failure */
+static int fetchNextBlock(AADecompressionStream s, AADecompressionBlock block) {
+    if (s->randomAccess) {
+        int found = indexGetBlock(s, s->nextBlock, &block->entry);
+        if (found <= 0) {
+            return found;
+        }
+        uint64_t compressedSize = block->entry.compressedSize;
+        ssize_t n = preadFully(s->compressedStream, block->compressed, compressedSize, block->entry.compressedOffset + PC_BLOCK_HEADER_SIZE);
+        if (n < 0 || (uint64_t)n != compressedSize) {
+            ParallelCompressionLogError("truncated block");
+            return -1;
+        }
+        s->nextBlock++;
+        return 1;
+    }
+    uint8_t blockHeader[PC_BLOCK_HEADER_SIZE];
+    ssize_t n = readFully(s->compressedStream, blockHeader, PC_BLOCK_HEADER_SIZE);
+    if (n == 0) {
+        return 0;
+    }
+    if (n != PC_BLOCK_HEADER_SIZE) {
+        ParallelCompressionLogError("truncated block header");
+        return -1;
+    }
+    uint64_t rawSize = pcLoadBE64(blockHeader);
+    uint64_t compressedSize = pcLoadBE64(blockHeader + 8);
+    if (!validBlockHeader(s, rawSize, compressedSize)) {
+        return -1;
+    }
+    n = readFully(s->compressedStream, block->compressed, compressedSize);
+    if (n < 0 || (uint64_t)n != compressedSize) {
+        ParallelCompressionLogError("truncated block");
+        return -1;
+    }
+    if (s->nextRawOffset == 0 && rawSize == compressedSize && loadDictionary(s, block->compressed, compressedSize) < 0) {
+        return -1;
+    }
+    block->entry.rawOffset = s->nextRawOffset;
+    block->entry.compressedOffset = 0;
+    block->entry.rawSize = rawSize;
+    block->entry.compressedSize = compressedSize;
+    s->nextRawOffset += rawSize;
+    return 1;
+}
+
+/* Free the blocks and worker contexts, possibly partially allocated */
+static void destroyPipelineBuffers(AADecompressionStream s) {
+    if (s->blocks) {
+        for (int i = 0; i < s->readAhead; i++) {
+            free(s->blocks[i].compressed);
+            free(s->blocks[i].raw);
+        }
+        free(s->blocks);
+        s->blocks = 0;
+    }
+    if (s->workerContexts) {
+        for (int i = 0; i < s->nThreads; i++) {
+            AACodecContextDestroy(s->workerContexts[i]);
+        }
+        free(s->workerContexts);
+        s->workerContexts = 0;
+    }
+}
+
+static int createPipeline(AADecompressionStream s) {
+    if (s->pipeline) {
+        return 0;
+    }
+    /* each block holds a compressed and a raw buffer, read less ahead if the budget is short */
+    if (!s->reserved) {
+        size_t itemSize = 2 * s->blockSize;
+        /* leave room for one pread call, it would otherwise wait for the read-ahead blocks */
+        size_t headroom = s->randomAccess ? 2 * s->blockSize : 0;
+        if (s->budget && AAMemoryBudgetGetLimit(s->budget) && AAMemoryBudgetGetLimit(s->budget) < itemSize + headroom) {
+            ParallelCompressionLogError("block size exceeds memory budget");
+            return -1;
+        }
+        /* never wait here, the budget may be held by the caller, e.g. through a compression stream */
+        if (headroom && budgetTryAcquire(s, headroom) < 0) {
+            ParallelCompressionLogError("memory budget exhausted");
+            return -1;
+        }
+        int readAhead = AAMemoryBudgetAcquireItems(s->budget, itemSize, s->readAhead);
+        AAMemoryBudgetRelease(s->budget, headroom);
+        if (readAhead < 0) {
+            ParallelCompressionLogError("memory budget exhausted");
+            return -1;
+        }
+        s->readAhead = readAhead;
+        s->reserved = (size_t)readAhead * 2 * s->blockSize;
+    }
+    s->blocks = calloc(s->readAhead, sizeof(struct AADecompressionBlock_impl));
+    s->workerContexts = calloc(s->nThreads, sizeof(AACodecContext));
+    void **items = calloc(s->readAhead, sizeof(void *));
+    if (!s->blocks || !s->workerContexts || !items) {
+        ParallelCompressionLogError("malloc");
+        goto ERROR;
+    }
+    for (int i = 0; i < s->nThreads; i++) {
+        s->workerContexts[i] = createContext(s);
+        if (!s->workerContexts[i]) {
+            goto ERROR;
+        }
+    }
+    for (int i = 0; i < s->readAhead; i++) {
+        AADecompressionBlock block = &s->blocks[i];
+        block->compressed = malloc(s->blockSize);
+        block->raw = malloc(s->blockSize);
+        if (!block->compressed || !block->raw) {
+            ParallelCompressionLogError("malloc");
+            goto ERROR;
+        }
+        items[i] = block;
+    }
+    s->pipeline = ThreadPipelineCreate(s->nThreads, s->readAhead, decompressionWorkerProc, (void **)s->workerContexts, items);
+    if (!s->pipeline) {
+        ParallelCompressionLogError("ThreadPipelineCreate");
+        goto ERROR;
+    }
+    free(items);
+    return 0;
+
+ERROR:
+    free(items);
+    destroyPipelineBuffers(s);
+    return -1;
+}
+
+/* Keep up to readAhead blocks in flight */
+static void fillPipeline(AADecompressionStream s) {
+    while (!s->eof && ThreadPipelineInFlight(s->pipeline) < s->readAhead) {
+        AADecompressionBlock block = ThreadPipelineAcquireItem(s->pipeline);
+        if (!block) {
+            s->eof = 1;
+            return;
+        }
+        block->fetchStatus = fetchNextBlock(s, block);
+        if (block->fetchStatus <= 0) {
+            /* submitted anyway, the reader will receive it in order */
+            s->eof = 1;
+        }
+        ThreadPipelineSubmitItem(s->pipeline, block);
+    }
+}
+
+/* Drop all blocks decoded ahead of the reader */
+static void drainPipeline(AADecompressionStream s) {
+    if (!s->pipeline) {
+        return;
+    }
+    if (s->current) {
+        ThreadPipelineReleaseItem(s->pipeline, s->current);
+        s->current = 0;
+    }
+    AADecompressionBlock block;
+    while ((block = ThreadPipelineRetireItem(s->pipeline, 0)) != 0) {
+        ThreadPipelineReleaseItem(s->pipeline, block);
+    }
+}
+
+ssize_t aaDecompressionStreamRead(AADecompressionStream s, void *buf, size_t nbyte) {
+    if (s->cancelled) {
+        return -1;
+    }
+    if (createPipeline(s) < 0) {
+        return -1;
+    }
+    size_t total = 0;
+    while (total < nbyte) {
+        if (!s->current) {
+            fillPipeline(s);
+            int status = 0;
+            AADecompressionBlock block = ThreadPipelineRetireItem(s->pipeline, &status);
+            if (!block) {
+                /* nothing in flight, end of stream */
+                break;
+            }
+            if (status < 0) {
+                ParallelCompressionLogError("block decompression failed");
+                ThreadPipelineReleaseItem(s->pipeline, block);
+                return -1;
+            }
+            if (block->fetchStatus == 0) {
+                ThreadPipelineReleaseItem(s->pipeline, block);
+                break;
+            }
+            s->current = block;
+            s->currentPos = s->skip;
+            s->skip = 0;
+        }
+        uint64_t available = s->current->entry.rawSize - s->currentPos;
+        size_t n = (nbyte - total < available) ? nbyte - total : (size_t)available;
+        memcpy((uint8_t *)buf + total, s->current->raw + s->currentPos, n);
+        s->currentPos += n;
+        s->position += n;
+        total += n;
+        if (s->currentPos >= s->current->entry.rawSize) {
+            ThreadPipelineReleaseItem(s->pipeline, s->current);
+            s->current = 0;
+        }
+    }
+    return total;
+}
+
+#pragma mark - Random access
+
+/* Copy raw bytes of block \p blockIndex from the cache, returns 1 on hit. Must be called with s->lock held */
+static int cacheCopyLocked(AADecompressionStream s, uint64_t blockIndex, uint8_t *dst, uint64_t offset, uint64_t nbyte) {
+    for (int i = 0; i < s->cacheSize; i++) {
+        struct AADecompressionCacheEntry_impl *c = &s->cache[i];
+        if (c->valid && c->blockIndex == blockIndex) {
+            c->lastUse = ++s->cacheClock;
+            memcpy(dst, c->raw + offset, nbyte);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Insert decoded block in the cache, evicting the least recently used entry.
+ * Takes ownership of \p raw, and of the \p size bytes reserved for it from the budget.
+ */
+static void cacheInsertLocked(AADecompressionStream s, uint64_t blockIndex, uint8_t *raw, size_t size) {
+    struct AADecompressionCacheEntry_impl *victim = &s->cache[0];
+    for (int i = 0; i < s->cacheSize; i++) {
+        struct AADecompressionCacheEntry_impl *c = &s->cache[i];
+        if (c->valid && c->blockIndex == blockIndex) {
+            /* decoded concurrently by another caller */
+            free(raw);
+            AAMemoryBudgetRelease(s->budget, size);
+            return;
+        }
+        if (!c->valid || c->lastUse < victim->lastUse) {
+            victim = c;
+            if (!c->valid) {
+                break;
+            }
+        }
+    }
+    free(victim->raw);
+    AAMemoryBudgetRelease(s->budget, victim->size);
+    victim->blockIndex = blockIndex;
+    victim->raw = raw;
+    victim->size = size;
+    victim->lastUse = ++s->cacheClock;
+    victim->valid = 1;
+}
+
+/* Get an idle codec context, or create one. Contexts are reused across calls, not allocated per block */
+static AACodecContext contextPoolGet(AADecompressionStream s) {
+    AACodecContext ctx = 0;
+    pthread_mutex_lock(&s->lock);
+    if (s->contextPoolCount) {
+        ctx = s->contextPool[--s->contextPoolCount];
+    }
+    pthread_mutex_unlock(&s->lock);
+    return ctx ? ctx : createContext(s);
+}
+
+static void contextPoolPut(AADecompressionStream s, AACodecContext ctx) {
+    if (!ctx) {
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    if (s->contextPoolCount < s->nThreads) {
+        s->contextPool[s->contextPoolCount++] = ctx;
+        ctx = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+    AACodecContextDestroy(ctx);
+}
+
+ssize_t aaDecompressionStreamPRead(AADecompressionStream s, void *buf, size_t nbyte, off_t offset) {
+    if (s->cancelled || !s->randomAccess || offset < 0) {
+        return -1;
+    }
+    size_t total = 0;
+    uint8_t *compressed = 0;
+    AACodecContext ctx = 0;
+    int result = 0;
+    while (total < nbyte) {
+        uint64_t pos = (uint64_t)offset + total;
+        uint64_t blockIndex;
+        AADecompressionIndexEntry entry;
+        pthread_mutex_lock(&s->lock);
+        int found = indexFindBlockLocked(s, pos, &blockIndex);
+        if (found <= 0) {
+            pthread_mutex_unlock(&s->lock);
+            result = found;
+            break;
+        }
+        entry = s->index[blockIndex];
+        uint64_t inBlock = pos - entry.rawOffset;
+        uint64_t available = entry.rawSize - inBlock;
+        size_t n = (nbyte - total < available) ? nbyte - total : (size_t)available;
+        int hit = cacheCopyLocked(s, blockIndex, (uint8_t *)buf + total, inBlock, n);
+        pthread_mutex_unlock(&s->lock);
+        if (!hit) {
+            /* decode outside the lock, concurrent callers decode different blocks in parallel */
+            if (!compressed || budgetTryAcquire(s, entry.rawSize) < 0) {
+                /* never wait while holding the scratch buffer: reserve both at once */
+                if (compressed) {
+                    free(compressed);
+                    compressed = 0;
+                    AAMemoryBudgetRelease(s->budget, s->blockSize);
+                }
+                if (budgetAcquire(s, s->blockSize + entry.rawSize) < 0) {
+                    result = -1;
+                    break;
+                }
+                compressed = malloc(s->blockSize);
+                if (!compressed) {
+                    ParallelCompressionLogError("malloc");
+                    AAMemoryBudgetRelease(s->budget, s->blockSize + entry.rawSize);
+                    result = -1;
+                    break;
+                }
+            }
+            if (!ctx) {
+                ctx = contextPoolGet(s);
+            }
+            uint8_t *raw = malloc(entry.rawSize);
+            if (!raw || !ctx) {
+                ParallelCompressionLogError("malloc");
+                free(raw);
+                AAMemoryBudgetRelease(s->budget, entry.rawSize);
+                result = -1;
+                break;
+            }
+            ssize_t r = preadFully(s->compressedStream, compressed, entry.compressedSize, entry.compressedOffset + PC_BLOCK_HEADER_SIZE);
+            if (r < 0 || (uint64_t)r != entry.compressedSize
+                || decodeBlock(ctx, raw, entry.rawSize, compressed, entry.compressedSize) < 0) {
+                ParallelCompressionLogError("block decompression failed");
+                free(raw);
+                AAMemoryBudgetRelease(s->budget, entry.rawSize);
+                result = -1;
+                break;
+            }
+            memcpy((uint8_t *)buf + total, raw + inBlock, n);
+            pthread_mutex_lock(&s->lock);
+            cacheInsertLocked(s, blockIndex, raw, entry.rawSize);
+            pthread_mutex_unlock(&s->lock);
+        }
+        total += n;
+    }
+    if (compressed) {
+        free(compressed);
+        AAMemoryBudgetRelease(s->budget, s->blockSize);
+    }
+    contextPoolPut(s, ctx);
+    return result < 0 ? -1 : (ssize_t)total;
+}
+
+off_t aaDecompressionStreamSeek(AADecompressionStream s, off_t offset, int whence) {
+    if (s->cancelled) {
+        return -1;
+    }
+    int64_t target;
+    switch (whence) {
+        case SEEK_SET:
+            target = offset;
+            break;
+        case SEEK_CUR:
+            target = (int64_t)s->position + offset;
+            break;
+        case SEEK_END:
+            if (!s->randomAccess) {
+                return -1;
+            }
+            pthread_mutex_lock(&s->lock);
+            uint64_t unused;
+            if (indexFindBlockLocked(s, UINT64_MAX, &unused) < 0) {
+                pthread_mutex_unlock(&s->lock);
+                return -1;
+            }
+            uint64_t size = 0;
+            if (s->indexCount) {
+                size = s->index[s->indexCount - 1].rawOffset + s->index[s->indexCount - 1].rawSize;
+            }
+            pthread_mutex_unlock(&s->lock);
+            target = (int64_t)size + offset;
+            break;
+        default:
+            return -1;
+    }
+    if (target < 0) {
+        return -1;
+    }
+    if ((uint64_t)target == s->position) {
+        return target;
+    }
+    if (!s->randomAccess) {
+        /* forward only, decode and discard */
+        if ((uint64_t)target < s->position) {
+            return -1;
+        }
+        uint8_t discard[4096];
+        while (s->position < (uint64_t)target) {
+            uint64_t remaining = (uint64_t)target - s->position;
+            ssize_t n = aaDecompressionStreamRead(s, discard, remaining < sizeof(discard) ? (size_t)remaining : sizeof(discard));
+            if (n <= 0) {
+                return -1;
+            }
+        }
+        return target;
+    }
+    /* Cancel read ahead, and restart at the block covering target */
+    drainPipeline(s);
+    pthread_mutex_lock(&s->lock);
+    uint64_t blockIndex;
+    int found = indexFindBlockLocked(s, (uint64_t)target, &blockIndex);
+    if (found < 0) {
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    if (found) {
+        s->nextBlock = blockIndex;
+        s->skip = (uint64_t)target - s->index[blockIndex].rawOffset;
+    } else {
+        s->nextBlock = s->indexCount;
+        s->skip = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+    s->eof = 0;
+    s->position = (uint64_t)target;
+    return target;
+}
+
+void aaDecompressionStreamCancel(AADecompressionStream s) {
+    s->cancelled = 1;
+    AAByteStreamCancel(s->compressedStream);
+}
+
+int aaDecompressionStreamClose(AADecompressionStream s) {
+    if (!s) {
+        return 0;
+    }
+    ThreadPipelineDestroy(s->pipeline);
+    destroyPipelineBuffers(s);
+    if (s->contextPool) {
+        for (int i = 0; i < s->contextPoolCount; i++) {
+            AACodecContextDestroy(s->contextPool[i]);
+        }
+        free(s->contextPool);
+    }
+    if (s->cache) {
+        cacheClearLocked(s);
+        free(s->cache);
+    }
+    AAMemoryBudgetRelease(s->budget, s->reserved);
+    free(s->index);
+    free(s->dict);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+    return 0;
+}
+
+#pragma mark - Open
+
+AAByteStream AADecompressionInputStreamOpenWithReadAhead(AAByteStream compressed_stream, AAFlagSet flags, int n_threads, int read_ahead, AAMemoryBudget budget) {
+    AADecompressionStream s = calloc(1, sizeof(struct AADecompressionStream_impl));
+    if (!s) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    pthread_mutex_init(&s->lock, 0);
+    s->compressedStream = compressed_stream;
+    s->flags = flags;
+    s->nThreads = n_threads > 0 ? n_threads : (int)getDefaultNThreads();
+    s->readAhead = read_ahead > 0 ? read_ahead : s->nThreads * AA_DECOMPRESSION_READ_AHEAD_PER_THREAD;
+    s->budget = budget;
+
+    /* pread support decides between index based and sequential block fetching */
+    uint8_t streamHeader[PC_STREAM_HEADER_SIZE];
+    if (preadFully(compressed_stream, streamHeader, PC_STREAM_HEADER_SIZE, 0) == PC_STREAM_HEADER_SIZE) {
+        s->randomAccess = 1;
+    } else if (readFully(compressed_stream, streamHeader, PC_STREAM_HEADER_SIZE) != PC_STREAM_HEADER_SIZE) {
+        ParallelCompressionLogError("truncated stream header");
+        aaDecompressionStreamClose(s);
+        return 0;
+    }
+    if (streamHeader[0] != 'p' || streamHeader[1] != 'b' || streamHeader[2] != 'z') {
+        ParallelCompressionLogError("invalid stream magic");
+        aaDecompressionStreamClose(s);
+        return 0;
+    }
+    s->algorithm = pcAlgorithmFromMagic(streamHeader[3]);
+    s->blockSize = pcLoadBE64(streamHeader + 4);
+    if (s->algorithm == UINT32_MAX || s->blockSize == 0 || s->blockSize > PC_MAX_BLOCK_SIZE) {
+        ParallelCompressionLogError("invalid stream header");
+        aaDecompressionStreamClose(s);
+        return 0;
+    }
+    if (!AACodecGetBackend(s->algorithm)) {
+        ParallelCompressionLogError("no codec for algorithm: %u");
+        aaDecompressionStreamClose(s);
+        return 0;
+    }
+    if (s->randomAccess) {
+        s->cacheSize = s->nThreads;
+        s->cache = calloc(s->cacheSize, sizeof(struct AADecompressionCacheEntry_impl));
+        s->contextPool = calloc(s->nThreads, sizeof(AACodecContext));
+        if (!s->cache || !s->contextPool) {
+            ParallelCompressionLogError("malloc");
+            aaDecompressionStreamClose(s);
+            return 0;
+        }
+        /* the dictionary must be known before any block is decoded */
+        AADecompressionIndexEntry first;
+        int found = indexGetBlock(s, 0, &first);
+        if (found > 0 && first.rawSize == first.compressedSize && first.rawSize >= PC_DICTIONARY_ENTRY_HEADER_SIZE) {
+            uint8_t *data = malloc(first.rawSize);
+            ssize_t n = data ? preadFully(compressed_stream, data, first.rawSize, first.compressedOffset + PC_BLOCK_HEADER_SIZE) : -1;
+            int ok = n >= 0 && (uint64_t)n == first.rawSize && loadDictionary(s, data, first.rawSize) == 0;
+            free(data);
+            found = ok ? 1 : -1;
+        }
+        if (found < 0) {
+            ParallelCompressionLogError("invalid first block");
+            aaDecompressionStreamClose(s);
+            return 0;
+        }
+    }
+
+    AAByteStream stream = AACustomByteStreamOpen();
+    if (!stream) {
+        aaDecompressionStreamClose(s);
+        return 0;
+    }
+    AACustomByteStreamSetData(stream, s);
+    AACustomByteStreamSetCloseProc(stream, (AAByteStreamCloseProc)aaDecompressionStreamClose);
+    AACustomByteStreamSetReadProc(stream, (AAByteStreamReadProc)aaDecompressionStreamRead);
+    AACustomByteStreamSetSeekProc(stream, (AAByteStreamSeekProc)aaDecompressionStreamSeek);
+    AACustomByteStreamSetCancelProc(stream, (AAByteStreamCancelProc)aaDecompressionStreamCancel);
+    if (s->randomAccess) {
+        AACustomByteStreamSetPReadProc(stream, (AAByteStreamPReadProc)aaDecompressionStreamPRead);
+    }
+    return stream;
+}
+
+AAByteStream AADecompressionInputStreamOpen(AAByteStream compressed_stream, AAFlagSet flags, int n_threads) {
+    return AADecompressionInputStreamOpenWithReadAhead(compressed_stream, flags, n_threads, 0, 0);
+}
@@ -0,0 +1,497 @@
+//
+//  AADedupEngine.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define AA_DEDUP_EDGE_SIZE 4096 /* bytes hashed at each end of the file */
+#define AA_DEDUP_COMPARE_SIZE (64 << 10) /* read size per file when comparing files */
+#define AA_DEDUP_COMPARE_FILES 64 /* max files compared together, each one open */
+#define AA_DEDUP_NO_CLUSTER UINT64_MAX
+
+
+/* Stage levels, each one refining the key of the previous one */
+enum {
+    AA_DEDUP_SIZE = 0,
+    AA_DEDUP_EDGE = 1,
+    AA_DEDUP_DIGEST = 2,
+};
+
+typedef struct {
+    char *path;
+    uint64_t entryId;
+    size_t index; /* submission order */
+    int status; /* 0 while the file is a candidate */
+    uint64_t size;
+    uint8_t edge[32]; /* SHA-256 of the first and last AA_DEDUP_EDGE_SIZE bytes */
+    uint8_t digest[32]; /* SHA-256 of the data */
+    uint64_t cluster;
+} AADedupFile;
+
+/* Files with the same size and digest */
+typedef struct {
+    AADedupFile **files;
+    size_t count;
+} AADedupGroup;
+
+struct AADedupEngine_impl {
+    int nThreads;
+    AADedupFile *files;
+    size_t count;
+    size_t capacity;
+    AADedupStats stats;
+};
+
+/* Work shared by the worker threads of one stage */
+typedef struct {
+    AADedupEngine engine;
+    void *items;
+    size_t count;
+    size_t next; /* next item, shared by the workers */
+    void (*proc)(AADedupEngine engine, void *items, size_t i);
+} AADedupStage;
+
+#pragma mark - Stages
+
+static void *stageWorkerProc(void *arg) {
+    AADedupStage *stage = arg;
+    while (1) {
+        size_t i = __atomic_fetch_add(&stage->next, 1, __ATOMIC_RELAXED);
+        if (i >= stage->count) {
+            break;
+        }
+        stage->proc(stage->engine, stage->items, i);
+    }
+    return 0;
+}
+
+/* Run \p proc for each of the \p count items, on the worker threads */
+static void runStage(AADedupEngine engine, void *items, size_t count, void (*proc)(AADedupEngine, void *, size_t)) {
+    AADedupStage stage = { .engine = engine, .items = items, .count = count, .next = 0, .proc = proc };
+    int nThreads = engine->nThreads;
+    if ((size_t)nThreads > count) {
+        nThreads = (int)count;
+    }
+    pthread_t *threads = (nThreads > 1) ? calloc(nThreads - 1, sizeof(pthread_t)) : 0;
+    int started = 0;
+    for (int i = 0; threads && i < nThreads - 1; i++, started++) {
+        if (pthread_create(&threads[i], 0, stageWorkerProc, &stage) != 0) {
+            break;
+        }
+    }
+    stageWorkerProc(&stage); /* the calling thread works too */
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], 0);
+    }
+    free(threads);
+}
+
+static ssize_t preadAll(int fd, uint8_t *buf, size_t size, uint64_t offset) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t n = pread(fd, buf + total, size - total, offset + total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+/* Bytes read by the edge stage for a file of \p size bytes, the whole file if small */
+static uint64_t edgeSize(uint64_t size) {
+    return (size < 2 * AA_DEDUP_EDGE_SIZE) ? size : 2 * AA_DEDUP_EDGE_SIZE;
+}
+
+static void statFile(AADedupEngine engine, void *items, size_t i) {
+    (void)engine;
+    AADedupFile *f = ((AADedupFile **)items)[i];
+    struct stat st;
+    if (lstat(f->path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        f->status = -1;
+        return;
+    }
+    f->size = st.st_size;
+}
+
+static void hashEdges(AADedupEngine engine, void *items, size_t i) {
+    AADedupFile *f = ((AADedupFile **)items)[i];
+    uint8_t buf[2 * AA_DEDUP_EDGE_SIZE];
+    size_t n = edgeSize(f->size);
+    int fd = open(f->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        f->status = -1;
+        return;
+    }
+    ssize_t r;
+    if (n == f->size) {
+        r = preadAll(fd, buf, n, 0);
+    } else {
+        r = preadAll(fd, buf, AA_DEDUP_EDGE_SIZE, 0);
+        if (r == AA_DEDUP_EDGE_SIZE) {
+            ssize_t r2 = preadAll(fd, buf + AA_DEDUP_EDGE_SIZE, AA_DEDUP_EDGE_SIZE, f->size - AA_DEDUP_EDGE_SIZE);
+            r = (r2 < 0) ? r2 : r + r2;
+        }
+    }
+    close(fd);
+    if (r > 0) {
+        __atomic_fetch_add(&engine->stats.bytes_read, (uint64_t)r, __ATOMIC_RELAXED);
+    }
+    if (r != (ssize_t)n) {
+        f->status = -1; /* read failed, or file truncated */
+        return;
+    }
+    const uint8_t *data[1] = { buf };
+    size_t sizes[1] = { n };
+    AADigests digests;
+    if (AAHashBuffers(AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_SHA256), 1, data, sizes, &digests) < 0) {
+        f->status = -1;
+        return;
+    }
+    memcpy(f->edge, digests.sha256, sizeof(f->edge));
+    if (n == f->size) {
+        memcpy(f->digest, digests.sha256, sizeof(f->digest)); /* whole file */
+    }
+}
+
+static int digestResultProc(void *arg, uint64_t entry_id, int status, const AADigests *digests) {
+    AADedupEngine engine = arg;
+    AADedupFile *f = &engine->files[entry_id]; /* the engine gets file indices */
+    if (status < 0) {
+        f->status = -1;
+    } else {
+        memcpy(f->digest, digests->sha256, sizeof(f->digest));
+    }
+    return 0;
+}
+
+/*
+ * Compare the files of a group, and assign their clusters. The first unassigned file is the
+ * reference, compared with up to AA_DEDUP_COMPARE_FILES - 1 other files at a time, reading all
+ * of them in lockstep, until no file is left to compare with it. Files different from the
+ * reference are compared with the next one.
+ */
+static void compareGroup(AADedupEngine engine, void *items, size_t i) {
+    AADedupGroup *group = &((AADedupGroup *)items)[i];
+    uint8_t *buffers = malloc((size_t)AA_DEDUP_COMPARE_FILES * AA_DEDUP_COMPARE_SIZE);
+    int *done = calloc(group->count, sizeof(int));
+    size_t *differs = malloc(group->count * sizeof(size_t)); /* reference the file was found different from */
+    int fds[AA_DEDUP_COMPARE_FILES];
+    size_t members[AA_DEDUP_COMPARE_FILES];
+    int matching[AA_DEDUP_COMPARE_FILES];
+    if (!buffers || !done || !differs) {
+        ParallelCompressionLogError("malloc");
+        goto END; /* files not assigned are not in a cluster */
+    }
+    for (size_t j = 0; j < group->count; j++) {
+        differs[j] = SIZE_MAX;
+    }
+    size_t ref = SIZE_MAX;
+    while (1) {
+        if (ref == SIZE_MAX) {
+            for (ref = 0; ref < group->count && done[ref]; ref++)
+                ;
+            if (ref == group->count) {
+                break;
+            }
+            done[ref] = 1;
+        }
+        size_t k = 0;
+        for (size_t j = ref; j < group->count && k < AA_DEDUP_COMPARE_FILES; j++) {
+            if (j != ref && (done[j] || differs[j] == ref)) {
+                continue;
+            }
+            int fd = open(group->files[j]->path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                done[j] = 1; /* can't read it, not in a cluster */
+                if (j == ref) {
+                    break;
+                }
+                continue;
+            }
+            fds[k] = fd;
+            members[k] = j;
+            matching[k] = 1;
+            k++;
+        }
+        if (k < 2) {
+            /* nothing left to compare with the reference */
+            if (k == 1) {
+                close(fds[0]);
+            }
+            ref = SIZE_MAX;
+            continue;
+        }
+        uint64_t size = group->files[ref]->size;
+        size_t nMatching = k;
+        for (uint64_t offset = 0; offset < size && nMatching > 1; offset += AA_DEDUP_COMPARE_SIZE) {
+            size_t n = (size - offset < AA_DEDUP_COMPARE_SIZE) ? (size_t)(size - offset) : AA_DEDUP_COMPARE_SIZE;
+            for (size_t m = 0; m < k; m++) {
+                if (!matching[m]) {
+                    continue;
+                }
+                uint8_t *buf = buffers + m * AA_DEDUP_COMPARE_SIZE;
+                ssize_t r = preadAll(fds[m], buf, n, offset);
+                if (r > 0) {
+                    __atomic_fetch_add(&engine->stats.bytes_read, (uint64_t)r, __ATOMIC_RELAXED);
+                }
+                if (r != (ssize_t)n) {
+                    done[members[m]] = 1; /* unreadable or truncated, not in a cluster */
+                    matching[m] = 0;
+                    nMatching--;
+                    if (m == 0) {
+                        nMatching = 0; /* no reference, the others are compared with the next one */
+                        break;
+                    }
+                } else if (m > 0 && memcmp(buf, buffers, n) != 0) {
+                    differs[members[m]] = ref;
+                    matching[m] = 0;
+                    nMatching--;
+                }
+            }
+        }
+        for (size_t m = 0; m < k; m++) {
+            if (m > 0 && nMatching > 1 && matching[m]) {
+                done[members[m]] = 1;
+                group->files[members[m]]->cluster = group->files[ref]->entryId;
+                group->files[ref]->cluster = group->files[ref]->entryId;
+            }
+            close(fds[m]);
+        }
+        if (nMatching == 0) {
+            ref = SIZE_MAX;
+        }
+    }
+
+END:
+    free(differs);
+    free(done);
+    free(buffers);
+}
+
+#pragma mark - Grouping
+
+static int compareKeys(const AADedupFile *a, const AADedupFile *b, int level) {
+    if (a->size != b->size) {
+        return (a->size < b->size) ? -1 : 1;
+    }
+    if (level == AA_DEDUP_EDGE) {
+        return memcmp(a->edge, b->edge, sizeof(a->edge));
+    }
+    if (level == AA_DEDUP_DIGEST) {
+        return memcmp(a->digest, b->digest, sizeof(a->digest));
+    }
+    return 0;
+}
+
+/* Sort by key, and then in submission order, so the first file of a cluster is the first submitted */
+static int compareFiles(const void *pa, const void *pb, int level) {
+    const AADedupFile *a = *(AADedupFile * const *)pa;
+    const AADedupFile *b = *(AADedupFile * const *)pb;
+    int c = compareKeys(a, b, level);
+    if (c != 0) {
+        return c;
+    }
+    return (a->index < b->index) ? -1 : 1;
+}
+
+static int compareSizes(const void *pa, const void *pb) { return compareFiles(pa, pb, AA_DEDUP_SIZE); }
+static int compareEdges(const void *pa, const void *pb) { return compareFiles(pa, pb, AA_DEDUP_EDGE); }
+static int compareDigests(const void *pa, const void *pb) { return compareFiles(pa, pb, AA_DEDUP_DIGEST); }
+
+/*
+ * Drop the files that failed, sort the others by key, and keep only the ones colliding with
+ * another file. \p avoided receives the size of the files dropped as unique, minus the bytes
+ * already read from them. Returns the new number of files.
+ */
+static size_t keepCollisions(AADedupFile **files, size_t count, int level, uint64_t *avoided) {
+    static int (* const compare[3])(const void *, const void *) = { compareSizes, compareEdges, compareDigests };
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (files[i]->status == 0) {
+            files[n++] = files[i];
+        }
+    }
+    count = n;
+    qsort(files, count, sizeof(files[0]), compare[level]);
+    n = 0;
+    for (size_t i = 0; i < count;) {
+        size_t j = i + 1;
+        while (j < count && compareKeys(files[i], files[j], level) == 0) {
+            j++;
+        }
+        if (j - i == 1) {
+            uint64_t size = files[i]->size;
+            *avoided += size - ((level == AA_DEDUP_EDGE) ? edgeSize(size) : 0);
+        } else {
+            memmove(files + n, files + i, (j - i) * sizeof(files[0]));
+            n += j - i;
+        }
+        i = j;
+    }
+    return n;
+}
+
+#pragma mark - API
+
+AADedupEngine AADedupEngineCreate(int n_threads) {
+    AADedupEngine engine = calloc(1, sizeof(struct AADedupEngine_impl));
+    if (!engine) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    engine->nThreads = n_threads > 0 ? n_threads : (int)getDefaultNThreads();
+    return engine;
+}
+
+int AADedupEngineSubmitPath(AADedupEngine engine, const char *path, uint64_t entry_id) {
+    if (engine->count == engine->capacity) {
+        size_t capacity = engine->capacity ? 2 * engine->capacity : 1024;
+        AADedupFile *files = realloc(engine->files, capacity * sizeof(AADedupFile));
+        if (!files) {
+            ParallelCompressionLogError("malloc");
+            return -1;
+        }
+        engine->files = files;
+        engine->capacity = capacity;
+    }
+    AADedupFile *f = &engine->files[engine->count];
+    memset(f, 0, sizeof(*f));
+    f->path = strdup(path);
+    if (!f->path) {
+        ParallelCompressionLogError("malloc");
+        return -1;
+    }
+    f->entryId = entry_id;
+    f->index = engine->count;
+    engine->count++;
+    return 0;
+}
+
+int AADedupEngineRun(AADedupEngine engine, AADedupEngineResultProc proc, void *arg) {
+    int status = 0;
+    AADigestEngine digestEngine = 0;
+    AADedupGroup *groups = 0;
+    AADedupStats *stats = &engine->stats;
+    memset(stats, 0, sizeof(*stats));
+    AADedupFile **files = malloc((engine->count ? engine->count : 1) * sizeof(AADedupFile *));
+    if (!files) {
+        ParallelCompressionLogError("malloc");
+        status = -1;
+        goto END;
+    }
+    size_t count = engine->count;
+    for (size_t i = 0; i < count; i++) {
+        files[i] = &engine->files[i];
+        files[i]->status = 0;
+        files[i]->cluster = AA_DEDUP_NO_CLUSTER;
+    }
+
+    /* size */
+    runStage(engine, files, count, statFile);
+    for (size_t i = 0; i < count; i++) {
+        if (files[i]->status == 0) {
+            stats->file_count++;
+            stats->file_bytes += files[i]->size;
+        }
+    }
+    count = keepCollisions(files, count, AA_DEDUP_SIZE, &stats->size_avoided);
+
+    /* first and last 4 KB */
+    runStage(engine, files, count, hashEdges);
+    count = keepCollisions(files, count, AA_DEDUP_EDGE, &stats->edge_avoided);
+
+    /* full digest, for files not entirely read by the previous stage */
+    digestEngine = AADigestEngineCreate(AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_SHA256), engine->nThreads, digestResultProc, engine, 0);
+    if (!digestEngine) {
+        status = -1;
+        goto END;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (files[i]->size == edgeSize(files[i]->size)) {
+            continue;
+        }
+        if (AADigestEngineSubmitPath(digestEngine, files[i]->path, files[i]->index) < 0) {
+            status = -1;
+            goto END;
+        }
+        stats->bytes_read += files[i]->size;
+    }
+    if (AADigestEngineFlush(digestEngine) < 0) {
+        status = -1;
+        goto END;
+    }
+    count = keepCollisions(files, count, AA_DEDUP_DIGEST, &stats->digest_avoided);
+
+    /* byte compare */
+    size_t nGroups = 0;
+    groups = malloc((count / 2 + 1) * sizeof(AADedupGroup));
+    if (!groups) {
+        ParallelCompressionLogError("malloc");
+        status = -1;
+        goto END;
+    }
+    for (size_t i = 0; i < count;) {
+        size_t j = i + 1;
+        while (j < count && compareKeys(files[i], files[j], AA_DEDUP_DIGEST) == 0) {
+            j++;
+        }
+        groups[nGroups].files = files + i;
+        groups[nGroups].count = j - i;
+        nGroups++;
+        i = j;
+    }
+    runStage(engine, groups, nGroups, compareGroup);
+
+    /* results, in submission order */
+    for (size_t i = 0; i < engine->count; i++) {
+        AADedupFile *f = &engine->files[i];
+        if (f->cluster == AA_DEDUP_NO_CLUSTER) {
+            continue;
+        }
+        if (f->cluster == f->entryId) {
+            stats->cluster_count++;
+        } else {
+            stats->duplicate_count++;
+            stats->duplicate_bytes += f->size;
+        }
+        if (proc && proc(arg, f->entryId, f->cluster) < 0) {
+            status = -1;
+            goto END;
+        }
+    }
+
+END:
+    AADigestEngineDestroy(digestEngine);
+    free(groups);
+    free(files);
+    return status;
+}
+
+void AADedupEngineGetStats(AADedupEngine engine, AADedupStats *stats) {
+    *stats = engine->stats;
+}
+
+void AADedupEngineDestroy(AADedupEngine engine) {
+    if (!engine) {
+        return;
+    }
+    for (size_t i = 0; i < engine->count; i++) {
+        free(engine->files[i].path);
+    }
+    free(engine->files);
+    free(engine);
+}
@@ -0,0 +1,116 @@
+// AppleArchive duplicate data detection
+
+#pragma once
+
+#ifndef __APPLE_ARCHIVE_H
+#error Include AppleArchive.h instead of this file
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull begin")
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma mark - Dedup engine
+
+/*!
+  @abstract Finds files with identical data, to assign SLC cluster ids with AA_FLAG_ARCHIVE_DEDUPLICATE_DAT
+
+  @discussion
+  Files are narrowed down in stages, each stage reading only the files still colliding after the previous one:
+  files are grouped by size, then by a hash of their first and last 4 KB, then by the SHA-256 digest of their
+  data, and each match is finally confirmed by comparing the files byte by byte.
+  Each stage runs on the worker threads.
+*/
+typedef struct AADedupEngine_impl * AADedupEngine APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Dedup statistics
+
+  @discussion Bytes avoided by a stage are the bytes the next stages would have read without it.
+*/
+typedef struct {
+  uint64_t file_count;        ///< regular files with data
+  uint64_t file_bytes;        ///< total size of these files
+  uint64_t bytes_read;        ///< bytes read by all stages
+  uint64_t size_avoided;      ///< bytes of the files with a unique size, not read at all
+  uint64_t edge_avoided;      ///< bytes not read because the first and last 4 KB of the file are unique
+  uint64_t digest_avoided;    ///< bytes not read for byte comparison because the digest of the file is unique
+  uint64_t cluster_count;     ///< clusters of 2 or more identical files
+  uint64_t duplicate_count;   ///< files in clusters, excluding the first file of each cluster
+  uint64_t duplicate_bytes;   ///< size of these files
+} AADedupStats APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Receives the cluster of one file, in submission order
+
+  @param arg user data
+  @param entry_id the id passed to AADedupEngineSubmitPath
+  @param cluster_id entry id of the first file submitted in the cluster, to be stored in the SLC field
+
+  @return 0 to continue, and a negative value to stop
+*/
+typedef int (*AADedupEngineResultProc)(void * _Nullable arg, uint64_t entry_id, uint64_t cluster_id);
+
+/*!
+  @abstract Create a dedup engine
+
+  @param n_threads number of worker threads, or 0 for default
+
+  @return a new engine on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AADedupEngine _Nullable AADedupEngineCreate(int n_threads);
+
+/*!
+  @abstract Queue a file
+
+  @discussion Symbolic links and other files that are not regular files are ignored, as are empty files.
+
+  @param engine target engine
+  @param path file path, copied
+  @param entry_id passed back to the result callback, e.g. the entry index in the archive
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AADedupEngineSubmitPath(AADedupEngine engine, const char * path, uint64_t entry_id);
+
+/*!
+  @abstract Find the clusters of identical files among all queued files
+
+  @discussion
+  \p proc is called for each file belonging to a cluster of 2 or more files, including the first one, in
+  submission order, on the calling thread. Files that can't be read are not part of any cluster.
+
+  @param engine target engine
+  @param proc receives the results
+  @param arg passed to \p proc
+
+  @return 0 on success, and a negative error code on failure, or if the callback stopped the engine
+*/
+APPLE_ARCHIVE_API int AADedupEngineRun(AADedupEngine engine, AADedupEngineResultProc proc, void * _Nullable arg);
+
+/*!
+  @abstract Get the statistics of the last run
+
+  @param engine target engine
+  @param stats receives the statistics
+*/
+APPLE_ARCHIVE_API void AADedupEngineGetStats(AADedupEngine engine, AADedupStats * stats);
+
+/*!
+  @abstract Destroy an engine
+
+  @param engine target engine, do nothing if NULL
+*/
+APPLE_ARCHIVE_API void AADedupEngineDestroy(AADedupEngine _Nullable engine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull end")
+#endif
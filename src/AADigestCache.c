@@ -0,0 +1,555 @@
+//
+//  AADigestCache.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#if defined(__APPLE__)
+#define ST_MTIM st_mtimespec
+#define ST_CTIM st_ctimespec
+#else
+#define ST_MTIM st_mtim
+#define ST_CTIM st_ctim
+#endif
+
+/*
+ * Log file: "AADC" + u32 version, then fixed size records, all integers
+ * little endian:
+ *   dev u64, ino u64, size u64, mtime s64 + u32 nsec, ctime s64 + u32 nsec,
+ *   functions u32, crc32 u32, sha1[20], sha256[32], sha384[48], sha512[64],
+ *   checksum u32 (cksum CRC of the record bytes before it).
+ */
+#define DIGEST_CACHE_MAGIC "AADC"
+#define DIGEST_CACHE_VERSION 1
+#define DIGEST_CACHE_HEADER_SIZE 8
+#define DIGEST_CACHE_RECORD_SIZE 224
+
+/* Compact at close when the log has more than this many records per file */
+#define DIGEST_CACHE_COMPACT_RATIO 2
+#define DIGEST_CACHE_MIN_CAPACITY 1024
+
+typedef struct AADigestCacheRecord_impl {
+    AADigestCacheKey key;
+    AADigests digests;
+    struct AADigestCacheRecord_impl *next; /* all records, freed at close */
+} AADigestCacheRecord;
+
+/*
+ * Open addressing table of (dev, ino) -> latest record. Readers load the
+ * table and the slots with acquire semantics and take no lock. Writers hold
+ * the cache lock, publish new records with release stores, and replace the
+ * table when it grows. Records and tables are immutable once published, and
+ * freed at close only.
+ */
+typedef struct AADigestCacheTable_impl {
+    size_t capacity; /* power of 2 */
+    AADigestCacheRecord **slots;
+    struct AADigestCacheTable_impl *retired; /* previous tables */
+} AADigestCacheTable;
+
+struct AADigestCache_impl {
+    char *path;
+    int fd;
+    pthread_mutex_t lock; /* writers */
+    AADigestCacheTable *table;
+    AADigestCacheRecord *records;
+    size_t liveCount; /* files in the table */
+    size_t logCount; /* records in the log */
+    uint64_t hitCount;
+    uint64_t missCount;
+};
+
+#pragma mark - Keys
+
+int AADigestCacheKeyInitWithFD(AADigestCacheKey *key, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        ParallelCompressionLogError("fstat");
+        return -1;
+    }
+    memset(key, 0, sizeof(*key));
+    key->dev = (uint64_t)st.st_dev;
+    key->ino = (uint64_t)st.st_ino;
+    key->size = (uint64_t)st.st_size;
+    key->mtime = st.ST_MTIM;
+    key->ctime = st.ST_CTIM;
+    return 0;
+}
+
+int AADigestCacheKeyInitWithPath(AADigestCacheKey *key, const char *path) {
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        ParallelCompressionLogError("lstat: %s");
+        return -1;
+    }
+    memset(key, 0, sizeof(*key));
+    key->dev = (uint64_t)st.st_dev;
+    key->ino = (uint64_t)st.st_ino;
+    key->size = (uint64_t)st.st_size;
+    key->mtime = st.ST_MTIM;
+    key->ctime = st.ST_CTIM;
+    return 0;
+}
+
+static int keyEqual(const AADigestCacheKey *a, const AADigestCacheKey *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec &&
+           a->ctime.tv_sec == b->ctime.tv_sec && a->ctime.tv_nsec == b->ctime.tv_nsec;
+}
+
+static size_t keyHash(const AADigestCacheKey *key) {
+    uint64_t h = key->ino * 0x9E3779B97F4A7C15ULL ^ key->dev * 0xC2B2AE3D27D4EB4FULL;
+    return (size_t)(h ^ (h >> 29));
+}
+
+#pragma mark - Records
+
+static void storeLE32(uint8_t *p, uint32_t x) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (uint8_t)(x >> (8 * i));
+    }
+}
+
+static void storeLE64(uint8_t *p, uint64_t x) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (uint8_t)(x >> (8 * i));
+    }
+}
+
+static uint32_t loadLE32(const uint8_t *p) {
+    uint32_t x = 0;
+    for (int i = 0; i < 4; i++) {
+        x |= (uint32_t)p[i] << (8 * i);
+    }
+    return x;
+}
+
+static uint64_t loadLE64(const uint8_t *p) {
+    uint64_t x = 0;
+    for (int i = 0; i < 8; i++) {
+        x |= (uint64_t)p[i] << (8 * i);
+    }
+    return x;
+}
+
+static uint32_t recordChecksum(const uint8_t *p) {
+    size_t size = DIGEST_CACHE_RECORD_SIZE - 4;
+    return AAHashCRC32Final(AAHashCRC32Update(0, p, size), size);
+}
+
+static void encodeRecord(uint8_t *p, const AADigestCacheRecord *r) {
+    uint8_t *q = p;
+    storeLE64(q, r->key.dev); q += 8;
+    storeLE64(q, r->key.ino); q += 8;
+    storeLE64(q, r->key.size); q += 8;
+    storeLE64(q, (uint64_t)r->key.mtime.tv_sec); q += 8;
+    storeLE32(q, (uint32_t)r->key.mtime.tv_nsec); q += 4;
+    storeLE64(q, (uint64_t)r->key.ctime.tv_sec); q += 8;
+    storeLE32(q, (uint32_t)r->key.ctime.tv_nsec); q += 4;
+    storeLE32(q, r->digests.functions); q += 4;
+    storeLE32(q, r->digests.crc32); q += 4;
+    memcpy(q, r->digests.sha1, 20); q += 20;
+    memcpy(q, r->digests.sha256, 32); q += 32;
+    memcpy(q, r->digests.sha384, 48); q += 48;
+    memcpy(q, r->digests.sha512, 64); q += 64;
+    storeLE32(q, recordChecksum(p));
+}
+
+/* Returns 0 if the record is valid */
+static int decodeRecord(AADigestCacheRecord *r, const uint8_t *p) {
+    if (loadLE32(p + DIGEST_CACHE_RECORD_SIZE - 4) != recordChecksum(p)) {
+        return -1;
+    }
+    const uint8_t *q = p;
+    memset(r, 0, sizeof(*r));
+    r->key.dev = loadLE64(q); q += 8;
+    r->key.ino = loadLE64(q); q += 8;
+    r->key.size = loadLE64(q); q += 8;
+    r->key.mtime.tv_sec = (time_t)loadLE64(q); q += 8;
+    r->key.mtime.tv_nsec = (long)loadLE32(q); q += 4;
+    r->key.ctime.tv_sec = (time_t)loadLE64(q); q += 8;
+    r->key.ctime.tv_nsec = (long)loadLE32(q); q += 4;
+    r->digests.functions = loadLE32(q); q += 4;
+    r->digests.crc32 = loadLE32(q); q += 4;
+    memcpy(r->digests.sha1, q, 20); q += 20;
+    memcpy(r->digests.sha256, q, 32); q += 32;
+    memcpy(r->digests.sha384, q, 48); q += 48;
+    memcpy(r->digests.sha512, q, 64);
+    return 0;
+}
+
+static int writeAll(int fd, const uint8_t *buf, size_t size) {
+    while (size) {
+        ssize_t n = write(fd, buf, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int writeHeader(int fd) {
+    uint8_t header[DIGEST_CACHE_HEADER_SIZE];
+    memcpy(header, DIGEST_CACHE_MAGIC, 4);
+    storeLE32(header + 4, DIGEST_CACHE_VERSION);
+    return writeAll(fd, header, sizeof(header));
+}
+
+#pragma mark - Table
+
+static AADigestCacheTable *tableCreate(size_t capacity) {
+    AADigestCacheTable *t = calloc(1, sizeof(AADigestCacheTable));
+    if (!t) {
+        return 0;
+    }
+    t->capacity = capacity;
+    t->slots = calloc(capacity, sizeof(AADigestCacheRecord *));
+    if (!t->slots) {
+        free(t);
+        return 0;
+    }
+    return t;
+}
+
+/* Slot of the record for (key->dev, key->ino), or of the empty slot ending the probe */
+static size_t tableFind(const AADigestCacheTable *t, const AADigestCacheKey *key) {
+    size_t mask = t->capacity - 1;
+    for (size_t i = keyHash(key) & mask;; i = (i + 1) & mask) {
+        AADigestCacheRecord *r = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+        if (!r || (r->key.dev == key->dev && r->key.ino == key->ino)) {
+            return i;
+        }
+    }
+}
+
+/* Writer side, lock held. Grows the table before it is half full. */
+static int tablePublish(AADigestCache cache, AADigestCacheRecord *r) {
+    AADigestCacheTable *t = cache->table;
+    if (2 * (cache->liveCount + 1) > t->capacity) {
+        AADigestCacheTable *grown = tableCreate(2 * t->capacity);
+        if (!grown) {
+            ParallelCompressionLogError("malloc");
+            return -1;
+        }
+        for (size_t i = 0; i < t->capacity; i++) {
+            if (t->slots[i]) {
+                grown->slots[tableFind(grown, &t->slots[i]->key)] = t->slots[i];
+            }
+        }
+        grown->retired = t;
+        __atomic_store_n(&cache->table, grown, __ATOMIC_RELEASE);
+        t = grown;
+    }
+    size_t i = tableFind(t, &r->key);
+    if (!t->slots[i]) {
+        cache->liveCount++;
+    }
+    __atomic_store_n(&t->slots[i], r, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static AADigestCacheRecord *recordCreate(AADigestCache cache, const AADigestCacheKey *key, const AADigests *digests) {
+    AADigestCacheRecord *r = calloc(1, sizeof(AADigestCacheRecord));
+    if (!r) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    r->key = *key;
+    r->digests = *digests;
+    r->next = cache->records;
+    cache->records = r;
+    return r;
+}
+
+#pragma mark - Log
+
+static int loadLog(AADigestCache cache) {
+    struct stat st;
+    if (fstat(cache->fd, &st) < 0) {
+        ParallelCompressionLogError("fstat");
+        return -1;
+    }
+    size_t fileSize = (size_t)st.st_size;
+    size_t validSize = 0;
+    uint8_t *buf = 0;
+    if (fileSize >= DIGEST_CACHE_HEADER_SIZE) {
+        buf = malloc(fileSize);
+        if (!buf) {
+            ParallelCompressionLogError("malloc");
+            return -1;
+        }
+        if (pread(cache->fd, buf, fileSize, 0) != (ssize_t)fileSize) {
+            ParallelCompressionLogError("read: %s");
+            free(buf);
+            return -1;
+        }
+        if (memcmp(buf, DIGEST_CACHE_MAGIC, 4) == 0 && loadLE32(buf + 4) == DIGEST_CACHE_VERSION) {
+            validSize = DIGEST_CACHE_HEADER_SIZE;
+        }
+    }
+    /* replay records up to the first torn or corrupted one */
+    while (validSize && validSize + DIGEST_CACHE_RECORD_SIZE <= fileSize) {
+        AADigestCacheRecord decoded;
+        if (decodeRecord(&decoded, buf + validSize) < 0) {
+            break;
+        }
+        AADigestCacheRecord *r = recordCreate(cache, &decoded.key, &decoded.digests);
+        if (!r || tablePublish(cache, r) < 0) {
+            free(buf);
+            return -1;
+        }
+        cache->logCount++;
+        validSize += DIGEST_CACHE_RECORD_SIZE;
+    }
+    free(buf);
+    if (validSize && validSize == fileSize) {
+        return 0;
+    }
+    /* drop the tail, or start a new log if the file is empty or the header invalid */
+    if (ftruncate(cache->fd, validSize) < 0) {
+        ParallelCompressionLogError("ftruncate: %s");
+        return -1;
+    }
+    if (validSize == 0 && writeHeader(cache->fd) < 0) {
+        ParallelCompressionLogError("write: %s");
+        return -1;
+    }
+    return 0;
+}
+
+/* Flush the directory containing \p path, so a rename to \p path is durable */
+static int syncParentDirectory(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir = (slash == path) ? strdup("/") : slash ? strndup(path, (size_t)(slash - path)) : strdup(".");
+    if (!dir) {
+        ParallelCompressionLogError("malloc");
+        return -1;
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(dir);
+    if (fd < 0) {
+        ParallelCompressionLogError("open: %s");
+        return -1;
+    }
+    int r = fsync(fd);
+    close(fd);
+    return r;
+}
+
+int AADigestCacheCompact(AADigestCache cache) {
+    int result = 0;
+    int fd = -1;
+    uint8_t *buf = 0;
+    size_t tmpPathSize = strlen(cache->path) + 8;
+    char *tmpPath = malloc(tmpPathSize);
+    pthread_mutex_lock(&cache->lock);
+    if (!tmpPath) {
+        ParallelCompressionLogError("malloc");
+        result = -1;
+        goto END;
+    }
+    snprintf(tmpPath, tmpPathSize, "%s.tmp", cache->path);
+    fd = open(tmpPath, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        ParallelCompressionLogError("open: %s");
+        result = -1;
+        goto END;
+    }
+    AADigestCacheTable *t = cache->table;
+    size_t bufSize = DIGEST_CACHE_HEADER_SIZE + cache->liveCount * DIGEST_CACHE_RECORD_SIZE;
+    buf = malloc(bufSize);
+    if (!buf) {
+        ParallelCompressionLogError("malloc");
+        result = -1;
+        goto END;
+    }
+    memcpy(buf, DIGEST_CACHE_MAGIC, 4);
+    storeLE32(buf + 4, DIGEST_CACHE_VERSION);
+    size_t pos = DIGEST_CACHE_HEADER_SIZE;
+    for (size_t i = 0; i < t->capacity; i++) {
+        if (t->slots[i]) {
+            encodeRecord(buf + pos, t->slots[i]);
+            pos += DIGEST_CACHE_RECORD_SIZE;
+        }
+    }
+    /* the new log must be on disk before it replaces the old one */
+    if (writeAll(fd, buf, pos) < 0 || fsync(fd) < 0) {
+        ParallelCompressionLogError("write: %s");
+        result = -1;
+        goto END;
+    }
+    if (rename(tmpPath, cache->path) < 0) {
+        ParallelCompressionLogError("rename: %s");
+        result = -1;
+        goto END;
+    }
+    close(cache->fd);
+    cache->fd = fd;
+    fd = -1;
+    cache->logCount = cache->liveCount;
+    /* the new log is in place, the rename itself must reach the disk too */
+    if (syncParentDirectory(cache->path) < 0) {
+        ParallelCompressionLogError("fsync: %s");
+        result = -1;
+    }
+
+END:
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmpPath);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(buf);
+    free(tmpPath);
+    return result;
+}
+
+#pragma mark - Cache
+
+AADigestCache AADigestCacheOpen(const char *path) {
+    AADigestCache cache = calloc(1, sizeof(struct AADigestCache_impl));
+    if (!cache) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    pthread_mutex_init(&cache->lock, 0);
+    cache->fd = -1;
+    cache->path = strdup(path);
+    cache->table = tableCreate(DIGEST_CACHE_MIN_CAPACITY);
+    if (!cache->path || !cache->table) {
+        ParallelCompressionLogError("malloc");
+        goto ERROR;
+    }
+    cache->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (cache->fd < 0) {
+        ParallelCompressionLogError("open: %s");
+        goto ERROR;
+    }
+    if (flock(cache->fd, LOCK_EX | LOCK_NB) < 0) {
+        ParallelCompressionLogError("digest cache in use: %s");
+        goto ERROR;
+    }
+    if (loadLog(cache) < 0) {
+        goto ERROR;
+    }
+    return cache;
+
+ERROR:
+    AADigestCacheClose(cache);
+    return 0;
+}
+
+int AADigestCacheClose(AADigestCache cache) {
+    if (!cache) {
+        return 0;
+    }
+    int result = 0;
+    if (cache->fd >= 0) {
+        if (cache->logCount > DIGEST_CACHE_COMPACT_RATIO * cache->liveCount && AADigestCacheCompact(cache) < 0) {
+            result = -1;
+        }
+        if (fsync(cache->fd) < 0) {
+            ParallelCompressionLogError("fsync: %s");
+            result = -1;
+        }
+        close(cache->fd);
+    }
+    AADigestCacheRecord *r = cache->records;
+    while (r) {
+        AADigestCacheRecord *next = r->next;
+        free(r);
+        r = next;
+    }
+    AADigestCacheTable *t = cache->table;
+    while (t) {
+        AADigestCacheTable *retired = t->retired;
+        free(t->slots);
+        free(t);
+        t = retired;
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->path);
+    free(cache);
+    return result;
+}
+
+int AADigestCacheLookup(AADigestCache cache, const AADigestCacheKey *key, uint32_t functions, AADigests *digests) {
+    AADigestCacheTable *t = __atomic_load_n(&cache->table, __ATOMIC_ACQUIRE);
+    AADigestCacheRecord *r = __atomic_load_n(&t->slots[tableFind(t, key)], __ATOMIC_ACQUIRE);
+    if (r && keyEqual(&r->key, key) && (r->digests.functions & functions) == functions) {
+        *digests = r->digests;
+        __atomic_fetch_add(&cache->hitCount, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    __atomic_fetch_add(&cache->missCount, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int AADigestCacheInsert(AADigestCache cache, const AADigestCacheKey *key, const AADigests *digests) {
+    int result = 0;
+    pthread_mutex_lock(&cache->lock);
+    AADigests merged = *digests;
+    AADigestCacheTable *t = cache->table;
+    AADigestCacheRecord *previous = t->slots[tableFind(t, key)];
+    if (previous && keyEqual(&previous->key, key)) {
+        /* keep the digests we have and the new record doesn't */
+        AADigests tmp = previous->digests;
+        if (merged.functions & AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_CRC32)) {
+            tmp.crc32 = merged.crc32;
+        }
+        if (merged.functions & AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_SHA1)) {
+            memcpy(tmp.sha1, merged.sha1, sizeof(tmp.sha1));
+        }
+        if (merged.functions & AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_SHA256)) {
+            memcpy(tmp.sha256, merged.sha256, sizeof(tmp.sha256));
+        }
+        if (merged.functions & AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_SHA384)) {
+            memcpy(tmp.sha384, merged.sha384, sizeof(tmp.sha384));
+        }
+        if (merged.functions & AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_SHA512)) {
+            memcpy(tmp.sha512, merged.sha512, sizeof(tmp.sha512));
+        }
+        tmp.functions |= merged.functions;
+        merged = tmp;
+    }
+    AADigestCacheRecord *r = recordCreate(cache, key, &merged);
+    if (!r) {
+        result = -1;
+        goto END;
+    }
+    /* log first: a record is published only once it is in the log */
+    uint8_t buf[DIGEST_CACHE_RECORD_SIZE];
+    encodeRecord(buf, r);
+    if (writeAll(cache->fd, buf, sizeof(buf)) < 0) {
+        ParallelCompressionLogError("write: %s");
+        result = -1;
+        goto END;
+    }
+    cache->logCount++;
+    result = tablePublish(cache, r);
+
+END:
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+}
+
+uint64_t AADigestCacheGetHitCount(AADigestCache cache) {
+    return __atomic_load_n(&cache->hitCount, __ATOMIC_RELAXED);
+}
+
+uint64_t AADigestCacheGetMissCount(AADigestCache cache) {
+    return __atomic_load_n(&cache->missCount, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,160 @@
+// AppleArchive digest cache
+
+#pragma once
+
+#ifndef __APPLE_ARCHIVE_H
+#error Include AppleArchive.h instead of this file
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull begin")
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma mark - Digest cache
+
+/*!
+  @abstract Digest cache
+
+  @discussion
+  A digest cache stores the CKS, SH1, SH2, SH3, SH5 values of files, keyed by their stat identity, so that files
+  not modified since they were last hashed are not read again.
+  The cache is an append-only log on disk, replayed when it is opened: a record torn by a crash is detected by
+  its checksum and dropped, with everything after it. Records superseded by a newer one for the same file are
+  dropped when the log is compacted.
+  Lookups are lock-free and can run concurrently with insertions from other threads.
+  A cache file can be opened by one process at a time.
+*/
+typedef struct AADigestCache_impl * AADigestCache APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract File identity, as returned by stat
+
+  @discussion Any change to the file contents changes at least \p ctime.
+*/
+typedef struct {
+  uint64_t dev;               ///< st_dev
+  uint64_t ino;               ///< st_ino
+  uint64_t size;              ///< st_size
+  struct timespec mtime;      ///< modification time
+  struct timespec ctime;      ///< status change time
+} AADigestCacheKey APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Get the identity of an open file
+
+  @param key receives the file identity
+  @param fd open file descriptor
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AADigestCacheKeyInitWithFD(AADigestCacheKey * key, int fd);
+
+/*!
+  @abstract Get the identity of a file, without following a final symbolic link
+
+  @param key receives the file identity
+  @param path file path
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AADigestCacheKeyInitWithPath(AADigestCacheKey * key, const char * path);
+
+/*!
+  @abstract Open a digest cache, creating the file if needed
+
+  @param path cache file
+
+  @return a new cache on success, and NULL on failure, including if the file is in use by another process
+*/
+APPLE_ARCHIVE_API AADigestCache _Nullable AADigestCacheOpen(const char * path);
+
+/*!
+  @abstract Close a digest cache
+
+  @discussion The log is compacted if it is mostly made of superseded records, and synced to disk.
+
+  @param cache target cache, do nothing if NULL
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AADigestCacheClose(AADigestCache _Nullable cache);
+
+/*!
+  @abstract Look up the digests of a file
+
+  @param cache target cache
+  @param key file identity
+  @param functions digests needed, mask of AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_*)
+  @param digests receives the cached digests on a hit
+
+  @return 1 on a hit, when the file is cached with an identical key and all \p functions, and 0 on a miss
+*/
+APPLE_ARCHIVE_API int AADigestCacheLookup(AADigestCache cache, const AADigestCacheKey * key, uint32_t functions, AADigests * digests);
+
+/*!
+  @abstract Store the digests of a file
+
+  @discussion
+  The record is appended to the log. Digests already cached for the same key are kept when \p digests
+  doesn't have them.
+
+  @param cache target cache
+  @param key file identity, taken before reading the file
+  @param digests digests of the file
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AADigestCacheInsert(AADigestCache cache, const AADigestCacheKey * key, const AADigests * digests);
+
+/*!
+  @abstract Rewrite the log with one record per file
+
+  @discussion The new log is written to a temporary file, synced, and renamed over the old one.
+
+  @param cache target cache
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AADigestCacheCompact(AADigestCache cache);
+
+/*!
+  @abstract Get the number of lookups that hit
+
+  @param cache target cache
+
+  @return number of hits since the cache was opened
+*/
+APPLE_ARCHIVE_API uint64_t AADigestCacheGetHitCount(AADigestCache cache);
+
+/*!
+  @abstract Get the number of lookups that missed
+
+  @param cache target cache
+
+  @return number of misses since the cache was opened
+*/
+APPLE_ARCHIVE_API uint64_t AADigestCacheGetMissCount(AADigestCache cache);
+
+/*!
+  @abstract Use a digest cache
+
+  @discussion
+  Files found in \p cache with all the engine functions are not read. Files hashed are inserted in \p cache
+  if their identity didn't change while they were read. Must be called before the first file is queued.
+
+  @param engine target engine
+  @param cache digest cache, or NULL to disable caching, must outlive the engine
+*/
+APPLE_ARCHIVE_API void AADigestEngineSetCache(AADigestEngine engine, AADigestCache _Nullable cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull end")
+#endif
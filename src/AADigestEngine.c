@@ -0,0 +1,319 @@
+//
+//  AADigestEngine.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "ThreadPipeline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define AA_DIGEST_BATCH_SIZE 16
+#define AA_DIGEST_BATCHES_PER_THREAD 2
+#define AA_DIGEST_SMALL_FILE_SIZE (64 << 10) /* hashed together with AAHashBuffers */
+#define AA_DIGEST_READ_SIZE (1 << 20) /* read size for large files */
+#define AA_DIGEST_WORKER_SIZE ((size_t)AA_DIGEST_BATCH_SIZE * (AA_DIGEST_SMALL_FILE_SIZE + 1) + AA_DIGEST_READ_SIZE) /* buffers of a worker */
+
+typedef struct {
+    char *path;
+    uint64_t entryId;
+    int status;
+    AADigests digests;
+    int cacheable; /* insert the digests in the cache, the file didn't change while read */
+    AADigestCacheKey key;
+} AADigestJob;
+
+struct AADigestBatch_impl {
+    int count;
+    AADigestJob jobs[AA_DIGEST_BATCH_SIZE];
+};
+
+typedef struct AADigestBatch_impl * AADigestBatch;
+
+struct AADigestWorker_impl {
+    struct AADigestEngine_impl *engine;
+    uint8_t *smallFiles; /* AA_DIGEST_BATCH_SIZE slots of AA_DIGEST_SMALL_FILE_SIZE + 1 bytes */
+    uint8_t *readBuffer;
+    AAHashContext ctx;
+};
+
+typedef struct AADigestWorker_impl * AADigestWorker;
+
+struct AADigestEngine_impl {
+    uint32_t functions;
+    int nThreads;
+    int nItems;
+    AADigestEngineResultProc proc;
+    void *arg;
+    ThreadPipeline pipeline;
+    AADigestCache cache;
+    AAMemoryBudget budget;
+    size_t reserved; /* bytes acquired from budget */
+    struct AADigestBatch_impl *batches;
+    struct AADigestWorker_impl *workers;
+    AADigestBatch current; /* being filled by the submitter */
+    int stopped;
+};
+
+#pragma mark - Worker
+
+/* Read up to \p capacity bytes, returns the number of bytes read, and -1 on failure */
+static ssize_t readFile(int fd, uint8_t *buf, size_t capacity) {
+    size_t total = 0;
+    while (total < capacity) {
+        ssize_t n = read(fd, buf + total, capacity - total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+static int hashLargeFile(AADigestWorker worker, int fd, const uint8_t *head, size_t headSize, AADigests *digests) {
+    AAHashContextReset(worker->ctx);
+    AAHashContextUpdate(worker->ctx, head, headSize);
+    while (1) {
+        ssize_t n = readFile(fd, worker->readBuffer, AA_DIGEST_READ_SIZE);
+        if (n < 0) {
+            ParallelCompressionLogError("read");
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        AAHashContextUpdate(worker->ctx, worker->readBuffer, n);
+    }
+    AAHashContextFinal(worker->ctx, digests);
+    return 0;
+}
+
+/* Clear \p job->cacheable unless the identity of the open file is still \p job->key, the key used for the lookup */
+static void checkUnchanged(AADigestJob *job, int fd) {
+    AADigestCacheKey key;
+    job->cacheable = job->cacheable && AADigestCacheKeyInitWithFD(&key, fd) == 0 &&
+                     memcmp(&key, &job->key, sizeof(key)) == 0;
+}
+
+static int digestWorkerProc(void *worker_data, void *item) {
+    AADigestWorker worker = worker_data;
+    AADigestBatch batch = item;
+    const uint8_t *smallData[AA_DIGEST_BATCH_SIZE];
+    size_t smallSizes[AA_DIGEST_BATCH_SIZE];
+    int smallJobs[AA_DIGEST_BATCH_SIZE];
+    AADigests smallDigests[AA_DIGEST_BATCH_SIZE];
+    int smallCount = 0;
+    for (int i = 0; i < batch->count; i++) {
+        AADigestJob *job = &batch->jobs[i];
+        AADigestCache cache = worker->engine->cache;
+        job->status = 0;
+        job->cacheable = cache && AADigestCacheKeyInitWithPath(&job->key, job->path) == 0;
+        if (job->cacheable && AADigestCacheLookup(cache, &job->key, worker->engine->functions, &job->digests)) {
+            /* unchanged since last hashed, don't read it */
+            job->digests.functions = worker->engine->functions;
+            continue;
+        }
+        int fd = open(job->path, O_RDONLY);
+        if (fd < 0) {
+            ParallelCompressionLogError("open: %s");
+            job->status = -1;
+            continue;
+        }
+        /* the file inserted must be the one looked up, not a symlink target or a replacement */
+        checkUnchanged(job, fd);
+        /* read one byte past the small file limit, to tell small files from large ones */
+        uint8_t *slot = worker->smallFiles + (size_t)i * (AA_DIGEST_SMALL_FILE_SIZE + 1);
+        ssize_t n = readFile(fd, slot, AA_DIGEST_SMALL_FILE_SIZE + 1);
+        if (n < 0) {
+            ParallelCompressionLogError("read");
+            job->status = -1;
+        } else if (n <= AA_DIGEST_SMALL_FILE_SIZE) {
+            smallData[smallCount] = slot;
+            smallSizes[smallCount] = n;
+            smallJobs[smallCount] = i;
+            smallCount++;
+        } else {
+            /* large file, streamed after the bytes already read */
+            job->status = hashLargeFile(worker, fd, slot, n, &job->digests);
+        }
+        checkUnchanged(job, fd);
+        close(fd);
+    }
+    if (smallCount && AAHashBuffers(worker->engine->functions, smallCount, smallData, smallSizes, smallDigests) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < smallCount; i++) {
+        batch->jobs[smallJobs[i]].digests = smallDigests[i];
+    }
+    for (int i = 0; i < batch->count; i++) {
+        AADigestJob *job = &batch->jobs[i];
+        if (job->cacheable && job->status == 0) {
+            AADigestCacheInsert(worker->engine->cache, &job->key, &job->digests);
+        }
+    }
+    return 0;
+}
+
+#pragma mark - Engine
+
+/* Deliver the results of the oldest batch in flight */
+static int retireBatch(AADigestEngine engine) {
+    int status = 0;
+    AADigestBatch batch = ThreadPipelineRetireItem(engine->pipeline, &status);
+    if (!batch) {
+        return -1;
+    }
+    for (int i = 0; i < batch->count; i++) {
+        AADigestJob *job = &batch->jobs[i];
+        if (!engine->stopped) {
+            int jobStatus = (status < 0) ? status : job->status;
+            if (engine->proc(engine->arg, job->entryId, jobStatus, &job->digests) < 0) {
+                engine->stopped = 1;
+            }
+        }
+        free(job->path);
+        job->path = 0;
+    }
+    batch->count = 0;
+    ThreadPipelineReleaseItem(engine->pipeline, batch);
+    return engine->stopped ? -1 : 0;
+}
+
+static int submitCurrent(AADigestEngine engine) {
+    AADigestBatch batch = engine->current;
+    engine->current = 0;
+    return ThreadPipelineSubmitItem(engine->pipeline, batch);
+}
+
+void AADigestEngineSetCache(AADigestEngine engine, AADigestCache cache) {
+    engine->cache = cache;
+}
+
+int AADigestEngineSubmitPath(AADigestEngine engine, const char *path, uint64_t entry_id) {
+    if (engine->stopped) {
+        return -1;
+    }
+    if (!engine->current) {
+        /* all batches in flight, the submitter is the only one retiring them */
+        while (ThreadPipelineInFlight(engine->pipeline) >= engine->nItems) {
+            if (retireBatch(engine) < 0) {
+                return -1;
+            }
+        }
+        engine->current = ThreadPipelineAcquireItem(engine->pipeline);
+        if (!engine->current) {
+            return -1;
+        }
+        engine->current->count = 0;
+    }
+    AADigestJob *job = &engine->current->jobs[engine->current->count];
+    job->path = strdup(path);
+    if (!job->path) {
+        ParallelCompressionLogError("malloc");
+        return -1;
+    }
+    job->entryId = entry_id;
+    engine->current->count++;
+    if (engine->current->count == AA_DIGEST_BATCH_SIZE) {
+        return submitCurrent(engine);
+    }
+    return 0;
+}
+
+int AADigestEngineFlush(AADigestEngine engine) {
+    int result = 0;
+    /* an empty batch is submitted too, acquired items must go through the pipeline */
+    if (engine->current && submitCurrent(engine) < 0) {
+        result = -1;
+    }
+    while (ThreadPipelineInFlight(engine->pipeline) > 0) {
+        if (retireBatch(engine) < 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+void AADigestEngineDestroy(AADigestEngine engine) {
+    if (!engine) {
+        return;
+    }
+    ThreadPipelineDestroy(engine->pipeline);
+    if (engine->batches) {
+        for (int i = 0; i < engine->nItems; i++) {
+            for (int j = 0; j < engine->batches[i].count; j++) {
+                free(engine->batches[i].jobs[j].path);
+            }
+        }
+        free(engine->batches);
+    }
+    if (engine->workers) {
+        for (int i = 0; i < engine->nThreads; i++) {
+            free(engine->workers[i].smallFiles);
+            free(engine->workers[i].readBuffer);
+            AAHashContextDestroy(engine->workers[i].ctx);
+        }
+        free(engine->workers);
+    }
+    AAMemoryBudgetRelease(engine->budget, engine->reserved);
+    free(engine);
+}
+
+AADigestEngine AADigestEngineCreate(uint32_t functions, int n_threads, AADigestEngineResultProc proc, void *arg, AAMemoryBudget budget) {
+    AADigestEngine engine = calloc(1, sizeof(struct AADigestEngine_impl));
+    if (!engine) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    engine->functions = functions;
+    engine->proc = proc;
+    engine->arg = arg;
+    engine->budget = budget;
+    engine->nThreads = n_threads > 0 ? n_threads : (int)getDefaultNThreads();
+    engine->nThreads = AAMemoryBudgetAcquireItems(budget, AA_DIGEST_WORKER_SIZE, engine->nThreads);
+    if (engine->nThreads < 0) {
+        ParallelCompressionLogError("memory budget exhausted");
+        free(engine);
+        return 0;
+    }
+    engine->reserved = (size_t)engine->nThreads * AA_DIGEST_WORKER_SIZE;
+    engine->nItems = engine->nThreads * AA_DIGEST_BATCHES_PER_THREAD;
+    engine->batches = calloc(engine->nItems, sizeof(struct AADigestBatch_impl));
+    engine->workers = calloc(engine->nThreads, sizeof(struct AADigestWorker_impl));
+    void **workerData = calloc(engine->nThreads, sizeof(void *));
+    void **items = calloc(engine->nItems, sizeof(void *));
+    int ok = engine->batches && engine->workers && workerData && items;
+    for (int i = 0; ok && i < engine->nThreads; i++) {
+        AADigestWorker worker = &engine->workers[i];
+        worker->engine = engine;
+        worker->smallFiles = malloc((size_t)AA_DIGEST_BATCH_SIZE * (AA_DIGEST_SMALL_FILE_SIZE + 1));
+        worker->readBuffer = malloc(AA_DIGEST_READ_SIZE);
+        worker->ctx = AAHashContextCreate(functions);
+        ok = worker->smallFiles && worker->readBuffer && worker->ctx;
+        workerData[i] = worker;
+    }
+    for (int i = 0; ok && i < engine->nItems; i++) {
+        items[i] = &engine->batches[i];
+    }
+    if (ok) {
+        engine->pipeline = ThreadPipelineCreate(engine->nThreads, engine->nItems, digestWorkerProc, workerData, items);
+        ok = (engine->pipeline != 0);
+    }
+    free(workerData);
+    free(items);
+    if (!ok) {
+        ParallelCompressionLogError("digest engine setup failed");
+        AADigestEngineDestroy(engine);
+        return 0;
+    }
+    return engine;
+}
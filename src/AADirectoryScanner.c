@@ -0,0 +1,628 @@
+//
+//  AADirectoryScanner.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#define SCAN_GETDENTS64 1
+#else
+#define SCAN_GETDENTS64 0
+#endif
+
+#define SCAN_OUTPUT_CAPACITY 4096 /* paths found and not yet returned */
+#define SCAN_DIRENT_BUFFER_SIZE (32 << 10)
+
+/* Open directory, kept open while children are queued, so they can be opened with openat */
+typedef struct {
+    int fd;
+    int refCount;
+} ScanDir;
+
+typedef struct {
+    ScanDir *parent; /* NULL for the root */
+    char *path; /* relative to the root */
+    const char *name; /* last component of path */
+} ScanTask;
+
+/* Owner pushes and pops at the end, thieves take from the start */
+typedef struct {
+    pthread_mutex_t lock;
+    ScanTask *tasks;
+    size_t start;
+    size_t end;
+    size_t capacity;
+} ScanDeque;
+
+typedef struct {
+    char *path;
+    uint32_t type;
+} ScanOutput;
+
+struct AADirectoryScanner_impl;
+
+typedef struct {
+    struct AADirectoryScanner_impl *scanner;
+    int index;
+    pthread_t thread;
+    int threadStarted;
+    ScanDeque deque;
+    uint8_t *direntBuffer;
+} ScanWorker;
+
+struct AADirectoryScanner_impl {
+    char *root;
+    dev_t rootDev;
+    AAFlagSet flags;
+    AAPathMatcher matcher; /* NULL to return all paths */
+    void *msgData;
+    AAEntryMessageProc msgProc;
+    pthread_mutex_t msgLock; /* serializes msgProc calls */
+
+    int nThreads;
+    ScanWorker *workers;
+
+    /* idle workers */
+    pthread_mutex_t workLock;
+    pthread_cond_t workCond;
+    int idleCount;
+    size_t queuedCount; /* tasks in all deques */
+    size_t pendingCount; /* tasks queued or running */
+    int stop;
+
+    /* paths found, consumed by AADirectoryScannerNext */
+    pthread_mutex_t outputLock;
+    pthread_cond_t outputNotEmpty;
+    pthread_cond_t outputNotFull;
+    ScanOutput output[SCAN_OUTPUT_CAPACITY];
+    size_t outputStart;
+    size_t outputCount;
+    int done;
+    int status;
+};
+
+typedef struct AADirectoryScanner_impl * Scanner;
+
+#pragma mark - Control
+
+/* Stop all workers, and wake up everyone waiting */
+static void scannerStop(Scanner s, int status) {
+    pthread_mutex_lock(&s->outputLock);
+    if (status < 0 && s->status == 0) {
+        s->status = status;
+    }
+    pthread_cond_broadcast(&s->outputNotFull);
+    pthread_cond_broadcast(&s->outputNotEmpty);
+    pthread_mutex_unlock(&s->outputLock);
+    pthread_mutex_lock(&s->workLock);
+    __atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&s->workCond);
+    pthread_mutex_unlock(&s->workLock);
+}
+
+static int scannerStopped(Scanner s) {
+    return __atomic_load_n(&s->stop, __ATOMIC_ACQUIRE);
+}
+
+/* Send \p message for \p path, a negative return value stops the scan */
+static int scannerMessage(Scanner s, AAEntryMessage message, const char *path) {
+    if (!s->msgProc) {
+        return 0;
+    }
+    pthread_mutex_lock(&s->msgLock);
+    int r = s->msgProc(s->msgData, message, path, 0);
+    pthread_mutex_unlock(&s->msgLock);
+    if (r < 0) {
+        ParallelCompressionLogError("scan aborted by client");
+        scannerStop(s, r);
+    }
+    return r;
+}
+
+/* Queue a path for AADirectoryScannerNext, takes ownership of \p path */
+static int scannerEmit(Scanner s, char *path, uint32_t type) {
+    pthread_mutex_lock(&s->outputLock);
+    while (s->outputCount == SCAN_OUTPUT_CAPACITY && !scannerStopped(s)) {
+        pthread_cond_wait(&s->outputNotFull, &s->outputLock);
+    }
+    if (scannerStopped(s)) {
+        pthread_mutex_unlock(&s->outputLock);
+        free(path);
+        return -1;
+    }
+    ScanOutput *o = &s->output[(s->outputStart + s->outputCount) % SCAN_OUTPUT_CAPACITY];
+    o->path = path;
+    o->type = type;
+    s->outputCount++;
+    pthread_cond_signal(&s->outputNotEmpty);
+    pthread_mutex_unlock(&s->outputLock);
+    return 0;
+}
+
+#pragma mark - Work stealing
+
+static void scanDirRelease(ScanDir *d) {
+    if (d && __atomic_sub_fetch(&d->refCount, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(d->fd);
+        free(d);
+    }
+}
+
+static int dequePush(ScanDeque *q, ScanTask task) {
+    pthread_mutex_lock(&q->lock);
+    if (q->end == q->capacity) {
+        if (q->start > 0) {
+            memmove(q->tasks, q->tasks + q->start, (q->end - q->start) * sizeof(ScanTask));
+            q->end -= q->start;
+            q->start = 0;
+        } else {
+            size_t capacity = q->capacity ? 2 * q->capacity : 64;
+            ScanTask *tasks = realloc(q->tasks, capacity * sizeof(ScanTask));
+            if (!tasks) {
+                pthread_mutex_unlock(&q->lock);
+                ParallelCompressionLogError("malloc");
+                return -1;
+            }
+            q->tasks = tasks;
+            q->capacity = capacity;
+        }
+    }
+    q->tasks[q->end++] = task;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/* Pop from the end (owner), or take from the start (thief) */
+static int dequeTake(ScanDeque *q, int steal, ScanTask *task) {
+    int ok = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->start < q->end) {
+        *task = steal ? q->tasks[q->start++] : q->tasks[--q->end];
+        if (q->start == q->end) {
+            q->start = q->end = 0;
+        }
+        ok = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+static int scannerPush(ScanWorker *w, ScanTask task) {
+    Scanner s = w->scanner;
+    __atomic_add_fetch(&s->pendingCount, 1, __ATOMIC_SEQ_CST);
+    if (dequePush(&w->deque, task) < 0) {
+        __atomic_sub_fetch(&s->pendingCount, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    __atomic_add_fetch(&s->queuedCount, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->idleCount, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&s->workLock);
+        pthread_cond_signal(&s->workCond);
+        pthread_mutex_unlock(&s->workLock);
+    }
+    return 0;
+}
+
+/* Get a task from our deque, or steal one. Returns 0 when the scan is done. */
+static int scannerTake(ScanWorker *w, ScanTask *task) {
+    Scanner s = w->scanner;
+    while (!scannerStopped(s)) {
+        if (dequeTake(&w->deque, 0, task)) {
+            __atomic_sub_fetch(&s->queuedCount, 1, __ATOMIC_SEQ_CST);
+            return 1;
+        }
+        for (int i = 1; i < s->nThreads; i++) {
+            ScanWorker *victim = &s->workers[(w->index + i) % s->nThreads];
+            if (dequeTake(&victim->deque, 1, task)) {
+                __atomic_sub_fetch(&s->queuedCount, 1, __ATOMIC_SEQ_CST);
+                return 1;
+            }
+        }
+        pthread_mutex_lock(&s->workLock);
+        __atomic_add_fetch(&s->idleCount, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&s->queuedCount, __ATOMIC_SEQ_CST) == 0 &&
+               __atomic_load_n(&s->pendingCount, __ATOMIC_SEQ_CST) > 0 && !s->stop) {
+            pthread_cond_wait(&s->workCond, &s->workLock);
+        }
+        __atomic_sub_fetch(&s->idleCount, 1, __ATOMIC_SEQ_CST);
+        int finished = (__atomic_load_n(&s->pendingCount, __ATOMIC_SEQ_CST) == 0);
+        pthread_mutex_unlock(&s->workLock);
+        if (finished) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static void scannerTaskDone(Scanner s) {
+    if (__atomic_sub_fetch(&s->pendingCount, 1, __ATOMIC_SEQ_CST) > 0) {
+        return;
+    }
+    /* last task: the scan is complete */
+    pthread_mutex_lock(&s->workLock);
+    pthread_cond_broadcast(&s->workCond);
+    pthread_mutex_unlock(&s->workLock);
+    pthread_mutex_lock(&s->outputLock);
+    s->done = 1;
+    pthread_cond_broadcast(&s->outputNotEmpty);
+    pthread_mutex_unlock(&s->outputLock);
+}
+
+#pragma mark - Scan
+
+static uint32_t entryTypeWithMode(mode_t mode) {
+    switch (mode & S_IFMT) {
+        case S_IFREG: return AA_ENTRY_TYPE_REG;
+        case S_IFDIR: return AA_ENTRY_TYPE_DIR;
+        case S_IFLNK: return AA_ENTRY_TYPE_LNK;
+        case S_IFIFO: return AA_ENTRY_TYPE_FIFO;
+        case S_IFCHR: return AA_ENTRY_TYPE_CHR;
+        case S_IFBLK: return AA_ENTRY_TYPE_BLK;
+        case S_IFSOCK: return AA_ENTRY_TYPE_SOCK;
+        default: return 0;
+    }
+}
+
+static uint32_t entryTypeWithDirent(unsigned char d_type) {
+    switch (d_type) {
+        case DT_REG: return AA_ENTRY_TYPE_REG;
+        case DT_DIR: return AA_ENTRY_TYPE_DIR;
+        case DT_LNK: return AA_ENTRY_TYPE_LNK;
+        case DT_FIFO: return AA_ENTRY_TYPE_FIFO;
+        case DT_CHR: return AA_ENTRY_TYPE_CHR;
+        case DT_BLK: return AA_ENTRY_TYPE_BLK;
+        case DT_SOCK: return AA_ENTRY_TYPE_SOCK;
+        default: return 0; /* DT_UNKNOWN, use fstatat */
+    }
+}
+
+static char *joinPath(const char *a, const char *b) {
+    size_t na = strlen(a);
+    size_t nb = strlen(b);
+    char *p = malloc(na + nb + 2);
+    if (!p) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    if (na) {
+        memcpy(p, a, na);
+        p[na++] = '/';
+    }
+    memcpy(p + na, b, nb + 1);
+    return p;
+}
+
+/* Handle one entry of directory \p dir, returns a negative value to stop scanning the directory */
+static int scanEntry(ScanWorker *w, ScanDir *dir, const char *dirPath, const char *name, unsigned char d_type) {
+    Scanner s = w->scanner;
+    if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) {
+        return 0;
+    }
+    uint32_t type = entryTypeWithDirent(d_type);
+    if (type == 0) {
+        struct stat st;
+        if (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            return 0; /* removed since listed */
+        }
+        type = entryTypeWithMode(st.st_mode);
+    }
+    char *path = joinPath(dirPath, name);
+    if (!path) {
+        scannerStop(s, -1);
+        return -1;
+    }
+    int selected = 1;
+    if (s->matcher) {
+        int m = AAPathMatcherMatch(s->matcher, path, strlen(path));
+        if (m < 0) {
+            free(path);
+            scannerStop(s, -1);
+            return -1;
+        }
+        selected = (m & AA_PATH_MATCH_SELECTED) != 0;
+        if (!selected && !(type == AA_ENTRY_TYPE_DIR && (m & AA_PATH_MATCH_DESCEND))) {
+            free(path);
+            return 0;
+        }
+    }
+    int r = selected ? scannerMessage(s, AA_ENTRY_MESSAGE_SEARCH_EXCLUDE, path) : 0;
+    if (r != 0) {
+        free(path);
+        return r < 0 ? -1 : 0;
+    }
+    int descend = 0;
+    if (type == AA_ENTRY_TYPE_DIR) {
+        r = scannerMessage(s, AA_ENTRY_MESSAGE_SEARCH_PRUNE_DIR, path);
+        if (r < 0) {
+            free(path);
+            return -1;
+        }
+        descend = (r == 0);
+    }
+    ScanTask task = { 0 };
+    if (descend) {
+        task.path = strdup(path);
+        if (!task.path) {
+            ParallelCompressionLogError("malloc");
+            free(path);
+            scannerStop(s, -1);
+            return -1;
+        }
+        task.name = task.path + (strlen(task.path) - strlen(name));
+        task.parent = dir;
+    }
+    /* the directory is emitted before it is queued, so before its contents */
+    if (!selected) {
+        free(path); /* only scanned for its contents */
+    } else if (scannerEmit(s, path, type) < 0) {
+        free(task.path);
+        return -1;
+    }
+    if (descend) {
+        __atomic_add_fetch(&dir->refCount, 1, __ATOMIC_ACQ_REL);
+        if (scannerPush(w, task) < 0) {
+            scanDirRelease(dir);
+            free(task.path);
+            scannerStop(s, -1);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int openTaskDirectory(Scanner s, const ScanTask *task) {
+    int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    if (!task->parent) {
+        return open(s->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    int fd = openat(task->parent->fd, task->name, flags);
+    if (fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+        /* too many directories held open for queued children, use the full path */
+        char *fullPath = joinPath(s->root, task->path);
+        if (fullPath) {
+            fd = open(fullPath, flags);
+            free(fullPath);
+        }
+    }
+    return fd;
+}
+
+static void scanDirectory(ScanWorker *w, ScanTask *task) {
+    Scanner s = w->scanner;
+    int fd = openTaskDirectory(s, task);
+    scanDirRelease(task->parent);
+    if (fd < 0) {
+        if (scannerMessage(s, AA_ENTRY_MESSAGE_SEARCH_FAIL, task->path) > 0) {
+            ParallelCompressionLogError("open: %s");
+            scannerStop(s, -1);
+        }
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (task->parent && !(s->flags & AA_FLAG_CROSS_VOLUME_BOUNDARIES) && st.st_dev != s->rootDev)) {
+        /* mount point: returned, but not scanned */
+        close(fd);
+        return;
+    }
+    ScanDir *dir = malloc(sizeof(ScanDir));
+    if (!dir) {
+        ParallelCompressionLogError("malloc");
+        close(fd);
+        scannerStop(s, -1);
+        return;
+    }
+    dir->fd = fd;
+    dir->refCount = 1;
+    int failed = 0;
+#if SCAN_GETDENTS64
+    struct linuxDirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+    while (!scannerStopped(s)) {
+        long n = syscall(SYS_getdents64, fd, w->direntBuffer, SCAN_DIRENT_BUFFER_SIZE);
+        if (n < 0) {
+            failed = 1;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        for (long pos = 0; pos < n;) {
+            struct linuxDirent64 *e = (struct linuxDirent64 *)(w->direntBuffer + pos);
+            pos += e->d_reclen;
+            if (scanEntry(w, dir, task->path, e->d_name, e->d_type) < 0) {
+                break;
+            }
+        }
+    }
+#else
+    /* readdir on a duplicate, closedir closes it and dir->fd stays open for openat */
+    int dupFd = dup(fd);
+    DIR *d = (dupFd >= 0) ? fdopendir(dupFd) : 0;
+    if (!d) {
+        if (dupFd >= 0) {
+            close(dupFd);
+        }
+        failed = 1;
+    } else {
+        struct dirent *e;
+        while (!scannerStopped(s) && (e = readdir(d)) != 0) {
+            if (scanEntry(w, dir, task->path, e->d_name, e->d_type) < 0) {
+                break;
+            }
+        }
+        closedir(d);
+    }
+#endif
+    if (failed && scannerMessage(s, AA_ENTRY_MESSAGE_SEARCH_FAIL, task->path) > 0) {
+        ParallelCompressionLogError("readdir: %s");
+        scannerStop(s, -1);
+    }
+    scanDirRelease(dir);
+}
+
+static void *scanWorkerProc(void *arg) {
+    ScanWorker *w = arg;
+    ScanTask task;
+    while (scannerTake(w, &task)) {
+        if (!scannerStopped(w->scanner)) {
+            scanDirectory(w, &task);
+        } else {
+            scanDirRelease(task.parent);
+        }
+        free(task.path);
+        scannerTaskDone(w->scanner);
+    }
+    return 0;
+}
+
+#pragma mark - API
+
+AADirectoryScanner AADirectoryScannerOpen(const char *dir, void *msg_data, AAEntryMessageProc msg_proc, AAFlagSet flags, int n_threads) {
+    return AADirectoryScannerOpenWithPathMatcher(dir, 0, msg_data, msg_proc, flags, n_threads);
+}
+
+AADirectoryScanner AADirectoryScannerOpenWithPathMatcher(const char *dir, AAPathMatcher matcher, void *msg_data, AAEntryMessageProc msg_proc, AAFlagSet flags, int n_threads) {
+    Scanner s = calloc(1, sizeof(struct AADirectoryScanner_impl));
+    if (!s) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    pthread_mutex_init(&s->msgLock, 0);
+    pthread_mutex_init(&s->workLock, 0);
+    pthread_cond_init(&s->workCond, 0);
+    pthread_mutex_init(&s->outputLock, 0);
+    pthread_cond_init(&s->outputNotEmpty, 0);
+    pthread_cond_init(&s->outputNotFull, 0);
+    s->flags = flags;
+    s->matcher = matcher;
+    s->msgData = msg_data;
+    s->msgProc = msg_proc;
+    s->nThreads = n_threads > 0 ? n_threads : (int)getDefaultNThreads();
+    s->root = strdup(dir);
+    s->workers = calloc(s->nThreads, sizeof(ScanWorker));
+    if (!s->root || !s->workers) {
+        ParallelCompressionLogError("malloc");
+        goto ERROR;
+    }
+    struct stat st;
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        ParallelCompressionLogError("not a directory: %s");
+        goto ERROR;
+    }
+    s->rootDev = st.st_dev;
+    for (int i = 0; i < s->nThreads; i++) {
+        ScanWorker *w = &s->workers[i];
+        w->scanner = s;
+        w->index = i;
+        pthread_mutex_init(&w->deque.lock, 0);
+        w->direntBuffer = malloc(SCAN_DIRENT_BUFFER_SIZE);
+        if (!w->direntBuffer) {
+            ParallelCompressionLogError("malloc");
+            goto ERROR;
+        }
+    }
+    /* the root, then its contents */
+    char *rootPath = strdup("");
+    ScanTask root = { 0, strdup(""), 0 };
+    root.name = root.path;
+    if (!rootPath || !root.path || scannerEmit(s, rootPath, AA_ENTRY_TYPE_DIR) < 0 || scannerPush(&s->workers[0], root) < 0) {
+        ParallelCompressionLogError("malloc");
+        free(root.path);
+        goto ERROR;
+    }
+    for (int i = 0; i < s->nThreads; i++) {
+        if (pthread_create(&s->workers[i].thread, 0, scanWorkerProc, &s->workers[i]) != 0) {
+            ParallelCompressionLogError("pthread_create");
+            goto ERROR;
+        }
+        s->workers[i].threadStarted = 1;
+    }
+    return s;
+
+ERROR:
+    AADirectoryScannerClose(s);
+    return 0;
+}
+
+int AADirectoryScannerNext(AADirectoryScanner scanner, size_t capacity, char *path, uint32_t *type) {
+    Scanner s = scanner;
+    pthread_mutex_lock(&s->outputLock);
+    while (s->outputCount == 0 && !s->done && s->status == 0 && !scannerStopped(s)) {
+        pthread_cond_wait(&s->outputNotEmpty, &s->outputLock);
+    }
+    int result = 0;
+    if (s->status < 0) {
+        result = s->status;
+    } else if (s->outputCount > 0) {
+        ScanOutput *o = &s->output[s->outputStart];
+        size_t n = strlen(o->path);
+        if (n + 1 > capacity) {
+            ParallelCompressionLogError("path too long");
+            result = -1;
+        } else {
+            memcpy(path, o->path, n + 1);
+            *type = o->type;
+            free(o->path);
+            s->outputStart = (s->outputStart + 1) % SCAN_OUTPUT_CAPACITY;
+            s->outputCount--;
+            pthread_cond_signal(&s->outputNotFull);
+            result = 1;
+        }
+    } else if (!s->done) {
+        result = -1; /* stopped */
+    }
+    pthread_mutex_unlock(&s->outputLock);
+    return result;
+}
+
+void AADirectoryScannerClose(AADirectoryScanner scanner) {
+    Scanner s = scanner;
+    if (!s) {
+        return;
+    }
+    scannerStop(s, 0);
+    if (s->workers) {
+        for (int i = 0; i < s->nThreads; i++) {
+            if (s->workers[i].threadStarted) {
+                pthread_join(s->workers[i].thread, 0);
+            }
+        }
+        ScanTask task;
+        for (int i = 0; i < s->nThreads; i++) {
+            ScanWorker *w = &s->workers[i];
+            while (dequeTake(&w->deque, 0, &task)) {
+                scanDirRelease(task.parent);
+                free(task.path);
+            }
+            free(w->deque.tasks);
+            free(w->direntBuffer);
+            pthread_mutex_destroy(&w->deque.lock);
+        }
+        free(s->workers);
+    }
+    for (size_t i = 0; i < s->outputCount; i++) {
+        free(s->output[(s->outputStart + i) % SCAN_OUTPUT_CAPACITY].path);
+    }
+    pthread_cond_destroy(&s->outputNotFull);
+    pthread_cond_destroy(&s->outputNotEmpty);
+    pthread_mutex_destroy(&s->outputLock);
+    pthread_cond_destroy(&s->workCond);
+    pthread_mutex_destroy(&s->workLock);
+    pthread_mutex_destroy(&s->msgLock);
+    free(s->root);
+    free(s);
+}
@@ -0,0 +1,106 @@
+// AppleArchive directory scanner
+
+#pragma once
+
+#ifndef __APPLE_ARCHIVE_H
+#error Include AppleArchive.h instead of this file
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull begin")
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma mark - Directory scanner
+
+/*!
+  @abstract Parallel directory tree scanner
+
+  @discussion
+  Worker threads read directories with openat and getdents64 (readdir where not available), each worker
+  descending depth first in its own queue of directories, and stealing the oldest queued directories of other
+  workers when idle. Paths are streamed to the client as they are found, while the scan is still running,
+  in a non predictable order, except that a directory is always returned before its contents.
+*/
+typedef struct AADirectoryScanner_impl * AADirectoryScanner APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Start scanning a directory tree
+
+  @discussion
+  \p msg_proc receives SEARCH_EXCLUDE for each entry, SEARCH_PRUNE_DIR for each directory not excluded, and
+  SEARCH_FAIL when a directory can't be read. Calls are serialized, but come from the worker threads.
+  Subdirectories on another volume are returned but not scanned, unless \p flags contains
+  AA_FLAG_CROSS_VOLUME_BOUNDARIES.
+
+  @param dir directory to scan, returned first as ""
+  @param msg_data is passed as first argument to \p msg_proc
+  @param msg_proc is called with queries to the caller if not NULL
+  @param flags scan flags
+  @param n_threads is the number of worker threads, or 0 for default
+
+  @return a new scanner on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AADirectoryScanner _Nullable AADirectoryScannerOpen(
+  const char * dir,
+  void * _Nullable msg_data,
+  AAEntryMessageProc _Nullable msg_proc,
+  AAFlagSet flags,
+  int n_threads);
+
+/*!
+  @abstract Start scanning a directory tree, returning only the paths selected by a path matcher
+
+  @discussion
+  Same as AADirectoryScannerOpen, except that paths not selected by \p matcher are not returned, and don't
+  receive SEARCH_EXCLUDE. Directories not selected are still scanned if \p matcher can select some of their
+  contents (AA_PATH_MATCH_DESCEND), and skipped otherwise, so excluded subtrees are never read.
+  \p matcher must remain valid until the scanner is closed.
+
+  @param dir directory to scan, returned first as ""
+  @param matcher path matcher, or NULL to return all paths
+  @param msg_data is passed as first argument to \p msg_proc
+  @param msg_proc is called with queries to the caller if not NULL
+  @param flags scan flags
+  @param n_threads is the number of worker threads, or 0 for default
+
+  @return a new scanner on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AADirectoryScanner _Nullable AADirectoryScannerOpenWithPathMatcher(
+  const char * dir,
+  AAPathMatcher _Nullable matcher,
+  void * _Nullable msg_data,
+  AAEntryMessageProc _Nullable msg_proc,
+  AAFlagSet flags,
+  int n_threads);
+
+/*!
+  @abstract Get the next path found, blocking until one is available or the scan is done
+
+  @param scanner target scanner
+  @param capacity number of bytes in \p path
+  @param path receives the 0-terminated path, relative to the scanned directory
+  @param type receives the entry type, one of AA_ENTRY_TYPE_*
+
+  @return 1 if a path was returned, 0 at the end of the scan, and a negative error code on failure,
+  if the scan failed or was aborted by the callback, or if \p capacity is too small
+*/
+APPLE_ARCHIVE_API int AADirectoryScannerNext(AADirectoryScanner scanner, size_t capacity, char * path, uint32_t * type);
+
+/*!
+  @abstract Stop the scan if still running, and destroy the scanner
+
+  @param scanner target scanner, do nothing if NULL
+*/
+APPLE_ARCHIVE_API void AADirectoryScannerClose(AADirectoryScanner _Nullable scanner);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull end")
+#endif
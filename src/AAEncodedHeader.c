@@ -0,0 +1,236 @@
+//
+//  AAEncodedHeader.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "AAEncodedHeader.h"
+
+static uint64_t loadLE(const uint8_t *p, size_t n) {
+    uint64_t x = 0;
+    for (size_t i = 0; i < n; i++) {
+        x |= (uint64_t)p[i] << (8 * i);
+    }
+    return x;
+}
+
+#pragma mark - Decoding
+
+int aaEncodedHeaderSize(const uint8_t *data) {
+    if (memcmp(data, "AA01", 4) != 0 && memcmp(data, "YAA1", 4) != 0) {
+        return -1;
+    }
+    int size = (int)loadLE(data + 4, 2);
+    if (size < AA_ENCODED_HEADER_MIN_SIZE) {
+        return -1;
+    }
+    return size;
+}
+
+int aaEncodedHeaderNextField(const uint8_t *header, size_t size, size_t *pos, uint64_t *blob_offset, AAEncodedField *field) {
+    if (*pos == 0) {
+        *pos = AA_ENCODED_HEADER_MIN_SIZE;
+    }
+    size_t p = *pos;
+    if (p == size) {
+        return 0;
+    }
+    if (p + 4 > size) {
+        ParallelCompressionLogError("truncated header");
+        return -1;
+    }
+    memcpy(field->key, header + p, 3);
+    field->key[3] = 0;
+    field->subtype = (char)header[p + 3];
+    field->offset = p;
+    field->uintValue = 0;
+    field->blobOffset = 0;
+    size_t n;
+    switch (field->subtype) {
+        case '*': n = 0; field->type = AA_FIELD_TYPE_FLAG; break;
+        case '1': n = 1; field->type = AA_FIELD_TYPE_UINT; break;
+        case '2': n = 2; field->type = AA_FIELD_TYPE_UINT; break;
+        case '4': n = 4; field->type = AA_FIELD_TYPE_UINT; break;
+        case '8': n = 8; field->type = AA_FIELD_TYPE_UINT; break;
+        case 'A': n = 2; field->type = AA_FIELD_TYPE_BLOB; break;
+        case 'B': n = 4; field->type = AA_FIELD_TYPE_BLOB; break;
+        case 'C': n = 8; field->type = AA_FIELD_TYPE_BLOB; break;
+        case 'F': n = 4; field->type = AA_FIELD_TYPE_HASH; break;
+        case 'G': n = 20; field->type = AA_FIELD_TYPE_HASH; break;
+        case 'H': n = 32; field->type = AA_FIELD_TYPE_HASH; break;
+        case 'I': n = 48; field->type = AA_FIELD_TYPE_HASH; break;
+        case 'J': n = 64; field->type = AA_FIELD_TYPE_HASH; break;
+        case 'S': n = 8; field->type = AA_FIELD_TYPE_TIMESPEC; break;
+        case 'T': n = 12; field->type = AA_FIELD_TYPE_TIMESPEC; break;
+        case 'P':
+            if (p + 6 > size) {
+                ParallelCompressionLogError("truncated header");
+                return -1;
+            }
+            n = (size_t)loadLE(header + p + 4, 2);
+            if (p + 6 + n > size) {
+                ParallelCompressionLogError("truncated header");
+                return -1;
+            }
+            field->type = AA_FIELD_TYPE_STRING;
+            field->value = header + p + 6;
+            field->valueSize = n;
+            field->uintValue = n;
+            field->size = 6 + n;
+            *pos = p + field->size;
+            return 1;
+        default:
+            ParallelCompressionLogError("invalid field subtype: %d");
+            return -1;
+    }
+    if (p + 4 + n > size) {
+        ParallelCompressionLogError("truncated header");
+        return -1;
+    }
+    field->value = header + p + 4;
+    field->valueSize = n;
+    field->size = 4 + n;
+    if (field->type == AA_FIELD_TYPE_UINT || field->type == AA_FIELD_TYPE_BLOB) {
+        field->uintValue = loadLE(field->value, n);
+    }
+    if (field->type == AA_FIELD_TYPE_BLOB) {
+        field->blobOffset = *blob_offset;
+        *blob_offset += field->uintValue;
+    }
+    *pos = p + field->size;
+    return 1;
+}
+
+int aaEncodedHeaderFindField(const uint8_t *header, size_t size, const char *key, AAEncodedField *field) {
+    size_t pos = 0;
+    uint64_t blobOffset = 0;
+    int r;
+    while ((r = aaEncodedHeaderNextField(header, size, &pos, &blobOffset, field)) > 0) {
+        if (memcmp(field->key, key, 3) == 0) {
+            return 1;
+        }
+    }
+    return r;
+}
+
+int64_t aaEncodedHeaderPayloadSize(const uint8_t *header, size_t size) {
+    size_t pos = 0;
+    uint64_t blobOffset = 0;
+    AAEncodedField field;
+    int r;
+    while ((r = aaEncodedHeaderNextField(header, size, &pos, &blobOffset, &field)) > 0)
+        ;
+    return (r < 0) ? -1 : (int64_t)blobOffset;
+}
+
+int aaEncodedHeaderGetUInt(const uint8_t *header, size_t size, const char *key, uint64_t *value) {
+    AAEncodedField field;
+    int r = aaEncodedHeaderFindField(header, size, key, &field);
+    if (r <= 0) {
+        return r;
+    }
+    if (field.type != AA_FIELD_TYPE_UINT) {
+        return 0;
+    }
+    *value = field.uintValue;
+    return 1;
+}
+
+int aaEncodedHeaderGetString(const uint8_t *header, size_t size, const char *key, size_t capacity, char *value) {
+    AAEncodedField field;
+    int r = aaEncodedHeaderFindField(header, size, key, &field);
+    if (r <= 0) {
+        return r;
+    }
+    if (field.type != AA_FIELD_TYPE_STRING || field.valueSize >= capacity) {
+        return 0;
+    }
+    memcpy(value, field.value, field.valueSize);
+    value[field.valueSize] = 0;
+    return 1;
+}
+
+#pragma mark - Encoding
+
+static void builderAppend(AAEncodedHeaderBuilder *b, const void *data, size_t size) {
+    if (b->size + size > AA_ENCODED_HEADER_MAX_SIZE) {
+        b->overflow = 1;
+        return;
+    }
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+static void builderKey(AAEncodedHeaderBuilder *b, const char *key, char subtype) {
+    uint8_t k[4] = { (uint8_t)key[0], (uint8_t)key[1], (uint8_t)key[2], (uint8_t)subtype };
+    builderAppend(b, k, 4);
+}
+
+static void builderLE(AAEncodedHeaderBuilder *b, uint64_t x, size_t size) {
+    uint8_t v[8];
+    for (size_t i = 0; i < size; i++) {
+        v[i] = (uint8_t)(x >> (8 * i));
+    }
+    builderAppend(b, v, size);
+}
+
+void aaEncodedHeaderBuilderInit(AAEncodedHeaderBuilder *b) {
+    b->size = 0;
+    b->overflow = 0;
+    builderAppend(b, "AA01", 4);
+    builderLE(b, 0, 2); /* set by Finish */
+}
+
+void aaEncodedHeaderBuilderAppendFlag(AAEncodedHeaderBuilder *b, const char *key) {
+    builderKey(b, key, '*');
+}
+
+/* Smallest of the 1, 2, 4, 8 byte encodings */
+void aaEncodedHeaderBuilderAppendUInt(AAEncodedHeaderBuilder *b, const char *key, uint64_t value) {
+    size_t size = (value <= 0xff) ? 1 : (value <= 0xffff) ? 2 : (value <= 0xffffffffULL) ? 4 : 8;
+    builderKey(b, key, (char)('0' + size));
+    builderLE(b, value, size);
+}
+
+void aaEncodedHeaderBuilderAppendString(AAEncodedHeaderBuilder *b, const char *key, const char *value, size_t length) {
+    if (length > 0xffff) {
+        b->overflow = 1;
+        return;
+    }
+    builderKey(b, key, 'P');
+    builderLE(b, length, 2);
+    builderAppend(b, value, length);
+}
+
+void aaEncodedHeaderBuilderAppendTimespec(AAEncodedHeaderBuilder *b, const char *key, struct timespec value) {
+    builderKey(b, key, 'T');
+    builderLE(b, (uint64_t)value.tv_sec, 8);
+    builderLE(b, (uint64_t)value.tv_nsec, 4);
+}
+
+void aaEncodedHeaderBuilderAppendBlob(AAEncodedHeaderBuilder *b, const char *key, uint64_t size) {
+    if (size <= 0xffff) {
+        builderKey(b, key, 'A');
+        builderLE(b, size, 2);
+    } else if (size <= 0xffffffffULL) {
+        builderKey(b, key, 'B');
+        builderLE(b, size, 4);
+    } else {
+        builderKey(b, key, 'C');
+        builderLE(b, size, 8);
+    }
+}
+
+void aaEncodedHeaderBuilderAppendField(AAEncodedHeaderBuilder *b, const uint8_t *header, const AAEncodedField *field) {
+    builderAppend(b, header + field->offset, field->size);
+}
+
+int aaEncodedHeaderBuilderFinish(AAEncodedHeaderBuilder *b) {
+    if (b->overflow) {
+        ParallelCompressionLogError("header too large");
+        return -1;
+    }
+    b->data[4] = (uint8_t)b->size;
+    b->data[5] = (uint8_t)(b->size >> 8);
+    return (int)b->size;
+}
@@ -0,0 +1,73 @@
+//
+//  AAEncodedHeader.h
+//  libAppleArchive
+//
+
+#ifndef AAEncodedHeader_h
+#define AAEncodedHeader_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Encoded archive headers: "AA01" or "YAA1", total size as 16-bit LE, then fields made of a
+ * 3 char key, a subtype char, and the value. Blob fields only store the blob size, the blobs
+ * follow the header in the order of their fields.
+ */
+
+#define AA_ENCODED_HEADER_MAX_SIZE 0xFFFF
+#define AA_ENCODED_HEADER_MIN_SIZE 6
+
+typedef struct {
+    char key[4]; /* 3 chars, 0-terminated */
+    char subtype;
+    int type; /* AA_FIELD_TYPE_* */
+    size_t offset; /* offset of the field in the header */
+    size_t size; /* encoded size of the field, key included */
+    const uint8_t *value; /* UINT, HASH, TIMESPEC value bytes, or STRING bytes */
+    size_t valueSize; /* number of bytes in value */
+    uint64_t uintValue; /* UINT value, or BLOB size */
+    uint64_t blobOffset; /* BLOB: offset of the blob in the payload following the header */
+} AAEncodedField;
+
+/* Size of the header starting with the 6 bytes at \p data, or -1 if the magic is invalid */
+int aaEncodedHeaderSize(const uint8_t *data);
+
+/*
+ * Decode the field at \p *pos, start with *pos = 0 and *blob_offset = 0.
+ * Returns 1 and advances \p *pos on success, 0 at the end of the header, and -1 if the header is invalid.
+ */
+int aaEncodedHeaderNextField(const uint8_t *header, size_t size, size_t *pos, uint64_t *blob_offset, AAEncodedField *field);
+
+/* Find field \p key. Returns 1 if found, 0 if not, and -1 if the header is invalid. */
+int aaEncodedHeaderFindField(const uint8_t *header, size_t size, const char *key, AAEncodedField *field);
+
+/* Total size of the blobs following the header, or -1 if the header is invalid */
+int64_t aaEncodedHeaderPayloadSize(const uint8_t *header, size_t size);
+
+/* Find field \p key and get its UINT value. Returns 1 if found, 0 if not or not a UINT, and -1 if the header is invalid. */
+int aaEncodedHeaderGetUInt(const uint8_t *header, size_t size, const char *key, uint64_t *value);
+
+/* Find field \p key and get its STRING value, 0-terminated. Returns 1 if found, 0 if not, or if \p capacity is too small. */
+int aaEncodedHeaderGetString(const uint8_t *header, size_t size, const char *key, size_t capacity, char *value);
+
+typedef struct {
+    uint8_t data[AA_ENCODED_HEADER_MAX_SIZE];
+    size_t size;
+    int overflow; /* a field didn't fit */
+} AAEncodedHeaderBuilder;
+
+void aaEncodedHeaderBuilderInit(AAEncodedHeaderBuilder *b);
+void aaEncodedHeaderBuilderAppendFlag(AAEncodedHeaderBuilder *b, const char *key);
+void aaEncodedHeaderBuilderAppendUInt(AAEncodedHeaderBuilder *b, const char *key, uint64_t value);
+void aaEncodedHeaderBuilderAppendString(AAEncodedHeaderBuilder *b, const char *key, const char *value, size_t length);
+void aaEncodedHeaderBuilderAppendTimespec(AAEncodedHeaderBuilder *b, const char *key, struct timespec value);
+void aaEncodedHeaderBuilderAppendBlob(AAEncodedHeaderBuilder *b, const char *key, uint64_t size);
+/* Copy a field decoded from another header */
+void aaEncodedHeaderBuilderAppendField(AAEncodedHeaderBuilder *b, const uint8_t *header, const AAEncodedField *field);
+/* Set the header size. Returns the header size, or -1 if a field didn't fit. */
+int aaEncodedHeaderBuilderFinish(AAEncodedHeaderBuilder *b);
+
+#endif /* AAEncodedHeader_h */
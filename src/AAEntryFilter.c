@@ -0,0 +1,242 @@
+//
+//  AAEntryFilter.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "AAEncodedHeader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILTER_MAX_PREDICATES 64 /* evaluated with 64-bit masks */
+
+typedef struct {
+    uint32_t key; /* ikey */
+    AAEntryFilterOp op;
+    uint64_t value;
+} FilterPredicate;
+
+struct AAEntryFilter_impl {
+    char **prefixes;
+    size_t prefixCount;
+    AAPathMatcher matcher; /* NULL if no pattern was added */
+    FilterPredicate predicates[FILTER_MAX_PREDICATES];
+    size_t predicateCount;
+    int keepAll;
+    uint32_t *keepKeys; /* sorted ikeys */
+    size_t keepCount;
+};
+
+static int appendString(char ***array, size_t *count, const char *s) {
+    char *copy = strdup(s);
+    char **a = realloc(*array, (*count + 1) * sizeof(char *));
+    if (!copy || !a) {
+        ParallelCompressionLogError("malloc");
+        free(copy);
+        if (a) {
+            *array = a;
+        }
+        return -1;
+    }
+    a[(*count)++] = copy;
+    *array = a;
+    return 0;
+}
+
+static int compareKeys(const void *a, const void *b) {
+    uint32_t ka = *(const uint32_t *)a;
+    uint32_t kb = *(const uint32_t *)b;
+    return (ka < kb) ? -1 : (ka > kb);
+}
+
+#pragma mark - API
+
+AAEntryFilter AAEntryFilterCreate(void) {
+    AAEntryFilter filter = calloc(1, sizeof(struct AAEntryFilter_impl));
+    if (!filter) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    filter->keepAll = 1;
+    return filter;
+}
+
+int AAEntryFilterAddPathPrefix(AAEntryFilter filter, const char *prefix) {
+    return appendString(&filter->prefixes, &filter->prefixCount, prefix);
+}
+
+static int addPattern(AAEntryFilter filter, const char *pattern, int exclude) {
+    if (!filter->matcher) {
+        filter->matcher = AAPathMatcherCreate();
+        if (!filter->matcher) {
+            return -1;
+        }
+    }
+    return AAPathMatcherAddPattern(filter->matcher, pattern, exclude);
+}
+
+int AAEntryFilterAddPathPattern(AAEntryFilter filter, const char *pattern) {
+    return addPattern(filter, pattern, 0);
+}
+
+int AAEntryFilterAddPathExcludePattern(AAEntryFilter filter, const char *pattern) {
+    return addPattern(filter, pattern, 1);
+}
+
+int AAEntryFilterAddFieldPredicate(AAEntryFilter filter, AAFieldKey key, AAEntryFilterOp op, uint64_t value) {
+    if (op > AA_ENTRY_FILTER_OP_ABSENT) {
+        ParallelCompressionLogError("invalid predicate");
+        return -1;
+    }
+    if (filter->predicateCount == FILTER_MAX_PREDICATES) {
+        ParallelCompressionLogError("too many predicates");
+        return -1;
+    }
+    FilterPredicate *pred = &filter->predicates[filter->predicateCount++];
+    pred->key = key.ikey;
+    pred->op = op;
+    pred->value = value;
+    return 0;
+}
+
+int AAEntryFilterSetKeySet(AAEntryFilter filter, AAFieldKeySet key_set) {
+    free(filter->keepKeys);
+    filter->keepKeys = 0;
+    filter->keepCount = 0;
+    filter->keepAll = (key_set == 0);
+    if (!key_set) {
+        return 0;
+    }
+    uint32_t n = AAFieldKeySetGetKeyCount(key_set);
+    filter->keepKeys = malloc((n > 0 ? n : 1) * sizeof(uint32_t));
+    if (!filter->keepKeys) {
+        ParallelCompressionLogError("malloc");
+        return -1;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        filter->keepKeys[i] = AAFieldKeySetGetKey(key_set, i).ikey;
+    }
+    filter->keepCount = n;
+    qsort(filter->keepKeys, n, sizeof(uint32_t), compareKeys);
+    return 0;
+}
+
+int AAEntryFilterKeepsField(AAEntryFilter filter, AAFieldKey key) {
+    if (filter->keepAll) {
+        return 1;
+    }
+    return bsearch(&key.ikey, filter->keepKeys, filter->keepCount, sizeof(uint32_t), compareKeys) != 0;
+}
+
+static int evalPredicate(const FilterPredicate *pred, const AAEncodedField *field) {
+    uint64_t x;
+    switch (pred->op) {
+        case AA_ENTRY_FILTER_OP_PRESENT: return 1;
+        case AA_ENTRY_FILTER_OP_ABSENT: return 0;
+        default: break;
+    }
+    if (field->type == AA_FIELD_TYPE_UINT) {
+        x = field->uintValue;
+    } else if (field->type == AA_FIELD_TYPE_TIMESPEC) {
+        x = 0;
+        for (int i = 0; i < 8; i++) {
+            x |= (uint64_t)field->value[i] << (8 * i); /* seconds */
+        }
+    } else {
+        return 0;
+    }
+    switch (pred->op) {
+        case AA_ENTRY_FILTER_OP_EQ: return x == pred->value;
+        case AA_ENTRY_FILTER_OP_NE: return x != pred->value;
+        case AA_ENTRY_FILTER_OP_LT: return x < pred->value;
+        case AA_ENTRY_FILTER_OP_LE: return x <= pred->value;
+        case AA_ENTRY_FILTER_OP_GT: return x > pred->value;
+        case AA_ENTRY_FILTER_OP_GE: return x >= pred->value;
+        default: return 0;
+    }
+}
+
+static int matchPath(AAEntryFilter filter, const char *path, size_t n) {
+    if (filter->prefixCount > 0) {
+        size_t i;
+        for (i = 0; i < filter->prefixCount; i++) {
+            size_t len = strlen(filter->prefixes[i]);
+            if (len <= n && memcmp(path, filter->prefixes[i], len) == 0) {
+                break;
+            }
+        }
+        if (i == filter->prefixCount) {
+            return 0;
+        }
+    }
+    if (filter->matcher) {
+        int m = AAPathMatcherMatch(filter->matcher, path, n);
+        if (m < 0) {
+            return -1;
+        }
+        if (!(m & AA_PATH_MATCH_SELECTED)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int AAEntryFilterMatch(AAEntryFilter filter, const uint8_t *header, size_t header_size) {
+    uint64_t found = 0;
+    uint64_t result = 0;
+    const char *path = 0;
+    size_t pathLength = 0;
+    AAEncodedField field;
+    size_t pos = 0;
+    uint64_t blobOffset = 0;
+    int status;
+    while ((status = aaEncodedHeaderNextField(header, header_size, &pos, &blobOffset, &field)) > 0) {
+        if (memcmp(field.key, "PAT", 3) == 0 && field.type == AA_FIELD_TYPE_STRING) {
+            path = (const char *)field.value;
+            pathLength = field.valueSize;
+        }
+        uint32_t key;
+        memcpy(&key, field.key, 4);
+        for (size_t i = 0; i < filter->predicateCount; i++) {
+            if (filter->predicates[i].key == key && !(found & (UINT64_C(1) << i))) {
+                found |= UINT64_C(1) << i;
+                if (evalPredicate(&filter->predicates[i], &field)) {
+                    result |= UINT64_C(1) << i;
+                }
+            }
+        }
+    }
+    if (status < 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < filter->predicateCount; i++) {
+        if (!(found & (UINT64_C(1) << i))) {
+            if (filter->predicates[i].op != AA_ENTRY_FILTER_OP_ABSENT) {
+                return 0;
+            }
+        } else if (!(result & (UINT64_C(1) << i))) {
+            return 0;
+        }
+    }
+    if (filter->prefixCount > 0 || filter->matcher) {
+        if (!path) {
+            return 0;
+        }
+        return matchPath(filter, path, pathLength);
+    }
+    return 1;
+}
+
+void AAEntryFilterDestroy(AAEntryFilter filter) {
+    if (!filter) {
+        return;
+    }
+    for (size_t i = 0; i < filter->prefixCount; i++) {
+        free(filter->prefixes[i]);
+    }
+    free(filter->prefixes);
+    AAPathMatcherDestroy(filter->matcher);
+    free(filter->keepKeys);
+    free(filter);
+}
@@ -0,0 +1,179 @@
+// AppleArchive entry filter
+
+#pragma once
+
+#ifndef __APPLE_ARCHIVE_H
+#error Include AppleArchive.h instead of this file
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull begin")
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma mark - Entry filter
+
+/*!
+  @abstract Selects archive entries and fields from the encoded header
+
+  @discussion
+  A filter is evaluated in one pass over the fields of an encoded header, so entries can be rejected by an
+  AAEntryReader before anything is copied out of the header, and their payload is skipped.
+  An entry matches the filter if all these conditions are true:
+  - its PAT starts with one of the path prefixes, if any was added
+  - its PAT is selected by the path patterns, if any was added (see AAPathMatcher)
+  - all the field predicates are true
+  The filter is not modified while it is used, and can be shared by several readers.
+*/
+typedef struct AAEntryFilter_impl * AAEntryFilter APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+// Entry filter predicate operators
+typedef uint32_t AAEntryFilterOp APPLE_ARCHIVE_SWIFT_PRIVATE;
+APPLE_ARCHIVE_ENUM(AAEntryFilterOps, uint32_t) {
+
+  AA_ENTRY_FILTER_OP_EQ        = 0,     ///< field == value
+  AA_ENTRY_FILTER_OP_NE        = 1,     ///< field != value
+  AA_ENTRY_FILTER_OP_LT        = 2,     ///< field < value
+  AA_ENTRY_FILTER_OP_LE        = 3,     ///< field <= value
+  AA_ENTRY_FILTER_OP_GT        = 4,     ///< field > value
+  AA_ENTRY_FILTER_OP_GE        = 5,     ///< field >= value
+  AA_ENTRY_FILTER_OP_PRESENT   = 6,     ///< field is present, value is ignored
+  AA_ENTRY_FILTER_OP_ABSENT    = 7,     ///< field is absent, value is ignored
+
+} APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Create an empty filter, matching all entries and keeping all fields
+
+  @return a new filter on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAEntryFilter _Nullable AAEntryFilterCreate(void);
+
+/*!
+  @abstract Add a path prefix
+
+  @discussion The prefix is a string prefix of PAT: use "usr/lib/" for the entries inside "usr/lib".
+
+  @param filter target filter
+  @param prefix PAT prefix
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AAEntryFilterAddPathPrefix(
+  AAEntryFilter filter,
+  const char * prefix);
+
+/*!
+  @abstract Add a path include pattern
+
+  @discussion
+  The patterns use the AAPathMatcher syntax, and must match the whole PAT, or one of its parent directories.
+  For example "**.so" matches all the PAT ending with ".so", "*.so" only those at the root, and "usr/lib"
+  matches "usr/lib" and all the PAT inside it.
+  All the patterns are compiled into a single DFA when the filter is first used.
+
+  @param filter target filter
+  @param pattern glob pattern
+
+  @return 0 on success, and a negative error code on failure, e.g. an invalid pattern
+*/
+APPLE_ARCHIVE_API int AAEntryFilterAddPathPattern(
+  AAEntryFilter filter,
+  const char * pattern);
+
+/*!
+  @abstract Add a path exclude pattern
+
+  @discussion
+  Entries whose PAT, or one of its parent directories, matches an exclude pattern are rejected, even if they
+  match an include pattern.
+
+  @param filter target filter
+  @param pattern glob pattern
+
+  @return 0 on success, and a negative error code on failure, e.g. an invalid pattern
+*/
+APPLE_ARCHIVE_API int AAEntryFilterAddPathExcludePattern(
+  AAEntryFilter filter,
+  const char * pattern);
+
+/*!
+  @abstract Add a field predicate
+
+  @discussion
+  The predicate applies to UINT fields, and to the seconds of TIMESPEC fields. A comparison with a missing field,
+  or a field of another type, is false.
+
+  @param filter target filter
+  @param key field key, e.g. SIZ, UID, MTM
+  @param op comparison operator
+  @param value compared value
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AAEntryFilterAddFieldPredicate(
+  AAEntryFilter filter,
+  AAFieldKey key,
+  AAEntryFilterOp op,
+  uint64_t value);
+
+/*!
+  @abstract Select the fields to keep
+
+  @discussion
+  The headers returned by a reader using the filter only contain these fields, and only the blobs of the kept
+  blob fields can be read. The keys are copied. Predicates and paths can use fields not kept.
+
+  @param filter target filter
+  @param key_set fields to keep, or NULL to keep all fields
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AAEntryFilterSetKeySet(
+  AAEntryFilter filter,
+  AAFieldKeySet _Nullable key_set);
+
+/*!
+  @abstract Match an encoded header
+
+  @param filter filter
+  @param header encoded header
+  @param header_size encoded header size
+
+  @return 1 if the entry matches, 0 if not, and a negative error code if the header is invalid
+*/
+APPLE_ARCHIVE_API int AAEntryFilterMatch(
+  AAEntryFilter filter,
+  const uint8_t * header,
+  size_t header_size);
+
+/*!
+  @abstract Check if a field is kept
+
+  @param filter filter
+  @param key field key
+
+  @return 1 if the field is kept, and 0 if it is removed
+*/
+APPLE_ARCHIVE_API int AAEntryFilterKeepsField(
+  AAEntryFilter filter,
+  AAFieldKey key);
+
+/*!
+  @abstract Destroy a filter
+
+  @param filter filter, can be NULL
+*/
+APPLE_ARCHIVE_API void AAEntryFilterDestroy(
+  AAEntryFilter _Nullable filter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull end")
+#endif
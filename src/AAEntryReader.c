@@ -0,0 +1,393 @@
+//
+//  AAEntryReader.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "AAEncodedHeader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ENTRY_READER_DISCARD_SIZE (1 << 20) /* payloads are read in this buffer when the stream can't seek */
+
+enum {
+    ENTRY_READER_PREAD = 0, /* read with pread, skip without I/O */
+    ENTRY_READER_SEEK = 1, /* read, skip with seek */
+    ENTRY_READER_STREAM = 2, /* read, skip by reading */
+};
+
+typedef struct {
+    uint32_t key; /* ikey */
+    uint64_t size;
+    uint64_t offset; /* in the archive */
+} EntryBlob;
+
+struct AAEntryReader_impl {
+    AAByteStream stream;
+    AAFlagSet flags;
+    AAEntryReaderStats *stats;
+    int mode;
+    off_t base; /* stream offset of the archive */
+    uint64_t offset; /* next byte to read, relative to base */
+    uint64_t entryOffset; /* current entry */
+    uint64_t nextEntryOffset;
+    int failed;
+
+    uint8_t *header;
+    size_t headerSize;
+    AAEncodedHeaderBuilder *builder; /* AA_FLAG_DECODE_INSERT_IDX, or filter removing fields */
+    AAEntryFilter filter;
+
+    EntryBlob *blobs;
+    size_t blobCount;
+    size_t blobIndex; /* first unread blob */
+    uint64_t blobRead; /* bytes read in blobs[blobIndex] */
+    size_t blobDone; /* last blob read completely, or blobCount */
+
+    uint8_t *discardBuffer;
+};
+
+static void addStats(AAEntryReader r, uint64_t header, uint64_t blob, uint64_t skipped, uint64_t discarded) {
+    if (r->stats) {
+        r->stats->header_bytes += header;
+        r->stats->blob_bytes += blob;
+        r->stats->skipped_bytes += skipped;
+        r->stats->discarded_bytes += discarded;
+    }
+}
+
+/* Read \p nbyte at the current offset. Returns the number of bytes read, less than \p nbyte at the end of the stream, or -1 on failure. */
+static ssize_t readBytes(AAEntryReader r, void *buf, size_t nbyte) {
+    size_t total = 0;
+    while (total < nbyte) {
+        ssize_t n;
+        if (r->mode == ENTRY_READER_PREAD) {
+            n = AAByteStreamPRead(r->stream, (uint8_t *)buf + total, nbyte - total, r->base + (off_t)(r->offset + total));
+        } else {
+            n = AAByteStreamRead(r->stream, (uint8_t *)buf + total, nbyte - total);
+        }
+        if (n < 0) {
+            ParallelCompressionLogError("archive read");
+            return -1;
+        }
+        if (n == 0) {
+            break; /* end of stream */
+        }
+        total += n;
+    }
+    r->offset += total;
+    return total;
+}
+
+/* Move the current offset forward to \p offset */
+static int skipTo(AAEntryReader r, uint64_t offset) {
+    uint64_t nbyte = offset - r->offset;
+    if (nbyte == 0) {
+        return 0;
+    }
+    if (r->mode == ENTRY_READER_PREAD) {
+        r->offset = offset;
+        addStats(r, 0, 0, nbyte, 0);
+        return 0;
+    }
+    if (r->mode == ENTRY_READER_SEEK) {
+        if (AAByteStreamSeek(r->stream, (off_t)nbyte, SEEK_CUR) >= 0) {
+            r->offset = offset;
+            addStats(r, 0, 0, nbyte, 0);
+            return 0;
+        }
+        r->mode = ENTRY_READER_STREAM;
+    }
+    if (!r->discardBuffer) {
+        r->discardBuffer = malloc(ENTRY_READER_DISCARD_SIZE);
+        if (!r->discardBuffer) {
+            ParallelCompressionLogError("malloc");
+            return -1;
+        }
+    }
+    while (r->offset < offset) {
+        uint64_t rem = offset - r->offset;
+        size_t n = (rem < ENTRY_READER_DISCARD_SIZE) ? (size_t)rem : ENTRY_READER_DISCARD_SIZE;
+        if (readBytes(r, r->discardBuffer, n) != (ssize_t)n) {
+            ParallelCompressionLogError("truncated archive");
+            return -1;
+        }
+        addStats(r, 0, 0, 0, n);
+    }
+    return 0;
+}
+
+/* At the end of the stream, check the last entry is complete: skipping past the end doesn't fail with pread or seek */
+static int checkEnd(AAEntryReader r) {
+    uint8_t last;
+    if (r->offset == 0 || r->mode == ENTRY_READER_STREAM) {
+        return 0;
+    }
+    ssize_t n;
+    if (r->mode == ENTRY_READER_PREAD) {
+        n = AAByteStreamPRead(r->stream, &last, 1, r->base + (off_t)r->offset - 1);
+    } else {
+        n = (AAByteStreamSeek(r->stream, -1, SEEK_CUR) < 0) ? -1 : AAByteStreamRead(r->stream, &last, 1);
+    }
+    if (n != 1) {
+        ParallelCompressionLogError("truncated archive");
+        return -1;
+    }
+    return 0;
+}
+
+AAEntryReader AAEntryReaderOpen(AAByteStream stream, AAFlagSet flags, AAEntryReaderStats *stats) {
+    AAEntryReader r = calloc(1, sizeof(struct AAEntryReader_impl));
+    if (!r) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    r->stream = stream;
+    r->flags = flags;
+    r->stats = stats;
+    r->header = malloc(AA_ENCODED_HEADER_MAX_SIZE);
+    /* each blob field takes at least 6 bytes */
+    r->blobs = malloc((AA_ENCODED_HEADER_MAX_SIZE / 6) * sizeof(EntryBlob));
+    r->builder = (flags & AA_FLAG_DECODE_INSERT_IDX) ? malloc(sizeof(AAEncodedHeaderBuilder)) : 0;
+    if (!r->header || !r->blobs || ((flags & AA_FLAG_DECODE_INSERT_IDX) && !r->builder)) {
+        ParallelCompressionLogError("malloc");
+        AAEntryReaderDestroy(r);
+        return 0;
+    }
+
+    /* pread needs the stream offset of the archive, a 0 byte pread checks it is implemented */
+    r->base = AAByteStreamSeek(stream, 0, SEEK_CUR);
+    uint8_t probe;
+    if (r->base < 0) {
+        r->base = 0;
+        r->mode = ENTRY_READER_STREAM;
+    } else if (AAByteStreamPRead(stream, &probe, 0, r->base) >= 0) {
+        r->mode = ENTRY_READER_PREAD;
+    } else {
+        r->mode = ENTRY_READER_SEEK;
+    }
+    return r;
+}
+
+static AAFieldKey fieldKey(const AAEncodedField *field) {
+    AAFieldKey key;
+    memcpy(key.skey, field->key, 4);
+    return key;
+}
+
+/* Copy the header fields kept by the filter, and append IDX */
+static int rewriteHeader(AAEntryReader r) {
+    AAEncodedHeaderBuilder *b = r->builder;
+    AAEncodedField field;
+    size_t pos = 0;
+    uint64_t blobOffset = 0;
+    int s;
+    aaEncodedHeaderBuilderInit(b);
+    while ((s = aaEncodedHeaderNextField(r->header, r->headerSize, &pos, &blobOffset, &field)) > 0) {
+        if ((r->flags & AA_FLAG_DECODE_INSERT_IDX) && memcmp(field.key, "IDX", 3) == 0) {
+            continue;
+        }
+        if (r->filter && !AAEntryFilterKeepsField(r->filter, fieldKey(&field))) {
+            continue;
+        }
+        aaEncodedHeaderBuilderAppendField(b, r->header, &field);
+    }
+    if (s < 0) {
+        return -1;
+    }
+    if (r->flags & AA_FLAG_DECODE_INSERT_IDX) {
+        aaEncodedHeaderBuilderAppendUInt(b, "IDX", r->entryOffset);
+    }
+    if (aaEncodedHeaderBuilderFinish(b) < 0) {
+        return -1;
+    }
+    memcpy(b->data, r->header, 4); /* keep the magic */
+    return 0;
+}
+
+int AAEntryReaderNext(AAEntryReader r, const uint8_t **header, size_t *header_size) {
+    if (r->failed) {
+        return -1;
+    }
+    for (;;) {
+        if (skipTo(r, r->nextEntryOffset) < 0) {
+            goto FAIL;
+        }
+        r->blobCount = 0;
+        r->blobIndex = 0;
+        r->blobRead = 0;
+        r->blobDone = 0;
+        r->entryOffset = r->offset;
+
+        ssize_t n = readBytes(r, r->header, AA_ENCODED_HEADER_MIN_SIZE);
+        if (n == 0) {
+            if (checkEnd(r) < 0) {
+                goto FAIL;
+            }
+            return 0; /* end of archive */
+        }
+        if (n != AA_ENCODED_HEADER_MIN_SIZE) {
+            ParallelCompressionLogError("truncated archive");
+            goto FAIL;
+        }
+        int size = aaEncodedHeaderSize(r->header);
+        if (size < 0) {
+            ParallelCompressionLogError("invalid header");
+            goto FAIL;
+        }
+        size_t rest = (size_t)size - AA_ENCODED_HEADER_MIN_SIZE;
+        if (readBytes(r, r->header + AA_ENCODED_HEADER_MIN_SIZE, rest) != (ssize_t)rest) {
+            ParallelCompressionLogError("truncated archive");
+            goto FAIL;
+        }
+        r->headerSize = (size_t)size;
+        addStats(r, size, 0, 0, 0);
+
+        if (!r->filter) {
+            break;
+        }
+        int match = AAEntryFilterMatch(r->filter, r->header, r->headerSize);
+        if (match < 0) {
+            goto FAIL;
+        }
+        if (match > 0) {
+            break;
+        }
+        /* rejected: skip the payload with the next entry */
+        int64_t payloadSize = aaEncodedHeaderPayloadSize(r->header, r->headerSize);
+        if (payloadSize < 0) {
+            goto FAIL;
+        }
+        r->nextEntryOffset = r->offset + (uint64_t)payloadSize;
+        if (r->stats) {
+            r->stats->filtered_count++;
+        }
+    }
+
+    /* blobs, and fields removed by the filter */
+    AAEncodedField field;
+    size_t pos = 0;
+    uint64_t blobOffset = 0;
+    int s;
+    int dropped = 0;
+    while ((s = aaEncodedHeaderNextField(r->header, r->headerSize, &pos, &blobOffset, &field)) > 0) {
+        if (r->filter && !AAEntryFilterKeepsField(r->filter, fieldKey(&field))) {
+            dropped = 1;
+            continue;
+        }
+        if (field.type != AA_FIELD_TYPE_BLOB) {
+            continue;
+        }
+        EntryBlob *blob = &r->blobs[r->blobCount++];
+        memcpy(&blob->key, field.key, 4);
+        blob->size = field.uintValue;
+        blob->offset = r->offset + field.blobOffset;
+    }
+    if (s < 0) {
+        goto FAIL;
+    }
+    r->nextEntryOffset = r->offset + blobOffset;
+    r->blobDone = r->blobCount;
+
+    if ((r->flags & AA_FLAG_DECODE_INSERT_IDX) || dropped) {
+        if (rewriteHeader(r) < 0) {
+            goto FAIL;
+        }
+        *header = r->builder->data;
+        *header_size = r->builder->size;
+    } else {
+        *header = r->header;
+        *header_size = r->headerSize;
+    }
+    if (r->stats) {
+        r->stats->entry_count++;
+    }
+    return 1;
+
+FAIL:
+    r->failed = 1;
+    return -1;
+}
+
+int AAEntryReaderSetFilter(AAEntryReader r, AAEntryFilter filter) {
+    if (filter && !r->builder) {
+        r->builder = malloc(sizeof(AAEncodedHeaderBuilder));
+        if (!r->builder) {
+            ParallelCompressionLogError("malloc");
+            return -1;
+        }
+    }
+    r->filter = filter;
+    return 0;
+}
+
+off_t AAEntryReaderGetEntryOffset(AAEntryReader r) {
+    return (off_t)r->entryOffset;
+}
+
+int AAEntryReaderGetBlobLocation(AAEntryReader r, AAFieldKey key, off_t *offset, uint64_t *size) {
+    for (size_t i = r->blobIndex; i < r->blobCount; i++) {
+        if (r->blobs[i].key == key.ikey) {
+            *offset = (off_t)r->blobs[i].offset;
+            *size = r->blobs[i].size;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+ssize_t AAEntryReaderReadBlob(AAEntryReader r, AAFieldKey key, void *buf, size_t nbyte) {
+    if (r->failed) {
+        return -1;
+    }
+    size_t i = r->blobIndex;
+    while (i < r->blobCount && r->blobs[i].key != key.ikey) {
+        i++;
+    }
+    if (i == r->blobCount) {
+        if (r->blobDone < r->blobCount && r->blobs[r->blobDone].key == key.ikey) {
+            return 0; /* end of the blob */
+        }
+        ParallelCompressionLogError("blob not found");
+        return -1;
+    }
+    if (i != r->blobIndex) {
+        r->blobIndex = i;
+        r->blobRead = 0;
+    }
+    EntryBlob *blob = &r->blobs[i];
+    if (skipTo(r, blob->offset + r->blobRead) < 0) {
+        r->failed = 1;
+        return -1;
+    }
+    uint64_t rem = blob->size - r->blobRead;
+    if ((uint64_t)nbyte > rem) {
+        nbyte = (size_t)rem;
+    }
+    if (readBytes(r, buf, nbyte) != (ssize_t)nbyte) {
+        ParallelCompressionLogError("truncated archive");
+        r->failed = 1;
+        return -1;
+    }
+    r->blobRead += nbyte;
+    addStats(r, 0, nbyte, 0, 0);
+    if (r->blobRead == blob->size) {
+        /* the next read of the same key goes to the next blob */
+        r->blobDone = r->blobIndex;
+        r->blobIndex++;
+        r->blobRead = 0;
+    }
+    return nbyte;
+}
+
+void AAEntryReaderDestroy(AAEntryReader r) {
+    if (!r) {
+        return;
+    }
+    free(r->header);
+    free(r->blobs);
+    free(r->builder);
+    free(r->discardBuffer);
+    free(r);
+}
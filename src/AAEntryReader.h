@@ -0,0 +1,161 @@
+// AppleArchive entry reader
+
+#pragma once
+
+#ifndef __APPLE_ARCHIVE_H
+#error Include AppleArchive.h instead of this file
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull begin")
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma mark - Entry reader
+
+/*!
+  @abstract Reads the entries of an uncompressed archive, header by header
+
+  @discussion
+  The reader returns the encoded header of each entry, and the blobs the caller asks for. Payload bytes not
+  read by the caller are skipped without being read when the stream implements pread or seek, so listing an
+  archive (headers only) costs the header bytes, not the archive bytes. Streams that can't seek, e.g. pipes,
+  are read and discarded in large blocks.
+  If the stream implements pread, the reader doesn't use the stream position, which is undefined after the
+  reader is destroyed.
+*/
+typedef struct AAEntryReader_impl * AAEntryReader APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Entry reader statistics
+*/
+typedef struct {
+  uint64_t entry_count;          ///< headers returned
+  uint64_t filtered_count;       ///< entries rejected by the filter
+  uint64_t header_bytes;         ///< header bytes read
+  uint64_t blob_bytes;           ///< blob bytes returned by AAEntryReaderReadBlob
+  uint64_t skipped_bytes;        ///< payload bytes skipped with pread or seek, not read
+  uint64_t discarded_bytes;      ///< payload bytes read and discarded, on streams that can't seek
+} AAEntryReaderStats APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Create an entry reader
+
+  @discussion
+  The archive starts at the current position of \p stream, which is offset 0 for the entry offsets.
+  With AA_FLAG_DECODE_INSERT_IDX, an IDX field set to the entry offset is appended to the returned headers
+  (replacing the IDX field of the header, if any).
+
+  @param stream archive stream, not closed when the reader is destroyed
+  @param flags AA_FLAG_DECODE_INSERT_IDX
+  @param stats if not NULL, receives the statistics, updated after each call
+
+  @return a new reader on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAEntryReader _Nullable AAEntryReaderOpen(
+  AAByteStream stream,
+  AAFlagSet flags,
+  AAEntryReaderStats * _Nullable stats);
+
+/*!
+  @abstract Move to the next entry
+
+  @discussion The unread payload of the current entry is skipped.
+
+  @param reader entry reader
+  @param header receives a pointer to the encoded header, valid until the next call
+  @param header_size receives the encoded header size
+
+  @return 1 if an entry is found, 0 at the end of the archive, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AAEntryReaderNext(
+  AAEntryReader reader,
+  const uint8_t * _Nullable * _Nonnull header,
+  size_t * header_size);
+
+/*!
+  @abstract Set the entry filter
+
+  @discussion
+  Entries not matching \p filter are skipped by AAEntryReaderNext: their header is read, but not returned, and
+  their payload is skipped. The fields not kept by \p filter are removed from the returned headers.
+  \p filter must remain valid while it is used by the reader.
+
+  @param reader entry reader
+  @param filter entry filter, or NULL to return all entries
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AAEntryReaderSetFilter(
+  AAEntryReader reader,
+  AAEntryFilter _Nullable filter);
+
+/*!
+  @abstract Get the offset of the current entry
+
+  @param reader entry reader
+
+  @return the offset of the header of the current entry, relative to the start of the archive
+*/
+APPLE_ARCHIVE_API off_t AAEntryReaderGetEntryOffset(
+  AAEntryReader reader);
+
+/*!
+  @abstract Get the location of a blob of the current entry
+
+  @discussion
+  Locates the first unread blob matching \p key, without reading it. With a stream implementing pread, the blob
+  can then be read directly from the stream, e.g. by other threads, and is skipped by the reader.
+
+  @param reader entry reader
+  @param key blob field key
+  @param offset receives the offset of the blob, relative to the start of the archive
+  @param size receives the blob size
+
+  @return 1 if the blob is found, and 0 if the entry has no unread blob \p key
+*/
+APPLE_ARCHIVE_API int AAEntryReaderGetBlobLocation(
+  AAEntryReader reader,
+  AAFieldKey key,
+  off_t * offset,
+  uint64_t * size);
+
+/*!
+  @abstract Read blob data of the current entry
+
+  @discussion
+  Reads from the first unread blob matching \p key. Blobs are read in header order: blobs before it that
+  were not read completely are skipped, and can't be read anymore.
+
+  @param reader entry reader
+  @param key blob field key
+  @param buf receives the blob data
+  @param nbyte number of bytes to read
+
+  @return the number of bytes read, less than \p nbyte at the end of the blob, and a negative error code on failure,
+  or if the entry has no unread blob \p key
+*/
+APPLE_ARCHIVE_API ssize_t AAEntryReaderReadBlob(
+  AAEntryReader reader,
+  AAFieldKey key,
+  void * buf,
+  size_t nbyte);
+
+/*!
+  @abstract Destroy an entry reader
+
+  @param reader entry reader, can be NULL
+*/
+APPLE_ARCHIVE_API void AAEntryReaderDestroy(
+  AAEntryReader _Nullable reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull end")
+#endif
@@ -0,0 +1,477 @@
+//
+//  AAEntryScheduler.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define AA_SCHEDULER_BUFFER_UNIT (64 << 10) /* reorder buffer reserved from the budget in units of this size */
+
+enum {
+    AA_ENTRY_PENDING = 0,
+    AA_ENTRY_RUNNING = 1,
+    AA_ENTRY_DONE = 2,
+};
+
+typedef struct AAScheduledEntry_impl {
+    struct AAEntryScheduler_impl *scheduler;
+    uint64_t entryId;
+    uint64_t index; /* submission order */
+    uint64_t cost;
+    int state;
+    int status;
+    int isHead; /* next in archive order, written directly to the output stream */
+    size_t heapIndex; /* position in the pending heap, while pending */
+    uint8_t *data; /* buffered output, while not head */
+    size_t size;
+    size_t capacity; /* counted in the reorder buffer */
+} AAScheduledEntry;
+
+struct AAEntryScheduler_impl {
+    AAByteStream out;
+    AAEntrySchedulerProc proc;
+    void *arg;
+    AAMemoryBudget budget;
+    size_t reserved; /* bytes reserved from the budget */
+
+    pthread_mutex_t lock;
+    pthread_cond_t workCond; /* pending entries, or stop */
+    pthread_cond_t roomCond; /* reorder buffer drained, or entry became head */
+    pthread_cond_t doneCond; /* entry done */
+
+    /* entries not written yet, entry index in entries[index & (entriesCapacity - 1)] */
+    AAScheduledEntry **entries;
+    uint64_t first; /* index of the head entry */
+    uint64_t count; /* number of entries submitted */
+    size_t entriesCapacity; /* power of 2 */
+
+    /* pending entries, max heap by cost, same capacity */
+    AAScheduledEntry **heap;
+    size_t heapSize;
+
+    size_t buffered; /* reorder buffer usage */
+    int roomWaiters; /* writers waiting for room in the reorder buffer */
+    size_t peakBuffered;
+    int stop;
+    int status;
+
+    int nThreads;
+    pthread_t *threads;
+};
+
+#pragma mark - Pending heap
+
+/* Higher cost first, then submission order */
+static int heapBefore(const AAScheduledEntry *a, const AAScheduledEntry *b) {
+    if (a->cost != b->cost) {
+        return a->cost > b->cost;
+    }
+    return a->index < b->index;
+}
+
+static void heapSet(AAEntryScheduler s, size_t i, AAScheduledEntry *e) {
+    s->heap[i] = e;
+    e->heapIndex = i;
+}
+
+static void heapSiftUp(AAEntryScheduler s, size_t i, AAScheduledEntry *e) {
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!heapBefore(e, s->heap[parent])) {
+            break;
+        }
+        heapSet(s, i, s->heap[parent]);
+        i = parent;
+    }
+    heapSet(s, i, e);
+}
+
+static void heapSiftDown(AAEntryScheduler s, size_t i, AAScheduledEntry *e) {
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= s->heapSize) {
+            break;
+        }
+        if (child + 1 < s->heapSize && heapBefore(s->heap[child + 1], s->heap[child])) {
+            child++;
+        }
+        if (!heapBefore(s->heap[child], e)) {
+            break;
+        }
+        heapSet(s, i, s->heap[child]);
+        i = child;
+    }
+    heapSet(s, i, e);
+}
+
+static void heapPush(AAEntryScheduler s, AAScheduledEntry *e) {
+    heapSiftUp(s, s->heapSize++, e);
+}
+
+/* Remove \p e from the heap. Called locked. */
+static void heapRemove(AAEntryScheduler s, AAScheduledEntry *e) {
+    size_t i = e->heapIndex;
+    AAScheduledEntry *last = s->heap[--s->heapSize];
+    if (i == s->heapSize) {
+        return;
+    }
+    if (i > 0 && heapBefore(last, s->heap[(i - 1) / 2])) {
+        heapSiftUp(s, i, last);
+    } else {
+        heapSiftDown(s, i, last);
+    }
+}
+
+/*
+ * Return the head entry if it is pending while the reorder buffer is full or writers are waiting for room,
+ * and NULL otherwise. Nothing drains the buffer until the head is encoded, so it must be started first.
+ * Called locked.
+ */
+static AAScheduledEntry *stalledHead(AAEntryScheduler s) {
+    if (s->first == s->count) {
+        return 0;
+    }
+    AAScheduledEntry *e = s->entries[s->first & (s->entriesCapacity - 1)];
+    if (e->state != AA_ENTRY_PENDING || (s->roomWaiters == 0 && s->buffered < s->reserved)) {
+        return 0;
+    }
+    return e;
+}
+
+/* Take the stalled head entry, or the most costly pending entry, or NULL if none. Called locked. */
+static AAScheduledEntry *nextPending(AAEntryScheduler s) {
+    if (s->heapSize == 0) {
+        return 0;
+    }
+    AAScheduledEntry *e = stalledHead(s);
+    if (e) {
+        e->isHead = 1;
+    } else {
+        e = s->heap[0];
+    }
+    heapRemove(s, e);
+    return e;
+}
+
+#pragma mark - Entry streams
+
+static ssize_t writeAll(AAByteStream out, const uint8_t *buf, size_t nbyte) {
+    size_t total = 0;
+    while (total < nbyte) {
+        ssize_t n = AAByteStreamWrite(out, buf + total, nbyte - total);
+        if (n <= 0) {
+            ParallelCompressionLogError("write");
+            return -1;
+        }
+        total += n;
+    }
+    return total;
+}
+
+/* Release the buffer of \p e, and wake up the writers waiting for room. Called locked. */
+static void releaseBuffer(AAEntryScheduler s, AAScheduledEntry *e) {
+    s->buffered -= e->capacity;
+    free(e->data);
+    e->data = 0;
+    e->size = 0;
+    e->capacity = 0;
+    pthread_cond_broadcast(&s->roomCond);
+}
+
+static ssize_t entryWriteProc(void *arg, const void *buf, size_t nbyte) {
+    AAScheduledEntry *e = arg;
+    AAEntryScheduler s = e->scheduler;
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        if (s->stop) {
+            pthread_mutex_unlock(&s->lock);
+            return -1;
+        }
+        if (e->isHead) {
+            break;
+        }
+        size_t needed = e->size + nbyte;
+        if (needed <= e->capacity) {
+            /* only the owner thread touches the buffer of a running entry */
+            pthread_mutex_unlock(&s->lock);
+            memcpy(e->data + e->size, buf, nbyte);
+            e->size += nbyte;
+            return nbyte;
+        }
+        size_t newCapacity = 2 * e->capacity;
+        if (newCapacity < needed || s->buffered - e->capacity + newCapacity > s->reserved) {
+            newCapacity = needed;
+        }
+        if (s->buffered - e->capacity + newCapacity <= s->reserved) {
+            uint8_t *data = realloc(e->data, newCapacity);
+            if (!data) {
+                ParallelCompressionLogError("malloc");
+                pthread_mutex_unlock(&s->lock);
+                return -1;
+            }
+            s->buffered += newCapacity - e->capacity;
+            if (s->buffered > s->peakBuffered) {
+                s->peakBuffered = s->buffered;
+            }
+            e->data = data;
+            e->capacity = newCapacity;
+            continue;
+        }
+        /* reorder buffer full, wait for the head to advance */
+        s->roomWaiters++;
+        pthread_cond_wait(&s->roomCond, &s->lock);
+        s->roomWaiters--;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    /* head entry: flush what was buffered before it became head, then write through */
+    if (e->size > 0) {
+        if (writeAll(s->out, e->data, e->size) < 0) {
+            return -1;
+        }
+        pthread_mutex_lock(&s->lock);
+        releaseBuffer(s, e);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return writeAll(s->out, buf, nbyte);
+}
+
+static int entryCloseProc(void *arg) {
+    (void)arg;
+    return 0;
+}
+
+/* Encode \p e on the calling thread */
+static void runEntry(AAEntryScheduler s, AAScheduledEntry *e) {
+    int status = -1;
+    AAByteStream stream = AACustomByteStreamOpen();
+    if (stream) {
+        AACustomByteStreamSetData(stream, e);
+        AACustomByteStreamSetWriteProc(stream, entryWriteProc);
+        AACustomByteStreamSetCloseProc(stream, entryCloseProc);
+        status = s->proc(s->arg, e->entryId, stream);
+        AAByteStreamClose(stream);
+    }
+    pthread_mutex_lock(&s->lock);
+    e->status = status;
+    e->state = AA_ENTRY_DONE;
+    pthread_cond_broadcast(&s->doneCond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void *workerProc(void *arg) {
+    AAEntryScheduler s = arg;
+    pthread_mutex_lock(&s->lock);
+    while (!s->stop) {
+        AAScheduledEntry *e = nextPending(s);
+        if (!e) {
+            pthread_cond_wait(&s->workCond, &s->lock);
+            continue;
+        }
+        e->state = AA_ENTRY_RUNNING;
+        pthread_mutex_unlock(&s->lock);
+        runEntry(s, e);
+        pthread_mutex_lock(&s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+#pragma mark - Head drain
+
+/*
+ * Write the head entries to the output stream, in order. If \p wait, process entries until
+ * all submitted entries are written; otherwise only write the entries already done, and encode
+ * the head entry here if it is stalled.
+ * Returns 0 on success, and -1 on failure.
+ */
+static int drain(AAEntryScheduler s, int wait) {
+    pthread_mutex_lock(&s->lock);
+    while (s->status == 0 && s->first < s->count) {
+        AAScheduledEntry *e = s->entries[s->first & (s->entriesCapacity - 1)];
+        if (!e->isHead) {
+            e->isHead = 1;
+            pthread_cond_broadcast(&s->roomCond); /* its writer may be waiting for room */
+        }
+        if (e->state == AA_ENTRY_PENDING) {
+            if (!wait && !stalledHead(s)) {
+                break;
+            }
+            /* no worker took it yet: encode it here */
+            heapRemove(s, e);
+            e->state = AA_ENTRY_RUNNING;
+            pthread_mutex_unlock(&s->lock);
+            runEntry(s, e);
+            pthread_mutex_lock(&s->lock);
+        }
+        if (e->state == AA_ENTRY_RUNNING) {
+            if (!wait) {
+                break;
+            }
+            pthread_cond_wait(&s->doneCond, &s->lock);
+            continue;
+        }
+        /* done: write what is left in its buffer */
+        if (e->status < 0) {
+            s->status = -1;
+            break;
+        }
+        if (e->size > 0) {
+            pthread_mutex_unlock(&s->lock);
+            ssize_t n = writeAll(s->out, e->data, e->size);
+            pthread_mutex_lock(&s->lock);
+            if (n < 0) {
+                s->status = -1;
+                break;
+            }
+        }
+        releaseBuffer(s, e);
+        free(e);
+        s->first++;
+    }
+    int status = s->status;
+    if (status < 0 && !s->stop) {
+        /* stop the workers, and the writers waiting for room */
+        s->stop = 1;
+        pthread_cond_broadcast(&s->workCond);
+        pthread_cond_broadcast(&s->roomCond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return status;
+}
+
+#pragma mark - API
+
+AAEntryScheduler AAEntrySchedulerCreate(AAByteStream out, AAEntrySchedulerProc proc, void *arg, AAMemoryBudget budget, size_t reorder_size,
+                                        int n_threads) {
+    AAEntryScheduler s = calloc(1, sizeof(struct AAEntryScheduler_impl));
+    if (!s) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    s->out = out;
+    s->proc = proc;
+    s->arg = arg;
+    s->budget = budget;
+    pthread_mutex_init(&s->lock, 0);
+    pthread_cond_init(&s->workCond, 0);
+    pthread_cond_init(&s->roomCond, 0);
+    pthread_cond_init(&s->doneCond, 0);
+
+    int nUnits = (int)((reorder_size + AA_SCHEDULER_BUFFER_UNIT - 1) / AA_SCHEDULER_BUFFER_UNIT);
+    if (nUnits < 1) {
+        nUnits = 1;
+    }
+    nUnits = AAMemoryBudgetAcquireItems(budget, AA_SCHEDULER_BUFFER_UNIT, nUnits);
+    if (nUnits < 0) {
+        ParallelCompressionLogError("memory budget exhausted");
+        AAEntrySchedulerDestroy(s);
+        return 0;
+    }
+    s->reserved = (size_t)nUnits * AA_SCHEDULER_BUFFER_UNIT;
+
+    s->nThreads = n_threads > 0 ? n_threads : (int)getDefaultNThreads();
+    s->threads = calloc(s->nThreads, sizeof(pthread_t));
+    if (!s->threads) {
+        ParallelCompressionLogError("malloc");
+        AAEntrySchedulerDestroy(s);
+        return 0;
+    }
+    for (int i = 0; i < s->nThreads; i++) {
+        if (pthread_create(&s->threads[i], 0, workerProc, s) != 0) {
+            ParallelCompressionLogError("pthread_create");
+            s->nThreads = i;
+            AAEntrySchedulerDestroy(s);
+            return 0;
+        }
+    }
+    return s;
+}
+
+int AAEntrySchedulerSubmit(AAEntryScheduler s, uint64_t entry_id, uint64_t cost) {
+    AAScheduledEntry *e = calloc(1, sizeof(AAScheduledEntry));
+    if (!e) {
+        ParallelCompressionLogError("malloc");
+        return -1;
+    }
+    e->scheduler = s;
+    e->entryId = entry_id;
+    e->cost = cost;
+    pthread_mutex_lock(&s->lock);
+    if (s->stop) {
+        pthread_mutex_unlock(&s->lock);
+        free(e);
+        return -1;
+    }
+    if (s->count - s->first == s->entriesCapacity) {
+        size_t capacity = s->entriesCapacity ? 2 * s->entriesCapacity : 256;
+        AAScheduledEntry **entries = malloc(capacity * sizeof(AAScheduledEntry *));
+        AAScheduledEntry **heap = realloc(s->heap, capacity * sizeof(AAScheduledEntry *));
+        if (heap) {
+            s->heap = heap;
+        }
+        if (!entries || !heap) {
+            ParallelCompressionLogError("malloc");
+            pthread_mutex_unlock(&s->lock);
+            free(entries);
+            free(e);
+            return -1;
+        }
+        for (uint64_t i = s->first; i < s->count; i++) {
+            entries[i & (capacity - 1)] = s->entries[i & (s->entriesCapacity - 1)];
+        }
+        free(s->entries);
+        s->entries = entries;
+        s->entriesCapacity = capacity;
+    }
+    e->index = s->count++;
+    s->entries[e->index & (s->entriesCapacity - 1)] = e;
+    heapPush(s, e);
+    pthread_cond_signal(&s->workCond);
+    pthread_mutex_unlock(&s->lock);
+    return drain(s, 0);
+}
+
+int AAEntrySchedulerFlush(AAEntryScheduler s) {
+    return drain(s, 1);
+}
+
+void AAEntrySchedulerDestroy(AAEntryScheduler s) {
+    if (!s) {
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->workCond);
+    pthread_cond_broadcast(&s->roomCond);
+    pthread_mutex_unlock(&s->lock);
+    for (int i = 0; i < s->nThreads; i++) {
+        pthread_join(s->threads[i], 0);
+    }
+    for (uint64_t i = s->first; i < s->count; i++) {
+        AAScheduledEntry *e = s->entries[i & (s->entriesCapacity - 1)];
+        free(e->data);
+        free(e);
+    }
+    AAMemoryBudgetRelease(s->budget, s->reserved);
+    pthread_cond_destroy(&s->doneCond);
+    pthread_cond_destroy(&s->roomCond);
+    pthread_cond_destroy(&s->workCond);
+    pthread_mutex_destroy(&s->lock);
+    free(s->threads);
+    free(s->heap);
+    free(s->entries);
+    free(s);
+}
+
+size_t AAEntrySchedulerGetPeakBuffered(AAEntryScheduler s) {
+    pthread_mutex_lock(&s->lock);
+    size_t peak = s->peakBuffered;
+    pthread_mutex_unlock(&s->lock);
+    return peak;
+}
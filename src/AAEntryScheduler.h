@@ -0,0 +1,115 @@
+// AppleArchive entry scheduler
+
+#pragma once
+
+#ifndef __APPLE_ARCHIVE_H
+#error Include AppleArchive.h instead of this file
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull begin")
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma mark - Entry scheduler
+
+/*!
+  @abstract Encodes archive entries in parallel, largest first, and writes them in archive order
+
+  @discussion
+  Entries are queued with a cost, e.g. the file size, and the worker threads always start the most costly
+  entry queued (longest processing time first), so a large file is read, hashed and compressed while the
+  small entries around it are processed by the other threads.
+  Each entry is encoded to its own stream. The entry next in archive order is written directly to the output
+  stream; the others are held in a reorder buffer until their turn. When the reorder buffer is full, workers
+  writing to it block until it drains, and the next entry in archive order is started before any other: by
+  the next free worker, or by the thread calling Submit, so the archive always makes progress. The scheduler
+  is not thread safe: Submit and Flush must be called from the same thread.
+*/
+typedef struct AAEntryScheduler_impl * AAEntryScheduler APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Encode one entry
+
+  @discussion Called on a worker thread, or on the thread calling AAEntrySchedulerFlush.
+
+  @param arg user data
+  @param entry_id the id passed to AAEntrySchedulerSubmit
+  @param out receives the encoded entry
+
+  @return 0 on success, and a negative value on failure, which stops the scheduler
+*/
+typedef int (*AAEntrySchedulerProc)(void * _Nullable arg, uint64_t entry_id, AAByteStream out);
+
+/*!
+  @abstract Create an entry scheduler
+
+  @discussion
+  The reorder buffer is reserved from \p budget when the scheduler is created, in 64 KB units, and released
+  when it is destroyed. With a short budget, the buffer is smaller than \p reorder_size, down to one unit.
+
+  @param out archive stream, receives the entries in submission order
+  @param proc encodes the entries
+  @param arg passed to \p proc
+  @param budget memory budget, or NULL
+  @param reorder_size max number of bytes held in the reorder buffer
+  @param n_threads number of worker threads, or 0 for default
+
+  @return a new scheduler on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAEntryScheduler _Nullable AAEntrySchedulerCreate(
+  AAByteStream out,
+  AAEntrySchedulerProc proc,
+  void * _Nullable arg,
+  AAMemoryBudget _Nullable budget,
+  size_t reorder_size,
+  int n_threads);
+
+/*!
+  @abstract Queue an entry
+
+  @discussion Entries already encoded at the front of the archive are written to the output stream.
+
+  @param scheduler target scheduler
+  @param entry_id passed to the entry proc
+  @param cost processing cost of the entry, e.g. the file size
+
+  @return 0 on success, and a negative error code on failure, or if the scheduler was stopped
+*/
+APPLE_ARCHIVE_API int AAEntrySchedulerSubmit(AAEntryScheduler scheduler, uint64_t entry_id, uint64_t cost);
+
+/*!
+  @abstract Encode and write all queued entries
+
+  @param scheduler target scheduler
+
+  @return 0 on success, and a negative error code on failure, or if the scheduler was stopped
+*/
+APPLE_ARCHIVE_API int AAEntrySchedulerFlush(AAEntryScheduler scheduler);
+
+/*!
+  @abstract Destroy a scheduler, entries queued and not flushed are dropped
+
+  @param scheduler target scheduler, do nothing if NULL
+*/
+APPLE_ARCHIVE_API void AAEntrySchedulerDestroy(AAEntryScheduler _Nullable scheduler);
+
+/*!
+  @abstract Get the peak size of the reorder buffer
+
+  @param scheduler target scheduler
+
+  @return the maximum number of bytes held in the reorder buffer at any time
+*/
+APPLE_ARCHIVE_API size_t AAEntrySchedulerGetPeakBuffered(AAEntryScheduler scheduler);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull end")
+#endif
@@ -0,0 +1,1658 @@
+//
+//  AAExtractor.c
+//  libAppleArchive
+//
+
+#if defined(__linux__)
+#define _GNU_SOURCE /* copy_file_range */
+#endif
+
+#include "AppleArchive.h"
+#include "AAEncodedHeader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#elif defined(__APPLE__)
+#include <sys/clonefile.h>
+#endif
+
+#define EXTRACT_MAX_OPEN_DIRS 256 /* idle directories kept open */
+#define EXTRACT_DEFAULT_BUDGET (64 << 20) /* DAT read by the client thread, not yet written, without a client budget */
+#define EXTRACT_IO_SIZE (1 << 20)
+
+enum {
+    DIR_PENDING = 0,
+    DIR_CREATED = 1,
+    DIR_FAILED = 2,
+};
+
+enum {
+    CLUSTER_HLC = 1,
+    CLUSTER_SLC = 2,
+};
+
+enum {
+    CLUSTER_PENDING = 0,
+    CLUSTER_DONE = 1,
+    CLUSTER_FAILED = 2,
+};
+
+/* State of an entry after its creation, to skip the attributes it already has */
+typedef struct {
+    uint64_t ino;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+} EntryStat;
+
+struct ExtractTask;
+
+/* Path of a file, link or special entry being extracted, later entries for the same path wait for it */
+typedef struct ExtractLeaf {
+    struct ExtractLeaf *next; /* hash chain */
+    uint64_t hash;
+    char *path;
+    struct ExtractTask *waitingHead; /* later entries, in archive order */
+    struct ExtractTask *waitingTail;
+} ExtractLeaf;
+
+/* Deferred attributes of an entry */
+typedef struct {
+    char *path;
+    const char *name; /* last component of path */
+    uint32_t type;
+    int hasStat;
+    EntryStat st;
+    AAEntryAttributes attr;
+    ExtractLeaf *leaf; /* done when the attributes are applied */
+} AttrOp;
+
+/* Node of the directory graph */
+typedef struct ExtractDir {
+    char *path; /* "" for the root */
+    const char *name; /* last component of path */
+    struct ExtractDir *parent;
+    struct ExtractDir *firstChild;
+    struct ExtractDir *nextSibling;
+    int state; /* DIR_* */
+    int fd; /* -1 when closed */
+    int users; /* running tasks using fd */
+    struct ExtractTask *waiting; /* tasks waiting for the directory */
+    int hasEntry; /* in the archive, receives messages and attributes */
+    AAEntryAttributes attr;
+    size_t remaining; /* subdirectories not finalized */
+    AttrOp *ops; /* deferred attributes of the entries in the directory */
+    size_t opCount;
+    size_t opCapacity;
+} ExtractDir;
+
+/* HLC or SLC cluster, the later members are created from the first one */
+typedef struct {
+    uint64_t id;
+    uint32_t kind; /* CLUSTER_HLC or CLUSTER_SLC */
+    int state; /* CLUSTER_* */
+    char *path; /* first member */
+    struct ExtractTask *waiting; /* later members waiting for the first one */
+} ExtractCluster;
+
+typedef struct ExtractTask {
+    struct ExtractTask *next;
+    int finalize; /* apply the metadata of dir */
+    int batch; /* apply the deferred attributes in ops, entries of dir */
+    AttrOp *ops;
+    size_t opCount;
+    uint32_t type;
+    ExtractDir *parent;
+    ExtractDir *dir; /* directories */
+    char *path;
+    const char *name;
+    AAEntryAttributes attr;
+    char *link;
+    uint64_t dev;
+    AAByteStream archive;
+    off_t dataOffset; /* stream offset of DAT */
+    uint64_t dataSize;
+    uint8_t *data; /* DAT read by the client thread, or NULL to read it with pread */
+    size_t dataCharge; /* bytes of data acquired from the memory budget */
+    ExtractCluster *cluster; /* regular files in a cluster */
+    int clusterSource; /* first member of cluster */
+    ExtractLeaf *leaf; /* entries other than directories */
+    int parentFailed;
+} ExtractTask;
+
+struct AAExtractor_impl;
+
+typedef struct {
+    struct AAExtractor_impl *extractor;
+    pthread_t thread;
+    int threadStarted;
+    uint8_t *buf;
+} ExtractWorker;
+
+struct AAExtractor_impl {
+    AAFlagSet flags;
+    void *msgData;
+    AAEntryMessageProc msgProc;
+    pthread_mutex_t msgLock; /* serializes msgProc calls */
+    AAExtractorStats *stats;
+    size_t attrBatchSize; /* 0 to apply the attributes immediately */
+
+    /* directory graph, the table is only used by the client thread */
+    ExtractDir *root;
+    ExtractDir **dirs; /* all directories, parents first */
+    size_t dirCount;
+    size_t dirCapacity;
+    ExtractDir **table; /* open addressing by path */
+    size_t tableSize;
+
+    /* clusters, the table is only used by the client thread, for the current archive */
+    ExtractCluster **clusters; /* all clusters */
+    size_t clusterCount;
+    size_t clusterCapacity;
+    size_t clusterBase; /* first cluster of the current archive */
+    ExtractCluster **clusterTable; /* open addressing by kind and id */
+    size_t clusterTableSize;
+
+    /* entries being extracted, by path, protected by the lock */
+    ExtractLeaf **leaves; /* hash chains */
+    size_t leafCount;
+    size_t leafTableSize;
+
+    int nThreads;
+    ExtractWorker *workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t workCond; /* workers wait for a task */
+    pthread_cond_t doneCond; /* the client waits for tasks to complete */
+    ExtractTask *readyHead;
+    ExtractTask *readyTail;
+    size_t pendingCount; /* tasks queued, waiting, or running */
+    size_t openDirs;
+    uint64_t bufferedSize;
+    AAMemoryBudget budget; /* charged for the buffered DAT */
+    AAMemoryBudget ownBudget; /* default budget, when the client didn't set one */
+    int rootFinalized;
+    int stop;
+    int aborted;
+    int status;
+};
+
+typedef struct AAExtractor_impl * Extractor;
+
+static uint64_t hashPath(const char *path, size_t n) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ (uint8_t)path[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static ssize_t writeFully(AAByteStream s, const void *buf, size_t nbyte) {
+    size_t total = 0;
+    while (total < nbyte) {
+        ssize_t n = AAByteStreamWrite(s, (const uint8_t *)buf + total, nbyte - total);
+        if (n <= 0) {
+            return -1;
+        }
+        total += n;
+    }
+    return total;
+}
+
+#pragma mark - Messages
+
+/* Send \p message for \p path, a negative return value aborts the extraction */
+static int extractorMessage(Extractor ex, AAEntryMessage message, const char *path, void *data) {
+    if (!ex->msgProc) {
+        return 0;
+    }
+    pthread_mutex_lock(&ex->msgLock);
+    int r = ex->msgProc(ex->msgData, message, path, data);
+    pthread_mutex_unlock(&ex->msgLock);
+    if (r < 0) {
+        ParallelCompressionLogError("extraction aborted by client");
+        __atomic_store_n(&ex->aborted, 1, __ATOMIC_RELEASE);
+    }
+    return r;
+}
+
+static int extractorAborted(Extractor ex) {
+    return __atomic_load_n(&ex->aborted, __ATOMIC_ACQUIRE);
+}
+
+/* Report a failed entry */
+static void entryFailed(Extractor ex, const char *path) {
+    pthread_mutex_lock(&ex->lock);
+    ex->status = -1;
+    pthread_mutex_unlock(&ex->lock);
+    if (!extractorAborted(ex) && extractorMessage(ex, AA_ENTRY_MESSAGE_EXTRACT_FAIL, path, 0) > 0) {
+        __atomic_store_n(&ex->aborted, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* Report a completed entry */
+static void entryDone(Extractor ex, const char *path) {
+    if (extractorMessage(ex, AA_ENTRY_MESSAGE_EXTRACT_END, path, 0) >= 0) {
+        pthread_mutex_lock(&ex->lock);
+        if (ex->stats) {
+            ex->stats->entry_count++;
+        }
+        pthread_mutex_unlock(&ex->lock);
+    }
+}
+
+#pragma mark - Scheduling
+
+/* Queue \p task for the workers, called with the lock held */
+static void pushReady(Extractor ex, ExtractTask *task) {
+    task->next = 0;
+    if (ex->readyTail) {
+        ex->readyTail->next = task;
+    } else {
+        ex->readyHead = task;
+    }
+    ex->readyTail = task;
+    pthread_cond_signal(&ex->workCond);
+}
+
+/* Open \p dir again after it was closed while idle, called with the lock held */
+static int reopenDir(Extractor ex, ExtractDir *dir) {
+    int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    if (dir->parent && dir->parent->fd >= 0) {
+        dir->fd = openat(dir->parent->fd, dir->name, flags);
+    } else {
+        dir->fd = openat(ex->root->fd, dir->path, flags);
+    }
+    if (dir->fd < 0) {
+        return -1;
+    }
+    ex->openDirs++;
+    if (ex->stats) {
+        ex->stats->reopened_dirs++;
+    }
+    return 0;
+}
+
+/* Run \p task when its parent directory exists, called with the lock held */
+static void scheduleTask(Extractor ex, ExtractTask *task) {
+    ExtractDir *parent = task->parent;
+    if (parent->state == DIR_PENDING) {
+        task->next = parent->waiting;
+        parent->waiting = task;
+        if (ex->stats) {
+            ex->stats->deferred_count++;
+        }
+        return;
+    }
+    if (parent->state == DIR_CREATED && parent->fd < 0 && reopenDir(ex, parent) < 0) {
+        parent->state = DIR_FAILED;
+    }
+    if (parent->state == DIR_FAILED) {
+        task->parentFailed = 1;
+    } else {
+        parent->users++;
+    }
+    pushReady(ex, task);
+}
+
+/* A task using \p dir is done, called with the lock held */
+static void releaseDir(Extractor ex, ExtractDir *dir) {
+    dir->users--;
+    if (dir->users == 0 && dir != ex->root && dir->fd >= 0 && ex->openDirs > EXTRACT_MAX_OPEN_DIRS) {
+        close(dir->fd);
+        dir->fd = -1;
+        ex->openDirs--;
+    }
+}
+
+/* Directory \p dir was created (\p fd >= 0) or failed, start the tasks waiting for it */
+static void dirReady(Extractor ex, ExtractDir *dir, int fd) {
+    pthread_mutex_lock(&ex->lock);
+    dir->fd = fd;
+    dir->state = (fd >= 0) ? DIR_CREATED : DIR_FAILED;
+    if (fd >= 0) {
+        ex->openDirs++;
+        if (ex->stats) {
+            ex->stats->dir_count++;
+        }
+    }
+    ExtractTask *task = dir->waiting;
+    dir->waiting = 0;
+    while (task) {
+        ExtractTask *next = task->next;
+        scheduleTask(ex, task);
+        task = next;
+    }
+    if (fd >= 0 && dir->users == 0) {
+        dir->users = 1;
+        releaseDir(ex, dir);
+    }
+    pthread_mutex_unlock(&ex->lock);
+}
+
+/* The first member of \p cluster was created (\p ok) or failed, start the later members, called with the lock held */
+static void clusterReady(Extractor ex, ExtractCluster *cluster, int ok) {
+    cluster->state = ok ? CLUSTER_DONE : CLUSTER_FAILED;
+    ExtractTask *task = cluster->waiting;
+    cluster->waiting = 0;
+    while (task) {
+        ExtractTask *next = task->next;
+        scheduleTask(ex, task);
+        task = next;
+    }
+}
+
+/* Run \p task when the first member of its cluster is complete, and its parent directory exists, called with the lock held */
+static void startTask(Extractor ex, ExtractTask *task) {
+    if (task->cluster && !task->clusterSource && task->cluster->state == CLUSTER_PENDING) {
+        /* the first member must be complete */
+        task->next = task->cluster->waiting;
+        task->cluster->waiting = task;
+        if (ex->stats) {
+            ex->stats->deferred_count++;
+        }
+        return;
+    }
+    scheduleTask(ex, task);
+}
+
+/* The entry extracted at \p leaf is done, start the next entry for the same path, called with the lock held */
+static void leafDone(Extractor ex, ExtractLeaf *leaf) {
+    ExtractTask *task = leaf->waitingHead;
+    if (task) {
+        leaf->waitingHead = task->next;
+        if (!leaf->waitingHead) {
+            leaf->waitingTail = 0;
+        }
+        startTask(ex, task);
+        return;
+    }
+    ExtractLeaf **link = &ex->leaves[leaf->hash & (ex->leafTableSize - 1)];
+    while (*link != leaf) {
+        link = &(*link)->next;
+    }
+    *link = leaf->next;
+    ex->leafCount--;
+    free(leaf->path);
+    free(leaf);
+}
+
+/* Queue the deferred attributes of \p dir as a batch, called with the lock held */
+static int pushBatch(Extractor ex, ExtractDir *dir) {
+    ExtractTask *batch = calloc(1, sizeof(ExtractTask));
+    if (!batch) {
+        ParallelCompressionLogError("malloc");
+        return -1;
+    }
+    if (dir->state == DIR_CREATED && dir->fd < 0 && reopenDir(ex, dir) < 0) {
+        dir->state = DIR_FAILED;
+    }
+    batch->batch = 1;
+    batch->dir = dir;
+    batch->ops = dir->ops;
+    batch->opCount = dir->opCount;
+    dir->ops = 0;
+    dir->opCount = 0;
+    dir->opCapacity = 0;
+    dir->users++;
+    ex->pendingCount++;
+    pushReady(ex, batch);
+    return 0;
+}
+
+/* Called with the lock held when the buffered DAT of \p task is no longer counted */
+static void releaseData(Extractor ex, ExtractTask *task) {
+    ex->bufferedSize -= task->dataSize;
+    AAMemoryBudgetRelease(ex->budget, task->dataCharge);
+    task->dataCharge = 0;
+}
+
+static void freeTask(ExtractTask *task) {
+    for (size_t i = 0; i < task->opCount; i++) {
+        free(task->ops[i].path);
+    }
+    free(task->ops);
+    free(task->path);
+    free(task->link);
+    free(task->data);
+    free(task);
+}
+
+#pragma mark - Entries
+
+/* Remove an existing file, link or special file blocking the creation of \p name */
+static int removeExisting(int dirFd, const char *name) {
+    return unlinkat(dirFd, name, 0);
+}
+
+/* Remove the extended attributes of an existing directory, with AA_FLAG_REPLACE_ATTRIBUTES */
+static int removeXattrs(Extractor ex, int fd) {
+#if defined(__APPLE__)
+    ssize_t n = flistxattr(fd, 0, 0, 0);
+#else
+    ssize_t n = flistxattr(fd, 0, 0);
+#endif
+    if (n <= 0) {
+        return (n < 0 && errno != ENOTSUP) ? -1 : 0;
+    }
+    char *names = malloc((size_t)n);
+    if (!names) {
+        ParallelCompressionLogError("malloc");
+        return -1;
+    }
+#if defined(__APPLE__)
+    n = flistxattr(fd, names, (size_t)n, 0);
+#else
+    n = flistxattr(fd, names, (size_t)n);
+#endif
+    int status = (n < 0) ? -1 : 0;
+    for (ssize_t i = 0; i < n; i += strlen(names + i) + 1) {
+#if defined(__APPLE__)
+        int r = fremovexattr(fd, names + i, 0);
+#else
+        int r = fremovexattr(fd, names + i);
+#endif
+        if (r < 0 && !((errno == EPERM || errno == EACCES) && (ex->flags & AA_FLAG_IGNORE_EPERM))) {
+            status = -1;
+        }
+    }
+    free(names);
+    return status;
+}
+
+/*
+  Apply \p attr to the entry open as \p fd, or to \p name in \p dirFd if \p fd < 0. The client can modify \p attr
+  first. If \p st is not NULL, it is the state of the entry, and the owner and mode it already has are not set.
+*/
+/* Check the result of a syscall setting an attribute, EPERM is ignored with AA_FLAG_IGNORE_EPERM */
+static int attributeFailed(Extractor ex, int r) {
+    return r < 0 && !(errno == EPERM && (ex->flags & AA_FLAG_IGNORE_EPERM));
+}
+
+static int applyAttributes(Extractor ex, int fd, int dirFd, const char *name, const char *path, uint32_t type, AAEntryAttributes *attr, const EntryStat *st) {
+    if (extractorMessage(ex, AA_ENTRY_MESSAGE_EXTRACT_ATTRIBUTES, path, attr) < 0) {
+        return -1;
+    }
+    if (attr->fields & (AA_ENTRY_ATTRIBUTE_UID | AA_ENTRY_ATTRIBUTE_GID)) {
+        uid_t uid = (attr->fields & AA_ENTRY_ATTRIBUTE_UID) ? (uid_t)attr->uid : (uid_t)-1;
+        gid_t gid = (attr->fields & AA_ENTRY_ATTRIBUTE_GID) ? (gid_t)attr->gid : (gid_t)-1;
+        int owned = st && (uid == (uid_t)-1 || uid == st->uid) && (gid == (gid_t)-1 || gid == st->gid);
+        int r = owned ? 0 : (fd >= 0) ? fchown(fd, uid, gid) : fchownat(dirFd, name, uid, gid, AT_SYMLINK_NOFOLLOW);
+        if (attributeFailed(ex, r)) {
+            return -1;
+        }
+    }
+    /* after chown, which clears the set-id bits */
+    if ((attr->fields & AA_ENTRY_ATTRIBUTE_MOD) && type != AA_ENTRY_TYPE_LNK) {
+        mode_t mode = (mode_t)(attr->mode & 07777);
+        if (!(st && st->mode == mode) && attributeFailed(ex, (fd >= 0) ? fchmod(fd, mode) : fchmodat(dirFd, name, mode, 0))) {
+            return -1;
+        }
+    }
+    if (attr->fields & AA_ENTRY_ATTRIBUTE_MTM) {
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1] = attr->mtime;
+        if (attributeFailed(ex, (fd >= 0) ? futimens(fd, times) : utimensat(dirFd, name, times, AT_SYMLINK_NOFOLLOW))) {
+            return -1;
+        }
+    }
+#if defined(__APPLE__)
+    /* last, the flags can make the entry immutable */
+    if ((attr->fields & AA_ENTRY_ATTRIBUTE_FLG) && (type == AA_ENTRY_TYPE_REG || type == AA_ENTRY_TYPE_DIR || type == AA_ENTRY_TYPE_LNK)) {
+        int flagsFd = fd;
+        if (fd < 0) {
+            flagsFd = openat(dirFd, name, O_RDONLY | O_NONBLOCK | O_CLOEXEC | ((type == AA_ENTRY_TYPE_LNK) ? O_SYMLINK : O_NOFOLLOW));
+        }
+        int r = (flagsFd >= 0) ? fchflags(flagsFd, attr->flags) : -1;
+        if (flagsFd >= 0 && flagsFd != fd) {
+            close(flagsFd);
+        }
+        if (attributeFailed(ex, r)) {
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+
+/* Queue the attributes of \p task in its parent directory, called with the lock held */
+static int deferAttributes(Extractor ex, ExtractTask *task, const EntryStat *st) {
+    ExtractDir *dir = task->parent;
+    if (dir->opCount == dir->opCapacity) {
+        size_t newCapacity = (dir->opCapacity < 16) ? 16 : 2 * dir->opCapacity;
+        AttrOp *ops = realloc(dir->ops, newCapacity * sizeof(AttrOp));
+        if (!ops) {
+            ParallelCompressionLogError("malloc");
+            return -1;
+        }
+        dir->ops = ops;
+        dir->opCapacity = newCapacity;
+    }
+    AttrOp *op = &dir->ops[dir->opCount++];
+    op->path = task->path;
+    op->name = task->name;
+    op->type = task->type;
+    op->hasStat = (st != 0);
+    if (st) {
+        op->st = *st;
+    }
+    op->attr = task->attr;
+    op->leaf = task->leaf;
+    task->path = 0; /* moved to op */
+    task->leaf = 0;
+
+    if (dir->opCount >= ex->attrBatchSize || (op->leaf && op->leaf->waitingHead)) {
+        /* full, or a later entry for the same path waits for these attributes */
+        pushBatch(ex, dir); /* on failure, applied with the directory */
+    }
+    return 0;
+}
+
+static int compareAttrOps(const void *a, const void *b) {
+    uint64_t x = ((const AttrOp *)a)->st.ino;
+    uint64_t y = ((const AttrOp *)b)->st.ino;
+    return (x < y) ? -1 : (x > y);
+}
+
+/* Apply deferred attributes to the entries of \p dirFd, in inode order */
+static void applyAttrOps(Extractor ex, int dirFd, AttrOp *ops, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (!ops[i].hasStat) {
+            ops[i].st.ino = 0;
+        }
+    }
+    qsort(ops, count, sizeof(AttrOp), compareAttrOps);
+    for (size_t i = 0; i < count && !extractorAborted(ex); i++) {
+        AttrOp *op = &ops[i];
+        if (dirFd < 0 || applyAttributes(ex, -1, dirFd, op->name, op->path, op->type, &op->attr, op->hasStat ? &op->st : 0) < 0) {
+            ParallelCompressionLogError("attributes: %s");
+            entryFailed(ex, op->path);
+        } else {
+            entryDone(ex, op->path);
+        }
+    }
+    pthread_mutex_lock(&ex->lock);
+    for (size_t i = 0; i < count; i++) {
+        if (ops[i].leaf) {
+            leafDone(ex, ops[i].leaf);
+        }
+    }
+    if (ex->stats) {
+        ex->stats->attribute_batches++;
+    }
+    pthread_mutex_unlock(&ex->lock);
+}
+
+/*
+  Create regular file \p name in \p dirFd, open for writing. With AA_FLAG_REPLACE_ATTRIBUTES, an existing file is
+  replaced by a new one, without its attributes; otherwise it is truncated. Returns the file descriptor, or -1 on failure.
+*/
+static int createFile(Extractor ex, int dirFd, const char *name) {
+    int flags = O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC;
+    int fd;
+    if (ex->flags & AA_FLAG_REPLACE_ATTRIBUTES) {
+        fd = openat(dirFd, name, flags | O_EXCL, 0600);
+        if (fd < 0 && errno == EEXIST && removeExisting(dirFd, name) == 0) {
+            fd = openat(dirFd, name, flags | O_EXCL, 0600);
+        }
+    } else {
+        fd = openat(dirFd, name, flags | O_TRUNC, 0600);
+        if (fd < 0 && (errno == ELOOP || errno == ETXTBSY) && removeExisting(dirFd, name) == 0) {
+            fd = openat(dirFd, name, flags | O_TRUNC, 0600);
+        }
+    }
+    return fd;
+}
+
+/*
+  Create a later member of a cluster from the first member: a hard link for HLC, or with
+  AA_FLAG_EXTRACT_AUTO_DEDUP_AS_HARD_LINKS, otherwise a clone, or an in-kernel copy.
+  Returns 1 on success, and 0 if the data must be extracted from the archive.
+*/
+static int dedupFile(Extractor ex, ExtractTask *task, int dirFd) {
+    ExtractCluster *cluster = task->cluster;
+    if (!cluster || task->clusterSource || cluster->state != CLUSTER_DONE) {
+        return 0;
+    }
+    if (cluster->kind == CLUSTER_HLC || (ex->flags & AA_FLAG_EXTRACT_AUTO_DEDUP_AS_HARD_LINKS)) {
+        for (int attempt = 0; attempt < 2; attempt++) {
+            if (linkat(ex->root->fd, cluster->path, dirFd, task->name, 0) == 0) {
+                pthread_mutex_lock(&ex->lock);
+                if (ex->stats) {
+                    ex->stats->linked_count++;
+                }
+                pthread_mutex_unlock(&ex->lock);
+                return 1;
+            }
+            if (errno != EEXIST || removeExisting(dirFd, task->name) < 0) {
+                break;
+            }
+        }
+    }
+    int srcFd = openat(ex->root->fd, cluster->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (srcFd < 0) {
+        return 0;
+    }
+    int done = 0;
+    int cloned = 0;
+#if defined(__APPLE__)
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (fclonefileat(srcFd, dirFd, task->name, 0) == 0) {
+            done = cloned = 1;
+            break;
+        }
+        if (errno != EEXIST || removeExisting(dirFd, task->name) < 0) {
+            break;
+        }
+    }
+#elif defined(__linux__)
+    int fd = createFile(ex, dirFd, task->name);
+    if (fd >= 0) {
+        if (ioctl(fd, FICLONE, srcFd) == 0) {
+            done = cloned = 1;
+        } else {
+            /* may still share the extents, depending on the filesystem */
+            uint64_t total = 0;
+            ssize_t n;
+            while ((n = copy_file_range(srcFd, 0, fd, 0, (size_t)1 << 30, 0)) > 0) {
+                total += (uint64_t)n;
+            }
+            done = (n == 0 && (!task->archive || total == task->dataSize));
+        }
+        close(fd);
+    }
+#endif
+    close(srcFd);
+    if (done) {
+        pthread_mutex_lock(&ex->lock);
+        if (ex->stats) {
+            if (cloned) {
+                ex->stats->cloned_count++;
+            } else {
+                ex->stats->copied_count++;
+            }
+        }
+        pthread_mutex_unlock(&ex->lock);
+    }
+    return done;
+}
+
+static int writeData(ExtractWorker *w, ExtractTask *task, AAByteStream s) {
+    if (task->data) {
+        return (writeFully(s, task->data, task->dataSize) < 0) ? -1 : 0;
+    }
+    uint64_t done = 0;
+    while (done < task->dataSize) {
+        size_t n = (task->dataSize - done < EXTRACT_IO_SIZE) ? (size_t)(task->dataSize - done) : EXTRACT_IO_SIZE;
+        size_t total = 0;
+        while (total < n) {
+            ssize_t r = AAByteStreamPRead(task->archive, w->buf + total, n - total, task->dataOffset + (off_t)(done + total));
+            if (r <= 0) {
+                ParallelCompressionLogError("truncated archive");
+                return -1;
+            }
+            total += r;
+        }
+        if (writeFully(s, w->buf, n) < 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/* Create the file, and write its data. With deferred attributes, \p st receives its state */
+static int extractFile(ExtractWorker *w, ExtractTask *task, int dirFd, EntryStat *st) {
+    Extractor ex = w->extractor;
+    int fd = createFile(ex, dirFd, task->name);
+    if (fd < 0) {
+        ParallelCompressionLogError("open: %s");
+        return -1;
+    }
+    /* zero blocks are left as holes, unless AA_FLAG_EXTRACT_NO_AUTO_SPARSE */
+    AASparseFileStats sparseStats = { 0 };
+    AAByteStream s = AASparseFileOutputStreamOpenWithFD(fd, 0, ex->flags, &sparseStats);
+    int status = s ? writeData(w, task, s) : -1;
+    if (AAByteStreamClose(s) < 0) {
+        status = -1;
+    }
+    if (status == 0) {
+        if (ex->attrBatchSize > 0) {
+            struct stat s;
+            status = fstat(fd, &s);
+            st->ino = (uint64_t)s.st_ino;
+            st->mode = (uint32_t)(s.st_mode & 07777);
+            st->uid = (uint32_t)s.st_uid;
+            st->gid = (uint32_t)s.st_gid;
+        } else {
+            status = applyAttributes(ex, fd, dirFd, task->name, task->path, task->type, &task->attr, 0);
+        }
+    }
+    close(fd);
+    if (status == 0) {
+        pthread_mutex_lock(&ex->lock);
+        if (ex->stats) {
+            ex->stats->data_bytes += task->dataSize;
+            ex->stats->hole_bytes += sparseStats.hole_bytes;
+        }
+        pthread_mutex_unlock(&ex->lock);
+    }
+    return status;
+}
+
+static int extractOther(ExtractTask *task, int dirFd) {
+    int r;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        switch (task->type) {
+            case AA_ENTRY_TYPE_LNK: r = symlinkat(task->link, dirFd, task->name); break;
+            case AA_ENTRY_TYPE_FIFO: r = mkfifoat(dirFd, task->name, 0600); break;
+            case AA_ENTRY_TYPE_CHR: r = mknodat(dirFd, task->name, S_IFCHR | 0600, (dev_t)task->dev); break;
+            case AA_ENTRY_TYPE_BLK: r = mknodat(dirFd, task->name, S_IFBLK | 0600, (dev_t)task->dev); break;
+            default:
+                ParallelCompressionLogError("unsupported entry type");
+                return -1;
+        }
+        if (r == 0 || errno != EEXIST || removeExisting(dirFd, task->name) < 0) {
+            break;
+        }
+    }
+    return r;
+}
+
+static int createDir(Extractor ex, ExtractTask *task, int dirFd) {
+    int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    /* writable until the metadata is applied, after the contents */
+    int existed = 0;
+    if (mkdirat(dirFd, task->name, 0755) < 0) {
+        if (errno != EEXIST) {
+            return -1;
+        }
+        existed = 1;
+    }
+    int fd = openat(dirFd, task->name, flags);
+    if (fd < 0 && (errno == ENOTDIR || errno == ELOOP) && removeExisting(dirFd, task->name) == 0) {
+        if (mkdirat(dirFd, task->name, 0755) < 0) {
+            return -1;
+        }
+        existed = 0;
+        fd = openat(dirFd, task->name, flags);
+    }
+    if (fd >= 0 && existed && (ex->flags & AA_FLAG_REPLACE_ATTRIBUTES) && removeXattrs(ex, fd) < 0) {
+        ParallelCompressionLogError("removing extended attributes: %s");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void runEntry(ExtractWorker *w, ExtractTask *task) {
+    Extractor ex = w->extractor;
+    int dirFd = task->parentFailed ? -1 : task->parent->fd;
+    int status = -1;
+    int created = 0; /* regular file created with its data */
+    if (extractorAborted(ex)) {
+        if (task->dir) {
+            dirReady(ex, task->dir, -1);
+        }
+    } else if (task->type == AA_ENTRY_TYPE_DIR) {
+        int fd = (dirFd >= 0) ? createDir(ex, task, dirFd) : -1;
+        dirReady(ex, task->dir, fd);
+        if (fd < 0) {
+            ParallelCompressionLogError("mkdir: %s");
+            pthread_mutex_lock(&ex->lock);
+            int hasEntry = task->dir->hasEntry;
+            pthread_mutex_unlock(&ex->lock);
+            if (hasEntry) {
+                entryFailed(ex, task->path);
+            }
+        }
+    } else if (dirFd < 0) {
+        entryFailed(ex, task->path);
+    } else {
+        EntryStat st;
+        int hasStat = 0;
+        if (task->type == AA_ENTRY_TYPE_REG && dedupFile(ex, task, dirFd)) {
+            status = 0;
+            if (ex->attrBatchSize == 0) {
+                status = applyAttributes(ex, -1, dirFd, task->name, task->path, task->type, &task->attr, 0);
+            }
+        } else if (task->type == AA_ENTRY_TYPE_REG && task->cluster && !task->clusterSource && !task->archive) {
+            ParallelCompressionLogError("cluster member without data: %s");
+            status = -1;
+        } else if (task->type == AA_ENTRY_TYPE_REG) {
+            status = extractFile(w, task, dirFd, &st);
+            hasStat = 1;
+            created = (status == 0);
+        } else {
+            status = extractOther(task, dirFd);
+            if (status == 0 && ex->attrBatchSize == 0) {
+                status = applyAttributes(ex, -1, dirFd, task->name, task->path, task->type, &task->attr, 0);
+            }
+        }
+        if (status == 0 && ex->attrBatchSize > 0) {
+            /* END is sent when the attributes are applied */
+            pthread_mutex_lock(&ex->lock);
+            status = deferAttributes(ex, task, hasStat ? &st : 0);
+            pthread_mutex_unlock(&ex->lock);
+            if (status < 0) {
+                entryFailed(ex, task->path);
+            }
+        } else if (status < 0) {
+            entryFailed(ex, task->path);
+        } else {
+            entryDone(ex, task->path);
+        }
+    }
+
+    pthread_mutex_lock(&ex->lock);
+    if (!task->parentFailed) {
+        releaseDir(ex, task->parent);
+    }
+    if (task->clusterSource) {
+        clusterReady(ex, task->cluster, created);
+    }
+    if (task->leaf) {
+        leafDone(ex, task->leaf);
+    }
+    if (task->data) {
+        releaseData(ex, task);
+    }
+    ex->pendingCount--;
+    pthread_cond_broadcast(&ex->doneCond);
+    pthread_mutex_unlock(&ex->lock);
+    freeTask(task);
+}
+
+/* Apply a batch of deferred attributes, the task holds a use of the directory */
+static void runBatch(ExtractWorker *w, ExtractTask *task) {
+    Extractor ex = w->extractor;
+    applyAttrOps(ex, task->dir->fd, task->ops, task->opCount);
+
+    pthread_mutex_lock(&ex->lock);
+    releaseDir(ex, task->dir);
+    ex->pendingCount--;
+    pthread_cond_broadcast(&ex->doneCond);
+    pthread_mutex_unlock(&ex->lock);
+    freeTask(task);
+}
+
+/* Apply the metadata of a directory, once all its subdirectories are done */
+static void runFinalize(ExtractWorker *w, ExtractTask *task) {
+    Extractor ex = w->extractor;
+    ExtractDir *dir = task->dir;
+    pthread_mutex_lock(&ex->lock);
+    if (dir->state == DIR_CREATED && dir->fd < 0 && reopenDir(ex, dir) < 0) {
+        dir->state = DIR_FAILED;
+    }
+    AttrOp *ops = dir->ops;
+    size_t opCount = dir->opCount;
+    dir->ops = 0;
+    dir->opCount = 0;
+    dir->opCapacity = 0;
+    int hasEntry = dir->hasEntry;
+    AAEntryAttributes attr = dir->attr;
+    pthread_mutex_unlock(&ex->lock);
+
+    /* the remaining deferred attributes of the entries, before the directory */
+    if (opCount > 0) {
+        applyAttrOps(ex, (dir->state == DIR_CREATED) ? dir->fd : -1, ops, opCount);
+    }
+    for (size_t i = 0; i < opCount; i++) {
+        free(ops[i].path);
+    }
+    free(ops);
+
+    if (hasEntry && !extractorAborted(ex)) {
+        if (dir->state == DIR_CREATED && applyAttributes(ex, dir->fd, -1, 0, dir->path, AA_ENTRY_TYPE_DIR, &attr, 0) == 0) {
+            entryDone(ex, dir->path);
+        } else if (dir->state == DIR_CREATED) {
+            ParallelCompressionLogError("directory attributes: %s");
+            entryFailed(ex, dir->path);
+        }
+    }
+
+    pthread_mutex_lock(&ex->lock);
+    if (dir != ex->root && dir->fd >= 0) {
+        close(dir->fd);
+        dir->fd = -1;
+        ex->openDirs--;
+    }
+    int requeued = 0;
+    if (dir->parent) {
+        if (--dir->parent->remaining == 0) {
+            /* last subdirectory done, the task moves to the parent */
+            task->dir = dir->parent;
+            pushReady(ex, task);
+            requeued = 1;
+        }
+    } else {
+        ex->rootFinalized = 1;
+    }
+    if (!requeued) {
+        ex->pendingCount--;
+        pthread_cond_broadcast(&ex->doneCond);
+    }
+    pthread_mutex_unlock(&ex->lock);
+    if (!requeued) {
+        freeTask(task);
+    }
+}
+
+static void *workerProc(void *arg) {
+    ExtractWorker *w = arg;
+    Extractor ex = w->extractor;
+    for (;;) {
+        pthread_mutex_lock(&ex->lock);
+        while (!ex->readyHead && !ex->stop) {
+            pthread_cond_wait(&ex->workCond, &ex->lock);
+        }
+        ExtractTask *task = ex->readyHead;
+        if (!task) {
+            pthread_mutex_unlock(&ex->lock);
+            break;
+        }
+        ex->readyHead = task->next;
+        if (!ex->readyHead) {
+            ex->readyTail = 0;
+        }
+        pthread_mutex_unlock(&ex->lock);
+        if (task->finalize) {
+            runFinalize(w, task);
+        } else if (task->batch) {
+            runBatch(w, task);
+        } else {
+            runEntry(w, task);
+        }
+    }
+    return 0;
+}
+
+#pragma mark - Directory graph
+
+static int tableInsert(Extractor ex, ExtractDir *dir) {
+    if (2 * (ex->dirCount + 1) > ex->tableSize) {
+        size_t newSize = (ex->tableSize < 1024) ? 1024 : 2 * ex->tableSize;
+        ExtractDir **table = calloc(newSize, sizeof(ExtractDir *));
+        if (!table) {
+            ParallelCompressionLogError("malloc");
+            return -1;
+        }
+        for (size_t i = 0; i < ex->dirCount; i++) {
+            size_t j = (size_t)hashPath(ex->dirs[i]->path, strlen(ex->dirs[i]->path)) & (newSize - 1);
+            while (table[j]) {
+                j = (j + 1) & (newSize - 1);
+            }
+            table[j] = ex->dirs[i];
+        }
+        free(ex->table);
+        ex->table = table;
+        ex->tableSize = newSize;
+    }
+    if (ex->dirCount == ex->dirCapacity) {
+        size_t newCapacity = (ex->dirCapacity < 1024) ? 1024 : 2 * ex->dirCapacity;
+        ExtractDir **dirs = realloc(ex->dirs, newCapacity * sizeof(ExtractDir *));
+        if (!dirs) {
+            ParallelCompressionLogError("malloc");
+            return -1;
+        }
+        ex->dirs = dirs;
+        ex->dirCapacity = newCapacity;
+    }
+    size_t j = (size_t)hashPath(dir->path, strlen(dir->path)) & (ex->tableSize - 1);
+    while (ex->table[j]) {
+        j = (j + 1) & (ex->tableSize - 1);
+    }
+    ex->table[j] = dir;
+    ex->dirs[ex->dirCount++] = dir;
+    return 0;
+}
+
+static ExtractDir *tableLookup(Extractor ex, const char *path, size_t n) {
+    size_t j = (size_t)hashPath(path, n) & (ex->tableSize - 1);
+    while (ex->table[j]) {
+        ExtractDir *dir = ex->table[j];
+        if (strncmp(dir->path, path, n) == 0 && dir->path[n] == 0) {
+            return dir;
+        }
+        j = (j + 1) & (ex->tableSize - 1);
+    }
+    return 0;
+}
+
+/* Directory \p path, created with its missing parents if needed */
+static ExtractDir *ensureDir(Extractor ex, const char *path, size_t n) {
+    ExtractDir *dir = tableLookup(ex, path, n);
+    if (dir) {
+        return dir;
+    }
+    size_t p = n;
+    while (p > 0 && path[p - 1] != '/') {
+        p--;
+    }
+    ExtractDir *parent = ensureDir(ex, path, (p > 0) ? p - 1 : 0);
+    if (!parent) {
+        return 0;
+    }
+    dir = calloc(1, sizeof(ExtractDir));
+    ExtractTask *task = calloc(1, sizeof(ExtractTask));
+    char *dirPath = malloc(n + 1);
+    char *taskPath = malloc(n + 1);
+    if (!dir || !task || !dirPath || !taskPath) {
+        ParallelCompressionLogError("malloc");
+        free(dir);
+        free(task);
+        free(dirPath);
+        free(taskPath);
+        return 0;
+    }
+    memcpy(dirPath, path, n);
+    dirPath[n] = 0;
+    memcpy(taskPath, path, n);
+    taskPath[n] = 0;
+    dir->path = dirPath;
+    dir->name = dirPath + p;
+    dir->parent = parent;
+    dir->fd = -1;
+    if (tableInsert(ex, dir) < 0) {
+        free(dirPath);
+        free(dir);
+        free(task);
+        free(taskPath);
+        return 0;
+    }
+    /* only the client thread reads the children links, until the workers are idle */
+    dir->nextSibling = parent->firstChild;
+    parent->firstChild = dir;
+
+    task->type = AA_ENTRY_TYPE_DIR;
+    task->dir = dir;
+    task->parent = parent;
+    task->path = taskPath;
+    task->name = taskPath + p;
+    pthread_mutex_lock(&ex->lock);
+    ex->pendingCount++;
+    scheduleTask(ex, task);
+    pthread_mutex_unlock(&ex->lock);
+    return dir;
+}
+
+#pragma mark - Clusters
+
+static size_t clusterSlot(uint32_t kind, uint64_t id, size_t tableSize) {
+    return (size_t)((id * 0x9e3779b97f4a7c15ULL) ^ kind) & (tableSize - 1);
+}
+
+/* Cluster \p kind, \p id of the current archive, or NULL if not found */
+static ExtractCluster *clusterLookup(Extractor ex, uint32_t kind, uint64_t id) {
+    if (ex->clusterTableSize == 0) {
+        return 0;
+    }
+    size_t j = clusterSlot(kind, id, ex->clusterTableSize);
+    while (ex->clusterTable[j]) {
+        ExtractCluster *cluster = ex->clusterTable[j];
+        if (cluster->kind == kind && cluster->id == id) {
+            return cluster;
+        }
+        j = (j + 1) & (ex->clusterTableSize - 1);
+    }
+    return 0;
+}
+
+/* New cluster \p kind, \p id of the current archive, with first member \p path */
+static ExtractCluster *clusterInsert(Extractor ex, uint32_t kind, uint64_t id, const char *path) {
+    size_t archiveCount = ex->clusterCount - ex->clusterBase;
+    if (2 * (archiveCount + 1) > ex->clusterTableSize) {
+        size_t newSize = (ex->clusterTableSize < 1024) ? 1024 : 2 * ex->clusterTableSize;
+        ExtractCluster **table = calloc(newSize, sizeof(ExtractCluster *));
+        if (!table) {
+            ParallelCompressionLogError("malloc");
+            return 0;
+        }
+        for (size_t i = ex->clusterBase; i < ex->clusterCount; i++) {
+            size_t j = clusterSlot(ex->clusters[i]->kind, ex->clusters[i]->id, newSize);
+            while (table[j]) {
+                j = (j + 1) & (newSize - 1);
+            }
+            table[j] = ex->clusters[i];
+        }
+        free(ex->clusterTable);
+        ex->clusterTable = table;
+        ex->clusterTableSize = newSize;
+    }
+    if (ex->clusterCount == ex->clusterCapacity) {
+        size_t newCapacity = (ex->clusterCapacity < 1024) ? 1024 : 2 * ex->clusterCapacity;
+        ExtractCluster **clusters = realloc(ex->clusters, newCapacity * sizeof(ExtractCluster *));
+        if (!clusters) {
+            ParallelCompressionLogError("malloc");
+            return 0;
+        }
+        ex->clusters = clusters;
+        ex->clusterCapacity = newCapacity;
+    }
+    ExtractCluster *cluster = calloc(1, sizeof(ExtractCluster));
+    if (!cluster || !(cluster->path = strdup(path))) {
+        ParallelCompressionLogError("malloc");
+        free(cluster);
+        return 0;
+    }
+    cluster->kind = kind;
+    cluster->id = id;
+    size_t j = clusterSlot(kind, id, ex->clusterTableSize);
+    while (ex->clusterTable[j]) {
+        j = (j + 1) & (ex->clusterTableSize - 1);
+    }
+    ex->clusterTable[j] = cluster;
+    ex->clusters[ex->clusterCount++] = cluster;
+    return cluster;
+}
+
+/* Attach a regular file to its HLC or SLC cluster, if any */
+static int attachCluster(Extractor ex, ExtractTask *task, const uint8_t *h, size_t size) {
+    uint64_t id;
+    uint32_t kind = 0;
+    if (aaEncodedHeaderGetUInt(h, size, "HLC", &id) > 0) {
+        kind = CLUSTER_HLC;
+    } else if (!(ex->flags & AA_FLAG_EXTRACT_NO_AUTO_DEDUP) && aaEncodedHeaderGetUInt(h, size, "SLC", &id) > 0) {
+        kind = CLUSTER_SLC;
+    }
+    if (kind == 0) {
+        return 0;
+    }
+    task->cluster = clusterLookup(ex, kind, id);
+    if (!task->cluster) {
+        task->cluster = clusterInsert(ex, kind, id, task->path);
+        task->clusterSource = 1;
+    }
+    return task->cluster ? 0 : -1;
+}
+
+#pragma mark - Leaves
+
+/* Entry being extracted at \p path, or NULL if none, called with the lock held */
+static ExtractLeaf *leafLookup(Extractor ex, const char *path, uint64_t hash) {
+    if (ex->leafTableSize == 0) {
+        return 0;
+    }
+    for (ExtractLeaf *leaf = ex->leaves[hash & (ex->leafTableSize - 1)]; leaf; leaf = leaf->next) {
+        if (leaf->hash == hash && strcmp(leaf->path, path) == 0) {
+            return leaf;
+        }
+    }
+    return 0;
+}
+
+/* New entry being extracted at \p path, called with the lock held */
+static ExtractLeaf *leafInsert(Extractor ex, const char *path, uint64_t hash) {
+    if (ex->leafCount + 1 > ex->leafTableSize) {
+        size_t newSize = (ex->leafTableSize < 1024) ? 1024 : 2 * ex->leafTableSize;
+        ExtractLeaf **table = calloc(newSize, sizeof(ExtractLeaf *));
+        if (!table) {
+            ParallelCompressionLogError("malloc");
+            return 0;
+        }
+        for (size_t i = 0; i < ex->leafTableSize; i++) {
+            ExtractLeaf *leaf = ex->leaves[i];
+            while (leaf) {
+                ExtractLeaf *next = leaf->next;
+                size_t j = (size_t)leaf->hash & (newSize - 1);
+                leaf->next = table[j];
+                table[j] = leaf;
+                leaf = next;
+            }
+        }
+        free(ex->leaves);
+        ex->leaves = table;
+        ex->leafTableSize = newSize;
+    }
+    ExtractLeaf *leaf = calloc(1, sizeof(ExtractLeaf));
+    if (!leaf || !(leaf->path = strdup(path))) {
+        ParallelCompressionLogError("malloc");
+        free(leaf);
+        return 0;
+    }
+    size_t j = (size_t)hash & (ex->leafTableSize - 1);
+    leaf->hash = hash;
+    leaf->next = ex->leaves[j];
+    ex->leaves[j] = leaf;
+    ex->leafCount++;
+    return leaf;
+}
+
+/*
+  Start \p task, or queue it after the entry being extracted at the same path: entries are
+  extracted in archive order, the last one wins. Called with the lock held.
+*/
+static int startLeaf(Extractor ex, ExtractTask *task) {
+    uint64_t hash = hashPath(task->path, strlen(task->path));
+    ExtractLeaf *leaf = leafLookup(ex, task->path, hash);
+    if (!leaf) {
+        task->leaf = leafInsert(ex, task->path, hash);
+        if (!task->leaf) {
+            return -1;
+        }
+        startTask(ex, task);
+        return 0;
+    }
+    /* the attributes of the previous entry may wait in a batch: queue them now */
+    for (size_t i = 0; i < task->parent->opCount; i++) {
+        if (task->parent->ops[i].leaf == leaf) {
+            if (pushBatch(ex, task->parent) < 0) {
+                return -1;
+            }
+            break;
+        }
+    }
+    task->leaf = leaf;
+    task->next = 0;
+    if (leaf->waitingTail) {
+        leaf->waitingTail->next = task;
+    } else {
+        leaf->waitingHead = task;
+    }
+    leaf->waitingTail = task;
+    if (ex->stats) {
+        ex->stats->deferred_count++;
+    }
+    return 0;
+}
+
+#pragma mark - Archive
+
+static void readAttributes(const uint8_t *h, size_t size, AAEntryAttributes *attr) {
+    uint64_t x;
+    AAEncodedField field;
+    memset(attr, 0, sizeof(AAEntryAttributes));
+    if (aaEncodedHeaderGetUInt(h, size, "MOD", &x) > 0) {
+        attr->fields |= AA_ENTRY_ATTRIBUTE_MOD;
+        attr->mode = (uint32_t)x;
+    }
+    if (aaEncodedHeaderGetUInt(h, size, "UID", &x) > 0) {
+        attr->fields |= AA_ENTRY_ATTRIBUTE_UID;
+        attr->uid = (uint32_t)x;
+    }
+    if (aaEncodedHeaderGetUInt(h, size, "GID", &x) > 0) {
+        attr->fields |= AA_ENTRY_ATTRIBUTE_GID;
+        attr->gid = (uint32_t)x;
+    }
+    if (aaEncodedHeaderGetUInt(h, size, "FLG", &x) > 0) {
+        attr->fields |= AA_ENTRY_ATTRIBUTE_FLG;
+        attr->flags = (uint32_t)x;
+    }
+    if (aaEncodedHeaderFindField(h, size, "MTM", &field) > 0 && field.type == AA_FIELD_TYPE_TIMESPEC) {
+        uint64_t sec = 0;
+        uint32_t nsec = 0;
+        for (int i = 0; i < 8; i++) {
+            sec |= (uint64_t)field.value[i] << (8 * i);
+        }
+        for (int i = 0; i < 4 && field.valueSize == 12; i++) {
+            nsec |= (uint32_t)field.value[8 + i] << (8 * i);
+        }
+        attr->fields |= AA_ENTRY_ATTRIBUTE_MTM;
+        attr->mtime.tv_sec = (time_t)sec;
+        attr->mtime.tv_nsec = (nsec < 1000000000) ? (long)nsec : 0;
+    }
+}
+
+/* Read the DAT blob in memory, when the workers can't pread it.
+   The data is charged to the memory budget. We wait for our own buffered tasks to complete while it is exhausted,
+   without blocking in the budget, which may be held by the stream we read from. When nothing of ours is buffered,
+   the data is read anyway, uncharged, so a blob larger than the budget can't stall the extraction. */
+static int bufferData(Extractor ex, AAEntryReader reader, ExtractTask *task) {
+    size_t size = (size_t)task->dataSize;
+    pthread_mutex_lock(&ex->lock);
+    while (AAMemoryBudgetTryAcquire(ex->budget, size) < 0) {
+        if (ex->bufferedSize == 0 || extractorAborted(ex)) {
+            size = 0;
+            break;
+        }
+        pthread_cond_wait(&ex->doneCond, &ex->lock);
+    }
+    task->dataCharge = size;
+    ex->bufferedSize += task->dataSize;
+    pthread_mutex_unlock(&ex->lock);
+    task->data = malloc(task->dataSize > 0 ? (size_t)task->dataSize : 1);
+    if (!task->data || (uint64_t)AAEntryReaderReadBlob(reader, AA_FIELD_DAT, task->data, (size_t)task->dataSize) != task->dataSize) {
+        ParallelCompressionLogError("DAT read failed");
+        pthread_mutex_lock(&ex->lock);
+        releaseData(ex, task);
+        pthread_mutex_unlock(&ex->lock);
+        return -1;
+    }
+    return 0;
+}
+
+/* pathIsValid doesn't check the last component, "." and ".." would resolve outside the entry's own name */
+static int lastComponentIsDots(const char *path, size_t n) {
+    size_t s = n;
+    while (s > 0 && path[s - 1] != '/') {
+        s--;
+    }
+    return (n - s == 1 && path[s] == '.') || (n - s == 2 && path[s] == '.' && path[s + 1] == '.');
+}
+
+/* Queue the extraction of one entry. Returns 0 on success, and -1 on failure */
+static int submitEntry(Extractor ex, AAEntryReader reader, AAByteStream archive, off_t base, int canPRead, const uint8_t *h, size_t size) {
+    char path[1024];
+    uint64_t type;
+    if (aaEncodedHeaderGetUInt(h, size, "TYP", &type) <= 0 || aaEncodedHeaderGetString(h, size, "PAT", sizeof(path), path) <= 0) {
+        ParallelCompressionLogError("invalid entry");
+        return -1;
+    }
+    char *p = path;
+    while (p[0] == '.' && p[1] == '/') {
+        p += 2;
+    }
+    size_t n = strlen(p);
+    if (!pathIsValid(p, (int)n) || lastComponentIsDots(p, n)) {
+        ParallelCompressionLogError("invalid path: %s");
+        return -1;
+    }
+    if (type == AA_ENTRY_TYPE_METADATA) {
+        return 0;
+    }
+    int r = extractorMessage(ex, AA_ENTRY_MESSAGE_EXTRACT_BEGIN, p, 0);
+    if (r != 0) {
+        return (r < 0) ? -1 : 0;
+    }
+
+    if (type == AA_ENTRY_TYPE_DIR) {
+        ExtractDir *dir = (n == 0) ? ex->root : ensureDir(ex, p, n);
+        if (!dir) {
+            return -1;
+        }
+        AAEntryAttributes attr;
+        readAttributes(h, size, &attr);
+        /* the workers read them when the directory fails or is finalized */
+        pthread_mutex_lock(&ex->lock);
+        dir->hasEntry = 1;
+        dir->attr = attr;
+        pthread_mutex_unlock(&ex->lock);
+        return 0;
+    }
+    if (n == 0) {
+        ParallelCompressionLogError("invalid path: %s");
+        return -1;
+    }
+
+    ExtractTask *task = calloc(1, sizeof(ExtractTask));
+    if (!task || !(task->path = strdup(p))) {
+        ParallelCompressionLogError("malloc");
+        free(task);
+        return -1;
+    }
+    task->type = (uint32_t)type;
+    size_t s = n;
+    while (s > 0 && p[s - 1] != '/') {
+        s--;
+    }
+    task->name = task->path + s;
+    task->parent = ensureDir(ex, p, (s > 0) ? s - 1 : 0);
+    readAttributes(h, size, &task->attr);
+    if (!task->parent) {
+        freeTask(task);
+        return -1;
+    }
+    if (type == AA_ENTRY_TYPE_LNK) {
+        char link[1024];
+        if (aaEncodedHeaderGetString(h, size, "LNK", sizeof(link), link) <= 0 || !(task->link = strdup(link))) {
+            ParallelCompressionLogError("invalid link");
+            freeTask(task);
+            return -1;
+        }
+    }
+    if (type == AA_ENTRY_TYPE_CHR || type == AA_ENTRY_TYPE_BLK) {
+        aaEncodedHeaderGetUInt(h, size, "DEV", &task->dev);
+    }
+    if (type == AA_ENTRY_TYPE_REG && attachCluster(ex, task, h, size) < 0) {
+        freeTask(task);
+        return -1;
+    }
+    off_t dataOffset;
+    if (type == AA_ENTRY_TYPE_REG && AAEntryReaderGetBlobLocation(reader, AA_FIELD_DAT, &dataOffset, &task->dataSize) > 0) {
+        task->archive = archive;
+        task->dataOffset = base + dataOffset;
+        if (!canPRead && bufferData(ex, reader, task) < 0) {
+            freeTask(task);
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&ex->lock);
+    int status = startLeaf(ex, task);
+    if (status == 0) {
+        ex->pendingCount++;
+    } else {
+        if (task->clusterSource) {
+            clusterReady(ex, task->cluster, 0);
+        }
+        if (task->data) {
+            releaseData(ex, task);
+        }
+    }
+    pthread_mutex_unlock(&ex->lock);
+    if (status < 0) {
+        freeTask(task);
+    }
+    return status;
+}
+
+#pragma mark - API
+
+AAExtractor AAExtractorOpen(const char *dir, void *msg_data, AAEntryMessageProc msg_proc, AAFlagSet flags, int n_threads, AAExtractorStats *stats) {
+    Extractor ex = calloc(1, sizeof(struct AAExtractor_impl));
+    if (!ex) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    pthread_mutex_init(&ex->msgLock, 0);
+    pthread_mutex_init(&ex->lock, 0);
+    pthread_cond_init(&ex->workCond, 0);
+    pthread_cond_init(&ex->doneCond, 0);
+    ex->flags = flags;
+    ex->msgData = msg_data;
+    ex->msgProc = msg_proc;
+    ex->stats = stats;
+    ex->nThreads = n_threads > 0 ? n_threads : (int)getDefaultNThreads();
+    ex->ownBudget = AAMemoryBudgetCreate(EXTRACT_DEFAULT_BUDGET);
+    ex->budget = ex->ownBudget;
+
+    ex->root = calloc(1, sizeof(ExtractDir));
+    ex->workers = calloc(ex->nThreads, sizeof(ExtractWorker));
+    if (!ex->ownBudget || !ex->root || !ex->workers || !(ex->root->path = strdup(""))) {
+        ParallelCompressionLogError("malloc");
+        goto ERROR;
+    }
+    ex->root->name = ex->root->path;
+    ex->root->fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ex->root->fd < 0) {
+        ParallelCompressionLogError("not a directory: %s");
+        goto ERROR;
+    }
+    ex->root->state = DIR_CREATED;
+    if (tableInsert(ex, ex->root) < 0) {
+        goto ERROR;
+    }
+    for (int i = 0; i < ex->nThreads; i++) {
+        ExtractWorker *w = &ex->workers[i];
+        w->extractor = ex;
+        w->buf = malloc(EXTRACT_IO_SIZE);
+        if (!w->buf) {
+            ParallelCompressionLogError("malloc");
+            goto ERROR;
+        }
+    }
+    for (int i = 0; i < ex->nThreads; i++) {
+        if (pthread_create(&ex->workers[i].thread, 0, workerProc, &ex->workers[i]) != 0) {
+            ParallelCompressionLogError("pthread_create");
+            goto ERROR;
+        }
+        ex->workers[i].threadStarted = 1;
+    }
+    return ex;
+
+ERROR:
+    AAExtractorClose(ex);
+    return 0;
+}
+
+int AAExtractorSetAttributeBatchSize(AAExtractor extractor, size_t batch_size) {
+    Extractor ex = extractor;
+    ex->attrBatchSize = batch_size;
+    return 0;
+}
+
+int AAExtractorSetMemoryBudget(AAExtractor extractor, AAMemoryBudget budget) {
+    Extractor ex = extractor;
+    ex->budget = budget;
+    return 0;
+}
+
+int AAExtractorExtractArchive(AAExtractor extractor, AAByteStream archive, AAEntryFilter filter) {
+    Extractor ex = extractor;
+    off_t base = AAByteStreamSeek(archive, 0, SEEK_CUR);
+    uint8_t probe;
+    int canPRead = (base >= 0 && AAByteStreamPRead(archive, &probe, 0, base) >= 0);
+    /* cluster ids are relative to the archive */
+    ex->clusterBase = ex->clusterCount;
+    if (ex->clusterTable) {
+        memset(ex->clusterTable, 0, ex->clusterTableSize * sizeof(ExtractCluster *));
+    }
+    AAEntryReader reader = AAEntryReaderOpen(archive, 0, 0);
+    if (!reader || (filter && AAEntryReaderSetFilter(reader, filter) < 0)) {
+        AAEntryReaderDestroy(reader);
+        return -1;
+    }
+    int status = 0;
+    const uint8_t *h;
+    size_t size;
+    int r = 0;
+    while (!extractorAborted(ex) && (r = AAEntryReaderNext(reader, &h, &size)) > 0) {
+        if (submitEntry(ex, reader, archive, base, canPRead, h, size) < 0) {
+            status = -1;
+            break;
+        }
+    }
+    if (r < 0 || extractorAborted(ex)) {
+        status = -1;
+    }
+    if (status < 0) {
+        pthread_mutex_lock(&ex->lock);
+        ex->status = -1;
+        pthread_mutex_unlock(&ex->lock);
+    }
+    AAEntryReaderDestroy(reader);
+    return status;
+}
+
+int AAExtractorClose(AAExtractor extractor) {
+    Extractor ex = extractor;
+    if (!ex) {
+        return 0;
+    }
+    int started = (ex->workers && ex->workers[ex->nThreads - 1].threadStarted);
+    if (started) {
+        /* all entries, then the directories, deepest first */
+        pthread_mutex_lock(&ex->lock);
+        while (ex->pendingCount > 0) {
+            pthread_cond_wait(&ex->doneCond, &ex->lock);
+        }
+        for (size_t i = 0; i < ex->dirCount; i++) {
+            ExtractDir *dir = ex->dirs[i];
+            dir->remaining = 0;
+            for (ExtractDir *child = dir->firstChild; child; child = child->nextSibling) {
+                dir->remaining++;
+            }
+        }
+        for (size_t i = 0; i < ex->dirCount; i++) {
+            if (ex->dirs[i]->remaining > 0) {
+                continue;
+            }
+            ExtractTask *task = calloc(1, sizeof(ExtractTask));
+            if (!task) {
+                ParallelCompressionLogError("malloc");
+                ex->status = -1;
+                break;
+            }
+            task->finalize = 1;
+            task->dir = ex->dirs[i];
+            ex->pendingCount++;
+            pushReady(ex, task);
+        }
+        while (ex->pendingCount > 0) {
+            pthread_cond_wait(&ex->doneCond, &ex->lock);
+        }
+        pthread_mutex_unlock(&ex->lock);
+    }
+    pthread_mutex_lock(&ex->lock);
+    ex->stop = 1;
+    pthread_cond_broadcast(&ex->workCond);
+    pthread_mutex_unlock(&ex->lock);
+    int status = ex->status;
+    if (ex->aborted || (started && !ex->rootFinalized)) {
+        status = -1;
+    }
+    if (ex->workers) {
+        for (int i = 0; i < ex->nThreads; i++) {
+            if (ex->workers[i].threadStarted) {
+                pthread_join(ex->workers[i].thread, 0);
+            }
+            free(ex->workers[i].buf);
+        }
+        free(ex->workers);
+    }
+    for (size_t i = 0; i < ex->dirCount; i++) {
+        ExtractDir *dir = ex->dirs[i];
+        if (dir->fd >= 0) {
+            close(dir->fd);
+        }
+        for (size_t j = 0; j < dir->opCount; j++) {
+            free(dir->ops[j].path);
+        }
+        free(dir->ops);
+        free(dir->path);
+        free(dir);
+    }
+    if (ex->dirCount == 0 && ex->root) {
+        if (ex->root->fd > 0) {
+            close(ex->root->fd);
+        }
+        free(ex->root->path);
+        free(ex->root);
+    }
+    for (size_t i = 0; i < ex->clusterCount; i++) {
+        free(ex->clusters[i]->path);
+        free(ex->clusters[i]);
+    }
+    for (size_t i = 0; i < ex->leafTableSize; i++) {
+        ExtractLeaf *leaf = ex->leaves[i];
+        while (leaf) {
+            ExtractLeaf *next = leaf->next;
+            free(leaf->path);
+            free(leaf);
+            leaf = next;
+        }
+    }
+    free(ex->leaves);
+    free(ex->clusters);
+    free(ex->clusterTable);
+    free(ex->dirs);
+    free(ex->table);
+    pthread_cond_destroy(&ex->doneCond);
+    pthread_cond_destroy(&ex->workCond);
+    pthread_mutex_destroy(&ex->lock);
+    pthread_mutex_destroy(&ex->msgLock);
+    AAMemoryBudgetDestroy(ex->ownBudget);
+    free(ex);
+    return status;
+}
@@ -0,0 +1,194 @@
+// AppleArchive parallel extractor
+
+#pragma once
+
+#ifndef __APPLE_ARCHIVE_H
+#error Include AppleArchive.h instead of this file
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull begin")
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma mark - Extractor
+
+/*!
+  @abstract Extracts uncompressed archives to a directory on several threads
+
+  @discussion
+  Entries are read in archive order by the client thread, and extracted by worker threads. Each entry waits for
+  its parent directory to be created, but not for the entries before it: directories form a dependency graph,
+  and file creation and data writes run in parallel as soon as their parent exists. Parent directories are
+  kept open, and entries are created with openat, mkdirat, symlinkat, relative to them, so paths are never
+  resolved again, and never through a symbolic link. Directories missing from the archive are created.
+  Directories are created writable, and their metadata (mode, owner, times) is applied when the archive is
+  complete, after the metadata of all their contents, so their modification time is kept.
+  When the archive stream implements pread, workers read the DAT blobs directly from the archive, otherwise the
+  client thread reads them in memory, up to a limit.
+*/
+typedef struct AAExtractor_impl * AAExtractor APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+// Entry attributes present in AAEntryAttributes
+typedef uint32_t AAEntryAttributeMask APPLE_ARCHIVE_SWIFT_PRIVATE;
+APPLE_ARCHIVE_ENUM(AAEntryAttributeMasks, uint32_t) {
+
+  AA_ENTRY_ATTRIBUTE_MOD       = 1,     ///< access modes
+  AA_ENTRY_ATTRIBUTE_UID       = 2,     ///< user id
+  AA_ENTRY_ATTRIBUTE_GID       = 4,     ///< group id
+  AA_ENTRY_ATTRIBUTE_MTM       = 8,     ///< modification time
+  AA_ENTRY_ATTRIBUTE_FLG       = 16,    ///< flags, applied on Apple platforms only
+
+} APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Entry attributes applied by the extractor
+
+  @discussion
+  Received with AA_ENTRY_MESSAGE_EXTRACT_ATTRIBUTES before they are applied: the callback can modify the values,
+  or clear bits of \p fields to leave the corresponding attributes unchanged.
+*/
+typedef struct {
+  AAEntryAttributeMask fields;   ///< attributes to apply
+  uint32_t mode;                 ///< MOD, low 12 bits of st_mode
+  uint32_t uid;                  ///< UID
+  uint32_t gid;                  ///< GID
+  uint32_t flags;                ///< FLG, st_flags
+  struct timespec mtime;         ///< MTM
+} AAEntryAttributes APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Extractor statistics
+*/
+typedef struct {
+  uint64_t entry_count;          ///< entries extracted
+  uint64_t dir_count;            ///< directories created, including the ones missing from the archive
+  uint64_t data_bytes;           ///< DAT bytes written
+  uint64_t hole_bytes;           ///< DAT bytes of 0 left as holes instead of written, included in data_bytes
+  uint64_t deferred_count;       ///< entries that waited for their parent directory to be created
+  uint64_t reopened_dirs;        ///< directories opened again after being closed while idle
+  uint64_t attribute_batches;    ///< batches of deferred attributes applied
+  uint64_t linked_count;         ///< cluster members created as hard links
+  uint64_t cloned_count;         ///< cluster members created as clones
+  uint64_t copied_count;         ///< cluster members copied from the first member by the kernel
+} AAExtractorStats APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Create an extractor
+
+  @discussion
+  \p msg_proc receives EXTRACT_BEGIN for each entry, in archive order, on the client thread, with NULL \p data.
+  If it returns a positive value, the entry is skipped. EXTRACT_END or EXTRACT_FAIL are received on the worker
+  threads when the entry is done, and for directories, only after all their contents. If EXTRACT_FAIL returns a
+  positive value, the extraction is aborted. EXTRACT_ATTRIBUTES is received on the worker threads before the
+  attributes of an entry are applied, with a pointer to its AAEntryAttributes. Calls are serialized.
+  Existing links and special files are replaced, existing directories are kept, and existing files are
+  truncated. Aligned blocks of 0 in the data of regular files are left as holes, unless \p flags contains
+  AA_FLAG_EXTRACT_NO_AUTO_SPARSE. With AA_FLAG_REPLACE_ATTRIBUTES, existing files are replaced too, and the
+  extended attributes of existing directories are removed, so no attribute of the previous entry remains.
+  Ownership is set only if the archive has UID or GID fields. With AA_FLAG_IGNORE_EPERM, failing with EPERM to
+  set the ownership, mode, modification time, or flags is not an error.
+  Regular files with the same HLC or SLC cluster id in an archive are created from the first extracted member
+  of their cluster, without writing their data again. HLC members are hard links. SLC members are clones if
+  the filesystem supports it, or hard links with AA_FLAG_EXTRACT_AUTO_DEDUP_AS_HARD_LINKS, and are extracted
+  as copies with AA_FLAG_EXTRACT_NO_AUTO_DEDUP. If the member can't be linked or cloned, it is copied by the
+  kernel from the first member where supported, and otherwise extracted from the archive.
+
+  @param dir output directory, must exist
+  @param msg_data is passed as first argument to \p msg_proc
+  @param msg_proc is called with queries to the caller if not NULL
+  @param flags extract flags
+  @param n_threads number of worker threads, or 0 for default
+  @param stats if not NULL, receives the statistics, updated until the extractor is closed
+
+  @return a new extractor on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAExtractor _Nullable AAExtractorOpen(
+  const char * dir,
+  void * _Nullable msg_data,
+  AAEntryMessageProc _Nullable msg_proc,
+  AAFlagSet flags,
+  int n_threads,
+  AAExtractorStats * _Nullable stats);
+
+/*!
+  @abstract Defer the attributes of the entries, and apply them in batches
+
+  @discussion
+  By default, the attributes of an entry are applied by the worker thread that creates it, right after its
+  data, and EXTRACT_END follows. With a non 0 \p batch_size, they are queued in their parent directory instead.
+  When \p batch_size entries are queued in a directory, a worker applies them, sorted by inode number, and
+  the remaining entries are applied when the directory is finalized, before the directory itself. Batches
+  run in parallel, and group the metadata updates of a directory away from the data writes. EXTRACT_ATTRIBUTES
+  and EXTRACT_END are received when the batch is applied.
+  Must be called before the first AAExtractorExtractArchive.
+
+  @param extractor target extractor
+  @param batch_size max number of entries queued in a directory, or 0 to apply the attributes immediately
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AAExtractorSetAttributeBatchSize(
+  AAExtractor extractor,
+  size_t batch_size);
+
+/*!
+  @abstract Set the memory budget charged for the data read ahead of the workers
+
+  @discussion
+  When \p archive can't be read with AAByteStreamPRead, e.g. a decompression stream, the data of each regular file is
+  read in memory by the client thread, and released when the file is written. While \p budget is exhausted,
+  AAExtractorExtractArchive waits for previous files to be written. A file is always read if no other data is in
+  memory, even if larger than the budget. The budget can be shared with the streams producing the archive.
+  By default, the extractor uses its own budget of 64 MB.
+  Must be called before the first AAExtractorExtractArchive.
+
+  @param extractor target extractor
+  @param budget memory budget, or NULL for no limit
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AAExtractorSetMemoryBudget(
+  AAExtractor extractor,
+  AAMemoryBudget _Nullable budget);
+
+/*!
+  @abstract Extract the entries of an uncompressed archive
+
+  @discussion
+  Reads the archive from the current position of \p archive to its end. Returns when all the entries are
+  queued: extraction may still be running, until AAExtractorClose. The archive stream must remain valid until
+  then. Several archives can be extracted to the same directory. Entries with the same path, in one archive or
+  across archives, are extracted in order: the last one wins.
+
+  @param extractor target extractor
+  @param archive uncompressed archive stream
+  @param filter if not NULL, only the entries matching \p filter are extracted
+
+  @return 0 on success, and a negative error code on failure, or if the extraction was aborted
+*/
+APPLE_ARCHIVE_API int AAExtractorExtractArchive(
+  AAExtractor extractor,
+  AAByteStream archive,
+  AAEntryFilter _Nullable filter);
+
+/*!
+  @abstract Wait for all entries, apply the directory metadata, and destroy an extractor
+
+  @param extractor extractor, can be NULL
+
+  @return 0 on success, and a negative error code if an entry failed, or if the extraction was aborted
+*/
+APPLE_ARCHIVE_API int AAExtractorClose(
+  AAExtractor _Nullable extractor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull end")
+#endif
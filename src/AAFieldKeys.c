@@ -6,6 +6,7 @@
 #include "AppleArchive.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 struct AAFieldKeySet_impl {
     uint64_t keyCount;
@@ -24,8 +25,11 @@ AAFieldKeySet AAFieldKeySetCreate(void) {
 }
 
 AAFieldKey AAFieldKeySetGetKey(AAFieldKeySet key_set, uint32_t i) {
-    AAFieldKey *firstKeyPtr = key_set->keys;
-    return *(firstKeyPtr + (i * 4));
+    /* keys is an array of AAFieldKey, one element per key */
+    if (i >= key_set->keyCount) {
+        return (AAFieldKey){ .ikey = 0 };
+    }
+    return key_set->keys[i];
 }
 
 void AAFieldKeySetDestroy(AAFieldKeySet key_set) {
@@ -44,3 +48,59 @@ int AAFieldKeySetClear(AAFieldKeySet key_set) {
     key_set->keyCount = 0;
     return 0;
 }
+
+int AAFieldKeySetContainsKey(AAFieldKeySet key_set, AAFieldKey key) {
+    for (uint64_t i = 0; i < key_set->keyCount; i++) {
+        if (key_set->keys[i].ikey == key.ikey) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int AAFieldKeySetInsertKey(AAFieldKeySet key_set, AAFieldKey key) {
+    if (AAFieldKeySetContainsKey(key_set, key)) {
+        return 0;
+    }
+    AAFieldKey *keys = realloc(key_set->keys, (key_set->keyCount + 1) * sizeof(AAFieldKey));
+    if (!keys) {
+        ParallelCompressionLogError("malloc");
+        return -1;
+    }
+    keys[key_set->keyCount++] = key;
+    key_set->keys = keys;
+    return 0;
+}
+
+AAFieldKeySet AAFieldKeySetCreateWithString(const char *s) {
+    size_t n = strlen(s);
+    if (n > 0 && (n + 1) % 4 != 0) {
+        ParallelCompressionLogError("invalid key set string");
+        return 0;
+    }
+    AAFieldKeySet key_set = AAFieldKeySetCreate();
+    if (!key_set) {
+        return 0;
+    }
+    for (size_t i = 0; i < n; i += 4) {
+        AAFieldKey key = { .ikey = 0 };
+        for (int j = 0; j < 3; j++) {
+            char c = s[i + j];
+            if (c >= 'a' && c <= 'z') {
+                c = (char)(c - 'a' + 'A');
+            }
+            if ((c < 'A' || c > 'Z') && (c < '0' || c > '9')) {
+                ParallelCompressionLogError("invalid key set string");
+                AAFieldKeySetDestroy(key_set);
+                return 0;
+            }
+            key.skey[j] = c;
+        }
+        if ((i + 3 < n && s[i + 3] != ',') || AAFieldKeySetInsertKey(key_set, key) < 0) {
+            ParallelCompressionLogError("invalid key set string");
+            AAFieldKeySetDestroy(key_set);
+            return 0;
+        }
+    }
+    return key_set;
+}
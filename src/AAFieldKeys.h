@@ -160,12 +160,12 @@ APPLE_ARCHIVE_API uint32_t AAFieldKeySetGetKeyCount(AAFieldKeySet key_set)
 APPLE_ARCHIVE_AVAILABLE(macos(11.0), ios(14.0), watchos(7.0), tvos(14.0));
 
 /*!
-  @abatract Get key at index \p i
+  @abstract Get key at index \p i
 
   @param key_set target object
-  @param i key index
+  @param i key index, in 0 .. AAFieldKeySetGetKeyCount - 1
 
-  @return a valid key on success, and a key with ikey = 0 on failure
+  @return a valid key on success, and a key with ikey = 0 if \p i is out of range
  */
 APPLE_ARCHIVE_API AAFieldKey AAFieldKeySetGetKey(AAFieldKeySet key_set, uint32_t i)
 APPLE_ARCHIVE_AVAILABLE(macos(11.0), ios(14.0), watchos(7.0), tvos(14.0));
@@ -0,0 +1,534 @@
+//
+//  AAHash.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "AAHashImpl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if AA_HASH_X86
+#include <cpuid.h>
+#endif
+
+/* Context updates run every function on one slice before the next, the slice stays in cache */
+#define AA_HASH_SLICE_SIZE (16 << 10)
+
+/* AAHashByteStream read size, the chunk stays in L2 while its slices are hashed */
+#define AA_HASH_CHUNK_SIZE (256 << 10)
+
+enum {
+    AA_HASH_SHA1 = 0,
+    AA_HASH_SHA256,
+    AA_HASH_SHA384,
+    AA_HASH_SHA512,
+    AA_HASH_ALGORITHM_COUNT
+};
+
+static const uint32_t hashFunctions[AA_HASH_ALGORITHM_COUNT] = {
+    AA_HASH_FUNCTION_SHA1, AA_HASH_FUNCTION_SHA256, AA_HASH_FUNCTION_SHA384, AA_HASH_FUNCTION_SHA512
+};
+
+static pthread_once_t hashSetupOnce = PTHREAD_ONCE_INIT;
+static uint32_t hashCPUFeatures;
+static AAHashAlgorithm hashAlgorithms[AA_HASH_ALGORITHM_COUNT];
+
+#pragma mark - CPU dispatch
+
+static uint32_t detectCPUFeatures(void) {
+    uint32_t features = 0;
+#if AA_HASH_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    int ssse3 = (ecx >> 9) & 1;
+    int sse41 = (ecx >> 19) & 1;
+    int osxsave = (ecx >> 27) & 1;
+    int avx = (ecx >> 28) & 1;
+    int ymmEnabled = 0;
+    if (osxsave && avx) {
+        /* the OS must save the YMM registers */
+        uint32_t xcr0Low, xcr0High;
+        __asm__ volatile("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+        ymmEnabled = (xcr0Low & 0x6) == 0x6;
+    }
+    if (ssse3 && sse41 && ((ecx >> 1) & 1)) {
+        features |= AA_HASH_CPU_PCLMUL;
+    }
+    if (__get_cpuid_max(0, 0) >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        if (ymmEnabled && ((ebx >> 5) & 1)) {
+            features |= AA_HASH_CPU_AVX2;
+        }
+        if (ssse3 && sse41 && ((ebx >> 29) & 1)) {
+            features |= AA_HASH_CPU_SHA;
+        }
+    }
+#endif
+    return features;
+}
+
+static void hashSetup(void) {
+    uint32_t cpu = detectCPUFeatures();
+    hashCPUFeatures = cpu;
+    AAHashAlgorithm sha1 = { AA_HASH_FUNCTION_SHA1, 64, 20, 8, 4, 5, aaSHA1InitialState, aaSHA1CompressScalar, 0, 0 };
+    AAHashAlgorithm sha256 = { AA_HASH_FUNCTION_SHA256, 64, 32, 8, 4, 8, aaSHA256InitialState, aaSHA256CompressScalar, 0, 0 };
+    AAHashAlgorithm sha384 = { AA_HASH_FUNCTION_SHA384, 128, 48, 16, 8, 8, aaSHA384InitialState, aaSHA512CompressScalar, 0, 0 };
+    AAHashAlgorithm sha512 = { AA_HASH_FUNCTION_SHA512, 128, 64, 16, 8, 8, aaSHA512InitialState, aaSHA512CompressScalar, 0, 0 };
+#if AA_HASH_X86
+    if (cpu & AA_HASH_CPU_SHA) {
+        /* one buffer at a time with the SHA extensions beats 8 AVX2 lanes */
+        sha1.compress = aaSHA1CompressSHANI;
+        sha256.compress = aaSHA256CompressSHANI;
+    } else if (cpu & AA_HASH_CPU_AVX2) {
+        sha1.lanes = 8;
+        sha1.compressLanes = aaSHA1CompressLanesAVX2;
+        sha256.lanes = 8;
+        sha256.compressLanes = aaSHA256CompressLanesAVX2;
+    }
+    if (cpu & AA_HASH_CPU_AVX2) {
+        sha384.lanes = 4;
+        sha384.compressLanes = aaSHA512CompressLanesAVX2;
+        sha512.lanes = 4;
+        sha512.compressLanes = aaSHA512CompressLanesAVX2;
+    }
+#endif
+    hashAlgorithms[AA_HASH_SHA1] = sha1;
+    hashAlgorithms[AA_HASH_SHA256] = sha256;
+    hashAlgorithms[AA_HASH_SHA384] = sha384;
+    hashAlgorithms[AA_HASH_SHA512] = sha512;
+}
+
+uint32_t aaHashCPUFeatures(void) {
+    pthread_once(&hashSetupOnce, hashSetup);
+    return hashCPUFeatures;
+}
+
+const AAHashAlgorithm *aaHashGetAlgorithm(uint32_t function) {
+    pthread_once(&hashSetupOnce, hashSetup);
+    for (int i = 0; i < AA_HASH_ALGORITHM_COUNT; i++) {
+        if (hashAlgorithms[i].function == function) {
+            return &hashAlgorithms[i];
+        }
+    }
+    return 0;
+}
+
+static uint8_t *digestField(AADigests *digests, uint32_t function) {
+    switch (function) {
+        case AA_HASH_FUNCTION_SHA1:
+            return digests->sha1;
+        case AA_HASH_FUNCTION_SHA256:
+            return digests->sha256;
+        case AA_HASH_FUNCTION_SHA384:
+            return digests->sha384;
+        default:
+            return digests->sha512;
+    }
+}
+
+static int validFunctions(uint32_t functions) {
+    uint32_t supported = AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_CRC32);
+    for (int i = 0; i < AA_HASH_ALGORITHM_COUNT; i++) {
+        supported |= AA_HASH_FUNCTION_MASK(hashFunctions[i]);
+    }
+    if (functions & ~supported) {
+        ParallelCompressionLogError("unsupported hash functions: %x");
+        return 0;
+    }
+    return 1;
+}
+
+#pragma mark - Single message
+
+typedef struct {
+    union {
+        uint32_t w32[16];
+        uint64_t w64[8];
+    } state;
+    uint8_t buffer[AA_HASH_MAX_BLOCK_SIZE];
+    size_t bufferSize;
+    uint64_t totalSize;
+} AAHashState;
+
+static void stateInit(const AAHashAlgorithm *alg, AAHashState *s) {
+    memcpy(&s->state, alg->initialState, alg->stateWords * alg->wordSize);
+    s->bufferSize = 0;
+    s->totalSize = 0;
+}
+
+static void stateUpdate(const AAHashAlgorithm *alg, AAHashState *s, const uint8_t *data, size_t size) {
+    size_t blockSize = alg->blockSize;
+    s->totalSize += size;
+    if (s->bufferSize) {
+        size_t n = blockSize - s->bufferSize;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(s->buffer + s->bufferSize, data, n);
+        s->bufferSize += n;
+        data += n;
+        size -= n;
+        if (s->bufferSize < blockSize) {
+            return;
+        }
+        alg->compress(&s->state, s->buffer, 1);
+        s->bufferSize = 0;
+    }
+    size_t nblocks = size / blockSize;
+    if (nblocks) {
+        alg->compress(&s->state, data, nblocks);
+        data += nblocks * blockSize;
+        size -= nblocks * blockSize;
+    }
+    memcpy(s->buffer, data, size);
+    s->bufferSize = size;
+}
+
+/*
+ * Build the padded tail of a \p totalSize byte message ending with the
+ * \p tailSize bytes of \p tail. Returns the number of blocks (1 or 2).
+ */
+static size_t padTail(const AAHashAlgorithm *alg, uint8_t *dst, const uint8_t *tail, size_t tailSize, uint64_t totalSize) {
+    size_t blockSize = alg->blockSize;
+    size_t nblocks = (tailSize + 1 + alg->lengthSize <= blockSize) ? 1 : 2;
+    size_t size = nblocks * blockSize;
+    memset(dst, 0, size);
+    memcpy(dst, tail, tailSize);
+    dst[tailSize] = 0x80;
+    /* bit length, big endian, the high bits of 128-bit lengths are 0 */
+    uint64_t bits = totalSize << 3;
+    for (int i = 0; i < 8; i++) {
+        dst[size - 1 - i] = (uint8_t)(bits >> (8 * i));
+    }
+    if (alg->lengthSize == 16) {
+        dst[size - 9] = (uint8_t)(totalSize >> 61);
+    }
+    return nblocks;
+}
+
+static void storeDigest(const AAHashAlgorithm *alg, const void *state, uint8_t *digest) {
+    for (size_t i = 0; i < alg->digestSize; i++) {
+        if (alg->wordSize == 4) {
+            uint32_t w = ((const uint32_t *)state)[i / 4];
+            digest[i] = (uint8_t)(w >> (24 - 8 * (i % 4)));
+        } else {
+            uint64_t w = ((const uint64_t *)state)[i / 8];
+            digest[i] = (uint8_t)(w >> (56 - 8 * (i % 8)));
+        }
+    }
+}
+
+static void stateFinal(const AAHashAlgorithm *alg, AAHashState *s, uint8_t *digest) {
+    uint8_t tail[2 * AA_HASH_MAX_BLOCK_SIZE];
+    size_t nblocks = padTail(alg, tail, s->buffer, s->bufferSize, s->totalSize);
+    alg->compress(&s->state, tail, nblocks);
+    storeDigest(alg, &s->state, digest);
+}
+
+#pragma mark - Context
+
+struct AAHashContext_impl {
+    uint32_t functions;
+    int count;
+    const AAHashAlgorithm *algorithms[AA_HASH_ALGORITHM_COUNT];
+    AAHashState states[AA_HASH_ALGORITHM_COUNT];
+    uint32_t crc;
+    uint64_t crcSize;
+};
+
+AAHashContext AAHashContextCreate(uint32_t functions) {
+    if (!validFunctions(functions)) {
+        return 0;
+    }
+    AAHashContext ctx = calloc(1, sizeof(struct AAHashContext_impl));
+    if (!ctx) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    ctx->functions = functions;
+    for (int i = 0; i < AA_HASH_ALGORITHM_COUNT; i++) {
+        if (functions & AA_HASH_FUNCTION_MASK(hashFunctions[i])) {
+            ctx->algorithms[ctx->count++] = aaHashGetAlgorithm(hashFunctions[i]);
+        }
+    }
+    AAHashContextReset(ctx);
+    return ctx;
+}
+
+void AAHashContextDestroy(AAHashContext ctx) {
+    free(ctx);
+}
+
+void AAHashContextReset(AAHashContext ctx) {
+    for (int i = 0; i < ctx->count; i++) {
+        stateInit(ctx->algorithms[i], &ctx->states[i]);
+    }
+    ctx->crc = 0;
+    ctx->crcSize = 0;
+}
+
+void AAHashContextUpdate(AAHashContext ctx, const void *data, size_t size) {
+    const uint8_t *p = data;
+    int crc = (ctx->functions & AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_CRC32)) != 0;
+    while (size) {
+        size_t n = size < AA_HASH_SLICE_SIZE ? size : AA_HASH_SLICE_SIZE;
+        if (crc) {
+            ctx->crc = aaCRC32Update(ctx->crc, p, n);
+            ctx->crcSize += n;
+        }
+        for (int i = 0; i < ctx->count; i++) {
+            stateUpdate(ctx->algorithms[i], &ctx->states[i], p, n);
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+void AAHashContextFinal(AAHashContext ctx, AADigests *digests) {
+    memset(digests, 0, sizeof(AADigests));
+    digests->functions = ctx->functions;
+    for (int i = 0; i < ctx->count; i++) {
+        const AAHashAlgorithm *alg = ctx->algorithms[i];
+        stateFinal(alg, &ctx->states[i], digestField(digests, alg->function));
+    }
+    if (ctx->functions & AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_CRC32)) {
+        digests->crc32 = AAHashCRC32Final(ctx->crc, ctx->crcSize);
+    }
+}
+
+#pragma mark - Multi-buffer
+
+typedef struct {
+    size_t job; /* SIZE_MAX when idle */
+    const uint8_t *next; /* next full block of the message */
+    size_t fullBlocks;
+    uint8_t tail[2 * AA_HASH_MAX_BLOCK_SIZE];
+    size_t tailBlocks;
+    size_t tailPos;
+} AAHashLane;
+
+static void laneSetState(const AAHashAlgorithm *alg, void *laneState, int lane, const void *state) {
+    for (int w = 0; w < alg->stateWords; w++) {
+        if (alg->wordSize == 4) {
+            ((uint32_t *)laneState)[w * alg->lanes + lane] = ((const uint32_t *)state)[w];
+        } else {
+            ((uint64_t *)laneState)[w * alg->lanes + lane] = ((const uint64_t *)state)[w];
+        }
+    }
+}
+
+static void laneGetState(const AAHashAlgorithm *alg, const void *laneState, int lane, void *state) {
+    for (int w = 0; w < alg->stateWords; w++) {
+        if (alg->wordSize == 4) {
+            ((uint32_t *)state)[w] = ((const uint32_t *)laneState)[w * alg->lanes + lane];
+        } else {
+            ((uint64_t *)state)[w] = ((const uint64_t *)laneState)[w * alg->lanes + lane];
+        }
+    }
+}
+
+static void laneStart(const AAHashAlgorithm *alg, AAHashLane *lane, size_t job, const uint8_t *data, size_t size) {
+    lane->job = job;
+    lane->next = data;
+    lane->fullBlocks = size / alg->blockSize;
+    size_t tailSize = size - lane->fullBlocks * alg->blockSize;
+    lane->tailBlocks = padTail(alg, lane->tail, data + lane->fullBlocks * alg->blockSize, tailSize, size);
+    lane->tailPos = 0;
+}
+
+/*
+ * Hash all buffers with alg->lanes independent messages in flight. A lane
+ * picks the next buffer as soon as its message is done; idle lanes hash a
+ * dummy block. The last message is finished on its own.
+ */
+static void hashLanes(const AAHashAlgorithm *alg, size_t count, const uint8_t * const *data, const size_t *sizes, AADigests *digests) {
+    uint64_t laneState[AA_HASH_MAX_LANES * 8];
+    AAHashLane lanes[AA_HASH_MAX_LANES];
+    static const uint8_t idleBlock[AA_HASH_MAX_BLOCK_SIZE];
+    const uint8_t *blocks[AA_HASH_MAX_LANES];
+    size_t nextJob = 0;
+    int active = 0;
+    for (int l = 0; l < alg->lanes; l++) {
+        lanes[l].job = SIZE_MAX;
+    }
+    while (1) {
+        for (int l = 0; l < alg->lanes && nextJob < count; l++) {
+            if (lanes[l].job == SIZE_MAX) {
+                laneStart(alg, &lanes[l], nextJob, data[nextJob], sizes[nextJob]);
+                laneSetState(alg, laneState, l, alg->initialState);
+                nextJob++;
+                active++;
+            }
+        }
+        if (active == 0) {
+            break;
+        }
+        if (active == 1 && nextJob == count) {
+            for (int l = 0; l < alg->lanes; l++) {
+                AAHashLane *lane = &lanes[l];
+                if (lane->job == SIZE_MAX) {
+                    continue;
+                }
+                uint64_t state[8];
+                laneGetState(alg, laneState, l, state);
+                alg->compress(state, lane->next, lane->fullBlocks);
+                alg->compress(state, lane->tail + lane->tailPos, lane->tailBlocks);
+                storeDigest(alg, state, digestField(&digests[lane->job], alg->function));
+            }
+            break;
+        }
+        for (int l = 0; l < alg->lanes; l++) {
+            AAHashLane *lane = &lanes[l];
+            if (lane->job == SIZE_MAX) {
+                blocks[l] = idleBlock;
+            } else if (lane->fullBlocks) {
+                blocks[l] = lane->next;
+            } else {
+                blocks[l] = lane->tail + lane->tailPos;
+            }
+        }
+        alg->compressLanes(laneState, blocks);
+        for (int l = 0; l < alg->lanes; l++) {
+            AAHashLane *lane = &lanes[l];
+            if (lane->job == SIZE_MAX) {
+                continue;
+            }
+            if (lane->fullBlocks) {
+                lane->next += alg->blockSize;
+                lane->fullBlocks--;
+            } else {
+                lane->tailPos += alg->blockSize;
+                lane->tailBlocks--;
+            }
+            if (!lane->fullBlocks && !lane->tailBlocks) {
+                uint64_t state[8];
+                laneGetState(alg, laneState, l, state);
+                storeDigest(alg, state, digestField(&digests[lane->job], alg->function));
+                lane->job = SIZE_MAX;
+                active--;
+            }
+        }
+    }
+}
+
+int AAHashBuffers(uint32_t functions, size_t count, const uint8_t * const *data, const size_t *sizes, AADigests *digests) {
+    if (!validFunctions(functions)) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        memset(&digests[i], 0, sizeof(AADigests));
+        digests[i].functions = functions;
+        if (functions & AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_CRC32)) {
+            digests[i].crc32 = AAHashCRC32Final(aaCRC32Update(0, data[i], sizes[i]), sizes[i]);
+        }
+    }
+    for (int f = 0; f < AA_HASH_ALGORITHM_COUNT; f++) {
+        if (!(functions & AA_HASH_FUNCTION_MASK(hashFunctions[f]))) {
+            continue;
+        }
+        const AAHashAlgorithm *alg = aaHashGetAlgorithm(hashFunctions[f]);
+        if (alg->lanes && count > 1) {
+            hashLanes(alg, count, data, sizes, digests);
+            continue;
+        }
+        for (size_t i = 0; i < count; i++) {
+            AAHashState s;
+            stateInit(alg, &s);
+            stateUpdate(alg, &s, data[i], sizes[i]);
+            stateFinal(alg, &s, digestField(&digests[i], alg->function));
+        }
+    }
+    return 0;
+}
+
+#pragma mark - Fused digests
+
+uint32_t AAHashFunctionsWithKeySet(AAFieldKeySet key_set) {
+    static const struct {
+        AAFieldKey key;
+        uint32_t function;
+    } digestFields[] = {
+        { AA_FIELD_CKS, AA_HASH_FUNCTION_CRC32 },
+        { AA_FIELD_SH1, AA_HASH_FUNCTION_SHA1 },
+        { AA_FIELD_SH2, AA_HASH_FUNCTION_SHA256 },
+        { AA_FIELD_SH3, AA_HASH_FUNCTION_SHA384 },
+        { AA_FIELD_SH5, AA_HASH_FUNCTION_SHA512 },
+    };
+    uint32_t functions = 0;
+    uint32_t n = AAFieldKeySetGetKeyCount(key_set);
+    for (uint32_t i = 0; i < n; i++) {
+        AAFieldKey key = AAFieldKeySetGetKey(key_set, i);
+        for (size_t j = 0; j < sizeof(digestFields) / sizeof(digestFields[0]); j++) {
+            if (key.ikey == digestFields[j].key.ikey) {
+                functions |= AA_HASH_FUNCTION_MASK(digestFields[j].function);
+            }
+        }
+    }
+    return functions;
+}
+
+int64_t AAHashByteStream(uint32_t functions, AAByteStream in, AAByteStream out, uint64_t size, AADigests *digests) {
+    AAHashContext ctx = AAHashContextCreate(functions);
+    uint8_t *buf = malloc(AA_HASH_CHUNK_SIZE);
+    int64_t total = 0;
+    if (!ctx || !buf) {
+        ParallelCompressionLogError("malloc");
+        total = -1;
+        goto END;
+    }
+    while ((uint64_t)total < size) {
+        uint64_t remaining = size - (uint64_t)total;
+        size_t n = remaining < AA_HASH_CHUNK_SIZE ? (size_t)remaining : AA_HASH_CHUNK_SIZE;
+        ssize_t r = AAByteStreamRead(in, buf, n);
+        if (r < 0) {
+            ParallelCompressionLogError("read");
+            total = -1;
+            goto END;
+        }
+        if (r == 0) {
+            break;
+        }
+        AAHashContextUpdate(ctx, buf, r);
+        if (out && AAByteStreamWrite(out, buf, r) != r) {
+            ParallelCompressionLogError("write");
+            total = -1;
+            goto END;
+        }
+        total += r;
+    }
+    if (size != UINT64_MAX && (uint64_t)total != size) {
+        ParallelCompressionLogError("truncated payload");
+        total = -1;
+        goto END;
+    }
+    AAHashContextFinal(ctx, digests);
+
+END:
+    free(buf);
+    AAHashContextDestroy(ctx);
+    return total;
+}
+
+uint32_t AADigestsCompare(const AADigests *expected, const AADigests *actual) {
+    uint32_t common = expected->functions & actual->functions;
+    uint32_t mismatch = 0;
+    if ((common & AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_CRC32)) && expected->crc32 != actual->crc32) {
+        mismatch |= AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_CRC32);
+    }
+    for (int i = 0; i < AA_HASH_ALGORITHM_COUNT; i++) {
+        uint32_t mask = AA_HASH_FUNCTION_MASK(hashFunctions[i]);
+        if (!(common & mask)) {
+            continue;
+        }
+        const AAHashAlgorithm *alg = aaHashGetAlgorithm(hashFunctions[i]);
+        if (memcmp(digestField((AADigests *)expected, alg->function), digestField((AADigests *)actual, alg->function), alg->digestSize)) {
+            mismatch |= mask;
+        }
+    }
+    return mismatch;
+}
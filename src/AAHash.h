@@ -0,0 +1,262 @@
+// AppleArchive entry digests
+
+#pragma once
+
+#ifndef __APPLE_ARCHIVE_H
+#error Include AppleArchive.h instead of this file
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull begin")
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma mark - Digests
+
+/*!
+  @abstract Bit for hash function \p f in a hash function mask, \p f one of AA_HASH_FUNCTION_*
+*/
+#define AA_HASH_FUNCTION_MASK(f) (UINT32_C(1) << (f))
+
+/*!
+  @abstract Entry data digests, as stored in the CKS, SH1, SH2, SH3, SH5 fields
+*/
+typedef struct {
+  uint32_t functions;   ///< mask of the digests computed, AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_*)
+  uint32_t crc32;       ///< AA_HASH_FUNCTION_CRC32 (CKS)
+  uint8_t sha1[20];     ///< AA_HASH_FUNCTION_SHA1 (SH1)
+  uint8_t sha256[32];   ///< AA_HASH_FUNCTION_SHA256 (SH2)
+  uint8_t sha384[48];   ///< AA_HASH_FUNCTION_SHA384 (SH3)
+  uint8_t sha512[64];   ///< AA_HASH_FUNCTION_SHA512 (SH5)
+} AADigests APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+typedef struct AAHashContext_impl * AAHashContext APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Create a hash context computing several digests in a single pass over the data
+
+  @discussion SHA-1 and SHA-256 use the SHA extensions, and CRC32 carry-less multiply, when the CPU has them.
+  A context is not thread safe.
+
+  @param functions mask of AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_*)
+
+  @return a new context on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAHashContext _Nullable AAHashContextCreate(uint32_t functions);
+
+/*!
+  @abstract Destroy a hash context
+
+  @param ctx target context, do nothing if NULL
+*/
+APPLE_ARCHIVE_API void AAHashContextDestroy(AAHashContext _Nullable ctx);
+
+/*!
+  @abstract Reset \p ctx to hash a new message with the same functions
+
+  @param ctx target context
+*/
+APPLE_ARCHIVE_API void AAHashContextReset(AAHashContext ctx);
+
+/*!
+  @abstract Hash \p size bytes of \p data with all the context functions
+
+  @param ctx target context
+  @param data bytes to hash
+  @param size number of bytes in \p data
+*/
+APPLE_ARCHIVE_API void AAHashContextUpdate(AAHashContext ctx, const void * data, size_t size);
+
+/*!
+  @abstract Get the digests of the data hashed since the last reset
+
+  @param ctx target context, must be reset before hashing another message
+  @param digests receives the digests
+*/
+APPLE_ARCHIVE_API void AAHashContextFinal(AAHashContext ctx, AADigests * digests);
+
+/*!
+  @abstract Hash \p count independent buffers
+
+  @discussion
+  Buffers are hashed several at a time: with AVX2, 8 SHA-1 or SHA-256 lanes, and 4 SHA-384 or SHA-512 lanes,
+  each lane processing a different buffer. With the SHA extensions, SHA-1 and SHA-256 use them one buffer at a time.
+  This is the fast path for many small files.
+
+  @param functions mask of AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_*)
+  @param count number of buffers
+  @param data buffers
+  @param sizes size of each buffer
+  @param digests receives the digests of each buffer
+
+  @return 0 on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AAHashBuffers(
+  uint32_t functions,
+  size_t count,
+  const uint8_t * _Nonnull const * _Nonnull data,
+  const size_t * sizes,
+  AADigests * digests);
+
+#pragma mark - Fused digests
+
+/*!
+  @abstract Get the hash functions needed by the digest fields of \p key_set
+
+  @param key_set field keys, CKS, SH1, SH2, SH3, SH5 are used and other keys ignored
+
+  @return mask of AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_*)
+*/
+APPLE_ARCHIVE_API uint32_t AAHashFunctionsWithKeySet(AAFieldKeySet key_set);
+
+/*!
+  @abstract Read a payload once, computing all requested digests, and optionally copying it
+
+  @discussion
+  Data is read in chunks sized for L2, and each chunk is hashed by all functions one L1-sized slice at a time,
+  so the payload is read from memory once whatever the number of digests. This is the path used to insert digests
+  when encoding or converting an entry, and to verify an extracted entry.
+
+  @param functions mask of AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_*)
+  @param in stream providing the payload
+  @param out if not NULL, receives a copy of the payload
+  @param size number of bytes to read, or UINT64_MAX to read until the end of \p in
+  @param digests receives the digests of the bytes read
+
+  @return number of bytes read on success, and a negative error code on failure, including a short read
+  when \p size is not UINT64_MAX
+*/
+APPLE_ARCHIVE_API int64_t AAHashByteStream(
+  uint32_t functions,
+  AAByteStream in,
+  AAByteStream _Nullable out,
+  uint64_t size,
+  AADigests * digests);
+
+/*!
+  @abstract Compare digests
+
+  @param expected expected digests, e.g. from the entry header
+  @param actual computed digests
+
+  @return mask of the functions present in both \p expected and \p actual with different values, 0 if all match
+*/
+APPLE_ARCHIVE_API uint32_t AADigestsCompare(const AADigests * expected, const AADigests * actual);
+
+#pragma mark - CRC32
+
+/*!
+  @abstract Update a POSIX 1003.2 cksum CRC (CKS field) with \p size bytes of \p data
+
+  @discussion
+  \p crc is the running CRC register, 0 for an empty message. The length and the final complement are
+  applied by AAHashCRC32Final. Uses carry-less multiply folding (PCLMULQDQ, ARMv8 PMULL) when available.
+
+  @param crc CRC of the data preceding \p data
+  @param data bytes to hash
+  @param size number of bytes in \p data
+
+  @return CRC of the data preceding \p data followed by \p data
+*/
+APPLE_ARCHIVE_API uint32_t AAHashCRC32Update(uint32_t crc, const void * data, size_t size);
+
+/*!
+  @abstract Combine the CRCs of two consecutive blocks
+
+  @discussion Blocks can be hashed in parallel, and their CRCs merged in order.
+
+  @param crc1 CRC of the first block, from AAHashCRC32Update starting at 0
+  @param crc2 CRC of the second block, from AAHashCRC32Update starting at 0
+  @param size2 size of the second block
+
+  @return CRC of the two blocks concatenated, as returned by AAHashCRC32Update
+*/
+APPLE_ARCHIVE_API uint32_t AAHashCRC32Combine(uint32_t crc1, uint32_t crc2, uint64_t size2);
+
+/*!
+  @abstract Get the cksum value stored in the CKS field
+
+  @param crc CRC of the entire message
+  @param size size of the entire message
+
+  @return \p crc, updated with the message length, and complemented
+*/
+APPLE_ARCHIVE_API uint32_t AAHashCRC32Final(uint32_t crc, uint64_t size);
+
+#pragma mark - Digest engine
+
+/*!
+  @abstract Receives the digests of one file, in submission order
+
+  @param arg user data
+  @param entry_id the id passed to AADigestEngineSubmitPath, e.g. the entry index in the archive
+  @param status 0 on success, and a negative value if the file could not be read
+  @param digests digests of the file contents, valid during the call
+
+  @return 0 to continue, and a negative value to stop the engine
+*/
+typedef int (*AADigestEngineResultProc)(void * _Nullable arg, uint64_t entry_id, int status, const AADigests * digests);
+
+typedef struct AADigestEngine_impl * AADigestEngine APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Create a digest engine
+
+  @discussion
+  Files are read and hashed by \p n_threads worker threads, in batches. Small files of a batch are hashed
+  together with AAHashBuffers, large files are streamed through a hash context.
+  Results are delivered to \p proc in submission order, on the thread calling AADigestEngineSubmitPath and
+  AADigestEngineFlush, so \p proc can store them in the entry headers (CKS, SH1, SH2, SH3, SH5) without locking.
+  The read buffers of the workers, about 2 MB each, are reserved from \p budget when the engine is created, and
+  released when it is destroyed. With a short budget, fewer than \p n_threads workers run, down to one.
+
+  @param functions mask of AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_*)
+  @param n_threads number of worker threads, or 0 for default
+  @param proc receives the results
+  @param arg passed to \p proc
+  @param budget memory budget, or NULL
+
+  @return a new engine on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AADigestEngine _Nullable AADigestEngineCreate(uint32_t functions, int n_threads, AADigestEngineResultProc proc, void * _Nullable arg,
+                                                                AAMemoryBudget _Nullable budget);
+
+/*!
+  @abstract Queue a file
+
+  @discussion Blocks when all batches are in flight, delivering completed results to the engine callback.
+
+  @param engine target engine
+  @param path file to hash, copied
+  @param entry_id passed back to the engine callback
+
+  @return 0 on success, and a negative error code on failure, or if the callback stopped the engine
+*/
+APPLE_ARCHIVE_API int AADigestEngineSubmitPath(AADigestEngine engine, const char * path, uint64_t entry_id);
+
+/*!
+  @abstract Wait for all queued files, and deliver their results
+
+  @param engine target engine
+
+  @return 0 on success, and a negative error code on failure, or if the callback stopped the engine
+*/
+APPLE_ARCHIVE_API int AADigestEngineFlush(AADigestEngine engine);
+
+/*!
+  @abstract Destroy an engine, files queued and not flushed are dropped
+
+  @param engine target engine, do nothing if NULL
+*/
+APPLE_ARCHIVE_API void AADigestEngineDestroy(AADigestEngine _Nullable engine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull end")
+#endif
@@ -0,0 +1,257 @@
+//
+//  AAHashCRC32.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "AAHashImpl.h"
+#include <pthread.h>
+
+#if AA_HASH_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+#include <arm_neon.h>
+#define AA_CRC32_PMULL 1
+#else
+#define AA_CRC32_PMULL 0
+#endif
+
+/*
+ * POSIX 1003.2 cksum CRC. Unlike the zlib CRC32, bits are processed most
+ * significant first, the register starts at 0, and the message length is
+ * appended before the final complement.
+ *
+ * With the register defined as M(x).x^32 mod P(x) for message M, the CRC of
+ * A||B is crc(A).x^(8|B|) + crc(B) mod P: this is what folding and combine
+ * rely on.
+ */
+#define CRC32_POLY 0x04C11DB7u
+
+/* Folding kernels need at least 4 x 16 bytes */
+#define CRC32_FOLD_MIN_SIZE 64
+
+static pthread_once_t crcSetupOnce = PTHREAD_ONCE_INIT;
+static uint32_t crcTables[16][256]; /* crcTables[k][b] = b.x^(32+8k) mod P */
+static uint32_t crcShiftPowers[64]; /* x^(8.2^k) mod P */
+static uint32_t (*crcUpdateProc)(uint32_t crc, const uint8_t *data, size_t size);
+
+/* Fold constants x^n mod P, for n = 128, 192, 256, 320, 384, 448, 512, 576 */
+static uint64_t crcFoldConstants[8];
+
+#pragma mark - GF(2) arithmetic
+
+/* a.b mod P */
+static uint32_t crcMultiply(uint32_t a, uint32_t b) {
+    uint32_t r = 0;
+    for (int i = 31; i >= 0; i--) {
+        r = (r << 1) ^ ((r & 0x80000000u) ? CRC32_POLY : 0);
+        if ((b >> i) & 1) {
+            r ^= a;
+        }
+    }
+    return r;
+}
+
+/* crc.x^(8.size) mod P, i.e. the register after \p size zero bytes */
+static uint32_t crcShift(uint32_t crc, uint64_t size) {
+    for (int k = 0; size; k++, size >>= 1) {
+        if (size & 1) {
+            crc = crcMultiply(crc, crcShiftPowers[k]);
+        }
+    }
+    return crc;
+}
+
+static void crcSetup(void) {
+    for (int b = 0; b < 256; b++) {
+        uint32_t crc = (uint32_t)b << 24;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc << 1) ^ ((crc & 0x80000000u) ? CRC32_POLY : 0);
+        }
+        crcTables[0][b] = crc;
+    }
+    for (int k = 1; k < 16; k++) {
+        for (int b = 0; b < 256; b++) {
+            uint32_t crc = crcTables[k - 1][b];
+            crcTables[k][b] = (crc << 8) ^ crcTables[0][crc >> 24];
+        }
+    }
+    crcShiftPowers[0] = 0x100; /* x^8 */
+    for (int k = 1; k < 64; k++) {
+        crcShiftPowers[k] = crcMultiply(crcShiftPowers[k - 1], crcShiftPowers[k - 1]);
+    }
+    for (int i = 0; i < 8; i++) {
+        crcFoldConstants[i] = crcShift(1, (128 + 64 * i) / 8);
+    }
+    crcUpdateProc = aaCRC32UpdateSliceBy16;
+#if AA_HASH_X86
+    if (aaHashCPUFeatures() & AA_HASH_CPU_PCLMUL) {
+        crcUpdateProc = aaCRC32UpdatePCLMUL;
+    }
+#endif
+}
+
+#pragma mark - Slice by 16
+
+uint32_t aaCRC32UpdateSliceBy16(uint32_t crc, const uint8_t *data, size_t size) {
+    pthread_once(&crcSetupOnce, crcSetup);
+    const uint32_t (*t)[256] = (const uint32_t (*)[256])crcTables;
+    while (size >= 16) {
+        uint32_t w = crc ^ aaLoadBE32(data);
+        crc = t[15][w >> 24] ^ t[14][(w >> 16) & 0xff] ^ t[13][(w >> 8) & 0xff] ^ t[12][w & 0xff] ^
+              t[11][data[4]] ^ t[10][data[5]] ^ t[9][data[6]] ^ t[8][data[7]] ^
+              t[7][data[8]] ^ t[6][data[9]] ^ t[5][data[10]] ^ t[4][data[11]] ^
+              t[3][data[12]] ^ t[2][data[13]] ^ t[1][data[14]] ^ t[0][data[15]];
+        data += 16;
+        size -= 16;
+    }
+    while (size--) {
+        crc = (crc << 8) ^ t[0][(crc >> 24) ^ *data++];
+    }
+    return crc;
+}
+
+#if AA_HASH_X86
+
+#pragma mark - PCLMULQDQ folding
+
+/*
+ * 16-byte chunks are loaded byte reversed, so that bit 127 is the first bit
+ * of the stream. Folding chunk X forward by n bits is X_hi.(x^(n+64) mod P)
+ * + X_lo.(x^n mod P), a 96-bit value congruent to X.x^n. The last 128 bits
+ * go through the table code, which also applies the final x^32.
+ */
+
+__attribute__((target("pclmul,ssse3,sse4.1")))
+static inline __m128i crcFoldPCLMUL(__m128i x, __m128i k) {
+    return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), _mm_clmulepi64_si128(x, k, 0x00));
+}
+
+__attribute__((target("pclmul,ssse3,sse4.1")))
+uint32_t aaCRC32UpdatePCLMUL(uint32_t crc, const uint8_t *data, size_t size) {
+    if (size < CRC32_FOLD_MIN_SIZE) {
+        return aaCRC32UpdateSliceBy16(crc, data, size);
+    }
+    pthread_once(&crcSetupOnce, crcSetup);
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i k128 = _mm_set_epi64x((long long)crcFoldConstants[1], (long long)crcFoldConstants[0]);
+    const __m128i k256 = _mm_set_epi64x((long long)crcFoldConstants[3], (long long)crcFoldConstants[2]);
+    const __m128i k384 = _mm_set_epi64x((long long)crcFoldConstants[5], (long long)crcFoldConstants[4]);
+    const __m128i k512 = _mm_set_epi64x((long long)crcFoldConstants[7], (long long)crcFoldConstants[6]);
+#define LOAD(p) _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p)), reverse)
+    __m128i x0 = _mm_xor_si128(LOAD(data), _mm_set_epi32((int)crc, 0, 0, 0));
+    __m128i x1 = LOAD(data + 16);
+    __m128i x2 = LOAD(data + 32);
+    __m128i x3 = LOAD(data + 48);
+    data += 64;
+    size -= 64;
+    while (size >= 64) {
+        x0 = _mm_xor_si128(crcFoldPCLMUL(x0, k512), LOAD(data));
+        x1 = _mm_xor_si128(crcFoldPCLMUL(x1, k512), LOAD(data + 16));
+        x2 = _mm_xor_si128(crcFoldPCLMUL(x2, k512), LOAD(data + 32));
+        x3 = _mm_xor_si128(crcFoldPCLMUL(x3, k512), LOAD(data + 48));
+        data += 64;
+        size -= 64;
+    }
+    __m128i x = _mm_xor_si128(_mm_xor_si128(crcFoldPCLMUL(x0, k384), crcFoldPCLMUL(x1, k256)),
+                              _mm_xor_si128(crcFoldPCLMUL(x2, k128), x3));
+    while (size >= 16) {
+        x = _mm_xor_si128(crcFoldPCLMUL(x, k128), LOAD(data));
+        data += 16;
+        size -= 16;
+    }
+#undef LOAD
+    uint8_t last[16];
+    _mm_storeu_si128((__m128i *)last, _mm_shuffle_epi8(x, reverse));
+    crc = aaCRC32UpdateSliceBy16(0, last, 16);
+    return aaCRC32UpdateSliceBy16(crc, data, size);
+}
+
+#endif /* AA_HASH_X86 */
+
+#if AA_CRC32_PMULL
+
+#pragma mark - PMULL folding
+
+/* Same scheme as the PCLMULQDQ kernel */
+
+static inline uint64x2_t crcLoadPMULL(const uint8_t *p) {
+    uint8x16_t b = vrev64q_u8(vld1q_u8(p));
+    return vreinterpretq_u64_u8(vextq_u8(b, b, 8));
+}
+
+static inline uint64x2_t crcFoldPMULL(uint64x2_t x, uint64x2_t k) {
+    uint64x2_t hi = vreinterpretq_u64_p128(vmull_p64((poly64_t)vgetq_lane_u64(x, 1), (poly64_t)vgetq_lane_u64(k, 1)));
+    uint64x2_t lo = vreinterpretq_u64_p128(vmull_p64((poly64_t)vgetq_lane_u64(x, 0), (poly64_t)vgetq_lane_u64(k, 0)));
+    return veorq_u64(hi, lo);
+}
+
+static uint32_t aaCRC32UpdatePMULL(uint32_t crc, const uint8_t *data, size_t size) {
+    if (size < CRC32_FOLD_MIN_SIZE) {
+        return aaCRC32UpdateSliceBy16(crc, data, size);
+    }
+    pthread_once(&crcSetupOnce, crcSetup);
+    const uint64x2_t k128 = vcombine_u64(vcreate_u64(crcFoldConstants[0]), vcreate_u64(crcFoldConstants[1]));
+    const uint64x2_t k256 = vcombine_u64(vcreate_u64(crcFoldConstants[2]), vcreate_u64(crcFoldConstants[3]));
+    const uint64x2_t k384 = vcombine_u64(vcreate_u64(crcFoldConstants[4]), vcreate_u64(crcFoldConstants[5]));
+    const uint64x2_t k512 = vcombine_u64(vcreate_u64(crcFoldConstants[6]), vcreate_u64(crcFoldConstants[7]));
+    uint64x2_t x0 = veorq_u64(crcLoadPMULL(data), vcombine_u64(vcreate_u64(0), vcreate_u64((uint64_t)crc << 32)));
+    uint64x2_t x1 = crcLoadPMULL(data + 16);
+    uint64x2_t x2 = crcLoadPMULL(data + 32);
+    uint64x2_t x3 = crcLoadPMULL(data + 48);
+    data += 64;
+    size -= 64;
+    while (size >= 64) {
+        x0 = veorq_u64(crcFoldPMULL(x0, k512), crcLoadPMULL(data));
+        x1 = veorq_u64(crcFoldPMULL(x1, k512), crcLoadPMULL(data + 16));
+        x2 = veorq_u64(crcFoldPMULL(x2, k512), crcLoadPMULL(data + 32));
+        x3 = veorq_u64(crcFoldPMULL(x3, k512), crcLoadPMULL(data + 48));
+        data += 64;
+        size -= 64;
+    }
+    uint64x2_t x = veorq_u64(veorq_u64(crcFoldPMULL(x0, k384), crcFoldPMULL(x1, k256)),
+                             veorq_u64(crcFoldPMULL(x2, k128), x3));
+    while (size >= 16) {
+        x = veorq_u64(crcFoldPMULL(x, k128), crcLoadPMULL(data));
+        data += 16;
+        size -= 16;
+    }
+    /* the byte reversal is its own inverse */
+    uint8_t last[16];
+    vst1q_u8(last, vreinterpretq_u8_u64(crcLoadPMULL((const uint8_t *)&x)));
+    crc = aaCRC32UpdateSliceBy16(0, last, 16);
+    return aaCRC32UpdateSliceBy16(crc, data, size);
+}
+
+#endif /* AA_CRC32_PMULL */
+
+#pragma mark - API
+
+uint32_t aaCRC32Update(uint32_t crc, const uint8_t *data, size_t size) {
+#if AA_CRC32_PMULL
+    return aaCRC32UpdatePMULL(crc, data, size);
+#else
+    pthread_once(&crcSetupOnce, crcSetup);
+    return crcUpdateProc(crc, data, size);
+#endif
+}
+
+uint32_t AAHashCRC32Update(uint32_t crc, const void *data, size_t size) {
+    return aaCRC32Update(crc, data, size);
+}
+
+uint32_t AAHashCRC32Combine(uint32_t crc1, uint32_t crc2, uint64_t size2) {
+    pthread_once(&crcSetupOnce, crcSetup);
+    return crcShift(crc1, size2) ^ crc2;
+}
+
+uint32_t AAHashCRC32Final(uint32_t crc, uint64_t size) {
+    pthread_once(&crcSetupOnce, crcSetup);
+    /* length, least significant byte first, without trailing zero bytes */
+    for (; size; size >>= 8) {
+        crc = (crc << 8) ^ crcTables[0][(crc >> 24) ^ (uint8_t)size];
+    }
+    return ~crc;
+}
@@ -0,0 +1,90 @@
+//
+//  AAHashImpl.h
+//  libAppleArchive
+//
+
+#ifndef AAHashImpl_h
+#define AAHashImpl_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define AA_HASH_X86 1
+#else
+#define AA_HASH_X86 0
+#endif
+
+/* CPU features, detected once at runtime */
+#define AA_HASH_CPU_AVX2 0x1
+#define AA_HASH_CPU_SHA  0x2 /* SHA-NI, with SSSE3 and SSE4.1 */
+#define AA_HASH_CPU_PCLMUL 0x4 /* PCLMULQDQ, with SSSE3 and SSE4.1 */
+
+uint32_t aaHashCPUFeatures(void);
+
+#define AA_HASH_MAX_LANES 8
+#define AA_HASH_MAX_BLOCK_SIZE 128
+
+/*
+ * One hash algorithm of the SHA family: big endian words, Merkle-Damgard
+ * padding with a 64-bit (SHA-1, SHA-256) or 128-bit (SHA-384, SHA-512)
+ * bit length.
+ * compress processes \p nblocks consecutive blocks of one message.
+ * compressLanes, if not NULL, processes one block for each of \p lanes
+ * independent messages. Lane states are stored word major: word w of
+ * lane l is at index w * lanes + l.
+ */
+typedef struct {
+    uint32_t function; /* AA_HASH_FUNCTION_* */
+    size_t blockSize;
+    size_t digestSize;
+    int lengthSize;
+    int wordSize;
+    int stateWords;
+    const void *initialState;
+    void (*compress)(void *state, const uint8_t *blocks, size_t nblocks);
+    int lanes;
+    void (*compressLanes)(void *laneState, const uint8_t * const *blocks);
+} AAHashAlgorithm;
+
+/* Returns the algorithm for \p function, with the best kernels for this CPU, NULL if not a SHA function */
+const AAHashAlgorithm *aaHashGetAlgorithm(uint32_t function);
+
+extern const uint32_t aaSHA1InitialState[5];
+extern const uint32_t aaSHA256InitialState[8];
+extern const uint64_t aaSHA384InitialState[8];
+extern const uint64_t aaSHA512InitialState[8];
+
+void aaSHA1CompressScalar(void *state, const uint8_t *blocks, size_t nblocks);
+void aaSHA256CompressScalar(void *state, const uint8_t *blocks, size_t nblocks);
+void aaSHA512CompressScalar(void *state, const uint8_t *blocks, size_t nblocks);
+
+#if AA_HASH_X86
+void aaSHA1CompressSHANI(void *state, const uint8_t *blocks, size_t nblocks);
+void aaSHA256CompressSHANI(void *state, const uint8_t *blocks, size_t nblocks);
+void aaSHA1CompressLanesAVX2(void *laneState, const uint8_t * const *blocks); /* 8 lanes */
+void aaSHA256CompressLanesAVX2(void *laneState, const uint8_t * const *blocks); /* 8 lanes */
+void aaSHA512CompressLanesAVX2(void *laneState, const uint8_t * const *blocks); /* 4 lanes */
+#endif
+
+/*
+ * POSIX cksum CRC, polynomial 0x04C11DB7, most significant bit first.
+ * \p crc is the raw register: 0 for an empty message, no length and no
+ * complement applied. Use AAHashCRC32Final to get the CKS value.
+ */
+uint32_t aaCRC32Update(uint32_t crc, const uint8_t *data, size_t size);
+uint32_t aaCRC32UpdateSliceBy16(uint32_t crc, const uint8_t *data, size_t size);
+#if AA_HASH_X86
+uint32_t aaCRC32UpdatePCLMUL(uint32_t crc, const uint8_t *data, size_t size);
+#endif
+
+static inline uint32_t aaLoadBE32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline uint64_t aaLoadBE64(const uint8_t *p) {
+    return ((uint64_t)aaLoadBE32(p) << 32) | aaLoadBE32(p + 4);
+}
+
+#endif /* AAHashImpl_h */
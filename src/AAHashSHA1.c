@@ -0,0 +1,176 @@
+//
+//  AAHashSHA1.c
+//  libAppleArchive
+//
+
+#include "AAHashImpl.h"
+
+#if AA_HASH_X86
+#include <immintrin.h>
+#endif
+
+const uint32_t aaSHA1InitialState[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#pragma mark - Scalar
+
+void aaSHA1CompressScalar(void *arg, const uint8_t *blocks, size_t nblocks) {
+    uint32_t *state = arg;
+    for (size_t block = 0; block < nblocks; block++, blocks += 64) {
+        uint32_t w[16];
+        for (int t = 0; t < 16; t++) {
+            w[t] = aaLoadBE32(blocks + 4 * t);
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+        for (int t = 0; t < 80; t++) {
+            if (t >= 16) {
+                uint32_t x = w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15];
+                w[t & 15] = ROL32(x, 1);
+            }
+            uint32_t f, k;
+            if (t < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (t < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (t < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t temp = ROL32(a, 5) + f + e + k + w[t & 15];
+            e = d;
+            d = c;
+            c = ROL32(b, 30);
+            b = a;
+            a = temp;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+}
+
+#if AA_HASH_X86
+
+#pragma mark - SHA-NI
+
+__attribute__((target("sha,ssse3,sse4.1")))
+void aaSHA1CompressSHANI(void *arg, const uint8_t *blocks, size_t nblocks) {
+    uint32_t *state = arg;
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+    __m128i e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+    __m128i e1;
+    for (size_t block = 0; block < nblocks; block++, blocks += 64) {
+        __m128i abcdSave = abcd;
+        __m128i e0Save = e0;
+        __m128i msg[4];
+        /* 4 rounds per group, E alternates between e0 and e1 */
+        for (int g = 0; g < 20; g++) {
+            if (g < 4) {
+                msg[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(blocks + 16 * g)), mask);
+            }
+            if (g == 0) {
+                e0 = _mm_add_epi32(e0, msg[0]);
+                e1 = abcd;
+                abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+            } else if (g & 1) {
+                e1 = _mm_sha1nexte_epu32(e1, msg[g & 3]);
+                e0 = abcd;
+                switch (g / 5) {
+                    case 0: abcd = _mm_sha1rnds4_epu32(abcd, e1, 0); break;
+                    case 1: abcd = _mm_sha1rnds4_epu32(abcd, e1, 1); break;
+                    case 2: abcd = _mm_sha1rnds4_epu32(abcd, e1, 2); break;
+                    default: abcd = _mm_sha1rnds4_epu32(abcd, e1, 3); break;
+                }
+            } else {
+                e0 = _mm_sha1nexte_epu32(e0, msg[g & 3]);
+                e1 = abcd;
+                switch (g / 5) {
+                    case 0: abcd = _mm_sha1rnds4_epu32(abcd, e0, 0); break;
+                    case 1: abcd = _mm_sha1rnds4_epu32(abcd, e0, 1); break;
+                    case 2: abcd = _mm_sha1rnds4_epu32(abcd, e0, 2); break;
+                    default: abcd = _mm_sha1rnds4_epu32(abcd, e0, 3); break;
+                }
+            }
+            /* message schedule for the following groups */
+            if (g >= 3 && g <= 18) {
+                msg[(g + 1) & 3] = _mm_sha1msg2_epu32(msg[(g + 1) & 3], msg[g & 3]);
+            }
+            if (g >= 1 && g <= 16) {
+                msg[(g - 1) & 3] = _mm_sha1msg1_epu32(msg[(g - 1) & 3], msg[g & 3]);
+            }
+            if (g >= 2 && g <= 17) {
+                msg[(g - 2) & 3] = _mm_xor_si128(msg[(g - 2) & 3], msg[g & 3]);
+            }
+        }
+        e0 = _mm_sha1nexte_epu32(e0, e0Save);
+        abcd = _mm_add_epi32(abcd, abcdSave);
+    }
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+#pragma mark - AVX2, 8 lanes
+
+#define ROL32X8(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+
+__attribute__((target("avx2")))
+void aaSHA1CompressLanesAVX2(void *laneState, const uint8_t * const *blocks) {
+    uint32_t *st = laneState;
+    __m256i w[16];
+    for (int t = 0; t < 16; t++) {
+        uint32_t words[8];
+        for (int l = 0; l < 8; l++) {
+            words[l] = aaLoadBE32(blocks[l] + 4 * t);
+        }
+        w[t] = _mm256_loadu_si256((const __m256i *)words);
+    }
+    __m256i a = _mm256_loadu_si256((const __m256i *)(st + 0));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(st + 8));
+    __m256i c = _mm256_loadu_si256((const __m256i *)(st + 16));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(st + 24));
+    __m256i e = _mm256_loadu_si256((const __m256i *)(st + 32));
+    __m256i a0 = a, b0 = b, c0 = c, d0 = d, e0 = e;
+    for (int t = 0; t < 80; t++) {
+        if (t >= 16) {
+            __m256i x = _mm256_xor_si256(_mm256_xor_si256(w[(t - 3) & 15], w[(t - 8) & 15]), _mm256_xor_si256(w[(t - 14) & 15], w[t & 15]));
+            w[t & 15] = ROL32X8(x, 1);
+        }
+        __m256i f;
+        uint32_t k;
+        if (t < 20) {
+            f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_andnot_si256(b, d));
+            k = 0x5A827999;
+        } else if (t < 40) {
+            f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            k = 0x6ED9EBA1;
+        } else if (t < 60) {
+            f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+            k = 0x8F1BBCDC;
+        } else {
+            f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            k = 0xCA62C1D6;
+        }
+        __m256i temp = _mm256_add_epi32(_mm256_add_epi32(ROL32X8(a, 5), f), _mm256_add_epi32(_mm256_add_epi32(e, _mm256_set1_epi32((int)k)), w[t & 15]));
+        e = d;
+        d = c;
+        c = ROL32X8(b, 30);
+        b = a;
+        a = temp;
+    }
+    _mm256_storeu_si256((__m256i *)(st + 0), _mm256_add_epi32(a, a0));
+    _mm256_storeu_si256((__m256i *)(st + 8), _mm256_add_epi32(b, b0));
+    _mm256_storeu_si256((__m256i *)(st + 16), _mm256_add_epi32(c, c0));
+    _mm256_storeu_si256((__m256i *)(st + 24), _mm256_add_epi32(d, d0));
+    _mm256_storeu_si256((__m256i *)(st + 32), _mm256_add_epi32(e, e0));
+}
+
+#endif /* AA_HASH_X86 */
@@ -0,0 +1,164 @@
+//
+//  AAHashSHA256.c
+//  libAppleArchive
+//
+
+#include "AAHashImpl.h"
+
+#if AA_HASH_X86
+#include <immintrin.h>
+#endif
+
+const uint32_t aaSHA256InitialState[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint32_t sha256K[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#pragma mark - Scalar
+
+void aaSHA256CompressScalar(void *arg, const uint8_t *blocks, size_t nblocks) {
+    uint32_t *state = arg;
+    for (size_t block = 0; block < nblocks; block++, blocks += 64) {
+        uint32_t w[16];
+        for (int t = 0; t < 16; t++) {
+            w[t] = aaLoadBE32(blocks + 4 * t);
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int t = 0; t < 64; t++) {
+            if (t >= 16) {
+                uint32_t w15 = w[(t - 15) & 15];
+                uint32_t w2 = w[(t - 2) & 15];
+                uint32_t s0 = ROR32(w15, 7) ^ ROR32(w15, 18) ^ (w15 >> 3);
+                uint32_t s1 = ROR32(w2, 17) ^ ROR32(w2, 19) ^ (w2 >> 10);
+                w[t & 15] += s0 + w[(t - 7) & 15] + s1;
+            }
+            uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[t] + w[t & 15];
+            uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if AA_HASH_X86
+
+#pragma mark - SHA-NI
+
+__attribute__((target("sha,ssse3,sse4.1")))
+void aaSHA256CompressSHANI(void *arg, const uint8_t *blocks, size_t nblocks) {
+    uint32_t *state = arg;
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    /* state is kept as ABEF and CDGH */
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+    for (size_t block = 0; block < nblocks; block++, blocks += 64) {
+        __m128i abefSave = state0;
+        __m128i cdghSave = state1;
+        __m128i msg[4];
+        for (int g = 0; g < 16; g++) {
+            if (g < 4) {
+                msg[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(blocks + 16 * g)), mask);
+            }
+            __m128i m = _mm_add_epi32(msg[g & 3], _mm_loadu_si128((const __m128i *)&sha256K[4 * g]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+            if (g >= 3 && g <= 14) {
+                __m128i next = _mm_add_epi32(msg[(g + 1) & 3], _mm_alignr_epi8(msg[g & 3], msg[(g - 1) & 3], 4));
+                msg[(g + 1) & 3] = _mm_sha256msg2_epu32(next, msg[g & 3]);
+            }
+            m = _mm_shuffle_epi32(m, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+            if (g >= 1 && g <= 12) {
+                msg[(g - 1) & 3] = _mm_sha256msg1_epu32(msg[(g - 1) & 3], msg[g & 3]);
+            }
+        }
+        state0 = _mm_add_epi32(state0, abefSave);
+        state1 = _mm_add_epi32(state1, cdghSave);
+    }
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+#pragma mark - AVX2, 8 lanes
+
+#define ROR32X8(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+__attribute__((target("avx2")))
+void aaSHA256CompressLanesAVX2(void *laneState, const uint8_t * const *blocks) {
+    uint32_t *st = laneState;
+    __m256i w[16];
+    for (int t = 0; t < 16; t++) {
+        uint32_t words[8];
+        for (int l = 0; l < 8; l++) {
+            words[l] = aaLoadBE32(blocks[l] + 4 * t);
+        }
+        w[t] = _mm256_loadu_si256((const __m256i *)words);
+    }
+    __m256i s[8];
+    __m256i v[8];
+    for (int i = 0; i < 8; i++) {
+        s[i] = _mm256_loadu_si256((const __m256i *)(st + 8 * i));
+        v[i] = s[i];
+    }
+    for (int t = 0; t < 64; t++) {
+        if (t >= 16) {
+            __m256i w15 = w[(t - 15) & 15];
+            __m256i w2 = w[(t - 2) & 15];
+            __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROR32X8(w15, 7), ROR32X8(w15, 18)), _mm256_srli_epi32(w15, 3));
+            __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROR32X8(w2, 17), ROR32X8(w2, 19)), _mm256_srli_epi32(w2, 10));
+            w[t & 15] = _mm256_add_epi32(_mm256_add_epi32(w[t & 15], s0), _mm256_add_epi32(w[(t - 7) & 15], s1));
+        }
+        __m256i a = v[0], b = v[1], c = v[2], e = v[4], f = v[5], g = v[6];
+        __m256i sum1 = _mm256_xor_si256(_mm256_xor_si256(ROR32X8(e, 6), ROR32X8(e, 11)), ROR32X8(e, 25));
+        __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+        __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(v[7], sum1), _mm256_add_epi32(ch, _mm256_add_epi32(_mm256_set1_epi32((int)sha256K[t]), w[t & 15])));
+        __m256i sum0 = _mm256_xor_si256(_mm256_xor_si256(ROR32X8(a, 2), ROR32X8(a, 13)), ROR32X8(a, 22));
+        __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+        __m256i t2 = _mm256_add_epi32(sum0, maj);
+        v[7] = g;
+        v[6] = f;
+        v[5] = e;
+        v[4] = _mm256_add_epi32(v[3], t1);
+        v[3] = c;
+        v[2] = b;
+        v[1] = a;
+        v[0] = _mm256_add_epi32(t1, t2);
+    }
+    for (int i = 0; i < 8; i++) {
+        _mm256_storeu_si256((__m256i *)(st + 8 * i), _mm256_add_epi32(s[i], v[i]));
+    }
+}
+
+#endif /* AA_HASH_X86 */
@@ -0,0 +1,140 @@
+//
+//  AAHashSHA512.c
+//  libAppleArchive
+//
+
+#include "AAHashImpl.h"
+
+#if AA_HASH_X86
+#include <immintrin.h>
+#endif
+
+const uint64_t aaSHA384InitialState[8] = {
+    0xCBBB9D5DC1059ED8ULL, 0x629A292A367CD507ULL, 0x9159015A3070DD17ULL, 0x152FECD8F70E5939ULL,
+    0x67332667FFC00B31ULL, 0x8EB44A8768581511ULL, 0xDB0C2E0D64F98FA7ULL, 0x47B5481DBEFA4FA4ULL
+};
+
+const uint64_t aaSHA512InitialState[8] = {
+    0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+    0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+};
+
+static const uint64_t sha512K[80] = {
+    0x428A2F98D728AE22ULL, 0x7137449123EF65CDULL, 0xB5C0FBCFEC4D3B2FULL, 0xE9B5DBA58189DBBCULL,
+    0x3956C25BF348B538ULL, 0x59F111F1B605D019ULL, 0x923F82A4AF194F9BULL, 0xAB1C5ED5DA6D8118ULL,
+    0xD807AA98A3030242ULL, 0x12835B0145706FBEULL, 0x243185BE4EE4B28CULL, 0x550C7DC3D5FFB4E2ULL,
+    0x72BE5D74F27B896FULL, 0x80DEB1FE3B1696B1ULL, 0x9BDC06A725C71235ULL, 0xC19BF174CF692694ULL,
+    0xE49B69C19EF14AD2ULL, 0xEFBE4786384F25E3ULL, 0x0FC19DC68B8CD5B5ULL, 0x240CA1CC77AC9C65ULL,
+    0x2DE92C6F592B0275ULL, 0x4A7484AA6EA6E483ULL, 0x5CB0A9DCBD41FBD4ULL, 0x76F988DA831153B5ULL,
+    0x983E5152EE66DFABULL, 0xA831C66D2DB43210ULL, 0xB00327C898FB213FULL, 0xBF597FC7BEEF0EE4ULL,
+    0xC6E00BF33DA88FC2ULL, 0xD5A79147930AA725ULL, 0x06CA6351E003826FULL, 0x142929670A0E6E70ULL,
+    0x27B70A8546D22FFCULL, 0x2E1B21385C26C926ULL, 0x4D2C6DFC5AC42AEDULL, 0x53380D139D95B3DFULL,
+    0x650A73548BAF63DEULL, 0x766A0ABB3C77B2A8ULL, 0x81C2C92E47EDAEE6ULL, 0x92722C851482353BULL,
+    0xA2BFE8A14CF10364ULL, 0xA81A664BBC423001ULL, 0xC24B8B70D0F89791ULL, 0xC76C51A30654BE30ULL,
+    0xD192E819D6EF5218ULL, 0xD69906245565A910ULL, 0xF40E35855771202AULL, 0x106AA07032BBD1B8ULL,
+    0x19A4C116B8D2D0C8ULL, 0x1E376C085141AB53ULL, 0x2748774CDF8EEB99ULL, 0x34B0BCB5E19B48A8ULL,
+    0x391C0CB3C5C95A63ULL, 0x4ED8AA4AE3418ACBULL, 0x5B9CCA4F7763E373ULL, 0x682E6FF3D6B2B8A3ULL,
+    0x748F82EE5DEFB2FCULL, 0x78A5636F43172F60ULL, 0x84C87814A1F0AB72ULL, 0x8CC702081A6439ECULL,
+    0x90BEFFFA23631E28ULL, 0xA4506CEBDE82BDE9ULL, 0xBEF9A3F7B2C67915ULL, 0xC67178F2E372532BULL,
+    0xCA273ECEEA26619CULL, 0xD186B8C721C0C207ULL, 0xEADA7DD6CDE0EB1EULL, 0xF57D4F7FEE6ED178ULL,
+    0x06F067AA72176FBAULL, 0x0A637DC5A2C898A6ULL, 0x113F9804BEF90DAEULL, 0x1B710B35131C471BULL,
+    0x28DB77F523047D84ULL, 0x32CAAB7B40C72493ULL, 0x3C9EBE0A15C9BEBCULL, 0x431D67C49C100D4CULL,
+    0x4CC5D4BECB3E42B6ULL, 0x597F299CFC657E2AULL, 0x5FCB6FAB3AD6FAECULL, 0x6C44198C4A475817ULL
+};
+
+#define ROR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+#pragma mark - Scalar
+
+void aaSHA512CompressScalar(void *arg, const uint8_t *blocks, size_t nblocks) {
+    uint64_t *state = arg;
+    for (size_t block = 0; block < nblocks; block++, blocks += 128) {
+        uint64_t w[16];
+        for (int t = 0; t < 16; t++) {
+            w[t] = aaLoadBE64(blocks + 8 * t);
+        }
+        uint64_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint64_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int t = 0; t < 80; t++) {
+            if (t >= 16) {
+                uint64_t w15 = w[(t - 15) & 15];
+                uint64_t w2 = w[(t - 2) & 15];
+                uint64_t s0 = ROR64(w15, 1) ^ ROR64(w15, 8) ^ (w15 >> 7);
+                uint64_t s1 = ROR64(w2, 19) ^ ROR64(w2, 61) ^ (w2 >> 6);
+                w[t & 15] += s0 + w[(t - 7) & 15] + s1;
+            }
+            uint64_t t1 = h + (ROR64(e, 14) ^ ROR64(e, 18) ^ ROR64(e, 41)) + ((e & f) ^ (~e & g)) + sha512K[t] + w[t & 15];
+            uint64_t t2 = (ROR64(a, 28) ^ ROR64(a, 34) ^ ROR64(a, 39)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if AA_HASH_X86
+
+#pragma mark - AVX2, 4 lanes
+
+#define ROR64X4(x, n) _mm256_or_si256(_mm256_srli_epi64((x), (n)), _mm256_slli_epi64((x), 64 - (n)))
+
+__attribute__((target("avx2")))
+void aaSHA512CompressLanesAVX2(void *laneState, const uint8_t * const *blocks) {
+    uint64_t *st = laneState;
+    __m256i w[16];
+    for (int t = 0; t < 16; t++) {
+        uint64_t words[4];
+        for (int l = 0; l < 4; l++) {
+            words[l] = aaLoadBE64(blocks[l] + 8 * t);
+        }
+        w[t] = _mm256_loadu_si256((const __m256i *)words);
+    }
+    __m256i s[8];
+    __m256i v[8];
+    for (int i = 0; i < 8; i++) {
+        s[i] = _mm256_loadu_si256((const __m256i *)(st + 4 * i));
+        v[i] = s[i];
+    }
+    for (int t = 0; t < 80; t++) {
+        if (t >= 16) {
+            __m256i w15 = w[(t - 15) & 15];
+            __m256i w2 = w[(t - 2) & 15];
+            __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROR64X4(w15, 1), ROR64X4(w15, 8)), _mm256_srli_epi64(w15, 7));
+            __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROR64X4(w2, 19), ROR64X4(w2, 61)), _mm256_srli_epi64(w2, 6));
+            w[t & 15] = _mm256_add_epi64(_mm256_add_epi64(w[t & 15], s0), _mm256_add_epi64(w[(t - 7) & 15], s1));
+        }
+        __m256i a = v[0], b = v[1], c = v[2], e = v[4], f = v[5], g = v[6];
+        __m256i sum1 = _mm256_xor_si256(_mm256_xor_si256(ROR64X4(e, 14), ROR64X4(e, 18)), ROR64X4(e, 41));
+        __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+        __m256i t1 = _mm256_add_epi64(_mm256_add_epi64(v[7], sum1), _mm256_add_epi64(ch, _mm256_add_epi64(_mm256_set1_epi64x((long long)sha512K[t]), w[t & 15])));
+        __m256i sum0 = _mm256_xor_si256(_mm256_xor_si256(ROR64X4(a, 28), ROR64X4(a, 34)), ROR64X4(a, 39));
+        __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+        __m256i t2 = _mm256_add_epi64(sum0, maj);
+        v[7] = g;
+        v[6] = f;
+        v[5] = e;
+        v[4] = _mm256_add_epi64(v[3], t1);
+        v[3] = c;
+        v[2] = b;
+        v[1] = a;
+        v[0] = _mm256_add_epi64(t1, t2);
+    }
+    for (int i = 0; i < 8; i++) {
+        _mm256_storeu_si256((__m256i *)(st + 4 * i), _mm256_add_epi64(s[i], v[i]));
+    }
+}
+
+#endif /* AA_HASH_X86 */
@@ -101,6 +101,38 @@ APPLE_ARCHIVE_API AAHeader _Nullable AAHeaderCreateWithPath(
   AAFlagSet flags)
 APPLE_ARCHIVE_AVAILABLE(macos(11.0), ios(14.0), watchos(7.0), tvos(14.0));
 
+/*!
+  @abstract Create headers for \p count filesystem objects DIR+"/"+PATHS[i]
+
+  @discussion
+  Same fields as AAHeaderCreateWithPath, except CKS,SH1,SH2,SH3,SH5, which are computed with AADigestEngine.
+  On Linux, statx calls are submitted through io_uring, keeping up to a queue depth of requests in flight, so the
+  latency of cold or remote filesystems overlaps. readlinkat and the extended attribute listing, and statx when
+  io_uring is not available, are spread over \p n_threads threads.
+
+  @param key_set fields to include
+  @param dir root path
+  @param count number of paths
+  @param paths relative paths of the filesystem objects
+  @param flags operation flags, with AA_FLAG_IGNORE_EPERM the paths that can't be stat'ed because of EPERM or EACCES
+  get a NULL header, and are not an error
+  @param n_threads is the number of worker threads, or 0 for default
+  @param headers receives a new header for each path, or NULL if the path could not be stat'ed
+  @param xat_sizes if not NULL, receives for each path the size of its extended attribute name list, 0 when
+  the entry has no extended attributes and XAT can be skipped
+
+  @return 0 on success, and a negative error code if some headers could not be created
+*/
+APPLE_ARCHIVE_API int AAHeaderCreateWithPaths(
+  AAFieldKeySet key_set,
+  const char * dir,
+  size_t count,
+  const char * _Nonnull const * _Nonnull paths,
+  AAFlagSet flags,
+  int n_threads,
+  AAHeader _Nullable * _Nonnull headers,
+  size_t * _Nullable xat_sizes);
+
 #pragma mark - Manipulating fields
 
 /*!
@@ -0,0 +1,525 @@
+//
+//  AAHeaderBatch.c
+//  libAppleArchive
+//
+
+#if defined(__linux__)
+#define _GNU_SOURCE /* statx */
+#endif
+
+#include "AppleArchive.h"
+#include "AAHeader.h"
+#include "AAEncodedHeader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define BATCH_IO_URING 1
+#else
+#define BATCH_IO_URING 0
+#endif
+
+#define BATCH_QUEUE_DEPTH 64 /* statx requests in flight */
+
+/* Metadata fields AAHeaderCreateWithPath takes from the key set */
+enum {
+    BATCH_UID = 1 << 0,
+    BATCH_GID = 1 << 1,
+    BATCH_MOD = 1 << 2,
+    BATCH_FLG = 1 << 3,
+    BATCH_MTM = 1 << 4,
+    BATCH_CTM = 1 << 5,
+    BATCH_BTM = 1 << 6,
+    BATCH_INO = 1 << 7,
+    BATCH_SIZ = 1 << 8,
+    BATCH_DUZ = 1 << 9,
+};
+
+typedef struct {
+    int stated; /* stat done */
+    int status; /* 0 when stat'ed, or -errno */
+    uint32_t type;
+    uint64_t uid;
+    uint64_t gid;
+    uint64_t mode;
+    uint64_t flags;
+    int hasFlags;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t duz;
+    uint64_t rdev;
+    struct timespec mtime;
+    struct timespec birthTime;
+    int hasBirthTime;
+    struct timespec backupTime;
+    int hasBackupTime;
+    char *link;
+    size_t xatSize;
+} BatchInfo;
+
+typedef struct {
+    const char *dir;
+    int dirFd;
+    const char * const *paths;
+    size_t count;
+    BatchInfo *infos;
+    size_t next; /* next path index, shared by the workers */
+} BatchContext;
+
+static uint32_t entryTypeWithMode(mode_t mode) {
+    switch (mode & S_IFMT) {
+        case S_IFREG: return AA_ENTRY_TYPE_REG;
+        case S_IFDIR: return AA_ENTRY_TYPE_DIR;
+        case S_IFLNK: return AA_ENTRY_TYPE_LNK;
+        case S_IFIFO: return AA_ENTRY_TYPE_FIFO;
+        case S_IFCHR: return AA_ENTRY_TYPE_CHR;
+        case S_IFBLK: return AA_ENTRY_TYPE_BLK;
+        case S_IFSOCK: return AA_ENTRY_TYPE_SOCK;
+        default: return 0;
+    }
+}
+
+#pragma mark - stat
+
+#if defined(__linux__)
+
+#define BATCH_STATX_MASK (STATX_BASIC_STATS | STATX_BTIME)
+
+static void infoSetWithStatx(BatchInfo *info, const struct statx *stx) {
+    info->type = entryTypeWithMode(stx->stx_mode);
+    info->uid = stx->stx_uid;
+    info->gid = stx->stx_gid;
+    info->mode = stx->stx_mode & 07777;
+    info->ino = stx->stx_ino;
+    info->size = stx->stx_size;
+    info->duz = stx->stx_blocks * 512;
+    info->rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor); /* same encoding as st_rdev, for mknodat */
+    info->mtime.tv_sec = stx->stx_mtime.tv_sec;
+    info->mtime.tv_nsec = stx->stx_mtime.tv_nsec;
+    if (stx->stx_mask & STATX_BTIME) {
+        info->birthTime.tv_sec = stx->stx_btime.tv_sec;
+        info->birthTime.tv_nsec = stx->stx_btime.tv_nsec;
+        info->hasBirthTime = 1;
+    }
+    info->status = 0;
+}
+
+static int statFlags(const char *path) {
+    return AT_SYMLINK_NOFOLLOW | (path[0] ? 0 : AT_EMPTY_PATH);
+}
+
+static void statPath(BatchContext *ctx, size_t i) {
+    struct statx stx;
+    if (statx(ctx->dirFd, ctx->paths[i], statFlags(ctx->paths[i]), BATCH_STATX_MASK, &stx) < 0) {
+        ctx->infos[i].status = -errno;
+        return;
+    }
+    infoSetWithStatx(&ctx->infos[i], &stx);
+}
+
+#else
+
+static void statPath(BatchContext *ctx, size_t i) {
+    BatchInfo *info = &ctx->infos[i];
+    struct stat st;
+    const char *path = ctx->paths[i][0] ? ctx->paths[i] : ".";
+    if (fstatat(ctx->dirFd, path, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        info->status = -errno;
+        return;
+    }
+    info->type = entryTypeWithMode(st.st_mode);
+    info->uid = st.st_uid;
+    info->gid = st.st_gid;
+    info->mode = st.st_mode & 07777;
+    info->ino = st.st_ino;
+    info->size = st.st_size;
+    info->duz = (uint64_t)st.st_blocks * 512;
+    info->rdev = st.st_rdev;
+#if defined(__APPLE__)
+    info->mtime = st.st_mtimespec;
+    info->birthTime = st.st_birthtimespec;
+    info->hasBirthTime = 1;
+    info->flags = st.st_flags;
+    info->hasFlags = 1;
+#else
+    info->mtime = st.st_mtim;
+#endif
+    info->status = 0;
+}
+
+#endif
+
+#if BATCH_IO_URING
+
+#pragma mark - io_uring
+
+typedef struct {
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+} StatRing;
+
+static void ringDestroy(StatRing *r) {
+    if (r->sqes) {
+        munmap(r->sqes, r->sqesSize);
+    }
+    if (r->cqRing && r->cqRing != r->sqRing) {
+        munmap(r->cqRing, r->cqRingSize);
+    }
+    if (r->sqRing) {
+        munmap(r->sqRing, r->sqRingSize);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+}
+
+static int ringCreate(StatRing *r, unsigned entries) {
+    memset(r, 0, sizeof(*r));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return -1; /* not available, or disabled */
+    }
+    r->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqRingSize > r->sqRingSize) {
+            r->sqRingSize = r->cqRingSize;
+        }
+        r->cqRingSize = r->sqRingSize;
+    }
+    r->sqRing = mmap(0, r->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sqRing == MAP_FAILED) {
+        r->sqRing = 0;
+        ringDestroy(r);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cqRing = r->sqRing;
+    } else {
+        r->cqRing = mmap(0, r->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cqRing == MAP_FAILED) {
+            r->cqRing = 0;
+            ringDestroy(r);
+            return -1;
+        }
+    }
+    r->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(0, r->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = 0;
+        ringDestroy(r);
+        return -1;
+    }
+    uint8_t *sq = r->sqRing;
+    uint8_t *cq = r->cqRing;
+    r->sqHead = (unsigned *)(sq + p.sq_off.head);
+    r->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    r->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sqArray = (unsigned *)(sq + p.sq_off.array);
+    r->cqHead = (unsigned *)(cq + p.cq_off.head);
+    r->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    r->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+/*
+ * statx the paths through io_uring, with up to BATCH_QUEUE_DEPTH requests in
+ * flight. Paths not stat'ed here, if io_uring is not available or fails, are
+ * stat'ed synchronously by the workers.
+ */
+static void statPathsWithRing(BatchContext *ctx) {
+    StatRing r;
+    if (ringCreate(&r, BATCH_QUEUE_DEPTH) < 0) {
+        return;
+    }
+    struct statx *buffers = malloc(BATCH_QUEUE_DEPTH * sizeof(struct statx));
+    size_t *slotPath = malloc(BATCH_QUEUE_DEPTH * sizeof(size_t));
+    int *freeSlots = malloc(BATCH_QUEUE_DEPTH * sizeof(int));
+    if (!buffers || !slotPath || !freeSlots) {
+        ParallelCompressionLogError("malloc");
+        goto END;
+    }
+    int nFree = BATCH_QUEUE_DEPTH;
+    for (int i = 0; i < BATCH_QUEUE_DEPTH; i++) {
+        freeSlots[i] = i;
+    }
+    size_t next = 0;
+    size_t inFlight = 0; /* consumed by the kernel, not completed */
+    unsigned sqHeadSeen = *r.sqHead;
+    int failed = 0;
+    for (;;) {
+        /* fill the submission queue, unless submitting failed */
+        unsigned tail = *r.sqTail;
+        while (!failed && next < ctx->count && nFree > 0) {
+            int slot = freeSlots[--nFree];
+            struct io_uring_sqe *sqe = &r.sqes[tail & *r.sqMask];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = ctx->dirFd;
+            sqe->addr = (uint64_t)(uintptr_t)ctx->paths[next];
+            sqe->len = BATCH_STATX_MASK;
+            sqe->statx_flags = statFlags(ctx->paths[next]);
+            sqe->off = (uint64_t)(uintptr_t)&buffers[slot];
+            sqe->user_data = (uint64_t)slot;
+            r.sqArray[tail & *r.sqMask] = tail & *r.sqMask;
+            slotPath[slot] = next;
+            tail++;
+            next++;
+        }
+        __atomic_store_n(r.sqTail, tail, __ATOMIC_RELEASE);
+        /* after a failure, the SQEs left in the queue are never submitted, their paths go to the workers */
+        unsigned toSubmit = failed ? 0 : tail - __atomic_load_n(r.sqHead, __ATOMIC_ACQUIRE);
+        if (toSubmit == 0 && inFlight == 0) {
+            break;
+        }
+        long rc = syscall(__NR_io_uring_enter, r.fd, toSubmit, 1, IORING_ENTER_GETEVENTS, 0, 0);
+        int enterErrno = errno;
+        /* count what the kernel consumed, even if the call failed */
+        unsigned sqHead = __atomic_load_n(r.sqHead, __ATOMIC_ACQUIRE);
+        inFlight += sqHead - sqHeadSeen;
+        sqHeadSeen = sqHead;
+        if (rc < 0 && enterErrno != EINTR && enterErrno != EAGAIN && enterErrno != EBUSY) {
+            ParallelCompressionLogError("io_uring_enter");
+            if (failed) {
+                /* can't wait for the requests in flight: the kernel may still write their buffers */
+                buffers = 0;
+                break;
+            }
+            failed = 1;
+        }
+        /* reap completions */
+        unsigned head = *r.cqHead;
+        while (head != __atomic_load_n(r.cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r.cqes[head & *r.cqMask];
+            int slot = (int)cqe->user_data;
+            BatchInfo *info = &ctx->infos[slotPath[slot]];
+            if (cqe->res == 0) {
+                infoSetWithStatx(info, &buffers[slot]);
+                info->stated = 1;
+            } else if (cqe->res != -EINVAL && cqe->res != -EOPNOTSUPP) {
+                info->status = cqe->res;
+                info->stated = 1;
+            } /* else kernel without IORING_OP_STATX, leave it to the workers */
+            freeSlots[nFree++] = slot;
+            inFlight--;
+            head++;
+        }
+        __atomic_store_n(r.cqHead, head, __ATOMIC_RELEASE);
+    }
+
+END:
+    ringDestroy(&r);
+    free(buffers);
+    free(slotPath);
+    free(freeSlots);
+}
+
+#endif /* BATCH_IO_URING */
+
+#pragma mark - Fan-out
+
+static void collectPath(BatchContext *ctx, size_t i) {
+    BatchInfo *info = &ctx->infos[i];
+    const char *path = ctx->paths[i];
+    if (!info->stated) {
+        statPath(ctx, i);
+    }
+    if (info->status < 0) {
+        return;
+    }
+    if (info->type == AA_ENTRY_TYPE_LNK) {
+        char buf[PATH_MAX];
+        ssize_t n = readlinkat(ctx->dirFd, path, buf, sizeof(buf) - 1);
+        if (n < 0) {
+            info->status = -errno;
+            return;
+        }
+        info->link = strndup(buf, n);
+        if (!info->link) {
+            info->status = -ENOMEM;
+            return;
+        }
+    }
+    /* no xattr *at calls: use the full path */
+    char fullPath[PATH_MAX];
+    if (snprintf(fullPath, sizeof(fullPath), "%s/%s", ctx->dir, path) < (int)sizeof(fullPath)) {
+#if defined(__APPLE__)
+        ssize_t n = listxattr(fullPath, 0, 0, XATTR_NOFOLLOW);
+#else
+        ssize_t n = llistxattr(fullPath, 0, 0);
+#endif
+        info->xatSize = n > 0 ? (size_t)n : 0;
+    }
+}
+
+static void *batchWorkerProc(void *arg) {
+    BatchContext *ctx = arg;
+    while (1) {
+        size_t i = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED);
+        if (i >= ctx->count) {
+            break;
+        }
+        collectPath(ctx, i);
+    }
+    return 0;
+}
+
+static void collectPaths(BatchContext *ctx, int nThreads) {
+    pthread_t *threads = (nThreads > 1) ? calloc(nThreads - 1, sizeof(pthread_t)) : 0;
+    int started = 0;
+    for (int i = 0; threads && i < nThreads - 1; i++, started++) {
+        if (pthread_create(&threads[i], 0, batchWorkerProc, ctx) != 0) {
+            break;
+        }
+    }
+    batchWorkerProc(ctx); /* the calling thread works too */
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], 0);
+    }
+    free(threads);
+}
+
+#pragma mark - Encoding
+
+static void builderString(AAEncodedHeaderBuilder *b, const char *key, const char *s) {
+    aaEncodedHeaderBuilderAppendString(b, key, s, strlen(s));
+}
+
+static AAHeader encodeHeader(const BatchInfo *info, const char *path, uint32_t fields) {
+    AAEncodedHeaderBuilder *b = malloc(sizeof(AAEncodedHeaderBuilder));
+    if (!b) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    aaEncodedHeaderBuilderInit(b);
+    aaEncodedHeaderBuilderAppendUInt(b, "TYP", info->type);
+    builderString(b, "PAT", path);
+    if (info->type == AA_ENTRY_TYPE_LNK) {
+        builderString(b, "LNK", info->link);
+    }
+    if (info->type == AA_ENTRY_TYPE_CHR || info->type == AA_ENTRY_TYPE_BLK) {
+        aaEncodedHeaderBuilderAppendUInt(b, "DEV", info->rdev);
+    }
+    if (fields & BATCH_UID) aaEncodedHeaderBuilderAppendUInt(b, "UID", info->uid);
+    if (fields & BATCH_GID) aaEncodedHeaderBuilderAppendUInt(b, "GID", info->gid);
+    if (fields & BATCH_MOD) aaEncodedHeaderBuilderAppendUInt(b, "MOD", info->mode);
+    if ((fields & BATCH_FLG) && info->hasFlags) aaEncodedHeaderBuilderAppendUInt(b, "FLG", info->flags);
+    if (fields & BATCH_MTM) aaEncodedHeaderBuilderAppendTimespec(b, "MTM", info->mtime);
+    if ((fields & BATCH_CTM) && info->hasBirthTime) aaEncodedHeaderBuilderAppendTimespec(b, "CTM", info->birthTime);
+    if ((fields & BATCH_BTM) && info->hasBackupTime) aaEncodedHeaderBuilderAppendTimespec(b, "BTM", info->backupTime);
+    if (fields & BATCH_INO) aaEncodedHeaderBuilderAppendUInt(b, "INO", info->ino);
+    if (info->type == AA_ENTRY_TYPE_REG) {
+        if (fields & BATCH_SIZ) aaEncodedHeaderBuilderAppendUInt(b, "SIZ", info->size);
+        if (fields & BATCH_DUZ) aaEncodedHeaderBuilderAppendUInt(b, "DUZ", info->duz);
+    }
+    AAHeader header = 0;
+    if (aaEncodedHeaderBuilderFinish(b) > 0) {
+        header = AAHeaderCreateWithEncodedData(b->size, b->data);
+    }
+    free(b);
+    return header;
+}
+
+static uint32_t fieldsWithKeySet(AAFieldKeySet key_set) {
+    static const struct {
+        const char *key;
+        uint32_t field;
+    } metadataFields[] = {
+        { "UID", BATCH_UID }, { "GID", BATCH_GID }, { "MOD", BATCH_MOD }, { "FLG", BATCH_FLG }, { "MTM", BATCH_MTM },
+        { "CTM", BATCH_CTM }, { "BTM", BATCH_BTM }, { "INO", BATCH_INO }, { "SIZ", BATCH_SIZ }, { "DUZ", BATCH_DUZ },
+    };
+    uint32_t fields = 0;
+    uint32_t n = AAFieldKeySetGetKeyCount(key_set);
+    for (uint32_t i = 0; i < n; i++) {
+        AAFieldKey key = AAFieldKeySetGetKey(key_set, i);
+        for (size_t j = 0; j < sizeof(metadataFields) / sizeof(metadataFields[0]); j++) {
+            if (memcmp(key.skey, metadataFields[j].key, 3) == 0) {
+                fields |= metadataFields[j].field;
+            }
+        }
+    }
+    return fields;
+}
+
+#pragma mark - API
+
+int AAHeaderCreateWithPaths(AAFieldKeySet key_set, const char *dir, size_t count, const char * const *paths, AAFlagSet flags,
+                            int n_threads, AAHeader *headers, size_t *xat_sizes) {
+    int result = 0;
+    for (size_t i = 0; i < count; i++) {
+        headers[i] = 0;
+    }
+    BatchContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.dir = dir;
+    ctx.paths = paths;
+    ctx.count = count;
+    ctx.dirFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    ctx.infos = calloc(count ? count : 1, sizeof(BatchInfo));
+    if (ctx.dirFd < 0 || !ctx.infos) {
+        ParallelCompressionLogError("open: %s");
+        result = -1;
+        goto END;
+    }
+#if BATCH_IO_URING
+    statPathsWithRing(&ctx);
+#endif
+    collectPaths(&ctx, n_threads > 0 ? n_threads : (int)getDefaultNThreads());
+    uint32_t fields = fieldsWithKeySet(key_set);
+    for (size_t i = 0; i < count; i++) {
+        BatchInfo *info = &ctx.infos[i];
+        if (xat_sizes) {
+            xat_sizes[i] = info->xatSize;
+        }
+        if (info->status == 0) {
+            headers[i] = encodeHeader(info, paths[i], fields);
+        } else if ((info->status == -EPERM || info->status == -EACCES) && (flags & AA_FLAG_IGNORE_EPERM)) {
+            continue; /* skipped, not an error */
+        }
+        if (!headers[i]) {
+            ParallelCompressionLogError("header creation failed: %s");
+            result = -1;
+        }
+    }
+
+END:
+    if (ctx.infos) {
+        for (size_t i = 0; i < count; i++) {
+            free(ctx.infos[i].link);
+        }
+        free(ctx.infos);
+    }
+    if (ctx.dirFd >= 0) {
+        close(ctx.dirFd);
+    }
+    return result;
+}
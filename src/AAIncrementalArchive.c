@@ -0,0 +1,539 @@
+//
+//  AAIncrementalArchive.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "AAEncodedHeader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INCREMENTAL_COPY_SIZE (1 << 20) /* DAT bytes copied from the reference per pread */
+
+typedef struct {
+    char *path;
+    off_t offset; /* entry offset in the reference archive */
+    uint8_t *header; /* encoded header */
+    size_t headerSize;
+} ReferenceEntry;
+
+struct AAReferenceArchive_impl {
+    AAByteStream stream;
+    ReferenceEntry *entries; /* sorted by path, then offset */
+    size_t entryCount;
+};
+
+static ssize_t preadFully(AAByteStream s, void *buf, size_t nbyte, off_t offset) {
+    size_t total = 0;
+    while (total < nbyte) {
+        ssize_t n = AAByteStreamPRead(s, (uint8_t *)buf + total, nbyte - total, offset + (off_t)total);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break; /* end of stream */
+        }
+        total += n;
+    }
+    return total;
+}
+
+static ssize_t writeFully(AAByteStream s, const void *buf, size_t nbyte) {
+    size_t total = 0;
+    while (total < nbyte) {
+        ssize_t n = AAByteStreamWrite(s, (const uint8_t *)buf + total, nbyte - total);
+        if (n <= 0) {
+            return -1;
+        }
+        total += n;
+    }
+    return total;
+}
+
+/* Read the header of the entry at \p offset. Returns the header size, 0 at the end of the archive, and -1 on failure. */
+static int readHeader(AAByteStream s, off_t offset, uint8_t *header) {
+    ssize_t n = preadFully(s, header, AA_ENCODED_HEADER_MIN_SIZE, offset);
+    if (n == 0) {
+        return 0;
+    }
+    if (n != AA_ENCODED_HEADER_MIN_SIZE) {
+        ParallelCompressionLogError("truncated archive");
+        return -1;
+    }
+    int size = aaEncodedHeaderSize(header);
+    if (size < 0) {
+        ParallelCompressionLogError("invalid header");
+        return -1;
+    }
+    size_t rest = (size_t)size - AA_ENCODED_HEADER_MIN_SIZE;
+    if (preadFully(s, header + AA_ENCODED_HEADER_MIN_SIZE, rest, offset + AA_ENCODED_HEADER_MIN_SIZE) != (ssize_t)rest) {
+        ParallelCompressionLogError("truncated archive");
+        return -1;
+    }
+    return size;
+}
+
+#pragma mark - Reference archive
+
+static int compareEntries(const void *a, const void *b) {
+    const ReferenceEntry *ea = a;
+    const ReferenceEntry *eb = b;
+    int c = strcmp(ea->path, eb->path);
+    if (c != 0) {
+        return c;
+    }
+    return (ea->offset < eb->offset) ? -1 : (ea->offset > eb->offset);
+}
+
+/* Last entry with \p path, i.e. the one an extraction of the reference leaves in place, or NULL */
+static const ReferenceEntry *lookupEntry(AAReferenceArchive ref, const char *path) {
+    size_t lo = 0;
+    size_t hi = ref->entryCount;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(ref->entries[mid].path, path) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0 || strcmp(ref->entries[lo - 1].path, path) != 0) {
+        return 0;
+    }
+    return &ref->entries[lo - 1];
+}
+
+AAReferenceArchive AAReferenceArchiveOpen(AAByteStream stream) {
+    AAReferenceArchive ref = calloc(1, sizeof(struct AAReferenceArchive_impl));
+    uint8_t *header = malloc(AA_ENCODED_HEADER_MAX_SIZE);
+    char *path = malloc(AA_ENCODED_HEADER_MAX_SIZE);
+    size_t capacity = 0;
+    if (!ref || !header || !path) {
+        ParallelCompressionLogError("malloc");
+        goto FAIL;
+    }
+    ref->stream = stream;
+
+    off_t offset = 0;
+    for (;;) {
+        int size = readHeader(stream, offset, header);
+        if (size == 0) {
+            break;
+        }
+        if (size < 0) {
+            goto FAIL;
+        }
+        int64_t payloadSize = aaEncodedHeaderPayloadSize(header, size);
+        if (payloadSize < 0) {
+            goto FAIL;
+        }
+        if (aaEncodedHeaderGetString(header, size, "PAT", AA_ENCODED_HEADER_MAX_SIZE, path) > 0) {
+            if (ref->entryCount == capacity) {
+                size_t newCapacity = (capacity < 1024) ? 1024 : 2 * capacity;
+                ReferenceEntry *entries = realloc(ref->entries, newCapacity * sizeof(ReferenceEntry));
+                if (!entries) {
+                    ParallelCompressionLogError("malloc");
+                    goto FAIL;
+                }
+                ref->entries = entries;
+                capacity = newCapacity;
+            }
+            ReferenceEntry *e = &ref->entries[ref->entryCount];
+            e->path = strdup(path);
+            e->header = malloc(size);
+            if (!e->path || !e->header) {
+                ParallelCompressionLogError("malloc");
+                free(e->path);
+                free(e->header);
+                goto FAIL;
+            }
+            memcpy(e->header, header, size);
+            e->headerSize = size;
+            e->offset = offset;
+            ref->entryCount++;
+        }
+        offset += size + payloadSize;
+    }
+    qsort(ref->entries, ref->entryCount, sizeof(ReferenceEntry), compareEntries);
+    free(header);
+    free(path);
+    return ref;
+
+FAIL:
+    free(header);
+    free(path);
+    AAReferenceArchiveDestroy(ref);
+    return 0;
+}
+
+size_t AAReferenceArchiveGetEntryCount(AAReferenceArchive ref) {
+    return ref->entryCount;
+}
+
+void AAReferenceArchiveDestroy(AAReferenceArchive ref) {
+    if (!ref) {
+        return;
+    }
+    for (size_t i = 0; i < ref->entryCount; i++) {
+        free(ref->entries[i].path);
+        free(ref->entries[i].header);
+    }
+    free(ref->entries);
+    free(ref);
+}
+
+#pragma mark - Matching
+
+static int sameValue(const AAEncodedField *a, const AAEncodedField *b) {
+    return a->subtype == b->subtype && a->valueSize == b->valueSize && memcmp(a->value, b->value, a->valueSize) == 0;
+}
+
+/* Same field value, or field absent from both headers when \p optional. Returns 1 on match, 0 otherwise. */
+static int sameField(const uint8_t *h, size_t hSize, const uint8_t *r, size_t rSize, const char *key, int optional) {
+    AAEncodedField fh, fr;
+    int ih = aaEncodedHeaderFindField(h, hSize, key, &fh);
+    int ir = aaEncodedHeaderFindField(r, rSize, key, &fr);
+    if (ih < 0 || ir < 0) {
+        return 0;
+    }
+    if (ih == 0 || ir == 0) {
+        return optional && ih == ir;
+    }
+    return sameValue(&fh, &fr);
+}
+
+/* Returns 1 if the DAT of entry \p h is the DAT of reference entry \p r, and 0 otherwise */
+static int matchEntry(const uint8_t *h, size_t hSize, const uint8_t *r, size_t rSize) {
+    static const char *digestKeys[] = { "SH5", "SH3", "SH2", "SH1", "CKS" };
+
+    AAEncodedField fh, fr;
+    if (!sameField(h, hSize, r, rSize, "TYP", 0)) {
+        return 0;
+    }
+    if (aaEncodedHeaderFindField(h, hSize, "DAT", &fh) <= 0 || aaEncodedHeaderFindField(r, rSize, "DAT", &fr) <= 0) {
+        return 0;
+    }
+    if (fh.uintValue == 0 || fh.uintValue != fr.uintValue) {
+        return 0;
+    }
+
+    /* strongest digest present in both headers */
+    for (size_t i = 0; i < sizeof(digestKeys) / sizeof(digestKeys[0]); i++) {
+        if (aaEncodedHeaderFindField(h, hSize, digestKeys[i], &fh) > 0 && aaEncodedHeaderFindField(r, rSize, digestKeys[i], &fr) > 0) {
+            return sameValue(&fh, &fr);
+        }
+    }
+
+    /* stat identity */
+    return sameField(h, hSize, r, rSize, "MTM", 0) && sameField(h, hSize, r, rSize, "SIZ", 1) && sameField(h, hSize, r, rSize, "INO", 1);
+}
+
+#pragma mark - Streams
+
+typedef struct {
+    uint64_t size;
+    int drop; /* blob not written to the output */
+} IncrementalBlob;
+
+typedef struct {
+    AAByteStream out;
+    AAReferenceArchive ref;
+    AAIncrementalStats *stats;
+    int resolve; /* resolver, or encoder */
+    int failed;
+
+    /* header being received */
+    uint8_t *header;
+    size_t headerFill;
+    size_t headerSize; /* 0 until received */
+    char *path;
+    AAEncodedHeaderBuilder *builder;
+
+    /* blobs of the current entry */
+    IncrementalBlob *blobs;
+    size_t blobCount;
+    size_t blobIndex;
+    uint64_t blobRemaining;
+
+    /* resolver: DAT to copy from the reference after the blobs */
+    off_t copyOffset;
+    uint64_t copySize;
+    uint8_t *copyBuffer;
+} IncrementalStream;
+
+static int incrementalStreamClose(void *arg) {
+    IncrementalStream *s = arg;
+    int status = s->failed ? -1 : 0;
+    if (!s->failed && (s->headerFill > 0 || s->headerSize > 0)) {
+        ParallelCompressionLogError("truncated archive");
+        status = -1;
+    }
+    free(s->header);
+    free(s->path);
+    free(s->builder);
+    free(s->blobs);
+    free(s->copyBuffer);
+    free(s);
+    return status;
+}
+
+/* Rewrite the header without \p skip fields, and with \p appendIdx / \p appendDat added when not < 0 */
+static int rewriteHeader(IncrementalStream *s, const char *skip1, const char *skip2, int64_t appendIdx, int64_t appendDat) {
+    AAEncodedHeaderBuilder *b = s->builder;
+    AAEncodedField field;
+    size_t pos = 0;
+    uint64_t blobOffset = 0;
+    int r;
+    aaEncodedHeaderBuilderInit(b);
+    while ((r = aaEncodedHeaderNextField(s->header, s->headerSize, &pos, &blobOffset, &field)) > 0) {
+        if (memcmp(field.key, skip1, 3) == 0 || memcmp(field.key, skip2, 3) == 0) {
+            continue;
+        }
+        aaEncodedHeaderBuilderAppendField(b, s->header, &field);
+    }
+    if (r < 0) {
+        return -1;
+    }
+    if (appendIdx >= 0) {
+        aaEncodedHeaderBuilderAppendUInt(b, "IDX", (uint64_t)appendIdx);
+    }
+    if (appendDat >= 0) {
+        aaEncodedHeaderBuilderAppendBlob(b, "DAT", (uint64_t)appendDat);
+    }
+    if (aaEncodedHeaderBuilderFinish(b) < 0) {
+        return -1;
+    }
+    /* keep the magic of the input header */
+    memcpy(b->data, s->header, 4);
+    return 0;
+}
+
+/* Set the blobs of the received header, dropping \p drop */
+static int setBlobs(IncrementalStream *s, const char *drop) {
+    AAEncodedField field;
+    size_t pos = 0;
+    uint64_t blobOffset = 0;
+    int r;
+    s->blobCount = 0;
+    while ((r = aaEncodedHeaderNextField(s->header, s->headerSize, &pos, &blobOffset, &field)) > 0) {
+        if (field.type != AA_FIELD_TYPE_BLOB) {
+            continue;
+        }
+        s->blobs[s->blobCount].size = field.uintValue;
+        s->blobs[s->blobCount].drop = (drop && memcmp(field.key, drop, 3) == 0);
+        s->blobCount++;
+    }
+    return r;
+}
+
+static int encodeHeader(IncrementalStream *s) {
+    const ReferenceEntry *e = 0;
+    if (aaEncodedHeaderGetString(s->header, s->headerSize, "PAT", AA_ENCODED_HEADER_MAX_SIZE, s->path) > 0) {
+        e = lookupEntry(s->ref, s->path);
+    }
+    if (e && matchEntry(s->header, s->headerSize, e->header, e->headerSize)) {
+        AAEncodedField dat;
+        aaEncodedHeaderFindField(s->header, s->headerSize, "DAT", &dat);
+        if (rewriteHeader(s, "DAT", "IDX", e->offset, -1) < 0 || setBlobs(s, "DAT") < 0) {
+            return -1;
+        }
+        if (writeFully(s->out, s->builder->data, s->builder->size) < 0) {
+            return -1;
+        }
+        if (s->stats) {
+            s->stats->reference_count++;
+            s->stats->reference_bytes += dat.uintValue;
+        }
+        return 0;
+    }
+    if (setBlobs(s, 0) < 0) {
+        return -1;
+    }
+    return (writeFully(s->out, s->header, s->headerSize) < 0) ? -1 : 0;
+}
+
+static int resolveHeader(IncrementalStream *s) {
+    AAEncodedField field;
+    uint64_t idx = 0;
+    int hasIdx = aaEncodedHeaderGetUInt(s->header, s->headerSize, "IDX", &idx);
+    int hasDat = aaEncodedHeaderFindField(s->header, s->headerSize, "DAT", &field);
+    if (hasIdx < 0 || hasDat < 0) {
+        return -1;
+    }
+    if (!hasIdx || hasDat) {
+        /* not a reference */
+        if (setBlobs(s, 0) < 0) {
+            return -1;
+        }
+        return (writeFully(s->out, s->header, s->headerSize) < 0) ? -1 : 0;
+    }
+
+    /* locate the DAT of the reference entry, the builder is used to hold its header */
+    uint8_t *refHeader = s->builder->data;
+    int refSize = readHeader(s->ref->stream, (off_t)idx, refHeader);
+    if (refSize <= 0) {
+        ParallelCompressionLogError("invalid reference entry");
+        return -1;
+    }
+    int r = aaEncodedHeaderFindField(refHeader, refSize, "DAT", &field);
+    if (r < 0) {
+        return -1;
+    }
+    s->copySize = (r > 0) ? field.uintValue : 0;
+    s->copyOffset = (off_t)idx + refSize + (off_t)field.blobOffset;
+
+    if (rewriteHeader(s, "IDX", "IDX", -1, (r > 0) ? (int64_t)s->copySize : -1) < 0 || setBlobs(s, 0) < 0) {
+        return -1;
+    }
+    if (writeFully(s->out, s->builder->data, s->builder->size) < 0) {
+        return -1;
+    }
+    if (s->stats) {
+        s->stats->reference_count++;
+        s->stats->reference_bytes += s->copySize;
+    }
+    return 0;
+}
+
+/* Copy the pending DAT from the reference archive */
+static int copyReferenceData(IncrementalStream *s) {
+    while (s->copySize > 0) {
+        size_t n = (s->copySize < INCREMENTAL_COPY_SIZE) ? (size_t)s->copySize : INCREMENTAL_COPY_SIZE;
+        if (preadFully(s->ref->stream, s->copyBuffer, n, s->copyOffset) != (ssize_t)n) {
+            ParallelCompressionLogError("truncated reference archive");
+            return -1;
+        }
+        if (writeFully(s->out, s->copyBuffer, n) < 0) {
+            return -1;
+        }
+        s->copyOffset += n;
+        s->copySize -= n;
+    }
+    return 0;
+}
+
+/* Move to the next non empty blob, or to the next entry */
+static int nextBlob(IncrementalStream *s) {
+    while (s->blobIndex < s->blobCount) {
+        s->blobRemaining = s->blobs[s->blobIndex].size;
+        if (s->blobRemaining > 0) {
+            return 0;
+        }
+        s->blobIndex++;
+    }
+    if (s->resolve && copyReferenceData(s) < 0) {
+        return -1;
+    }
+    s->headerFill = 0;
+    s->headerSize = 0;
+    return 0;
+}
+
+static ssize_t incrementalStreamWrite(void *arg, const void *buf, size_t nbyte) {
+    IncrementalStream *s = arg;
+    const uint8_t *p = buf;
+    size_t i = 0;
+    if (s->failed) {
+        return -1;
+    }
+    while (i < nbyte) {
+        if (s->headerSize == 0 || s->headerFill < s->headerSize) {
+            /* receive header */
+            size_t need = (s->headerSize == 0) ? AA_ENCODED_HEADER_MIN_SIZE : s->headerSize;
+            size_t n = need - s->headerFill;
+            if (n > nbyte - i) {
+                n = nbyte - i;
+            }
+            memcpy(s->header + s->headerFill, p + i, n);
+            s->headerFill += n;
+            i += n;
+            if (s->headerFill < need) {
+                continue;
+            }
+            if (s->headerSize == 0) {
+                int size = aaEncodedHeaderSize(s->header);
+                if (size < 0) {
+                    ParallelCompressionLogError("invalid header");
+                    goto FAIL;
+                }
+                s->headerSize = (size_t)size;
+                if (s->headerFill < s->headerSize) {
+                    continue;
+                }
+            }
+            if (s->stats) {
+                s->stats->entry_count++;
+            }
+            s->copySize = 0;
+            if ((s->resolve ? resolveHeader(s) : encodeHeader(s)) < 0) {
+                goto FAIL;
+            }
+            s->blobIndex = 0;
+            if (nextBlob(s) < 0) {
+                goto FAIL;
+            }
+            continue;
+        }
+
+        /* blob payload */
+        size_t n = nbyte - i;
+        if ((uint64_t)n > s->blobRemaining) {
+            n = (size_t)s->blobRemaining;
+        }
+        if (!s->blobs[s->blobIndex].drop && writeFully(s->out, p + i, n) < 0) {
+            goto FAIL;
+        }
+        i += n;
+        s->blobRemaining -= n;
+        if (s->blobRemaining == 0) {
+            s->blobIndex++;
+            if (nextBlob(s) < 0) {
+                goto FAIL;
+            }
+        }
+    }
+    return nbyte;
+
+FAIL:
+    s->failed = 1;
+    return -1;
+}
+
+static AAByteStream incrementalStreamOpen(AAByteStream out, AAReferenceArchive ref, AAIncrementalStats *stats, int resolve) {
+    IncrementalStream *s = calloc(1, sizeof(IncrementalStream));
+    AAByteStream stream = AACustomByteStreamOpen();
+    if (!s || !stream) {
+        ParallelCompressionLogError("malloc");
+        free(s);
+        AAByteStreamClose(stream);
+        return 0;
+    }
+    AACustomByteStreamSetData(stream, s);
+    AACustomByteStreamSetCloseProc(stream, incrementalStreamClose);
+    AACustomByteStreamSetWriteProc(stream, incrementalStreamWrite);
+    s->out = out;
+    s->ref = ref;
+    s->stats = stats;
+    s->resolve = resolve;
+    s->header = malloc(AA_ENCODED_HEADER_MAX_SIZE);
+    s->path = malloc(AA_ENCODED_HEADER_MAX_SIZE);
+    s->builder = malloc(sizeof(AAEncodedHeaderBuilder));
+    /* each blob field takes at least 6 bytes */
+    s->blobs = malloc((AA_ENCODED_HEADER_MAX_SIZE / 6) * sizeof(IncrementalBlob));
+    s->copyBuffer = resolve ? malloc(INCREMENTAL_COPY_SIZE) : 0;
+    if (!s->header || !s->path || !s->builder || !s->blobs || (resolve && !s->copyBuffer)) {
+        ParallelCompressionLogError("malloc");
+        AAByteStreamClose(stream);
+        return 0;
+    }
+    return stream;
+}
+
+AAByteStream AAIncrementalEncodeOutputStreamOpen(AAByteStream out, AAReferenceArchive ref, AAIncrementalStats *stats) {
+    return incrementalStreamOpen(out, ref, stats, 0);
+}
+
+AAByteStream AAIncrementalResolveOutputStreamOpen(AAByteStream out, AAReferenceArchive ref, AAIncrementalStats *stats) {
+    return incrementalStreamOpen(out, ref, stats, 1);
+}
@@ -0,0 +1,125 @@
+// AppleArchive incremental archives
+
+#pragma once
+
+#ifndef __APPLE_ARCHIVE_H
+#error Include AppleArchive.h instead of this file
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull begin")
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma mark - Reference archive
+
+/*!
+  @abstract Previous archive, referenced by an incremental archive
+
+  @discussion
+  An incremental archive is encoded against a reference archive: entries whose data didn't change since the
+  reference was encoded are stored without their DAT blob, and with an IDX field set to the offset of the
+  entry in the reference archive. All other fields and blobs are stored as usual, so the metadata of the
+  incremental archive is always current.
+  The reference archive index maps the PAT of each entry to its location, it is built by reading all the
+  headers of the reference archive once, and skipping the payloads.
+*/
+typedef struct AAReferenceArchive_impl * AAReferenceArchive APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Incremental archive statistics
+*/
+typedef struct {
+  uint64_t entry_count;          ///< entries processed
+  uint64_t reference_count;      ///< entries stored as (or resolved from) a reference
+  uint64_t reference_bytes;      ///< DAT bytes not encoded (or copied from the reference archive)
+} AAIncrementalStats APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Open a reference archive
+
+  @discussion
+  \p stream must implement pread, and must remain valid until the reference archive is destroyed. It is not
+  closed by AAReferenceArchiveDestroy. The archive must be an uncompressed archive stream, i.e. a raw archive
+  file, or a random access decompression stream of a compressed archive.
+
+  @param stream reference archive stream
+
+  @return a new reference archive on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAReferenceArchive _Nullable AAReferenceArchiveOpen(
+  AAByteStream stream);
+
+/*!
+  @abstract Get the number of entries in a reference archive
+
+  @param ref reference archive
+
+  @return the number of entries in \p ref
+*/
+APPLE_ARCHIVE_API size_t AAReferenceArchiveGetEntryCount(
+  AAReferenceArchive ref);
+
+/*!
+  @abstract Destroy a reference archive
+
+  @param ref reference archive, can be NULL
+*/
+APPLE_ARCHIVE_API void AAReferenceArchiveDestroy(
+  AAReferenceArchive _Nullable ref);
+
+#pragma mark - Incremental encoding
+
+/*!
+  @abstract Create an incremental encoder stream
+
+  @discussion
+  The stream receives an archive, e.g. from an archive encoder, and writes the corresponding incremental
+  archive to \p out. An entry is stored as a reference if the reference archive has an entry with the same
+  PAT and TYP, and a DAT blob of the same size, and
+  - both headers have a digest field of the same type (CKS, SH1, SH2, SH3, SH5) with the same value, or
+  - the headers have no digest type in common, and have the same MTM, and the same SIZ and INO when present.
+  Only entries with a non empty DAT blob are stored as references.
+  \p out is not closed when the stream is closed.
+
+  @param out receives the incremental archive
+  @param ref reference archive
+  @param stats if not NULL, receives the statistics, updated after each entry
+
+  @return a new stream on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAByteStream _Nullable AAIncrementalEncodeOutputStreamOpen(
+  AAByteStream out,
+  AAReferenceArchive ref,
+  AAIncrementalStats * _Nullable stats);
+
+/*!
+  @abstract Create an incremental resolver stream
+
+  @discussion
+  The stream receives an incremental archive, and writes the corresponding full archive to \p out. The
+  entries with an IDX field and no DAT blob are resolved: the IDX field is removed, and a DAT blob field is
+  appended to the header, with the payload read from the reference archive.
+  \p out is not closed when the stream is closed.
+
+  @param out receives the full archive
+  @param ref reference archive, the stream passed to AAReferenceArchiveOpen is used to read the payloads
+  @param stats if not NULL, receives the statistics, updated after each entry
+
+  @return a new stream on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAByteStream _Nullable AAIncrementalResolveOutputStreamOpen(
+  AAByteStream out,
+  AAReferenceArchive ref,
+  AAIncrementalStats * _Nullable stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull end")
+#endif
@@ -0,0 +1,143 @@
+//
+//  AAMemoryBudget.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+struct AAMemoryBudget_impl {
+    pthread_mutex_t lock;
+    pthread_cond_t releaseCond; /* signaled when memory is released */
+    size_t limit; /* 0 for unlimited */
+    size_t current;
+    size_t peak;
+    uint64_t waitCount;
+};
+
+AAMemoryBudget AAMemoryBudgetCreate(size_t limit) {
+    AAMemoryBudget budget = calloc(1, sizeof(struct AAMemoryBudget_impl));
+    if (!budget) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    pthread_mutex_init(&budget->lock, 0);
+    pthread_cond_init(&budget->releaseCond, 0);
+    budget->limit = limit;
+    return budget;
+}
+
+void AAMemoryBudgetDestroy(AAMemoryBudget budget) {
+    if (!budget) {
+        return;
+    }
+    pthread_cond_destroy(&budget->releaseCond);
+    pthread_mutex_destroy(&budget->lock);
+    free(budget);
+}
+
+static int availableLocked(AAMemoryBudget budget, size_t size) {
+    return budget->limit == 0 || budget->limit - budget->current >= size;
+}
+
+static void reserveLocked(AAMemoryBudget budget, size_t size) {
+    budget->current += size;
+    if (budget->current > budget->peak) {
+        budget->peak = budget->current;
+    }
+}
+
+int AAMemoryBudgetAcquire(AAMemoryBudget budget, size_t size) {
+    if (!budget) {
+        return 0;
+    }
+    if (budget->limit && size > budget->limit) {
+        /* would wait forever */
+        ParallelCompressionLogError("memory budget exceeded: %zu");
+        return -1;
+    }
+    pthread_mutex_lock(&budget->lock);
+    if (!availableLocked(budget, size)) {
+        budget->waitCount++;
+        do {
+            pthread_cond_wait(&budget->releaseCond, &budget->lock);
+        } while (!availableLocked(budget, size));
+    }
+    reserveLocked(budget, size);
+    pthread_mutex_unlock(&budget->lock);
+    return 0;
+}
+
+int AAMemoryBudgetTryAcquire(AAMemoryBudget budget, size_t size) {
+    if (!budget) {
+        return 0;
+    }
+    pthread_mutex_lock(&budget->lock);
+    int ok = availableLocked(budget, size);
+    if (ok) {
+        reserveLocked(budget, size);
+    } else {
+        budget->waitCount++;
+    }
+    pthread_mutex_unlock(&budget->lock);
+    return ok ? 0 : -1;
+}
+
+int AAMemoryBudgetAcquireItems(AAMemoryBudget budget, size_t item_size, int max_items) {
+    if (max_items <= 0) {
+        return -1;
+    }
+    if (!budget) {
+        return max_items;
+    }
+    /* not counted as a wait: reserving fewer items is the expected outcome with a short budget */
+    int n = 0;
+    pthread_mutex_lock(&budget->lock);
+    while (n < max_items && availableLocked(budget, item_size)) {
+        reserveLocked(budget, item_size);
+        n++;
+    }
+    pthread_mutex_unlock(&budget->lock);
+    if (n == 0) {
+        ParallelCompressionLogError("memory budget exhausted: %zu");
+        return -1;
+    }
+    return n;
+}
+
+void AAMemoryBudgetRelease(AAMemoryBudget budget, size_t size) {
+    if (!budget || !size) {
+        return;
+    }
+    pthread_mutex_lock(&budget->lock);
+    budget->current = (size > budget->current) ? 0 : budget->current - size;
+    pthread_cond_broadcast(&budget->releaseCond);
+    pthread_mutex_unlock(&budget->lock);
+}
+
+size_t AAMemoryBudgetGetLimit(AAMemoryBudget budget) {
+    return budget->limit;
+}
+
+size_t AAMemoryBudgetGetCurrent(AAMemoryBudget budget) {
+    pthread_mutex_lock(&budget->lock);
+    size_t current = budget->current;
+    pthread_mutex_unlock(&budget->lock);
+    return current;
+}
+
+size_t AAMemoryBudgetGetPeak(AAMemoryBudget budget) {
+    pthread_mutex_lock(&budget->lock);
+    size_t peak = budget->peak;
+    pthread_mutex_unlock(&budget->lock);
+    return peak;
+}
+
+uint64_t AAMemoryBudgetGetWaitCount(AAMemoryBudget budget) {
+    pthread_mutex_lock(&budget->lock);
+    uint64_t waitCount = budget->waitCount;
+    pthread_mutex_unlock(&budget->lock);
+    return waitCount;
+}
@@ -0,0 +1,133 @@
+// AppleArchive memory budget
+
+#pragma once
+
+#ifndef __APPLE_ARCHIVE_H
+#error Include AppleArchive.h instead of this file
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull begin")
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma mark - Memory budget
+
+/*!
+  @abstract Memory budget
+
+  @discussion
+  A budget bounds the memory used by in-flight buffers (blocks queued, being processed, or read ahead) across
+  all the streams, schedulers, digest engines, and extractors it is passed to. They reserve most buffers
+  from the budget when they are set up, without blocking, and degrade to fewer buffers in flight when the
+  budget is short, down to the one buffer they need to make progress. If even that one is not available,
+  setup fails instead of waiting for another client to release memory.
+  A budget is thread safe, and must outlive the objects using it.
+*/
+typedef struct AAMemoryBudget_impl * AAMemoryBudget APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Create a memory budget
+
+  @param limit maximum number of bytes reserved at any time, 0 for unlimited (usage is still tracked)
+
+  @return a new budget on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAMemoryBudget _Nullable AAMemoryBudgetCreate(size_t limit);
+
+/*!
+  @abstract Destroy a memory budget
+
+  @param budget target budget, do nothing if NULL
+*/
+APPLE_ARCHIVE_API void AAMemoryBudgetDestroy(AAMemoryBudget _Nullable budget);
+
+/*!
+  @abstract Reserve memory, blocking until it is available
+
+  @param budget target budget, always succeed if NULL
+  @param size number of bytes to reserve
+
+  @return 0 on success, and a negative error code if \p size exceeds the budget limit
+*/
+APPLE_ARCHIVE_API int AAMemoryBudgetAcquire(AAMemoryBudget _Nullable budget, size_t size);
+
+/*!
+  @abstract Reserve memory if available, without blocking
+
+  @param budget target budget, always succeed if NULL
+  @param size number of bytes to reserve
+
+  @return 0 on success, and a negative error code if \p size is not available
+*/
+APPLE_ARCHIVE_API int AAMemoryBudgetTryAcquire(AAMemoryBudget _Nullable budget, size_t size);
+
+/*!
+  @abstract Reserve memory for up to \p max_items buffers of \p item_size bytes
+
+  @discussion Reserves as many buffers as available, without blocking. This is how streams size their queues: with a short
+  budget, they run with fewer buffers in flight. Never blocking matters when a thread opens several streams on the same
+  budget, e.g. decompressing and recompressing: waiting here could wait for memory held by the same thread.
+
+  @param budget target budget, always reserve \p max_items if NULL
+  @param item_size number of bytes per buffer
+  @param max_items maximum number of buffers
+
+  @return the number of buffers reserved, at least 1, on success, and a negative error code if not even one buffer is available
+*/
+APPLE_ARCHIVE_API int AAMemoryBudgetAcquireItems(AAMemoryBudget _Nullable budget, size_t item_size, int max_items);
+
+/*!
+  @abstract Release memory reserved by AAMemoryBudgetAcquire or AAMemoryBudgetTryAcquire
+
+  @param budget target budget, do nothing if NULL
+  @param size number of bytes to release
+*/
+APPLE_ARCHIVE_API void AAMemoryBudgetRelease(AAMemoryBudget _Nullable budget, size_t size);
+
+/*!
+  @abstract Get the budget limit
+
+  @param budget target budget
+
+  @return the limit in bytes, 0 if unlimited
+*/
+APPLE_ARCHIVE_API size_t AAMemoryBudgetGetLimit(AAMemoryBudget budget);
+
+/*!
+  @abstract Get the memory currently reserved
+
+  @param budget target budget
+
+  @return the number of bytes currently reserved
+*/
+APPLE_ARCHIVE_API size_t AAMemoryBudgetGetCurrent(AAMemoryBudget budget);
+
+/*!
+  @abstract Get the peak memory reserved
+
+  @param budget target budget
+
+  @return the maximum number of bytes reserved at any time since the budget was created
+*/
+APPLE_ARCHIVE_API size_t AAMemoryBudgetGetPeak(AAMemoryBudget budget);
+
+/*!
+  @abstract Get the number of reservations that had to wait
+
+  @param budget target budget
+
+  @return the number of AAMemoryBudgetAcquire calls that blocked, and AAMemoryBudgetTryAcquire calls that failed
+*/
+APPLE_ARCHIVE_API uint64_t AAMemoryBudgetGetWaitCount(AAMemoryBudget budget);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull end")
+#endif
@@ -0,0 +1,577 @@
+//
+//  AAParallelDecoder.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include "AAEncodedHeader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define PDEC_RANGE_SIZE (4 << 20) /* archive bytes per range */
+#define PDEC_BUFFER_SIZE (1 << 20) /* read buffer */
+#define PDEC_MIN_READ_SIZE (128 << 10) /* smallest read, larger than any header */
+#define PDEC_RANGES_PER_THREAD 4 /* ranges decoded ahead of the client */
+
+typedef struct {
+    off_t offset; /* header offset */
+    size_t headerStart; /* in the range header bytes */
+    size_t headerSize;
+    int status; /* -1 if a digest doesn't match */
+} DecodedEntry;
+
+typedef struct {
+    off_t start; /* entries with a header in [start, end) */
+    off_t end;
+    off_t exit; /* offset following the last entry, >= end */
+    int status; /* 0 if a chain was found, -1 if not */
+    int done;
+    DecodedEntry *entries;
+    size_t entryCount;
+    size_t entryCapacity;
+    uint8_t *headers;
+    size_t headersSize;
+    size_t headersCapacity;
+    uint64_t falseCandidates;
+    uint64_t verifiedCount;
+    uint64_t verifiedBytes;
+} DecodeRange;
+
+struct AAParallelDecoder_impl;
+
+/* Read buffer and hash context, one per worker, and one for the client thread */
+typedef struct {
+    struct AAParallelDecoder_impl *decoder;
+    pthread_t thread;
+    int threadStarted;
+    uint8_t *buf;
+    off_t bufOffset;
+    size_t bufSize;
+    int failed; /* read error */
+    AAHashContext hash;
+} DecodeWorker;
+
+struct AAParallelDecoder_impl {
+    AAByteStream stream;
+    off_t base; /* stream offset of the archive */
+    off_t size; /* archive size */
+    uint32_t verifyFunctions;
+    AAParallelDecoderStats *stats;
+
+    DecodeRange *ranges;
+    size_t rangeCount;
+
+    int nThreads;
+    DecodeWorker *workers;
+    DecodeWorker client; /* decodes again the ranges wrongly speculated */
+
+    pthread_mutex_t lock;
+    pthread_cond_t workCond; /* workers wait for a range to decode */
+    pthread_cond_t doneCond; /* the client waits for a decoded range */
+    size_t nextRange; /* next range to decode */
+    size_t consumedRange; /* range being returned to the client */
+    int stop;
+
+    /* client state */
+    off_t expected; /* offset of the next entry */
+    size_t entryIndex; /* next entry in ranges[consumedRange] */
+    int started;
+    int failed;
+};
+
+typedef struct AAParallelDecoder_impl * Decoder;
+
+#pragma mark - Decoding
+
+/* Pointer to bytes [offset, offset + nbyte) of the archive, or NULL if out of range or on read failure */
+static const uint8_t *workerGet(DecodeWorker *w, off_t offset, size_t nbyte) {
+    Decoder d = w->decoder;
+    if (offset < 0 || nbyte > PDEC_BUFFER_SIZE || offset + (off_t)nbyte > d->size) {
+        return 0;
+    }
+    if (offset >= w->bufOffset && offset + (off_t)nbyte <= w->bufOffset + (off_t)w->bufSize) {
+        return w->buf + (offset - w->bufOffset);
+    }
+    size_t want = (nbyte > PDEC_MIN_READ_SIZE) ? nbyte : PDEC_MIN_READ_SIZE;
+    if ((off_t)want > d->size - offset) {
+        want = (size_t)(d->size - offset);
+    }
+    size_t total = 0;
+    while (total < want) {
+        ssize_t n = AAByteStreamPRead(d->stream, w->buf + total, want - total, d->base + offset + (off_t)total);
+        if (n <= 0) {
+            ParallelCompressionLogError("archive read failed");
+            w->failed = 1;
+            w->bufSize = 0;
+            return 0;
+        }
+        total += n;
+    }
+    w->bufOffset = offset;
+    w->bufSize = want;
+    return w->buf;
+}
+
+static int appendEntry(DecodeRange *range, off_t offset, const uint8_t *header, size_t size) {
+    if (range->entryCount == range->entryCapacity) {
+        size_t newCapacity = (range->entryCapacity < 64) ? 64 : 2 * range->entryCapacity;
+        DecodedEntry *entries = realloc(range->entries, newCapacity * sizeof(DecodedEntry));
+        if (!entries) {
+            ParallelCompressionLogError("malloc");
+            return -1;
+        }
+        range->entries = entries;
+        range->entryCapacity = newCapacity;
+    }
+    if (range->headersSize + size > range->headersCapacity) {
+        size_t newCapacity = (range->headersCapacity < 4096) ? 4096 : range->headersCapacity;
+        while (newCapacity < range->headersSize + size) {
+            newCapacity *= 2;
+        }
+        uint8_t *headers = realloc(range->headers, newCapacity);
+        if (!headers) {
+            ParallelCompressionLogError("malloc");
+            return -1;
+        }
+        range->headers = headers;
+        range->headersCapacity = newCapacity;
+    }
+    DecodedEntry *e = &range->entries[range->entryCount++];
+    e->offset = offset;
+    e->headerStart = range->headersSize;
+    e->headerSize = size;
+    e->status = 0;
+    memcpy(range->headers + range->headersSize, header, size);
+    range->headersSize += size;
+    return 0;
+}
+
+/* Follow the chain of entries from \p offset to the first entry starting after the range. Returns 0 on success, and -1 if an entry is invalid. */
+static int decodeChain(DecodeWorker *w, DecodeRange *range, off_t offset) {
+    Decoder d = w->decoder;
+    range->entryCount = 0;
+    range->headersSize = 0;
+    while (offset < range->end) {
+        const uint8_t *p = workerGet(w, offset, AA_ENCODED_HEADER_MIN_SIZE);
+        int size = p ? aaEncodedHeaderSize(p) : -1;
+        if (size < AA_ENCODED_HEADER_MIN_SIZE) {
+            return -1;
+        }
+        p = workerGet(w, offset, (size_t)size);
+        int64_t payloadSize = p ? aaEncodedHeaderPayloadSize(p, (size_t)size) : -1;
+        if (payloadSize < 0 || (uint64_t)payloadSize > (uint64_t)(d->size - offset - size)) {
+            return -1;
+        }
+        if (appendEntry(range, offset, p, (size_t)size) < 0) {
+            w->failed = 1;
+            return -1;
+        }
+        offset += size + (off_t)payloadSize;
+    }
+    range->exit = offset;
+    return 0;
+}
+
+/* Digest field for each hash function */
+static const char *digestKeys[] = { 0, "CKS", "SH1", "SH2", "SH3", "SH5" };
+
+static int sameDigest(const AADigests *digests, int f, const AAEncodedField *field) {
+    const uint8_t *d = 0;
+    uint8_t crc[4];
+    size_t n = 0;
+    switch (f) {
+        case AA_HASH_FUNCTION_CRC32:
+            /* stored as the digest bytes, most significant first */
+            crc[0] = (uint8_t)(digests->crc32 >> 24);
+            crc[1] = (uint8_t)(digests->crc32 >> 16);
+            crc[2] = (uint8_t)(digests->crc32 >> 8);
+            crc[3] = (uint8_t)digests->crc32;
+            d = crc;
+            n = 4;
+            break;
+        case AA_HASH_FUNCTION_SHA1: d = digests->sha1; n = 20; break;
+        case AA_HASH_FUNCTION_SHA256: d = digests->sha256; n = 32; break;
+        case AA_HASH_FUNCTION_SHA384: d = digests->sha384; n = 48; break;
+        case AA_HASH_FUNCTION_SHA512: d = digests->sha512; n = 64; break;
+        default: return 0;
+    }
+    return field->valueSize == n && memcmp(field->value, d, n) == 0;
+}
+
+/* Hash the DAT of the entries having a digest field to verify, and set their status */
+static int verifyRange(DecodeWorker *w, DecodeRange *range) {
+    Decoder d = w->decoder;
+    for (size_t i = 0; i < range->entryCount; i++) {
+        DecodedEntry *e = &range->entries[i];
+        const uint8_t *h = range->headers + e->headerStart;
+        AAEncodedField dat;
+        AAEncodedField digestFields[6];
+        uint32_t present = 0;
+        if (aaEncodedHeaderFindField(h, e->headerSize, "DAT", &dat) <= 0) {
+            continue;
+        }
+        for (int f = AA_HASH_FUNCTION_CRC32; f <= AA_HASH_FUNCTION_SHA512; f++) {
+            if ((d->verifyFunctions & AA_HASH_FUNCTION_MASK(f))
+                && aaEncodedHeaderFindField(h, e->headerSize, digestKeys[f], &digestFields[f]) > 0
+                && digestFields[f].type == AA_FIELD_TYPE_HASH) {
+                present |= AA_HASH_FUNCTION_MASK(f);
+            }
+        }
+        if (!present) {
+            continue;
+        }
+        AAHashContextReset(w->hash);
+        off_t offset = e->offset + (off_t)e->headerSize + (off_t)dat.blobOffset;
+        uint64_t remaining = dat.uintValue;
+        while (remaining > 0) {
+            size_t n = (remaining < PDEC_BUFFER_SIZE) ? (size_t)remaining : PDEC_BUFFER_SIZE;
+            const uint8_t *p = workerGet(w, offset, n);
+            if (!p) {
+                return -1;
+            }
+            AAHashContextUpdate(w->hash, p, n);
+            offset += n;
+            remaining -= n;
+        }
+        AADigests digests;
+        AAHashContextFinal(w->hash, &digests);
+        for (int f = AA_HASH_FUNCTION_CRC32; f <= AA_HASH_FUNCTION_SHA512; f++) {
+            if ((present & AA_HASH_FUNCTION_MASK(f)) && !sameDigest(&digests, f, &digestFields[f])) {
+                e->status = -1;
+            }
+        }
+        range->verifiedCount++;
+        range->verifiedBytes += dat.uintValue;
+    }
+    return 0;
+}
+
+static int isMagic(const uint8_t *p) {
+    return memcmp(p, "AA01", 4) == 0 || memcmp(p, "YAA1", 4) == 0;
+}
+
+/* Find the first entry chain starting in the range. Sets range->status to 0 if found, and -1 if not. */
+static void decodeRangeSpeculative(DecodeWorker *w, DecodeRange *range) {
+    Decoder d = w->decoder;
+    range->status = -1;
+    if (range->start == 0) {
+        /* the first range starts with an entry */
+        if (decodeChain(w, range, 0) == 0) {
+            range->status = 0;
+        }
+        goto END;
+    }
+    off_t pos = range->start;
+    while (pos < range->end && !w->failed && !__atomic_load_n(&d->stop, __ATOMIC_ACQUIRE)) {
+        /* scan a buffer for a magic starting in the range */
+        size_t n = PDEC_BUFFER_SIZE;
+        if ((off_t)n > d->size - pos) {
+            n = (size_t)(d->size - pos);
+        }
+        if (pos >= w->bufOffset && pos < w->bufOffset + (off_t)w->bufSize) {
+            size_t available = (size_t)(w->bufOffset + (off_t)w->bufSize - pos);
+            if (available >= AA_ENCODED_HEADER_MIN_SIZE) {
+                n = available; /* scan what was already read */
+            }
+        }
+        if (n < AA_ENCODED_HEADER_MIN_SIZE) {
+            break;
+        }
+        const uint8_t *p = workerGet(w, pos, n);
+        if (!p) {
+            break;
+        }
+        size_t i;
+        size_t last = n - AA_ENCODED_HEADER_MIN_SIZE;
+        if ((off_t)last >= range->end - pos) {
+            last = (size_t)(range->end - pos) - 1;
+        }
+        for (i = 0; i <= last; i++) {
+            if ((p[i] == 'A' || p[i] == 'Y') && isMagic(p + i)) {
+                break;
+            }
+        }
+        if (i > last) {
+            pos += (off_t)last + 1;
+            continue;
+        }
+        off_t candidate = pos + (off_t)i;
+        if (decodeChain(w, range, candidate) == 0) {
+            range->status = 0;
+            goto END;
+        }
+        range->falseCandidates++;
+        pos = candidate + 1;
+    }
+    range->entryCount = 0;
+    range->headersSize = 0;
+
+END:
+    if (range->status == 0 && d->verifyFunctions && verifyRange(w, range) < 0) {
+        range->status = -1;
+    }
+}
+
+static void *workerProc(void *arg) {
+    DecodeWorker *w = arg;
+    Decoder d = w->decoder;
+    for (;;) {
+        pthread_mutex_lock(&d->lock);
+        while (!d->stop && d->nextRange < d->rangeCount
+               && d->nextRange >= d->consumedRange + (size_t)d->nThreads * PDEC_RANGES_PER_THREAD) {
+            pthread_cond_wait(&d->workCond, &d->lock);
+        }
+        if (d->stop || d->nextRange >= d->rangeCount) {
+            pthread_mutex_unlock(&d->lock);
+            break;
+        }
+        DecodeRange *range = &d->ranges[d->nextRange++];
+        pthread_mutex_unlock(&d->lock);
+
+        w->failed = 0;
+        decodeRangeSpeculative(w, range);
+
+        pthread_mutex_lock(&d->lock);
+        range->done = 1;
+        pthread_cond_broadcast(&d->doneCond);
+        pthread_mutex_unlock(&d->lock);
+    }
+    return 0;
+}
+
+static void freeRange(DecodeRange *range) {
+    free(range->entries);
+    free(range->headers);
+    range->entries = 0;
+    range->headers = 0;
+    range->entryCount = 0;
+    range->entryCapacity = 0;
+    range->headersSize = 0;
+    range->headersCapacity = 0;
+}
+
+static int initWorker(Decoder d, DecodeWorker *w) {
+    w->decoder = d;
+    w->buf = malloc(PDEC_BUFFER_SIZE);
+    if (!w->buf) {
+        ParallelCompressionLogError("malloc");
+        return -1;
+    }
+    if (d->verifyFunctions) {
+        w->hash = AAHashContextCreate(d->verifyFunctions);
+        if (!w->hash) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void destroyWorker(DecodeWorker *w) {
+    free(w->buf);
+    AAHashContextDestroy(w->hash);
+}
+
+/* Stitch range \p index to the entries returned before it. Returns 0 on success, and -1 on failure. */
+static int stitchRange(Decoder d, size_t index) {
+    DecodeRange *range = &d->ranges[index];
+    pthread_mutex_lock(&d->lock);
+    d->consumedRange = index;
+    pthread_cond_broadcast(&d->workCond);
+    while (!range->done) {
+        pthread_cond_wait(&d->doneCond, &d->lock);
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    d->entryIndex = 0;
+    if (d->stats) {
+        d->stats->range_count++;
+        d->stats->false_candidates += range->falseCandidates;
+    }
+    if (d->expected >= range->end) {
+        /* no entry starts in the range, it is covered by a payload */
+        range->entryCount = 0;
+        return 0;
+    }
+    if (range->status == 0) {
+        /* entries are sorted by offset */
+        size_t lo = 0;
+        size_t hi = range->entryCount;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (range->entries[mid].offset < d->expected) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < range->entryCount && range->entries[lo].offset == d->expected) {
+            d->entryIndex = lo;
+            d->expected = range->exit;
+            goto END;
+        }
+    }
+
+    /* wrong speculation, decode again from the known entry */
+    if (d->stats) {
+        d->stats->redecoded_ranges++;
+    }
+    d->client.failed = 0;
+    range->falseCandidates = 0;
+    range->verifiedCount = 0;
+    range->verifiedBytes = 0;
+    if (decodeChain(&d->client, range, d->expected) < 0) {
+        if (!d->client.failed) {
+            ParallelCompressionLogError("invalid archive");
+        }
+        return -1;
+    }
+    if (d->verifyFunctions && verifyRange(&d->client, range) < 0) {
+        return -1;
+    }
+    d->expected = range->exit;
+
+END:
+    if (d->stats) {
+        d->stats->verified_count += range->verifiedCount;
+        d->stats->verified_bytes += range->verifiedBytes;
+    }
+    return 0;
+}
+
+#pragma mark - API
+
+AAParallelDecoder AAParallelDecoderOpen(AAByteStream stream, uint32_t verify_functions, int n_threads, AAParallelDecoderStats *stats) {
+    Decoder d = calloc(1, sizeof(struct AAParallelDecoder_impl));
+    if (!d) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    pthread_mutex_init(&d->lock, 0);
+    pthread_cond_init(&d->workCond, 0);
+    pthread_cond_init(&d->doneCond, 0);
+    d->stream = stream;
+    d->verifyFunctions = verify_functions;
+    d->stats = stats;
+    d->nThreads = n_threads > 0 ? n_threads : (int)getDefaultNThreads();
+
+    d->base = AAByteStreamSeek(stream, 0, SEEK_CUR);
+    off_t end = AAByteStreamSeek(stream, 0, SEEK_END);
+    uint8_t probe;
+    if (d->base < 0 || end < d->base || AAByteStreamSeek(stream, d->base, SEEK_SET) < 0
+        || AAByteStreamPRead(stream, &probe, 0, d->base) < 0) {
+        ParallelCompressionLogError("stream must implement pread and seek");
+        goto ERROR;
+    }
+    d->size = end - d->base;
+
+    d->rangeCount = (size_t)((d->size + PDEC_RANGE_SIZE - 1) / PDEC_RANGE_SIZE);
+    d->ranges = calloc(d->rangeCount > 0 ? d->rangeCount : 1, sizeof(DecodeRange));
+    d->workers = calloc(d->nThreads, sizeof(DecodeWorker));
+    if (!d->ranges || !d->workers) {
+        ParallelCompressionLogError("malloc");
+        goto ERROR;
+    }
+    for (size_t i = 0; i < d->rangeCount; i++) {
+        d->ranges[i].start = (off_t)i * PDEC_RANGE_SIZE;
+        d->ranges[i].end = (i + 1 == d->rangeCount) ? d->size : (off_t)(i + 1) * PDEC_RANGE_SIZE;
+    }
+    if (initWorker(d, &d->client) < 0) {
+        goto ERROR;
+    }
+    for (int i = 0; i < d->nThreads; i++) {
+        if (initWorker(d, &d->workers[i]) < 0) {
+            goto ERROR;
+        }
+    }
+    for (int i = 0; i < d->nThreads; i++) {
+        if (pthread_create(&d->workers[i].thread, 0, workerProc, &d->workers[i]) != 0) {
+            ParallelCompressionLogError("pthread_create");
+            goto ERROR;
+        }
+        d->workers[i].threadStarted = 1;
+    }
+    return d;
+
+ERROR:
+    AAParallelDecoderDestroy(d);
+    return 0;
+}
+
+int AAParallelDecoderNext(AAParallelDecoder decoder, const uint8_t **header, size_t *header_size, off_t *offset) {
+    Decoder d = decoder;
+    if (d->failed) {
+        return -1;
+    }
+    if (!d->started) {
+        d->started = 1;
+        if (d->rangeCount == 0) {
+            return 0; /* empty archive */
+        }
+        if (stitchRange(d, 0) < 0) {
+            goto FAIL;
+        }
+    }
+    for (;;) {
+        DecodeRange *range = &d->ranges[d->consumedRange];
+        if (d->entryIndex < range->entryCount) {
+            DecodedEntry *e = &range->entries[d->entryIndex++];
+            if (e->status < 0) {
+                ParallelCompressionLogError("digest mismatch");
+                goto FAIL;
+            }
+            *header = range->headers + e->headerStart;
+            *header_size = e->headerSize;
+            *offset = e->offset;
+            if (d->stats) {
+                d->stats->entry_count++;
+            }
+            return 1;
+        }
+        /* the headers returned by the previous call are released here */
+        if (d->consumedRange + 1 == d->rangeCount) {
+            freeRange(range);
+            return 0;
+        }
+        freeRange(range);
+        if (stitchRange(d, d->consumedRange + 1) < 0) {
+            goto FAIL;
+        }
+    }
+
+FAIL:
+    d->failed = 1;
+    return -1;
+}
+
+void AAParallelDecoderDestroy(AAParallelDecoder decoder) {
+    Decoder d = decoder;
+    if (!d) {
+        return;
+    }
+    pthread_mutex_lock(&d->lock);
+    __atomic_store_n(&d->stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&d->workCond);
+    pthread_mutex_unlock(&d->lock);
+    if (d->workers) {
+        for (int i = 0; i < d->nThreads; i++) {
+            if (d->workers[i].threadStarted) {
+                pthread_join(d->workers[i].thread, 0);
+            }
+            destroyWorker(&d->workers[i]);
+        }
+        free(d->workers);
+    }
+    destroyWorker(&d->client);
+    if (d->ranges) {
+        for (size_t i = 0; i < d->rangeCount; i++) {
+            freeRange(&d->ranges[i]);
+        }
+        free(d->ranges);
+    }
+    pthread_cond_destroy(&d->doneCond);
+    pthread_cond_destroy(&d->workCond);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+}
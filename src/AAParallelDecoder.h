@@ -0,0 +1,102 @@
+// AppleArchive parallel decoder
+
+#pragma once
+
+#ifndef __APPLE_ARCHIVE_H
+#error Include AppleArchive.h instead of this file
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull begin")
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma mark - Parallel decoder
+
+/*!
+  @abstract Decodes the headers of an uncompressed archive on several threads
+
+  @discussion
+  An uncompressed archive is a sequence of headers starting with "AA01" or "YAA1" and their size, each followed
+  by its payload, so it can be split. The archive is partitioned into ranges decoded speculatively by worker
+  threads: a worker scans its range for a header magic, validates the candidate header, and follows the chain
+  of entries from it to the end of the range. A candidate that doesn't chain to a valid entry is a false match
+  in payload data, and the scan continues after it.
+  The client thread stitches the ranges in order: the entry following the last entry of a range must be in the
+  chain of the next range. When it is not, e.g. the worker followed a chain starting inside a payload that
+  happened to be valid, the range is decoded again from the known entry offset. Entries are returned in
+  archive order, with the same results as a sequential decoder.
+  The stream must implement pread and seek.
+*/
+typedef struct AAParallelDecoder_impl * AAParallelDecoder APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Parallel decoder statistics
+*/
+typedef struct {
+  uint64_t entry_count;          ///< headers returned
+  uint64_t range_count;          ///< ranges stitched
+  uint64_t false_candidates;     ///< header candidates rejected by the workers
+  uint64_t redecoded_ranges;     ///< ranges decoded again by the client thread after a wrong speculation
+  uint64_t verified_count;       ///< entries with a DAT digest verified
+  uint64_t verified_bytes;       ///< DAT bytes hashed to verify the digests
+} AAParallelDecoderStats APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Create a parallel decoder and start decoding
+
+  @discussion
+  The archive starts at the current position of \p stream, which is offset 0 for the entry offsets, and ends at
+  the end of the stream.
+  With \p verify_functions, the workers hash the DAT blob of each entry having a digest field of one of these
+  functions (CKS, SH1, SH2, SH3, SH5), and AAParallelDecoderNext fails when it reaches an entry whose digest
+  doesn't match. Otherwise payloads are not read.
+
+  @param stream archive stream, not closed when the decoder is destroyed
+  @param verify_functions mask of AA_HASH_FUNCTION_MASK(AA_HASH_FUNCTION_*), digests to verify, or 0
+  @param n_threads number of worker threads, or 0 for default
+  @param stats if not NULL, receives the statistics, updated after each call
+
+  @return a new decoder on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAParallelDecoder _Nullable AAParallelDecoderOpen(
+  AAByteStream stream,
+  uint32_t verify_functions,
+  int n_threads,
+  AAParallelDecoderStats * _Nullable stats);
+
+/*!
+  @abstract Get the next entry, in archive order
+
+  @param decoder parallel decoder
+  @param header receives a pointer to the encoded header, valid until the next call
+  @param header_size receives the encoded header size
+  @param offset receives the offset of the header, relative to the start of the archive
+
+  @return 1 if an entry is found, 0 at the end of the archive, and a negative error code on failure, if the
+  archive is invalid, or if a digest doesn't match
+*/
+APPLE_ARCHIVE_API int AAParallelDecoderNext(
+  AAParallelDecoder decoder,
+  const uint8_t * _Nullable * _Nonnull header,
+  size_t * header_size,
+  off_t * offset);
+
+/*!
+  @abstract Stop the workers, and destroy a parallel decoder
+
+  @param decoder parallel decoder, can be NULL
+*/
+APPLE_ARCHIVE_API void AAParallelDecoderDestroy(
+  AAParallelDecoder _Nullable decoder);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull end")
+#endif
@@ -0,0 +1,593 @@
+//
+//  AAPathMatcher.c
+//  libAppleArchive
+//
+
+#include "AppleArchive.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define MATCHER_MAX_DFA_STATES (1 << 16) /* simulate the NFA above this */
+#define MATCHER_MAX_DFA_TABLE_SIZE (64 << 20) /* bytes */
+
+enum {
+    STATE_INCLUDE = 1, /* an include pattern matches */
+    STATE_EXCLUDE = 2, /* an exclude pattern matches */
+    STATE_LIVE = 4, /* an include pattern can still match */
+};
+
+/* NFA position: one pattern item, or the end of a pattern */
+typedef struct {
+    uint8_t set[32]; /* bytes matched by the item */
+    uint8_t repeat; /* '*' or "**", matching 0 or more bytes */
+    uint8_t end; /* end of pattern, no item */
+    uint8_t exclude; /* pattern type */
+} MatcherPosition;
+
+/* Sorted list of NFA positions */
+typedef struct {
+    uint32_t *p;
+    size_t count;
+} PositionList;
+
+struct AAPathMatcher_impl {
+    MatcherPosition *positions;
+    size_t positionCount;
+    size_t positionCapacity;
+    uint32_t *starts; /* first position of each pattern */
+    size_t patternCount;
+    int hasInclude;
+
+    pthread_mutex_t lock;
+    int compiled;
+    int compileStatus;
+
+    /* bytes matched by the same items share a class */
+    uint8_t classOf[256];
+    uint8_t classByte[256]; /* a byte of each class */
+    uint32_t classCount;
+
+    /* DFA, state 0 is the dead state */
+    int useDFA;
+    uint32_t *transitions; /* [stateCount][classCount] */
+    uint8_t *stateFlags;
+    uint32_t stateCount;
+    uint32_t startState;
+
+    /* NFA */
+    PositionList startList;
+};
+
+static inline void setAdd(uint8_t *set, uint8_t c) { set[c >> 3] |= (uint8_t)(1 << (c & 7)); }
+static inline int setContains(const uint8_t *set, uint8_t c) { return (set[c >> 3] >> (c & 7)) & 1; }
+
+#pragma mark - Patterns
+
+static MatcherPosition *appendPosition(AAPathMatcher m) {
+    if (m->positionCount == m->positionCapacity) {
+        size_t newCapacity = (m->positionCapacity < 256) ? 256 : 2 * m->positionCapacity;
+        MatcherPosition *positions = realloc(m->positions, newCapacity * sizeof(MatcherPosition));
+        if (!positions) {
+            ParallelCompressionLogError("malloc");
+            return 0;
+        }
+        m->positions = positions;
+        m->positionCapacity = newCapacity;
+    }
+    MatcherPosition *pos = &m->positions[m->positionCount++];
+    memset(pos, 0, sizeof(MatcherPosition));
+    return pos;
+}
+
+/* Parse the class starting after '[' at \p p into \p set. Returns a pointer after ']', or NULL if invalid. */
+static const char *parseClass(const char *p, uint8_t *set) {
+    uint8_t in[32] = { 0 };
+    int negate = 0;
+    if (*p == '!' || *p == '^') {
+        negate = 1;
+        p++;
+    }
+    int first = 1;
+    while (*p && (*p != ']' || first)) {
+        first = 0;
+        unsigned char lo = (unsigned char)*p++;
+        if (lo == '\\') {
+            if (!*p) {
+                return 0;
+            }
+            lo = (unsigned char)*p++;
+        }
+        unsigned char hi = lo;
+        if (p[0] == '-' && p[1] && p[1] != ']') {
+            p++;
+            hi = (unsigned char)*p++;
+            if (hi == '\\') {
+                if (!*p) {
+                    return 0;
+                }
+                hi = (unsigned char)*p++;
+            }
+        }
+        for (unsigned c = lo; c <= hi; c++) {
+            setAdd(in, (uint8_t)c);
+        }
+    }
+    if (*p != ']') {
+        return 0;
+    }
+    for (int i = 0; i < 32; i++) {
+        set[i] = negate ? (uint8_t)~in[i] : in[i];
+    }
+    set['/' >> 3] &= (uint8_t)~(1 << ('/' & 7));
+    return p + 1;
+}
+
+int AAPathMatcherAddPattern(AAPathMatcher m, const char *pattern, int exclude) {
+    size_t start = m->positionCount;
+    const char *p = pattern;
+    while (*p) {
+        MatcherPosition *pos = appendPosition(m);
+        if (!pos) {
+            goto FAIL;
+        }
+        pos->exclude = (uint8_t)(exclude != 0);
+        if (*p == '*') {
+            int any = (p[1] == '*');
+            while (*p == '*') {
+                p++;
+            }
+            memset(pos->set, 0xff, 32);
+            if (!any) {
+                pos->set['/' >> 3] &= (uint8_t)~(1 << ('/' & 7));
+            }
+            pos->repeat = 1;
+        } else if (*p == '?') {
+            memset(pos->set, 0xff, 32);
+            pos->set['/' >> 3] &= (uint8_t)~(1 << ('/' & 7));
+            p++;
+        } else if (*p == '[') {
+            p = parseClass(p + 1, pos->set);
+            if (!p) {
+                ParallelCompressionLogError("invalid pattern");
+                goto FAIL;
+            }
+        } else {
+            if (*p == '\\') {
+                p++;
+                if (!*p) {
+                    ParallelCompressionLogError("invalid pattern");
+                    goto FAIL;
+                }
+            }
+            setAdd(pos->set, (uint8_t)*p++);
+        }
+    }
+    MatcherPosition *end = appendPosition(m);
+    if (!end) {
+        goto FAIL;
+    }
+    end->end = 1;
+    end->exclude = (uint8_t)(exclude != 0);
+
+    uint32_t *starts = realloc(m->starts, (m->patternCount + 1) * sizeof(uint32_t));
+    if (!starts) {
+        ParallelCompressionLogError("malloc");
+        goto FAIL;
+    }
+    m->starts = starts;
+    m->starts[m->patternCount++] = (uint32_t)start;
+    if (!exclude) {
+        m->hasInclude = 1;
+    }
+    m->compiled = 0;
+    return 0;
+
+FAIL:
+    m->positionCount = start;
+    return -1;
+}
+
+#pragma mark - NFA
+
+typedef struct {
+    uint32_t *stamp; /* [positionCount], positions already in the list being built */
+    uint32_t generation;
+} StepContext;
+
+static int comparePositions(const void *a, const void *b) {
+    uint32_t pa = *(const uint32_t *)a;
+    uint32_t pb = *(const uint32_t *)b;
+    return (pa < pb) ? -1 : (pa > pb);
+}
+
+static void listAdd(StepContext *ctx, uint32_t *out, size_t *count, uint32_t pos) {
+    if (ctx->stamp[pos] != ctx->generation) {
+        ctx->stamp[pos] = ctx->generation;
+        out[(*count)++] = pos;
+    }
+}
+
+/* Add the positions following repeat items, and sort */
+static void closeList(AAPathMatcher m, StepContext *ctx, uint32_t *out, size_t *count) {
+    for (size_t i = 0; i < *count; i++) {
+        uint32_t pos = out[i];
+        if (m->positions[pos].repeat) {
+            listAdd(ctx, out, count, pos + 1);
+        }
+    }
+    qsort(out, *count, sizeof(uint32_t), comparePositions);
+}
+
+/* Positions after reading \p c from \p in, \p out has room for all positions */
+static size_t stepList(AAPathMatcher m, StepContext *ctx, const uint32_t *in, size_t inCount, uint8_t c, uint32_t *out) {
+    size_t count = 0;
+    ctx->generation++;
+    for (size_t i = 0; i < inCount; i++) {
+        const MatcherPosition *pos = &m->positions[in[i]];
+        if (pos->end || !setContains(pos->set, c)) {
+            continue;
+        }
+        listAdd(ctx, out, &count, pos->repeat ? in[i] : in[i] + 1);
+    }
+    closeList(m, ctx, out, &count);
+    return count;
+}
+
+static uint8_t listFlags(AAPathMatcher m, const uint32_t *list, size_t count) {
+    uint8_t flags = 0;
+    for (size_t i = 0; i < count; i++) {
+        const MatcherPosition *pos = &m->positions[list[i]];
+        if (pos->end) {
+            flags |= pos->exclude ? STATE_EXCLUDE : STATE_INCLUDE;
+        } else if (!pos->exclude) {
+            flags |= STATE_LIVE;
+        }
+    }
+    return flags;
+}
+
+#pragma mark - DFA
+
+typedef struct {
+    uint32_t *pool; /* position lists of all states */
+    size_t poolSize;
+    size_t poolCapacity;
+    size_t *listStart; /* [state] */
+    size_t *listCount;
+    uint32_t *table; /* open addressing, state + 1 */
+    size_t tableSize;
+    uint32_t stateCapacity;
+} DFABuilder;
+
+static uint64_t hashList(const uint32_t *list, size_t count) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < count; i++) {
+        h = (h ^ list[i]) * 0x100000001b3ULL;
+    }
+    return h ^ (h >> 29);
+}
+
+/* State for \p list, created if needed. Returns the state, or -1 on failure or if the DFA gets too large. */
+static int64_t internState(AAPathMatcher m, DFABuilder *b, const uint32_t *list, size_t count) {
+    size_t mask = b->tableSize - 1;
+    size_t i = (size_t)hashList(list, count) & mask;
+    while (b->table[i] != 0) {
+        uint32_t s = b->table[i] - 1;
+        if (b->listCount[s] == count && memcmp(b->pool + b->listStart[s], list, count * sizeof(uint32_t)) == 0) {
+            return s;
+        }
+        i = (i + 1) & mask;
+    }
+    if (m->stateCount == MATCHER_MAX_DFA_STATES
+        || (uint64_t)(m->stateCount + 1) * m->classCount * sizeof(uint32_t) > MATCHER_MAX_DFA_TABLE_SIZE) {
+        return -1;
+    }
+    if (m->stateCount == b->stateCapacity) {
+        uint32_t newCapacity = 2 * b->stateCapacity;
+        size_t *listStart = realloc(b->listStart, newCapacity * sizeof(size_t));
+        if (listStart) {
+            b->listStart = listStart;
+        }
+        size_t *listCount = realloc(b->listCount, newCapacity * sizeof(size_t));
+        if (listCount) {
+            b->listCount = listCount;
+        }
+        uint8_t *stateFlags = realloc(m->stateFlags, newCapacity);
+        if (stateFlags) {
+            m->stateFlags = stateFlags;
+        }
+        uint32_t *transitions = realloc(m->transitions, (size_t)newCapacity * m->classCount * sizeof(uint32_t));
+        if (transitions) {
+            m->transitions = transitions;
+        }
+        if (!listStart || !listCount || !stateFlags || !transitions) {
+            ParallelCompressionLogError("malloc");
+            return -1;
+        }
+        b->stateCapacity = newCapacity;
+        /* rehash, keeping the load factor under 1/2 */
+        free(b->table);
+        b->tableSize = 2 * (size_t)newCapacity;
+        b->table = calloc(b->tableSize, sizeof(uint32_t));
+        if (!b->table) {
+            ParallelCompressionLogError("malloc");
+            return -1;
+        }
+        mask = b->tableSize - 1;
+        for (uint32_t s = 0; s < m->stateCount; s++) {
+            size_t j = (size_t)hashList(b->pool + b->listStart[s], b->listCount[s]) & mask;
+            while (b->table[j] != 0) {
+                j = (j + 1) & mask;
+            }
+            b->table[j] = s + 1;
+        }
+        i = (size_t)hashList(list, count) & mask;
+        while (b->table[i] != 0) {
+            i = (i + 1) & mask;
+        }
+    }
+    if (b->poolSize + count > b->poolCapacity) {
+        size_t newCapacity = 2 * b->poolCapacity;
+        while (newCapacity < b->poolSize + count) {
+            newCapacity *= 2;
+        }
+        uint32_t *pool = realloc(b->pool, newCapacity * sizeof(uint32_t));
+        if (!pool) {
+            ParallelCompressionLogError("malloc");
+            return -1;
+        }
+        b->pool = pool;
+        b->poolCapacity = newCapacity;
+    }
+    uint32_t s = m->stateCount++;
+    if (count > 0) {
+        memcpy(b->pool + b->poolSize, list, count * sizeof(uint32_t));
+    }
+    b->listStart[s] = b->poolSize;
+    b->listCount[s] = count;
+    b->poolSize += count;
+    b->table[i] = s + 1;
+    m->stateFlags[s] = listFlags(m, list, count);
+    return s;
+}
+
+/* Build the DFA by subset construction. Returns 0 on success, and -1 if it gets too large. */
+static int buildDFA(AAPathMatcher m, StepContext *ctx, uint32_t *scratch) {
+    DFABuilder b = { 0 };
+    int status = -1;
+    b.stateCapacity = 256;
+    b.poolCapacity = 4096;
+    b.tableSize = 2 * (size_t)b.stateCapacity;
+    b.pool = malloc(b.poolCapacity * sizeof(uint32_t));
+    b.listStart = malloc(b.stateCapacity * sizeof(size_t));
+    b.listCount = malloc(b.stateCapacity * sizeof(size_t));
+    b.table = calloc(b.tableSize, sizeof(uint32_t));
+    m->stateFlags = malloc(b.stateCapacity);
+    m->transitions = malloc((size_t)b.stateCapacity * m->classCount * sizeof(uint32_t));
+    m->stateCount = 0;
+    if (!b.pool || !b.listStart || !b.listCount || !b.table || !m->stateFlags || !m->transitions) {
+        ParallelCompressionLogError("malloc");
+        goto END;
+    }
+    if (internState(m, &b, 0, 0) != 0) { /* dead state */
+        goto END;
+    }
+    int64_t start = internState(m, &b, m->startList.p, m->startList.count);
+    if (start < 0) {
+        goto END;
+    }
+    m->startState = (uint32_t)start;
+    /* states are created in order, and processed in the same order */
+    for (uint32_t s = 0; s < m->stateCount; s++) {
+        for (uint32_t c = 0; c < m->classCount; c++) {
+            /* the list may move when the pool grows, step from a copy */
+            size_t count = b.listCount[s];
+            uint32_t *in = scratch + m->positionCount;
+            memcpy(in, b.pool + b.listStart[s], count * sizeof(uint32_t));
+            size_t n = stepList(m, ctx, in, count, m->classByte[c], scratch);
+            int64_t t = internState(m, &b, scratch, n);
+            if (t < 0) {
+                goto END;
+            }
+            m->transitions[(size_t)s * m->classCount + c] = (uint32_t)t;
+        }
+    }
+    status = 0;
+
+END:
+    if (status < 0) {
+        free(m->transitions);
+        free(m->stateFlags);
+        m->transitions = 0;
+        m->stateFlags = 0;
+        m->stateCount = 0;
+    }
+    free(b.pool);
+    free(b.listStart);
+    free(b.listCount);
+    free(b.table);
+    return status;
+}
+
+#pragma mark - Compile
+
+/* Byte classes: two bytes are in the same class if all items match both or neither */
+static void computeClasses(AAPathMatcher m) {
+    memset(m->classOf, 0, 256);
+    m->classCount = 1;
+    for (size_t i = 0; i < m->positionCount; i++) {
+        const MatcherPosition *pos = &m->positions[i];
+        if (pos->end) {
+            continue;
+        }
+        int16_t newClass[256][2];
+        memset(newClass, 0xff, sizeof(newClass));
+        uint32_t count = 0;
+        for (int c = 0; c < 256; c++) {
+            int bit = setContains(pos->set, (uint8_t)c);
+            int16_t *k = &newClass[m->classOf[c]][bit];
+            if (*k < 0) {
+                *k = (int16_t)count++;
+            }
+            m->classOf[c] = (uint8_t)*k;
+        }
+        m->classCount = count;
+    }
+    /* '/' is checked by the matcher at each path component */
+    for (int c = 255; c >= 0; c--) {
+        m->classByte[m->classOf[c]] = (uint8_t)c;
+    }
+}
+
+static int compile(AAPathMatcher m) {
+    free(m->transitions);
+    free(m->stateFlags);
+    free(m->startList.p);
+    m->transitions = 0;
+    m->stateFlags = 0;
+    m->startList.p = 0;
+    m->stateCount = 0;
+    m->useDFA = 0;
+
+    computeClasses(m);
+    StepContext ctx = { 0 };
+    ctx.stamp = calloc(m->positionCount + 1, sizeof(uint32_t));
+    uint32_t *scratch = malloc(2 * (m->positionCount + 1) * sizeof(uint32_t));
+    m->startList.p = malloc((m->positionCount + 1) * sizeof(uint32_t));
+    if (!ctx.stamp || !scratch || !m->startList.p) {
+        ParallelCompressionLogError("malloc");
+        free(ctx.stamp);
+        free(scratch);
+        return -1;
+    }
+    ctx.generation = 1;
+    m->startList.count = 0;
+    for (size_t i = 0; i < m->patternCount; i++) {
+        listAdd(&ctx, m->startList.p, &m->startList.count, m->starts[i]);
+    }
+    closeList(m, &ctx, m->startList.p, &m->startList.count);
+
+    m->useDFA = (buildDFA(m, &ctx, scratch) == 0);
+    free(ctx.stamp);
+    free(scratch);
+    return 0;
+}
+
+#pragma mark - API
+
+AAPathMatcher AAPathMatcherCreate(void) {
+    AAPathMatcher m = calloc(1, sizeof(struct AAPathMatcher_impl));
+    if (!m) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    pthread_mutex_init(&m->lock, 0);
+    return m;
+}
+
+static int matchNFA(AAPathMatcher m, const char *path, size_t length, int *included, int *excluded, uint8_t *nextFlags) {
+    StepContext ctx = { 0 };
+    ctx.stamp = calloc(m->positionCount + 1, sizeof(uint32_t));
+    uint32_t *a = malloc((m->positionCount + 1) * sizeof(uint32_t));
+    uint32_t *b = malloc((m->positionCount + 1) * sizeof(uint32_t));
+    if (!ctx.stamp || !a || !b) {
+        ParallelCompressionLogError("malloc");
+        free(ctx.stamp);
+        free(a);
+        free(b);
+        return -1;
+    }
+    memcpy(a, m->startList.p, m->startList.count * sizeof(uint32_t));
+    size_t count = m->startList.count;
+    for (size_t i = 0; i < length && count > 0; i++) {
+        if (path[i] == '/') {
+            uint8_t f = listFlags(m, a, count);
+            *included |= (f & STATE_INCLUDE) != 0;
+            if (f & STATE_EXCLUDE) {
+                *excluded = 1;
+                break;
+            }
+        }
+        count = stepList(m, &ctx, a, count, (uint8_t)path[i], b);
+        uint32_t *t = a;
+        a = b;
+        b = t;
+    }
+    if (!*excluded) {
+        uint8_t f = listFlags(m, a, count);
+        *included |= (f & STATE_INCLUDE) != 0;
+        *excluded = (f & STATE_EXCLUDE) != 0;
+        count = stepList(m, &ctx, a, count, '/', b);
+        *nextFlags = listFlags(m, b, count);
+    }
+    free(ctx.stamp);
+    free(a);
+    free(b);
+    return 0;
+}
+
+int AAPathMatcherMatch(AAPathMatcher m, const char *path, size_t length) {
+    if (!__atomic_load_n(&m->compiled, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&m->lock);
+        if (!m->compiled) {
+            m->compileStatus = compile(m);
+            __atomic_store_n(&m->compiled, 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&m->lock);
+    }
+    if (m->compileStatus < 0) {
+        return -1;
+    }
+
+    int included = 0;
+    int excluded = 0;
+    uint8_t nextFlags = 0; /* state after path + "/" */
+    if (m->useDFA) {
+        const uint32_t *transitions = m->transitions;
+        uint32_t classCount = m->classCount;
+        uint32_t state = m->startState;
+        for (size_t i = 0; i < length && state != 0; i++) {
+            uint8_t c = (uint8_t)path[i];
+            if (c == '/') {
+                uint8_t f = m->stateFlags[state];
+                included |= (f & STATE_INCLUDE) != 0;
+                if (f & STATE_EXCLUDE) {
+                    excluded = 1;
+                    break;
+                }
+            }
+            state = transitions[(size_t)state * classCount + m->classOf[c]];
+        }
+        if (!excluded) {
+            uint8_t f = m->stateFlags[state];
+            included |= (f & STATE_INCLUDE) != 0;
+            excluded = (f & STATE_EXCLUDE) != 0;
+            nextFlags = m->stateFlags[transitions[(size_t)state * classCount + m->classOf['/']]];
+        }
+    } else if (matchNFA(m, path, length, &included, &excluded, &nextFlags) < 0) {
+        return -1;
+    }
+
+    if (excluded) {
+        return 0;
+    }
+    if (included || !m->hasInclude) {
+        return AA_PATH_MATCH_SELECTED | AA_PATH_MATCH_DESCEND;
+    }
+    return (nextFlags & STATE_LIVE) ? AA_PATH_MATCH_DESCEND : 0;
+}
+
+void AAPathMatcherDestroy(AAPathMatcher m) {
+    if (!m) {
+        return;
+    }
+    pthread_mutex_destroy(&m->lock);
+    free(m->positions);
+    free(m->starts);
+    free(m->transitions);
+    free(m->stateFlags);
+    free(m->startList.p);
+    free(m);
+}
@@ -0,0 +1,99 @@
+// AppleArchive path matcher
+
+#pragma once
+
+#ifndef __APPLE_ARCHIVE_H
+#error Include AppleArchive.h instead of this file
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull begin")
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma mark - Path matcher
+
+/*!
+  @abstract Matches paths against a set of include and exclude glob patterns
+
+  @discussion
+  All the patterns are compiled into a single DFA, matching a path against any number of patterns in one pass
+  over the path. If the DFA gets too large, the matcher simulates the NFA instead, which is slower, but has the
+  same results.
+  A path is selected if it, or one of its parent directories, matches an include pattern, or if there are no
+  include patterns, and if neither it nor any of its parent directories matches an exclude pattern.
+  Patterns must match the whole path. '*' matches any sequence of characters except '/', "**" matches any
+  sequence of characters, '?' matches one character except '/', "[...]" matches one character of the set,
+  except '/', with ranges "a-z", and negation "[!...]", and '\' escapes the next character.
+  The patterns are compiled on the first match. Matching is thread safe, but patterns can't be added while
+  the matcher is used.
+*/
+typedef struct AAPathMatcher_impl * AAPathMatcher APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+// Path matcher results
+typedef uint32_t AAPathMatch APPLE_ARCHIVE_SWIFT_PRIVATE;
+APPLE_ARCHIVE_ENUM(AAPathMatches, uint32_t) {
+
+  AA_PATH_MATCH_SELECTED       = 1,     ///< the path is selected
+  AA_PATH_MATCH_DESCEND        = 2,     ///< paths inside directory path can be selected
+
+} APPLE_ARCHIVE_SWIFT_PRIVATE;
+
+/*!
+  @abstract Create an empty path matcher, selecting all paths
+
+  @return a new matcher on success, and NULL on failure
+*/
+APPLE_ARCHIVE_API AAPathMatcher _Nullable AAPathMatcherCreate(void);
+
+/*!
+  @abstract Add a pattern
+
+  @param matcher target matcher
+  @param pattern glob pattern
+  @param exclude 0 for an include pattern, 1 for an exclude pattern
+
+  @return 0 on success, and a negative error code on failure, e.g. an invalid pattern
+*/
+APPLE_ARCHIVE_API int AAPathMatcherAddPattern(
+  AAPathMatcher matcher,
+  const char * pattern,
+  int exclude);
+
+/*!
+  @abstract Match a path
+
+  @discussion
+  AA_PATH_MATCH_DESCEND is set if \p path is a directory some of whose contents can be selected: it is not
+  excluded, and it is selected, or the DFA state after "path/" can still reach an include pattern. A directory
+  scan can skip the directories without AA_PATH_MATCH_DESCEND.
+
+  @param matcher matcher
+  @param path path, without leading or trailing '/'
+  @param length path length
+
+  @return a combination of AA_PATH_MATCH_* flags on success, and a negative error code on failure
+*/
+APPLE_ARCHIVE_API int AAPathMatcherMatch(
+  AAPathMatcher matcher,
+  const char * path,
+  size_t length);
+
+/*!
+  @abstract Destroy a path matcher
+
+  @param matcher matcher, can be NULL
+*/
+APPLE_ARCHIVE_API void AAPathMatcherDestroy(
+  AAPathMatcher _Nullable matcher);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if __has_feature(assume_nonnull)
+_Pragma("clang assume_nonnull end")
+#endif
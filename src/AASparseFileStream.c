@@ -0,0 +1,352 @@
+//
+//  AASparseFileStream.c
+//  libAppleArchive
+//
+
+#if defined(__linux__)
+#define _GNU_SOURCE /* SEEK_DATA, SEEK_HOLE */
+#endif
+
+#include "AppleArchive.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define AA_SPARSE_DEFAULT_BLOCK_SIZE 4096
+#define AA_SPARSE_MAX_BLOCK_SIZE (1 << 20)
+
+/* Offsets in [segStart, dataStart) are a hole, and [dataStart, dataEnd) data */
+typedef struct {
+    off_t segStart;
+    off_t dataStart;
+    off_t dataEnd;
+} AASparseExtent;
+
+typedef struct {
+    int fd;
+    int automaticClose;
+    AASparseFileStats *stats;
+    off_t offset; /* sequential read/write position */
+
+    /* input: PRead can be called concurrently, lock protects sparse, extent and stats */
+    pthread_mutex_t lock;
+    int seekable; /* 0 for pipes and sockets: sequential reads only, without pread */
+    int sparse; /* use SEEK_DATA/SEEK_HOLE */
+    off_t size; /* file size when opened */
+    AASparseExtent extent; /* last extent located */
+
+    /* output */
+    size_t blockSize;
+    uint8_t *block; /* partial block, not written yet */
+    size_t blockFill;
+    int noHoles;
+    off_t written; /* end of the last block actually written */
+} AASparseFile;
+
+static int isZero(const uint8_t *p, size_t n);
+static int flushBlock(AASparseFile *f);
+
+static void addStats(AASparseFile *f, uint64_t data, uint64_t hole) {
+    if (f->stats) {
+        f->stats->data_bytes += data;
+        f->stats->hole_bytes += hole;
+    }
+}
+
+static int sparseFileClose(void *arg) {
+    AASparseFile *f = arg;
+    int status = 0;
+    if (f->blockFill > 0) {
+        if (isZero(f->block, f->blockFill)) {
+            addStats(f, 0, f->blockFill); /* partial block of 0 at the end, set by ftruncate */
+        } else {
+            status = flushBlock(f);
+        }
+    }
+    if (f->blockSize > 0 && f->written < f->offset) {
+        /* file ends with a hole */
+        if (ftruncate(f->fd, f->offset) < 0) {
+            ParallelCompressionLogError("ftruncate: %s");
+            status = -1;
+        }
+    }
+    if (f->automaticClose) {
+        if (close(f->fd) < 0) {
+            status = -1;
+        }
+    }
+    pthread_mutex_destroy(&f->lock);
+    free(f->block);
+    free(f);
+    return status;
+}
+
+#pragma mark - Input
+
+/* Locate the extent containing \p offset in \p x. Returns 0 on success, and -1 if SEEK_DATA can't be used. */
+static int locateExtent(AASparseFile *f, off_t offset, AASparseExtent *x) {
+    off_t data = lseek(f->fd, offset, SEEK_DATA);
+    if (data < 0) {
+        if (errno != ENXIO) {
+            return -1; /* not supported */
+        }
+        data = f->size; /* hole until the end of the file */
+    }
+    off_t hole = (data < f->size) ? lseek(f->fd, data, SEEK_HOLE) : f->size;
+    if (hole < 0) {
+        return -1;
+    }
+    x->segStart = offset;
+    x->dataStart = data;
+    x->dataEnd = hole;
+    return 0;
+}
+
+static ssize_t sparseFilePRead(void *arg, void *buf, size_t nbyte, off_t offset) {
+    AASparseFile *f = arg;
+    uint8_t *p = buf;
+    size_t total = 0;
+    uint64_t data = 0;
+    uint64_t hole = 0;
+
+    /* work on a copy of the cached extent, concurrent calls read other offsets */
+    pthread_mutex_lock(&f->lock);
+    int sparse = f->sparse;
+    AASparseExtent x = f->extent;
+    pthread_mutex_unlock(&f->lock);
+
+    while (total < nbyte) {
+        off_t pos = offset + (off_t)total;
+        size_t n = nbyte - total;
+        if (sparse && pos < f->size) {
+            if (pos < x.segStart || pos >= x.dataEnd) {
+                if (locateExtent(f, pos, &x) < 0) {
+                    sparse = 0;
+                    pthread_mutex_lock(&f->lock);
+                    f->sparse = 0;
+                    pthread_mutex_unlock(&f->lock);
+                    continue;
+                }
+                pthread_mutex_lock(&f->lock);
+                f->extent = x;
+                pthread_mutex_unlock(&f->lock);
+            }
+            if (pos < x.dataStart) {
+                /* hole: 0 without reading */
+                if ((off_t)n > x.dataStart - pos) {
+                    n = (size_t)(x.dataStart - pos);
+                }
+                memset(p + total, 0, n);
+                hole += n;
+                total += n;
+                continue;
+            }
+            if ((off_t)n > x.dataEnd - pos) {
+                n = (size_t)(x.dataEnd - pos);
+            }
+        }
+        ssize_t r = pread(f->fd, p + total, n, pos);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ParallelCompressionLogError("pread: %s");
+            total = (size_t)-1;
+            break;
+        }
+        data += r;
+        total += r;
+        if ((size_t)r < n) {
+            break; /* end of file */
+        }
+    }
+
+    pthread_mutex_lock(&f->lock);
+    addStats(f, data, hole);
+    pthread_mutex_unlock(&f->lock);
+    return (ssize_t)total;
+}
+
+static ssize_t sparseFileRead(void *arg, void *buf, size_t nbyte) {
+    AASparseFile *f = arg;
+    if (!f->seekable) {
+        ssize_t r;
+        do {
+            r = read(f->fd, buf, nbyte);
+        } while (r < 0 && errno == EINTR);
+        if (r < 0) {
+            ParallelCompressionLogError("read: %s");
+            return -1;
+        }
+        pthread_mutex_lock(&f->lock);
+        addStats(f, (uint64_t)r, 0);
+        pthread_mutex_unlock(&f->lock);
+        return r;
+    }
+    ssize_t n = sparseFilePRead(f, buf, nbyte, f->offset);
+    if (n > 0) {
+        f->offset += n;
+    }
+    return n;
+}
+
+AAByteStream AASparseFileInputStreamOpenWithFD(int fd, int automatic_close, AASparseFileStats *stats) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        ParallelCompressionLogError("fstat: %s");
+        return 0;
+    }
+    AASparseFile *f = calloc(1, sizeof(AASparseFile));
+    AAByteStream s = AACustomByteStreamOpen();
+    if (!f || !s) {
+        ParallelCompressionLogError("malloc");
+        free(f);
+        AAByteStreamClose(s);
+        return 0;
+    }
+    f->fd = fd;
+    f->automaticClose = automatic_close;
+    f->stats = stats;
+    f->offset = lseek(fd, 0, SEEK_CUR);
+    f->seekable = (f->offset >= 0);
+    if (!f->seekable) {
+        f->offset = 0;
+    }
+    f->size = st.st_size;
+    /* only files with fewer blocks than their size can have holes */
+    f->sparse = S_ISREG(st.st_mode) && (off_t)st.st_blocks * 512 < st.st_size;
+    pthread_mutex_init(&f->lock, 0);
+    AACustomByteStreamSetData(s, f);
+    AACustomByteStreamSetCloseProc(s, sparseFileClose);
+    AACustomByteStreamSetReadProc(s, sparseFileRead);
+    if (f->seekable) {
+        /* without a PRead proc, AAByteStreamPRead fails, and clients fall back to sequential reads */
+        AACustomByteStreamSetPReadProc(s, sparseFilePRead);
+    }
+    return s;
+}
+
+#pragma mark - Output
+
+static int isZero(const uint8_t *p, size_t n) {
+    return n == 0 || (p[0] == 0 && memcmp(p, p + 1, n - 1) == 0);
+}
+
+static int writeAt(AASparseFile *f, const uint8_t *buf, size_t nbyte, off_t offset) {
+    size_t total = 0;
+    while (total < nbyte) {
+        ssize_t r = pwrite(f->fd, buf + total, nbyte - total, offset + (off_t)total);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ParallelCompressionLogError("pwrite: %s");
+            return -1;
+        }
+        total += r;
+    }
+    addStats(f, nbyte, 0);
+    f->written = offset + (off_t)nbyte;
+    return 0;
+}
+
+/* Write the block being filled, or leave a hole if it is a whole block of 0 */
+static int flushBlock(AASparseFile *f) {
+    off_t start = f->offset - (off_t)f->blockFill;
+    int status = 0;
+    if (f->blockFill == f->blockSize && isZero(f->block, f->blockFill)) {
+        addStats(f, 0, f->blockFill);
+    } else if (f->blockFill > 0) {
+        status = writeAt(f, f->block, f->blockFill, start);
+    }
+    f->blockFill = 0;
+    return status;
+}
+
+static ssize_t sparseFileWrite(void *arg, const void *buf, size_t nbyte) {
+    AASparseFile *f = arg;
+    const uint8_t *p = buf;
+    if (f->noHoles) {
+        if (writeAt(f, p, nbyte, f->offset) < 0) {
+            return -1;
+        }
+        f->offset += nbyte;
+        return nbyte;
+    }
+    size_t i = 0;
+    while (i < nbyte) {
+        size_t toBoundary = f->blockSize - (size_t)(f->offset % (off_t)f->blockSize);
+        if (f->blockFill > 0 || nbyte - i < toBoundary || toBoundary < f->blockSize) {
+            /* partial block: accumulate, blocks straddling writes are checked whole */
+            size_t n = (nbyte - i < toBoundary) ? nbyte - i : toBoundary;
+            memcpy(f->block + f->blockFill, p + i, n);
+            f->blockFill += n;
+            f->offset += n;
+            i += n;
+            if (n == toBoundary && flushBlock(f) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        /* aligned whole blocks: write runs of non 0 blocks, skip the blocks of 0 */
+        size_t runStart = i;
+        while (nbyte - i >= f->blockSize) {
+            if (isZero(p + i, f->blockSize)) {
+                if (i > runStart && writeAt(f, p + runStart, i - runStart, f->offset - (off_t)(i - runStart)) < 0) {
+                    return -1;
+                }
+                addStats(f, 0, f->blockSize);
+                runStart = i + f->blockSize;
+            }
+            i += f->blockSize;
+            f->offset += f->blockSize;
+        }
+        if (i > runStart && writeAt(f, p + runStart, i - runStart, f->offset - (off_t)(i - runStart)) < 0) {
+            return -1;
+        }
+    }
+    return nbyte;
+}
+
+AAByteStream AASparseFileOutputStreamOpenWithFD(int fd, int automatic_close, AAFlagSet flags, AASparseFileStats *stats) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        ParallelCompressionLogError("fstat: %s");
+        return 0;
+    }
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset < 0) {
+        ParallelCompressionLogError("lseek: %s");
+        return 0;
+    }
+    AASparseFile *f = calloc(1, sizeof(AASparseFile));
+    AAByteStream s = AACustomByteStreamOpen();
+    if (!f || !s) {
+        ParallelCompressionLogError("malloc");
+        free(f);
+        AAByteStreamClose(s);
+        return 0;
+    }
+    f->fd = fd;
+    f->automaticClose = automatic_close;
+    f->stats = stats;
+    f->offset = offset;
+    f->written = offset;
+    f->blockSize = (st.st_blksize > 0 && st.st_blksize <= AA_SPARSE_MAX_BLOCK_SIZE) ? (size_t)st.st_blksize : AA_SPARSE_DEFAULT_BLOCK_SIZE;
+    f->noHoles = (flags & AA_FLAG_EXTRACT_NO_AUTO_SPARSE) != 0 || !S_ISREG(st.st_mode);
+    f->block = f->noHoles ? 0 : malloc(f->blockSize);
+    if (!f->noHoles && !f->block) {
+        ParallelCompressionLogError("malloc");
+        AAByteStreamClose(s);
+        free(f);
+        return 0;
+    }
+    pthread_mutex_init(&f->lock, 0);
+    AACustomByteStreamSetData(s, f);
+    AACustomByteStreamSetCloseProc(s, sparseFileClose);
+    AACustomByteStreamSetWriteProc(s, sparseFileWrite);
+    return s;
+}
@@ -53,11 +53,26 @@
 
 #include "ParallelCompression.h"
 #include "AADefs.h"
+#include "AAFlagSet.h"
+#include "AAMemoryBudget.h"
+#include "AACodec.h"
+#include "AAHash.h"
+#include "AADigestCache.h"
 #include "AACustomByteStream.h"
 #include "AAByteStream.h"
 #include "AAFieldKeys.h"
 #include "AAEntryMessage.h"
-#include "AAFlagSet.h"
 #include "AAArchiveStream.h"
+#include "AAPathMatcher.h"
+#include "AADirectoryScanner.h"
+#include "AADedupEngine.h"
+#include "AAClusterTable.h"
+#include "AAEntryScheduler.h"
+#include "AAIncrementalArchive.h"
+#include "AAEntryFilter.h"
+#include "AAEntryReader.h"
+#include "AAArchiveIndex.h"
+#include "AAParallelDecoder.h"
+#include "AAExtractor.h"
 
 #endif /* libAppleArchive_h */
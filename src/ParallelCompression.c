@@ -6,18 +6,131 @@
 #include "ParallelCompression.h"
 
 #include <stdio.h>
-#include <sys/sysctl.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
 
 uint64_t getDefaultNThreads(void) {
+#ifdef __APPLE__
     int32_t cores = 0;
     size_t size = 4;
-    if (!sysctlbyname("hw.physicalcpu", &cores, &size, 0, 0)) {
+    if (sysctlbyname("hw.physicalcpu", &cores, &size, 0, 0) != 0 || cores <= 0) {
         ParallelCompressionLogError("sysctlbyname");
         return 1;
     }
     return cores;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores <= 0) {
+        ParallelCompressionLogError("sysconf");
+        return 1;
+    }
+    return cores;
+#endif
+}
+
+uint32_t pcAlgorithmFromMagic(char c) {
+    switch (c) {
+        case '-':
+            return 0x000; /* AA_COMPRESSION_ALGORITHM_NONE */
+        case '4':
+            return 0x100; /* AA_COMPRESSION_ALGORITHM_LZ4 */
+        case 'z':
+            return 0x505; /* AA_COMPRESSION_ALGORITHM_ZLIB */
+        case 'x':
+            return 0x306; /* AA_COMPRESSION_ALGORITHM_LZMA */
+        case 'e':
+            return 0x801; /* AA_COMPRESSION_ALGORITHM_LZFSE */
+        default:
+            return UINT32_MAX;
+    }
+}
+
+char pcMagicFromAlgorithm(uint32_t algorithm) {
+    switch (algorithm) {
+        case 0x000:
+            return '-';
+        case 0x100:
+            return '4';
+        case 0x505:
+            return 'z';
+        case 0x306:
+            return 'x';
+        case 0x801:
+            return 'e';
+        default:
+            return 0;
+    }
+}
+
+#pragma mark - Path validation
+
+/*
+ * Separator and NUL masks for one chunk of PC_PATH_CHUNK_SIZE bytes,
+ * bit i set if byte i matches.
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define PC_PATH_CHUNK_SIZE 32
+static inline void pathChunkMasks(const char *p, uint32_t *slashMask, uint32_t *nulMask) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    *slashMask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+    *nulMask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PC_PATH_CHUNK_SIZE 16
+static inline void pathChunkMasks(const char *p, uint32_t *slashMask, uint32_t *nulMask) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    *slashMask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+    *nulMask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PC_PATH_CHUNK_SIZE 16
+static inline uint32_t neonMovemask(uint8x16_t eq) {
+    static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t bits = vandq_u8(eq, vld1q_u8(weights));
+    return (uint32_t)vaddv_u8(vget_low_u8(bits)) | ((uint32_t)vaddv_u8(vget_high_u8(bits)) << 8);
+}
+static inline void pathChunkMasks(const char *p, uint32_t *slashMask, uint32_t *nulMask) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)p);
+    *slashMask = neonMovemask(vceqq_u8(v, vdupq_n_u8('/')));
+    *nulMask = neonMovemask(vceqq_u8(v, vdupq_n_u8(0)));
+}
+#else
+#define PC_PATH_CHUNK_SIZE 16
+static inline void pathChunkMasks(const char *p, uint32_t *slashMask, uint32_t *nulMask) {
+    uint32_t slash = 0;
+    uint32_t nul = 0;
+    for (int i = 0; i < PC_PATH_CHUNK_SIZE; i++) {
+        slash |= (uint32_t)(p[i] == '/') << i;
+        nul |= (uint32_t)(p[i] == 0) << i;
+    }
+    *slashMask = slash;
+    *nulMask = nul;
+}
+#endif
+
+/*
+ * Check the component path[start..end), followed by a /. Empty components,
+ * . components other than the first, and .. components are invalid.
+ */
+static inline int componentIsValid(const char *path, int start, int end) {
+    int len = end - start;
+    if (len == 0) {
+        return 0;
+    }
+    if (len == 1 && path[start] == '.' && start != 0) {
+        return 0;
+    }
+    if (len == 2 && path[start] == '.' && path[start + 1] == '.') {
+        return 0;
+    }
+    return 1;
 }
 
 /*
@@ -32,49 +145,72 @@ uint64_t getDefaultNThreads(void) {
  * -Path *cannot* have "./" after a "/" (beginning is fine!)
  * -Path *cannot* have "../" after a "/"
  * -Path *cannot* begin with "../"
+ * -Path *cannot* end with "/"
+ *
+ * The path is scanned one chunk at a time: a vector compare finds the
+ * separators and NULs of the chunk, and only the bytes right before each
+ * separator are inspected. The tail is copied to a padded chunk, bytes
+ * past size are never read.
 */
 int pathIsValid(const char *path, int size) {
     if (!size) {
         /* if 0 size, valid path */
         return 1;
     }
-    if (size > 1023) {
+    if (size < 0 || size > 1023) {
         /* path must be 1023 or smaller */
         return 0;
     }
-    if (memchr(path, 0, size)) {
-        /* path must not be null terminated before size */
-        return 0;
-    }
     if (path[0] == '/') {
         /* path must not start with / */
         return 0;
     }
-    uint64_t pos = 0;
-    const char *shortPath;
-loop_through_path:
-    shortPath = path + pos;
-    void *slashPtr = memchr(shortPath, '/', (uint64_t)(path - pos));
-    if (!slashPtr) {
-        return pos != size;
+    int componentStart = 0;
+    for (int chunk = 0; chunk < size; chunk += PC_PATH_CHUNK_SIZE) {
+        uint32_t slashMask;
+        uint32_t nulMask;
+        int n = size - chunk;
+        if (n >= PC_PATH_CHUNK_SIZE) {
+            pathChunkMasks(path + chunk, &slashMask, &nulMask);
+        } else {
+            char tail[PC_PATH_CHUNK_SIZE];
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, path + chunk, n);
+            pathChunkMasks(tail, &slashMask, &nulMask);
+            /* ignore the padding */
+            nulMask &= (UINT32_C(1) << n) - 1;
+        }
+        if (nulMask) {
+            /* path must not be null terminated before size */
+            return 0;
+        }
+        while (slashMask) {
+            int slash = chunk + __builtin_ctz(slashMask);
+            slashMask &= slashMask - 1;
+            if (!componentIsValid(path, componentStart, slash)) {
+                return 0;
+            }
+            componentStart = slash + 1;
+        }
     }
-    long slashIndex = (slashPtr - (void *)path);
-    int slashIndexInShortPath = ((char *)slashIndex - pos);
-    if (slashIndex == pos) {
-        /* no / right after / */
-        return 0;
-    }
-    if (pos && slashIndexInShortPath == 1 && shortPath[0] == '.') {
-        /* no ./ when not at beginning at path */
-        return 0;
-    }
-    if ((!pos || (pos && slashIndexInShortPath != 1)) && slashIndexInShortPath == 2 && shortPath[0] == '.' && shortPath[1] == '.') {
-        /* no ../ */
-        return 0;
+    /* last component: only "" is invalid, when the path ends with / */
+    return componentStart != size;
+}
+
+int pathIsValidBatch(const char *paths, const int *sizes, size_t count, uint8_t *valid) {
+    int validCount = 0;
+    const char *path = paths;
+    for (size_t i = 0; i < count; i++) {
+        if (sizes[i] < 0) {
+            /* the following paths can't be located */
+            memset(valid + i, 0, count - i);
+            break;
+        }
+        valid[i] = (uint8_t)pathIsValid(path, sizes[i]);
+        validCount += valid[i];
+        path += sizes[i];
     }
-    pos = slashIndex + 1;
-    if (pos < size) { goto loop_through_path;};
-    return pos != size;
+    return validCount;
 }
 
 size_t SharedBufferReadFromBufferProc(uint8_t **buffer, uint8_t *dest, size_t n) {
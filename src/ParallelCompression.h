@@ -7,9 +7,61 @@
 #define ParallelCompression_h
 
 #include <stdio.h>
+#include <stdint.h>
 
 #define ParallelCompressionLogError(msg) /* implement pc_log_error later */
 
 uint64_t getDefaultNThreads(void);
 
+/*
+ * Path validation for PAT and LNK fields, returns 1 if valid, 0 otherwise.
+ * Only the components followed by a "/" are checked for "." and "..":
+ * Valid: "", "a", "a/b", "./a", ".", "..", "...", "a/.b", "a/.", "a/..".
+ * Invalid: "/a", "a//b", "a/", "../a", "a/./b", "a/../b".
+ * pathIsValidBatch validates \p count paths packed back to back in \p paths,
+ * stores each result in \p valid, and returns the number of valid paths. A
+ * negative size marks that path and the following ones invalid.
+ */
+int pathIsValid(const char *path, int size);
+int pathIsValidBatch(const char *paths, const int *sizes, size_t count, uint8_t *valid);
+
+#pragma mark - Compressed stream format
+
+/*
+ * A compressed stream starts with "pbz" followed by one algorithm char,
+ * and the 64-bit big endian block size. Each block then stores the 64-bit
+ * big endian raw size, the 64-bit big endian compressed size, and the
+ * compressed payload. A block is stored raw when both sizes are equal.
+ */
+#define PC_STREAM_HEADER_SIZE 12
+#define PC_BLOCK_HEADER_SIZE 16
+#define PC_MAX_BLOCK_SIZE (UINT64_C(1) << 30)
+
+uint32_t pcAlgorithmFromMagic(char c);
+char pcMagicFromAlgorithm(uint32_t algorithm);
+
+static inline uint64_t pcLoadBE64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static inline void pcStoreBE64(uint8_t *p, uint64_t v) {
+    for (int i = 7; i >= 0; i--) {
+        p[i] = (uint8_t)v;
+        v >>= 8;
+    }
+}
+
+/*
+ * A stream compressed with a dictionary stores it in its first block, raw,
+ * as an archive metadata entry. Every other block is compressed with it.
+ */
+#define PC_DICTIONARY_ENTRY_HEADER_SIZE 25
+
+size_t pcEncodeDictionaryEntry(uint8_t *dst, size_t dictSize);
+int pcDecodeDictionaryEntry(const uint8_t *src, size_t size, const uint8_t **dict, size_t *dictSize);
+
 #endif /* ParallelCompression_h */
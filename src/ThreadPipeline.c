@@ -0,0 +1,225 @@
+//
+//  ThreadPipeline.c
+//  libAppleArchive
+//
+
+#include "ThreadPipeline.h"
+#include "ParallelCompression.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+enum {
+    THREAD_PIPELINE_ITEM_FREE     = 0,
+    THREAD_PIPELINE_ITEM_ACQUIRED = 1,
+    THREAD_PIPELINE_ITEM_QUEUED   = 2,
+    THREAD_PIPELINE_ITEM_DONE     = 3,
+    THREAD_PIPELINE_ITEM_RETIRED  = 4,
+};
+
+struct ThreadPipelineWorker_impl {
+    struct ThreadPipeline_impl *pipeline;
+    void *data;
+    pthread_t thread;
+    int started;
+};
+
+struct ThreadPipeline_impl {
+    pthread_mutex_t lock;
+    pthread_cond_t workCond; /* signaled when an item is queued, or on abort */
+    pthread_cond_t stateCond; /* signaled when an item is done or released */
+    ThreadPipelineWorkerProc proc;
+    int nThreads;
+    int nItems;
+    struct ThreadPipelineWorker_impl *workers;
+    void **items;
+    int *state;
+    int *status;
+    uint64_t acquirePos; /* next item handed to the producer */
+    uint64_t submitPos; /* items submitted so far */
+    uint64_t dispatchPos; /* next item picked by a worker */
+    uint64_t retirePos; /* next item handed to the consumer */
+    int inFlight;
+    int abort;
+};
+
+static int itemIndex(ThreadPipeline pipeline, void *item) {
+    for (int i = 0; i < pipeline->nItems; i++) {
+        if (pipeline->items[i] == item) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void *workerThread(void *arg) {
+    struct ThreadPipelineWorker_impl *worker = arg;
+    ThreadPipeline pipeline = worker->pipeline;
+    pthread_mutex_lock(&pipeline->lock);
+    while (1) {
+        while (!pipeline->abort && pipeline->dispatchPos == pipeline->submitPos) {
+            pthread_cond_wait(&pipeline->workCond, &pipeline->lock);
+        }
+        if (pipeline->abort) {
+            break;
+        }
+        int i = (int)(pipeline->dispatchPos % pipeline->nItems);
+        pipeline->dispatchPos++;
+        pthread_mutex_unlock(&pipeline->lock);
+        int status = pipeline->proc(worker->data, pipeline->items[i]);
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->status[i] = status;
+        pipeline->state[i] = THREAD_PIPELINE_ITEM_DONE;
+        pthread_cond_broadcast(&pipeline->stateCond);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return 0;
+}
+
+ThreadPipeline ThreadPipelineCreate(int n_threads, int n_items, ThreadPipelineWorkerProc proc, void **worker_data, void **items) {
+    if (n_threads <= 0 || n_items <= 0 || !proc || !items) {
+        ParallelCompressionLogError("invalid pipeline parameters");
+        return 0;
+    }
+    ThreadPipeline pipeline = calloc(1, sizeof(struct ThreadPipeline_impl));
+    if (!pipeline) {
+        ParallelCompressionLogError("malloc");
+        return 0;
+    }
+    pipeline->proc = proc;
+    pipeline->nThreads = n_threads;
+    pipeline->nItems = n_items;
+    pipeline->workers = calloc(n_threads, sizeof(struct ThreadPipelineWorker_impl));
+    pipeline->items = calloc(n_items, sizeof(void *));
+    pipeline->state = calloc(n_items, sizeof(int));
+    pipeline->status = calloc(n_items, sizeof(int));
+    if (!pipeline->workers || !pipeline->items || !pipeline->state || !pipeline->status) {
+        ParallelCompressionLogError("malloc");
+        free(pipeline->workers);
+        free(pipeline->items);
+        free(pipeline->state);
+        free(pipeline->status);
+        free(pipeline);
+        return 0;
+    }
+    memcpy(pipeline->items, items, n_items * sizeof(void *));
+    pthread_mutex_init(&pipeline->lock, 0);
+    pthread_cond_init(&pipeline->workCond, 0);
+    pthread_cond_init(&pipeline->stateCond, 0);
+    for (int i = 0; i < n_threads; i++) {
+        struct ThreadPipelineWorker_impl *worker = &pipeline->workers[i];
+        worker->pipeline = pipeline;
+        worker->data = worker_data ? worker_data[i] : 0;
+        if (pthread_create(&worker->thread, 0, workerThread, worker) != 0) {
+            ParallelCompressionLogError("pthread_create");
+            ThreadPipelineDestroy(pipeline);
+            return 0;
+        }
+        worker->started = 1;
+    }
+    return pipeline;
+}
+
+void *ThreadPipelineAcquireItem(ThreadPipeline pipeline) {
+    pthread_mutex_lock(&pipeline->lock);
+    int i = (int)(pipeline->acquirePos % pipeline->nItems);
+    while (!pipeline->abort && pipeline->state[i] != THREAD_PIPELINE_ITEM_FREE) {
+        pthread_cond_wait(&pipeline->stateCond, &pipeline->lock);
+    }
+    if (pipeline->abort) {
+        pthread_mutex_unlock(&pipeline->lock);
+        return 0;
+    }
+    pipeline->state[i] = THREAD_PIPELINE_ITEM_ACQUIRED;
+    pipeline->acquirePos++;
+    pipeline->inFlight++;
+    pthread_mutex_unlock(&pipeline->lock);
+    return pipeline->items[i];
+}
+
+int ThreadPipelineSubmitItem(ThreadPipeline pipeline, void *item) {
+    int i = itemIndex(pipeline, item);
+    pthread_mutex_lock(&pipeline->lock);
+    /* items must be submitted in the order they were acquired */
+    if (i < 0 || i != (int)(pipeline->submitPos % pipeline->nItems) || pipeline->state[i] != THREAD_PIPELINE_ITEM_ACQUIRED) {
+        pthread_mutex_unlock(&pipeline->lock);
+        ParallelCompressionLogError("invalid pipeline item");
+        return -1;
+    }
+    pipeline->state[i] = THREAD_PIPELINE_ITEM_QUEUED;
+    pipeline->status[i] = 0;
+    pipeline->submitPos++;
+    pthread_cond_signal(&pipeline->workCond);
+    pthread_mutex_unlock(&pipeline->lock);
+    return 0;
+}
+
+void *ThreadPipelineRetireItem(ThreadPipeline pipeline, int *status) {
+    pthread_mutex_lock(&pipeline->lock);
+    if (pipeline->retirePos == pipeline->submitPos) {
+        /* nothing submitted, the caller would wait forever */
+        pthread_mutex_unlock(&pipeline->lock);
+        return 0;
+    }
+    int i = (int)(pipeline->retirePos % pipeline->nItems);
+    while (!pipeline->abort && pipeline->state[i] != THREAD_PIPELINE_ITEM_DONE) {
+        pthread_cond_wait(&pipeline->stateCond, &pipeline->lock);
+    }
+    if (pipeline->abort) {
+        pthread_mutex_unlock(&pipeline->lock);
+        return 0;
+    }
+    pipeline->state[i] = THREAD_PIPELINE_ITEM_RETIRED;
+    pipeline->retirePos++;
+    if (status) {
+        *status = pipeline->status[i];
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return pipeline->items[i];
+}
+
+void ThreadPipelineReleaseItem(ThreadPipeline pipeline, void *item) {
+    int i = itemIndex(pipeline, item);
+    if (i < 0) {
+        return;
+    }
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->state[i] = THREAD_PIPELINE_ITEM_FREE;
+    pipeline->inFlight--;
+    pthread_cond_broadcast(&pipeline->stateCond);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+int ThreadPipelineInFlight(ThreadPipeline pipeline) {
+    pthread_mutex_lock(&pipeline->lock);
+    int inFlight = pipeline->inFlight;
+    pthread_mutex_unlock(&pipeline->lock);
+    return inFlight;
+}
+
+int ThreadPipelineDestroy(ThreadPipeline pipeline) {
+    if (!pipeline) {
+        return 0;
+    }
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->abort = 1;
+    pthread_cond_broadcast(&pipeline->workCond);
+    pthread_cond_broadcast(&pipeline->stateCond);
+    pthread_mutex_unlock(&pipeline->lock);
+    for (int i = 0; i < pipeline->nThreads; i++) {
+        if (pipeline->workers[i].started) {
+            pthread_join(pipeline->workers[i].thread, 0);
+        }
+    }
+    pthread_cond_destroy(&pipeline->stateCond);
+    pthread_cond_destroy(&pipeline->workCond);
+    pthread_mutex_destroy(&pipeline->lock);
+    free(pipeline->workers);
+    free(pipeline->items);
+    free(pipeline->state);
+    free(pipeline->status);
+    free(pipeline);
+    return 0;
+}
@@ -0,0 +1,37 @@
+//
+//  ThreadPipeline.h
+//  libAppleArchive
+//
+
+#ifndef ThreadPipeline_h
+#define ThreadPipeline_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * ThreadPipeline
+ *
+ * Fixed pool of worker threads processing a ring of N items.
+ * Items are acquired and submitted by a single producer, processed
+ * by any worker, and retired by a single consumer in submission order.
+ *
+ * acquire -> (fill) -> submit -> (worker proc) -> retire -> (consume) -> release
+ *
+ * N bounds the number of items in flight, which is the read-ahead depth
+ * of the streams built on top of it.
+ */
+typedef struct ThreadPipeline_impl * ThreadPipeline;
+
+/* Called on a worker thread, returns 0 on success and a negative value on failure */
+typedef int (*ThreadPipelineWorkerProc)(void *worker_data, void *item);
+
+ThreadPipeline ThreadPipelineCreate(int n_threads, int n_items, ThreadPipelineWorkerProc proc, void **worker_data, void **items);
+void *ThreadPipelineAcquireItem(ThreadPipeline pipeline);
+int ThreadPipelineSubmitItem(ThreadPipeline pipeline, void *item);
+void *ThreadPipelineRetireItem(ThreadPipeline pipeline, int *status);
+void ThreadPipelineReleaseItem(ThreadPipeline pipeline, void *item);
+int ThreadPipelineInFlight(ThreadPipeline pipeline);
+int ThreadPipelineDestroy(ThreadPipeline pipeline);
+
+#endif /* ThreadPipeline_h */